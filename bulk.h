@@ -0,0 +1,561 @@
+
+/******************/
+/*Bulk.h          */
+/******************/
+
+/*
+This header file holds bulk extraction, which copies a whole tree out of the
+image and can pick up where an earlier run stopped.
+
+    EXTRACT -r <path> <host directory> [--manifest file] [--verify] [--sync]
+
+The tree at path is recreated under the host directory, under its own name,
+or directly in it when path is /. Files are written the way EXTRACT writes
+them, with all-zero blocks left as holes.
+
+Progress is kept in an append-only manifest, <host directory>/.fat32-manifest
+unless --manifest names another file. Each line is one record:
+
+    F <size> <crc32> <first cluster> <path>    the file was written in full
+    P <offset> <crc32> <first cluster> <path>  the first offset bytes were written
+
+P records are added every BULK_CHECKPOINT_BYTES of a large file. The CRC is
+the zlib CRC-32 of the bytes so far, and paths are relative to the host
+directory. When the same command is run again, a file whose F record still
+matches its size and first cluster, and whose copy on the host has that size,
+is skipped. --verify checks the copy's CRC as well. A file with P records
+carries on from the last one, at the cluster holding that offset, with its
+CRC picked up from the record. Anything else is written from the start.
+Running out of disk space stops the run; the manifest keeps what was done.
+
+Copies are only recorded once they are written, so a run that is killed or
+fails loses nothing recorded. --sync flushes each copy to disk before
+recording it, so a power cut loses nothing either.
+
+The bytes copied so far and the rate they are copied at are printed every
+BULK_PROGRESS_SECONDS. Files skipped are not counted in the rate.
+*/
+
+#ifndef BULK_H
+#define BULK_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BULK_CHECKPOINT_BYTES (64*1024*1024) //A P record is written after each this much of a file
+#define BULK_PROGRESS_SECONDS 5
+#define BULK_MANIFEST_BUCKETS 65536
+#define BULK_MANIFEST_NAME ".fat32-manifest"
+
+static u_int32_t Crc32Table[8][256];
+static pthread_once_t Crc32TableOnce = PTHREAD_ONCE_INIT;
+
+void Crc32BuildTable(void)
+{
+    for(uint i = 0; i < 256; i++)
+    {
+        u_int32_t crc = i;
+        for(int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        Crc32Table[0][i] = crc;
+    }
+    //Table k gives the CRC of a byte followed by k zero bytes, so eight bytes can be folded in at once
+    for(uint i = 0; i < 256; i++)
+        for(int k = 1; k < 8; k++) Crc32Table[k][i] = (Crc32Table[k - 1][i] >> 8) ^ Crc32Table[0][Crc32Table[k - 1][i] & 0xFF];
+}
+
+/// @brief Continues a CRC-32 (the one zlib computes) over count more bytes. Start with 0.
+u_int32_t Crc32Update(u_int32_t crc, const unsigned char* bytes, size_t count)
+{
+    pthread_once(&Crc32TableOnce, Crc32BuildTable);
+    crc = ~crc;
+    for(; count >= 8; bytes += 8, count -= 8)
+    {
+        u_int32_t low = (bytes[0] | ((u_int32_t)bytes[1] << 8) | ((u_int32_t)bytes[2] << 16) | ((u_int32_t)bytes[3] << 24)) ^ crc;
+        u_int32_t high = bytes[4] | ((u_int32_t)bytes[5] << 8) | ((u_int32_t)bytes[6] << 16) | ((u_int32_t)bytes[7] << 24);
+        crc = Crc32Table[7][low & 0xFF] ^ Crc32Table[6][(low >> 8) & 0xFF] ^ Crc32Table[5][(low >> 16) & 0xFF] ^ Crc32Table[4][low >> 24] ^
+        Crc32Table[3][high & 0xFF] ^ Crc32Table[2][(high >> 8) & 0xFF] ^ Crc32Table[1][(high >> 16) & 0xFF] ^ Crc32Table[0][high >> 24];
+    }
+    for(; count > 0; bytes++, count--) crc = Crc32Table[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/// @brief What the manifest says about one path, from its latest records.
+struct BulkRecord
+{
+    char* path;
+    u_int32_t cluster;
+    bool complete;
+    u_int64_t size; //Of the whole file, once complete
+    u_int32_t crc; //Of the whole file, once complete
+    u_int64_t checkpoint; //Bytes written as of the latest P record
+    u_int32_t checkpointCrc;
+    struct BulkRecord* next;
+};
+
+/// @brief A file waiting to be extracted.
+struct BulkFile
+{
+    struct Fat32Entry entry;
+    char* path; //Relative to the host directory
+};
+
+/// @brief Everything one run keeps track of.
+struct BulkRun
+{
+    struct Fat32Volume* vol;
+    const char* hostDirectory;
+    bool verify, sync;
+    FILE* out;
+
+    struct BulkRecord** records; //BULK_MANIFEST_BUCKETS chains, keyed by path
+    int manifestFd;
+
+    struct BulkFile* files;
+    u_int64_t numFiles, maxFiles;
+    unsigned char* visited;
+
+    unsigned char* buffer;
+
+    //Progress
+    u_int64_t totalBytes, doneBytes, copiedBytes, skippedBytes;
+    u_int64_t doneFiles, skippedFiles, resumedFiles, failedFiles;
+    struct timespec started, lastReport;
+    bool stopped; //The host disk is full, or some other failure no file will get past
+};
+
+u_int32_t BulkHash(const char* path)
+{
+    u_int32_t hash = 2166136261u;
+    for(; *path; path++) hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash % BULK_MANIFEST_BUCKETS;
+}
+
+/// @brief Stops the run for want of memory, saying so once.
+void BulkOutOfMemory(struct BulkRun* run)
+{
+    if(!run->stopped) fprintf(run->out, "%s\n", strerror(ENOMEM));
+    run->stopped = true;
+}
+
+/// @return The record, or NULL when there is none and create is false, or there was no memory for it.
+struct BulkRecord* BulkFindRecord(struct BulkRun* run, const char* path, bool create)
+{
+    u_int32_t bucket = BulkHash(path);
+    for(struct BulkRecord* record = run->records[bucket]; record != NULL; record = record->next) if(strcmp(record->path, path) == 0) return record;
+    if(!create) return NULL;
+
+    struct BulkRecord* record = calloc(1, sizeof(struct BulkRecord));
+    if(record == NULL || (record->path = strdup(path)) == NULL)
+    {
+        free(record);
+        return NULL;
+    }
+    record->next = run->records[bucket];
+    run->records[bucket] = record;
+    return record;
+}
+
+/// @brief Reads every record of an earlier run. A missing manifest is an empty one.
+void BulkLoadManifest(struct BulkRun* run, const char* manifestPath)
+{
+    FILE* manifest = fopen(manifestPath, "r");
+    if(manifest == NULL) return;
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while((length = getline(&line, &capacity, manifest)) > 0)
+    {
+        //A run killed mid-write can leave a last line without its newline, which is not a record
+        if(line[length - 1] != '\n') break;
+        line[length - 1] = '\0';
+
+        char kind;
+        unsigned long long number;
+        u_int32_t crc, cluster;
+        int consumed;
+        if(sscanf(line, "%c %llu %x %u %n", &kind, &number, &crc, &cluster, &consumed) != 4 || (kind != 'F' && kind != 'P')) continue;
+
+        //A manifest only partly read would have finished files copied again, so the run goes no further
+        struct BulkRecord* record = BulkFindRecord(run, line + consumed, true);
+        if(record == NULL)
+        {
+            BulkOutOfMemory(run);
+            break;
+        }
+        if(record->cluster != cluster) record->complete = false, record->checkpoint = 0;
+        record->cluster = cluster;
+        if(kind == 'F') record->complete = true, record->size = number, record->crc = crc;
+        else record->complete = false, record->checkpoint = number, record->checkpointCrc = crc;
+    }
+    free(line);
+    fclose(manifest);
+}
+
+/// @brief Appends one record. Each goes out in a single write, so records from a killed run are whole or missing.
+bool BulkAppendRecord(struct BulkRun* run, char kind, u_int64_t number, u_int32_t crc, u_int32_t cluster, const char* path)
+{
+    char* line;
+    int length = asprintf(&line, "%c %llu %08x %u %s\n", kind, (unsigned long long)number, crc, cluster, path);
+    if(length < 0) return false;
+    bool written = write(run->manifestFd, line, length) == length;
+    free(line);
+    return written;
+}
+
+double BulkSeconds(const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/// @brief Prints how far the run has got, if it has been long enough since it last did.
+void BulkProgress(struct BulkRun* run, bool final)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(!final && BulkSeconds(&run->lastReport, &now) < BULK_PROGRESS_SECONDS) return;
+    run->lastReport = now;
+
+    double seconds = BulkSeconds(&run->started, &now);
+    double rate = seconds > 0 ? run->copiedBytes / seconds / (1024 * 1024) : 0;
+    fprintf(run->out, "%'llu of %'llu bytes, %llu of %llu files, %.1f MB/s\n", (unsigned long long)run->doneBytes, (unsigned long long)run->totalBytes,
+    (unsigned long long)run->doneFiles, (unsigned long long)run->numFiles, rate);
+    fflush(run->out);
+}
+
+/// @brief Makes a directory on the host, or finds it already there.
+bool BulkMakeDirectory(struct BulkRun* run, const char* relativePath)
+{
+    char* hostPath;
+    if(asprintf(&hostPath, "%s/%s", run->hostDirectory, relativePath) < 0) return false;
+    bool made = mkdir(hostPath, 0777) == 0 || errno == EEXIST;
+    if(!made) fprintf(run->out, "%s: %s\n", hostPath, strerror(errno));
+    free(hostPath);
+    return made;
+}
+
+/// @brief Lists every file under a directory of the image, making its directories on the host as it goes.
+void BulkCollect(struct BulkRun* run, u_int32_t cluster, const char* path)
+{
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(run->vol, cluster, &dir)) return;
+
+    while(!run->stopped && Fat32ReadDir(&dir, &entry))
+    {
+        if((entry.dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+        if(strcmp(entry.shortName, ".") == 0 || strcmp(entry.shortName, "..") == 0) continue;
+
+        char* childPath = malloc(strlen(path) + strlen(entry.name) + 2);
+        if(childPath == NULL)
+        {
+            BulkOutOfMemory(run);
+            break;
+        }
+        sprintf(childPath, "%s%s%s", path, path[0] ? "/" : "", entry.name);
+
+        if((entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+        {
+            u_int32_t child = entry.firstCluster;
+            if(child >= 2 && child < Fat32ClusterCount(run->vol) && (run->visited[child / 8] & (1 << (child % 8))) == 0 && BulkMakeDirectory(run, childPath))
+            {
+                run->visited[child / 8] |= 1 << (child % 8);
+                BulkCollect(run, child, childPath);
+            }
+            free(childPath);
+            continue;
+        }
+
+        if(run->numFiles == run->maxFiles)
+        {
+            u_int64_t maxFiles = run->maxFiles ? run->maxFiles * 2 : 1024;
+            struct BulkFile* files = realloc(run->files, maxFiles * sizeof(struct BulkFile));
+            if(files == NULL)
+            {
+                free(childPath);
+                BulkOutOfMemory(run);
+                break;
+            }
+            run->files = files;
+            run->maxFiles = maxFiles;
+        }
+        run->files[run->numFiles].entry = entry;
+        run->files[run->numFiles].path = childPath;
+        run->numFiles++;
+        run->totalBytes += entry.dir.DIR_FileSize;
+    }
+    Fat32CloseDir(&dir);
+}
+
+/// @brief Works out the CRC of a file already on the host.
+/// @return Whether it could be read.
+bool BulkHostCrc(struct BulkRun* run, const char* hostPath, u_int32_t* crc)
+{
+    int fd = open(hostPath, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+    *crc = 0;
+    ssize_t n;
+    while((n = read(fd, run->buffer, Fat32PreferredReadBytes(run->vol))) > 0) *crc = Crc32Update(*crc, run->buffer, n);
+    close(fd);
+    return n == 0;
+}
+
+/// @brief Extracts one file, or skips it or carries on with it as the manifest allows.
+void BulkExtractFile(struct BulkRun* run, struct BulkFile* file)
+{
+    struct Fat32Volume* vol = run->vol;
+    struct Fat32Entry* entry = &file->entry;
+    u_int64_t size = entry->dir.DIR_FileSize;
+    char* hostPath;
+    if(asprintf(&hostPath, "%s/%s", run->hostDirectory, file->path) < 0)
+    {
+        run->stopped = true;
+        return;
+    }
+
+    struct stat host;
+    bool onHost = stat(hostPath, &host) == 0 && S_ISREG(host.st_mode);
+    struct BulkRecord* record = BulkFindRecord(run, file->path, false);
+    bool sameSource = record != NULL && record->cluster == entry->firstCluster;
+
+    //Already done, as long as the copy is still the right size and, when asked, still has the right CRC
+    if(sameSource && record->complete && record->size == size && onHost && (u_int64_t)host.st_size == size)
+    {
+        u_int32_t crc;
+        if(!run->verify || (BulkHostCrc(run, hostPath, &crc) && crc == record->crc))
+        {
+            run->skippedFiles++;
+            run->skippedBytes += size;
+            run->doneFiles++;
+            run->doneBytes += size;
+            free(hostPath);
+            return;
+        }
+    }
+
+    //Part done: carry on from the last checkpoint. Holes may leave the copy shorter than that, so only its existence is checked.
+    u_int64_t offset = 0;
+    u_int32_t crc = 0;
+    int fd;
+    if(sameSource && !record->complete && record->checkpoint > 0 && record->checkpoint <= size && onHost)
+    {
+        offset = record->checkpoint;
+        crc = record->checkpointCrc;
+        fd = open(hostPath, O_WRONLY | O_CLOEXEC);
+        if(fd >= 0 && ftruncate(fd, offset) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if(fd >= 0) run->resumedFiles++;
+    }
+    else fd = OpenExtractTarget(vol, hostPath);
+    if(fd < 0)
+    {
+        fprintf(run->out, "%s: %s\n", hostPath, strerror(errno));
+        run->failedFiles++;
+        free(hostPath);
+        return;
+    }
+    run->doneBytes += offset;
+
+    u_int32_t blockBytes = ExtractBlockBytes(fd);
+    u_int64_t readBytes = Fat32PreferredReadBytes(vol);
+    u_int64_t nextCheckpoint = (offset / BULK_CHECKPOINT_BYTES + 1) * BULK_CHECKPOINT_BYTES;
+    bool failed = false;
+    while(offset < size && !failed)
+    {
+        size_t chunk = size - offset < readBytes ? size - offset : readBytes;
+        ssize_t n = Fat32PRead(vol, entry, run->buffer, chunk, offset);
+        if(n <= 0)
+        {
+            fprintf(run->out, "%s: %s\n", file->path, n < 0 ? strerror(errno) : "chain ends before the file does");
+            failed = true;
+            break;
+        }
+        if(!WriteExtractTarget(fd, run->buffer, n, offset, blockBytes))
+        {
+            fprintf(run->out, "%s: %s\n", hostPath, strerror(errno));
+            failed = true;
+            //Out of space or quota, nothing after this file will fit either
+            if(errno == ENOSPC || errno == EDQUOT || errno == EIO) run->stopped = true;
+            break;
+        }
+        crc = Crc32Update(crc, run->buffer, n);
+        offset += n;
+        run->copiedBytes += n;
+        run->doneBytes += n;
+
+        //Holes at the end only exist once the copy has its length, so that comes before the record saying how far it got
+        if(offset >= nextCheckpoint && offset < size)
+        {
+            if(ftruncate(fd, offset) != 0 || (run->sync && fdatasync(fd) != 0))
+            {
+                fprintf(run->out, "%s: %s\n", hostPath, strerror(errno));
+                failed = true;
+            }
+            else if(!BulkAppendRecord(run, 'P', offset, crc, entry->firstCluster, file->path))
+            {
+                fprintf(run->out, "Manifest: %s\n", strerror(errno));
+                failed = run->stopped = true;
+            }
+            nextCheckpoint += BULK_CHECKPOINT_BYTES;
+        }
+        BulkProgress(run, false);
+    }
+
+    if(!failed && (ftruncate(fd, size) != 0 || (run->sync && fdatasync(fd) != 0)))
+    {
+        fprintf(run->out, "%s: %s\n", hostPath, strerror(errno));
+        failed = true;
+        if(errno == ENOSPC || errno == EDQUOT) run->stopped = true;
+    }
+    close(fd);
+
+    if(failed) run->failedFiles++;
+    else if(!BulkAppendRecord(run, 'F', size, crc, entry->firstCluster, file->path))
+    {
+        fprintf(run->out, "Manifest: %s\n", strerror(errno));
+        run->stopped = true;
+    }
+    else run->doneFiles++;
+    free(hostPath);
+}
+
+/// @brief Runs EXTRACT -r. See the top of this file for the syntax.
+/// @param argument Everything after -r. It is modified in place.
+void BulkExtract(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    struct BulkRun run;
+    memset(&run, 0, sizeof(run));
+    run.vol = vol;
+    run.out = out;
+
+    char* cursor = argument;
+    char* word;
+    char* path = NULL;
+    char* manifestPath = NULL;
+    bool valid = true;
+    while(valid && (word = NextWord(&cursor)) != NULL)
+    {
+        if(strcmp(word, "--verify") == 0) run.verify = true;
+        else if(strcmp(word, "--sync") == 0) run.sync = true;
+        else if(strcmp(word, "--manifest") == 0) valid = (manifestPath = NextWord(&cursor)) != NULL;
+        else if(path == NULL) path = word;
+        else if(run.hostDirectory == NULL) run.hostDirectory = word;
+        else valid = false;
+    }
+    if(!valid || run.hostDirectory == NULL)
+    {
+        fprintf(out, "Usage: EXTRACT -r <path> <host directory> [--manifest file] [--verify] [--sync]\n");
+        return;
+    }
+
+    //The root, . and .. have no name of their own, so what is in them goes straight into the host directory
+    u_int32_t topCluster = Fat32RootCluster(vol);
+    bool hasName = false;
+    struct Fat32Entry top;
+    if(path[0] != '\0' && strspn(path, "/") != strlen(path))
+    {
+        if(!Fat32Stat(vol, currentDirectory, path, &top))
+        {
+            fprintf(out, "File Not Found\n");
+            return;
+        }
+        if(strcmp(top.shortName, ".") != 0 && strcmp(top.shortName, "..") != 0) hasName = true;
+        else if(top.firstCluster != 0) topCluster = top.firstCluster;
+    }
+    if(mkdir(run.hostDirectory, 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(out, "%s: %s\n", run.hostDirectory, strerror(errno));
+        return;
+    }
+
+    char* defaultManifest = NULL;
+    if(manifestPath == NULL && asprintf(&defaultManifest, "%s/%s", run.hostDirectory, BULK_MANIFEST_NAME) >= 0) manifestPath = defaultManifest;
+    run.records = calloc(BULK_MANIFEST_BUCKETS, sizeof(struct BulkRecord*));
+    if(run.records == NULL)
+    {
+        fprintf(out, "%s\n", strerror(ENOMEM));
+        free(defaultManifest);
+        return;
+    }
+    BulkLoadManifest(&run, manifestPath);
+    run.manifestFd = open(manifestPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if(run.manifestFd < 0)
+    {
+        fprintf(out, "%s: %s\n", manifestPath, strerror(errno));
+        free(defaultManifest);
+        free(run.records);
+        return;
+    }
+
+    //Everything to copy is listed first, so progress can be given against the total
+    run.visited = calloc(Fat32ClusterCount(vol) / 8 + 1, 1);
+    if(run.visited == NULL) BulkOutOfMemory(&run);
+    if(!run.stopped)
+    {
+        run.visited[topCluster / 8] |= 1 << (topCluster % 8);
+        if(!hasName) BulkCollect(&run, topCluster, "");
+        else if((top.dir.DIR_Attr & ATTR_DIRECTORY) == 0)
+        {
+            run.files = malloc(sizeof(struct BulkFile));
+            if(run.files == NULL || (run.files[0].path = strdup(top.name)) == NULL) BulkOutOfMemory(&run);
+            else
+            {
+                run.files[0].entry = top;
+                run.numFiles = run.maxFiles = 1;
+                run.totalBytes = top.dir.DIR_FileSize;
+            }
+        }
+        else if(BulkMakeDirectory(&run, top.name) && top.firstCluster >= 2)
+        {
+            run.visited[top.firstCluster / 8] |= 1 << (top.firstCluster % 8);
+            BulkCollect(&run, top.firstCluster, top.name);
+        }
+    }
+
+    //Every file is read through this one buffer, and BulkHostCrc reads into it too
+    run.buffer = Fat32GetBuffer(vol);
+    if(run.buffer == NULL) BulkOutOfMemory(&run);
+    clock_gettime(CLOCK_MONOTONIC, &run.started);
+    run.lastReport = run.started;
+    for(u_int64_t i = 0; i < run.numFiles && !run.stopped; i++)
+    {
+        //The next file's chain is walked and its first bytes read ahead while this one is written
+        if(i + 1 < run.numFiles) Fat32Prefetch(vol, &run.files[i + 1].entry, 0, Fat32PreferredReadBytes(vol));
+        BulkExtractFile(&run, &run.files[i]);
+    }
+    BulkProgress(&run, true);
+
+    fprintf(out, "%llu file(s) copied, %llu of them resumed, %llu skipped as already done (%'llu bytes)", (unsigned long long)(run.doneFiles - run.skippedFiles),
+    (unsigned long long)run.resumedFiles, (unsigned long long)run.skippedFiles, (unsigned long long)run.skippedBytes);
+    if(run.failedFiles > 0) fprintf(out, ", %llu failed", (unsigned long long)run.failedFiles);
+    fprintf(out, "\n");
+    if(run.stopped || run.failedFiles > 0) fprintf(out, "Run the same command again to carry on\n");
+
+    Fat32PutBuffer(vol, run.buffer);
+    close(run.manifestFd);
+    for(u_int64_t i = 0; i < run.numFiles; i++) free(run.files[i].path);
+    free(run.files);
+    free(run.visited);
+    for(uint i = 0; i < BULK_MANIFEST_BUCKETS; i++)
+    {
+        for(struct BulkRecord* record = run.records[i]; record != NULL; )
+        {
+            struct BulkRecord* next = record->next;
+            free(record->path);
+            free(record);
+            record = next;
+        }
+    }
+    free(run.records);
+    free(defaultManifest);
+}
+
+#endif
@@ -0,0 +1,419 @@
+
+/******************/
+/*Carve.h         */
+/******************/
+
+/*
+This header file holds the CARVE command, which recovers files from free
+clusters by their content alone, for when not even a deleted directory
+entry is left.
+
+    CARVE [--out dir] [--types jpg,png,pdf,zip,evtx] [--threads n]
+
+FAT32 hands out whole clusters, so a file always begins at the start of a
+cluster. The scanner only has to test one spot per free cluster: the first
+four bytes are loaded as one word and compared, under a mask, against every
+signature's prefix at once, and only a hit is checked against the full
+header. The end of a file is then found with memmem, which glibc runs with
+SIMD, over the free clusters that follow it. EVTX logs have no footer; their
+size comes from the chunk count in the file header.
+
+The FAT says which clusters are free. The cluster range is split into one
+contiguous share per thread, and each thread reads the free runs in its share
+with large sequential reads. Carved files are written to the output
+directory (carved by default) as <first cluster>.<type>, and manifest.txt
+there lists every one of them.
+*/
+
+#ifndef CARVE_H
+#define CARVE_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CARVE_MAX_THREADS 16
+#define CARVE_NUM_SIGNATURES 5
+
+/// @brief What a carvable file type looks like.
+struct CarveSignature
+{
+    const char* type; //Also the extension of carved files
+    const unsigned char* header;
+    uint headerLength;
+    const unsigned char* footer; //NULL when the size comes from the header instead
+    uint footerLength;
+    u_int64_t maxBytes; //Give up on a file that has not ended by then
+    u_int32_t prefix; //First four header bytes as a little endian word
+    u_int32_t prefixMask; //Covers the bytes of prefix the header actually has
+};
+
+/// @brief Returns the bytes that follow a footer and still belong to the file.
+/// @param footer The footer, with available bytes readable from it.
+u_int64_t CarveTrailerLength(struct CarveSignature* signature, const unsigned char* footer, size_t available)
+{
+    //PNG: the IEND chunk's CRC
+    if(strcmp(signature->type, "png") == 0) return 4;
+    //ZIP: the rest of the end of central directory record and its comment
+    if(strcmp(signature->type, "zip") == 0) return 18 + (available >= 22 ? (footer[20] | (footer[21] << 8)) : 0);
+    return 0;
+}
+
+/// @brief Works out the size of a file whose header records it.
+/// @return The size, or 0 if the header does not hold a sane one.
+u_int64_t CarveSizeFromHeader(struct CarveSignature* signature, const unsigned char* header)
+{
+    //EVTX: a 4K file header followed by 64K chunks
+    if(strcmp(signature->type, "evtx") == 0)
+    {
+        uint chunks = header[42] | (header[43] << 8);
+        return chunks ? 0x1000 + (u_int64_t)chunks * 0x10000 : 0;
+    }
+    return 0;
+}
+
+static const unsigned char CARVE_JPG_HEADER[] = {0xFF, 0xD8, 0xFF};
+static const unsigned char CARVE_JPG_FOOTER[] = {0xFF, 0xD9};
+static const unsigned char CARVE_PNG_HEADER[] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+static const unsigned char CARVE_PNG_FOOTER[] = {'I', 'E', 'N', 'D'};
+static const unsigned char CARVE_PDF_HEADER[] = {'%', 'P', 'D', 'F', '-'};
+static const unsigned char CARVE_PDF_FOOTER[] = {'%', '%', 'E', 'O', 'F'};
+static const unsigned char CARVE_ZIP_HEADER[] = {'P', 'K', 0x03, 0x04};
+static const unsigned char CARVE_ZIP_FOOTER[] = {'P', 'K', 0x05, 0x06};
+static const unsigned char CARVE_EVTX_HEADER[] = {'E', 'l', 'f', 'F', 'i', 'l', 'e', 0x00};
+
+/// @brief Fills in the signature table, including the prefix words the scanner compares against.
+void CarveInitSignatures(struct CarveSignature signatures[CARVE_NUM_SIGNATURES])
+{
+    struct CarveSignature table[CARVE_NUM_SIGNATURES] =
+    {
+        {"jpg", CARVE_JPG_HEADER, sizeof(CARVE_JPG_HEADER), CARVE_JPG_FOOTER, sizeof(CARVE_JPG_FOOTER), 64 << 20, 0, 0},
+        {"png", CARVE_PNG_HEADER, sizeof(CARVE_PNG_HEADER), CARVE_PNG_FOOTER, sizeof(CARVE_PNG_FOOTER), 64 << 20, 0, 0},
+        {"pdf", CARVE_PDF_HEADER, sizeof(CARVE_PDF_HEADER), CARVE_PDF_FOOTER, sizeof(CARVE_PDF_FOOTER), 256 << 20, 0, 0},
+        {"zip", CARVE_ZIP_HEADER, sizeof(CARVE_ZIP_HEADER), CARVE_ZIP_FOOTER, sizeof(CARVE_ZIP_FOOTER), 1024 << 20, 0, 0},
+        {"evtx", CARVE_EVTX_HEADER, sizeof(CARVE_EVTX_HEADER), NULL, 0, 1024 << 20, 0, 0},
+    };
+
+    for(int i = 0; i < CARVE_NUM_SIGNATURES; i++)
+    {
+        signatures[i] = table[i];
+        for(uint b = 0; b < 4 && b < table[i].headerLength; b++)
+        {
+            signatures[i].prefix |= (u_int32_t)table[i].header[b] << (8 * b);
+            signatures[i].prefixMask |= (u_int32_t)0xFF << (8 * b);
+        }
+    }
+}
+
+/// @brief One carved file, as listed in the manifest.
+struct CarvedFile
+{
+    u_int32_t firstCluster;
+    u_int32_t clusters;
+    u_int64_t size;
+    struct CarveSignature* signature;
+};
+
+/// @brief One thread's share of the volume.
+struct CarveRange
+{
+    struct Fat32Volume* vol;
+    struct CarveSignature* signatures;
+    bool* wanted; //Per signature
+    const char* outDirectory;
+    u_int32_t firstCluster;
+    u_int32_t endCluster;
+    struct CarvedFile* carved;
+    uint numCarved;
+    uint capacity;
+    bool outOfMemory; //Set when the range could not get its buffers or grow its list; it stops there
+};
+
+/// @brief Counts the free clusters from cluster on, up to limit.
+u_int32_t FreeRunLength(struct Fat32Volume* vol, u_int32_t cluster, u_int32_t limit)
+{
+    u_int32_t length = 0;
+    while(cluster + length < Fat32ClusterCount(vol) && length < limit && Fat32NextCluster(vol, cluster + length) == 0) length++;
+    return length;
+}
+
+/// @brief Finds where a file that starts at firstCluster ends, searching only the free clusters that follow it.
+/// @param buffer A pooled read buffer.
+/// @return The size of the file, or 0 if its end was not found.
+u_int64_t CarveFindEnd(struct CarveRange* range, struct CarveSignature* signature, u_int32_t firstCluster, unsigned char* buffer)
+{
+    struct Fat32Volume* vol = range->vol;
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    u_int32_t maxClusters = (signature->maxBytes + clusterBytes - 1) / clusterBytes;
+    u_int64_t limit = (u_int64_t)FreeRunLength(vol, firstCluster, maxClusters) * clusterBytes;
+    u_int64_t start = Fat32ClusterOffset(vol, firstCluster);
+    if(limit > signature->maxBytes) limit = signature->maxBytes;
+
+    if(signature->footer == NULL)
+    {
+        unsigned char header[64];
+        if(!Fat32ReadAt(vol, header, sizeof(header), start)) return 0;
+        u_int64_t size = CarveSizeFromHeader(signature, header);
+        return size <= limit ? size : 0;
+    }
+
+    //The last few bytes of each read are carried over, so a footer split across two reads is still found
+    u_int32_t readBytes = Fat32PreferredReadBytes(vol) - 64;
+    size_t carry = 0;
+    u_int64_t offset = 0;
+    while(offset < limit)
+    {
+        size_t count = limit - offset < readBytes ? limit - offset : readBytes;
+        if(!Fat32ReadAt(vol, buffer + carry, count, start + offset)) return 0;
+
+        size_t length = carry + count;
+        unsigned char* footer = memmem(buffer, length, signature->footer, signature->footerLength);
+        if(footer != NULL)
+        {
+            u_int64_t footerOffset = offset - carry + (footer - buffer);
+            u_int64_t end = footerOffset + signature->footerLength + CarveTrailerLength(signature, footer, buffer + length - footer);
+            return end <= limit ? end : limit;
+        }
+
+        carry = signature->footerLength - 1;
+        memmove(buffer, buffer + length - carry, carry);
+        offset += count;
+    }
+    return 0;
+}
+
+/// @brief Copies size bytes starting at firstCluster into the output directory.
+bool CarveWrite(struct CarveRange* range, struct CarveSignature* signature, u_int32_t firstCluster, u_int64_t size, unsigned char* buffer)
+{
+    struct Fat32Volume* vol = range->vol;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%u.%s", range->outDirectory, firstCluster, signature->type);
+
+    int newfile = OpenExtractTarget(vol, path);
+    if(newfile < 0) return false;
+
+    u_int32_t readBytes = Fat32PreferredReadBytes(vol);
+    u_int64_t start = Fat32ClusterOffset(vol, firstCluster);
+    u_int32_t blockBytes = ExtractBlockBytes(newfile);
+    u_int64_t done = 0;
+    bool written = true;
+    while(done < size && written)
+    {
+        size_t chunk = size - done < readBytes ? size - done : readBytes;
+        written = Fat32ReadAt(vol, buffer, chunk, start + done) && WriteExtractTarget(newfile, buffer, chunk, done, blockBytes);
+        done += chunk;
+    }
+    written = written && ftruncate(newfile, size) == 0;
+    close(newfile);
+    if(!written) unlink(path);
+    return written;
+}
+
+/// @brief Tests the start of a cluster against every wanted signature.
+/// @return The signature it matches, or NULL.
+struct CarveSignature* CarveMatchHeader(struct CarveRange* range, const unsigned char* bytes)
+{
+    u_int32_t word = bytes[0] | ((u_int32_t)bytes[1] << 8) | ((u_int32_t)bytes[2] << 16) | ((u_int32_t)bytes[3] << 24);
+    for(int i = 0; i < CARVE_NUM_SIGNATURES; i++)
+    {
+        struct CarveSignature* signature = &range->signatures[i];
+        if((word & signature->prefixMask) != signature->prefix || !range->wanted[i]) continue;
+        if(memcmp(bytes, signature->header, signature->headerLength) == 0) return signature;
+    }
+    return NULL;
+}
+
+/// @brief Makes room for one more carved file, before it is written, so every file written is listed.
+/// @return Whether there was memory for it.
+bool CarveReserve(struct CarveRange* range)
+{
+    if(range->numCarved < range->capacity) return true;
+    uint capacity = range->capacity ? range->capacity * 2 : 64;
+    struct CarvedFile* carved = realloc(range->carved, capacity * sizeof(struct CarvedFile));
+    if(carved == NULL)
+    {
+        range->outOfMemory = true;
+        return false;
+    }
+    range->carved = carved;
+    range->capacity = capacity;
+    return true;
+}
+
+void* CarveScanRange(void* argument)
+{
+    struct CarveRange* range = argument;
+    Fat32TraceContext("CARVE");
+    struct Fat32Volume* vol = range->vol;
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    u_int32_t chunkClusters = Fat32PreferredReadBytes(vol) / clusterBytes;
+    unsigned char* bytes = Fat32GetBuffer(vol);
+    unsigned char* carveBuffer = Fat32GetBuffer(vol);
+    if(bytes == NULL || carveBuffer == NULL) range->outOfMemory = true;
+
+    u_int32_t cluster = range->firstCluster;
+    while(cluster < range->endCluster && !range->outOfMemory)
+    {
+        //Skip to the next run of free clusters, and read it in large sequential pieces
+        if(Fat32NextCluster(vol, cluster) != 0)
+        {
+            cluster++;
+            continue;
+        }
+        u_int32_t runLength = FreeRunLength(vol, cluster, range->endCluster - cluster);
+        u_int32_t count = runLength < chunkClusters ? runLength : chunkClusters;
+        if(!Fat32ReadAt(vol, bytes, (size_t)count * clusterBytes, Fat32ClusterOffset(vol, cluster))) break;
+
+        u_int32_t next = cluster + count;
+        for(u_int32_t i = 0; i < count; i++)
+        {
+            struct CarveSignature* signature = CarveMatchHeader(range, &bytes[(size_t)i * clusterBytes]);
+            if(signature == NULL) continue;
+
+            u_int32_t first = cluster + i;
+            u_int64_t size = CarveFindEnd(range, signature, first, carveBuffer);
+            if(size == 0) continue;
+            if(!CarveReserve(range)) break;
+            if(!CarveWrite(range, signature, first, size, carveBuffer)) continue;
+
+            struct CarvedFile* carved = &range->carved[range->numCarved++];
+            carved->firstCluster = first;
+            carved->clusters = (size + clusterBytes - 1) / clusterBytes;
+            carved->size = size;
+            carved->signature = signature;
+
+            //The clusters of a carved file are not searched for headers again
+            if(first + carved->clusters > cluster + count)
+            {
+                next = first + carved->clusters;
+                break;
+            }
+            i += carved->clusters - 1;
+        }
+        cluster = next;
+    }
+
+    Fat32PutBuffer(vol, bytes);
+    Fat32PutBuffer(vol, carveBuffer);
+    return NULL;
+}
+
+/// @brief Runs CARVE. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Carve(struct Fat32Volume* vol, char* argument, FILE* out)
+{
+    struct CarveSignature signatures[CARVE_NUM_SIGNATURES];
+    bool wanted[CARVE_NUM_SIGNATURES];
+    CarveInitSignatures(signatures);
+    for(int i = 0; i < CARVE_NUM_SIGNATURES; i++) wanted[i] = true;
+
+    const char* outDirectory = "carved";
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < CARVE_MAX_THREADS ? online : CARVE_MAX_THREADS) : 1;
+
+    char* cursor = argument;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        char* value = NextWord(&cursor);
+        if(value == NULL)
+        {
+            fprintf(out, "Usage: CARVE [--out dir] [--types jpg,png,pdf,zip,evtx] [--threads n]\n");
+            return;
+        }
+
+        if(strcmp(word, "--out") == 0) outDirectory = value;
+        else if(strcmp(word, "--threads") == 0)
+        {
+            numThreads = atoi(value);
+            if(numThreads < 1 || numThreads > CARVE_MAX_THREADS)
+            {
+                fprintf(out, "--threads takes 1 to %d\n", CARVE_MAX_THREADS);
+                return;
+            }
+        }
+        else if(strcmp(word, "--types") == 0)
+        {
+            for(int i = 0; i < CARVE_NUM_SIGNATURES; i++) wanted[i] = false;
+            //strtok keeps its place in state shared by every thread
+            char* saved;
+            for(char* type = strtok_r(value, ",", &saved); type != NULL; type = strtok_r(NULL, ",", &saved))
+            {
+                int i;
+                for(i = 0; i < CARVE_NUM_SIGNATURES && strcasecmp(type, signatures[i].type) != 0; i++);
+                if(i == CARVE_NUM_SIGNATURES)
+                {
+                    fprintf(out, "Unknown type %s\n", type);
+                    return;
+                }
+                wanted[i] = true;
+            }
+        }
+        else
+        {
+            fprintf(out, "Unexpected argument %s\n", word);
+            return;
+        }
+    }
+
+    if(mkdir(outDirectory, 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(out, "%s: %s\n", outDirectory, strerror(errno));
+        return;
+    }
+
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    u_int32_t perThread = (clusterCount - 2 + numThreads - 1) / numThreads;
+    struct CarveRange ranges[CARVE_MAX_THREADS];
+    pthread_t threads[CARVE_MAX_THREADS];
+    bool started[CARVE_MAX_THREADS];
+    for(uint i = 0; i < numThreads; i++)
+    {
+        memset(&ranges[i], 0, sizeof(struct CarveRange));
+        ranges[i].vol = vol;
+        ranges[i].signatures = signatures;
+        ranges[i].wanted = wanted;
+        ranges[i].outDirectory = outDirectory;
+        ranges[i].firstCluster = 2 + i * perThread < clusterCount ? 2 + i * perThread : clusterCount;
+        ranges[i].endCluster = ranges[i].firstCluster + perThread < clusterCount ? ranges[i].firstCluster + perThread : clusterCount;
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, CarveScanRange, &ranges[i]) == 0;
+    }
+    for(uint i = 0; i < numThreads; i++) if(!started[i]) CarveScanRange(&ranges[i]);
+
+    char manifestPath[4096];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/manifest.txt", outDirectory);
+    FILE* manifest = fopen(manifestPath, "w");
+    if(manifest != NULL) fprintf(manifest, "file\ttype\tfirst_cluster\tclusters\tsize\n");
+
+    //Ranges are in disk order, so the manifest is too
+    uint total = 0;
+    uint perType[CARVE_NUM_SIGNATURES] = {0};
+    bool outOfMemory = false;
+    for(uint i = 0; i < numThreads; i++)
+    {
+        if(started[i]) pthread_join(threads[i], NULL);
+        outOfMemory = outOfMemory || ranges[i].outOfMemory;
+        for(uint j = 0; j < ranges[i].numCarved; j++)
+        {
+            struct CarvedFile* carved = &ranges[i].carved[j];
+            if(manifest != NULL) fprintf(manifest, "%u.%s\t%s\t%u\t%u\t%llu\n", carved->firstCluster, carved->signature->type, carved->signature->type, carved->firstCluster, carved->clusters, (unsigned long long)carved->size);
+            fprintf(out, "%u.%s %'llu bytes\n", carved->firstCluster, carved->signature->type, (unsigned long long)carved->size);
+            perType[carved->signature - signatures]++;
+            total++;
+        }
+        free(ranges[i].carved);
+    }
+    if(manifest != NULL) fclose(manifest);
+
+    fprintf(out, "\n%u file(s) carved into %s:", total, outDirectory);
+    for(int i = 0; i < CARVE_NUM_SIGNATURES; i++) if(wanted[i]) fprintf(out, " %u %s", perType[i], signatures[i].type);
+    fprintf(out, "\n");
+    if(outOfMemory) fprintf(out, "Out of memory; parts of the volume were not searched\n");
+}
+
+#endif
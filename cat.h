@@ -0,0 +1,173 @@
+
+/******************/
+/*Cat.h           */
+/******************/
+
+/*
+This header file holds the CAT command, which writes the raw bytes of a file.
+
+    CAT <file> [offset] [length]
+
+Without offset the file is written from its start, and without length to its
+end. Numbers may be written in hex with a leading 0x, and sizes may end in K,
+M or G.
+
+Reads find the cluster holding offset by binary search over the file's
+extent map instead of following the chain from the first cluster, so reading
+the last bytes of a 4GB file costs as little as reading its first ones.
+
+When the output is a pipe or a socket the bytes are moved with splice or
+sendfile straight from the image, never passing through this process, which
+makes CAT the way to feed a file to another tool without extracting it:
+
+    fat32 --cat <image> <path> [offset] [length] | zstd > out.zst
+
+streams one file to stdout, or to the descriptor given with --fd n, and exits.
+The path may start with pN: to read from partition N of a disk image.
+*/
+
+#ifndef CAT_H
+#define CAT_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief Writes length bytes of a file from offset, or as many as there are.
+/// When out is backed by a file descriptor the bytes go straight to it, zero copy if it is a pipe or a socket.
+void CatFile(struct Fat32Volume* vol, struct Fat32Entry* entry, u_int64_t offset, u_int64_t length, FILE* out)
+{
+    fflush(out);
+    int outFd = fileno(out);
+    if(outFd >= 0)
+    {
+        for(u_int64_t done = 0; done < length; )
+        {
+            ssize_t n = Fat32SendFile(vol, entry, outFd, offset + done, length - done);
+            if(n <= 0)
+            {
+                if(n < 0 && errno != EPIPE) fprintf(stderr, "Read failed at offset %llu: %s\n", (unsigned long long)(offset + done), strerror(errno));
+                break;
+            }
+            done += n;
+        }
+        return;
+    }
+
+    //Memory streams, such as the replies of the daemon, get the bytes through a buffer
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    if(buffer == NULL)
+    {
+        fprintf(out, "Out of memory\n");
+        return;
+    }
+
+    u_int64_t chunkBytes = Fat32PreferredReadBytes(vol);
+    for(u_int64_t done = 0; done < length; )
+    {
+        size_t chunk = length - done < chunkBytes ? length - done : chunkBytes;
+        ssize_t n = Fat32PRead(vol, entry, buffer, chunk, offset + done);
+        if(n <= 0)
+        {
+            if(n < 0) fprintf(out, "Read failed at offset %llu: %s\n", (unsigned long long)(offset + done), strerror(errno));
+            break;
+        }
+        if(fwrite(buffer, 1, n, out) != (size_t)n) break;
+        done += n;
+    }
+    Fat32PutBuffer(vol, buffer);
+}
+
+/// @brief Runs CAT. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Cat(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    char* cursor = argument;
+    char* path = NextWord(&cursor);
+    char* offsetText = NextWord(&cursor);
+    char* lengthText = NextWord(&cursor);
+    u_int64_t offset = 0, length = (u_int64_t)-1;
+    if(path == NULL || NextWord(&cursor) != NULL ||
+    (offsetText != NULL && !HexDumpParseNumber(offsetText, &offset)) ||
+    (lengthText != NULL && !HexDumpParseNumber(lengthText, &length)))
+    {
+        fprintf(out, "Usage: CAT <file> [offset] [length]\n");
+        return;
+    }
+
+    struct Fat32Entry entry;
+    if(!Fat32Stat(vol, currentDirectory, path, &entry))
+    {
+        fprintf(out, "File Not Found\n");
+        return;
+    }
+    if((entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+    {
+        fprintf(out, "%s is a directory\n", path);
+        return;
+    }
+    if(offset > entry.dir.DIR_FileSize)
+    {
+        fprintf(out, "Offset %llu is past the end of the file\n", (unsigned long long)offset);
+        return;
+    }
+
+    if(length > entry.dir.DIR_FileSize - offset) length = entry.dir.DIR_FileSize - offset;
+    CatFile(vol, &entry, offset, length, out);
+}
+
+/// @brief Runs the reader as fat32 --cat <image> <path> [offset] [length]: streams one file to outFd and nothing else.
+/// Errors go to stderr so they never end up mixed into the stream.
+/// @param args Everything after --cat.
+/// @return The exit status.
+int CatStream(int numArgs, char* args[], int openFlags, u_int64_t fatBudget, int outFd)
+{
+    u_int64_t offset = 0, length = (u_int64_t)-1;
+    if(numArgs < 2 || numArgs > 4 ||
+    (numArgs > 2 && !HexDumpParseNumber(args[2], &offset)) ||
+    (numArgs > 3 && !HexDumpParseNumber(args[3], &length)))
+    {
+        fprintf(stderr, "Usage: fat32 --cat <image> <path> [offset] [length] [--fd n] [--direct] [--compact-fat] [--fat-budget size]\n");
+        return 1;
+    }
+
+    //The path may name its partition, as pN:/path
+    char* path = args[1];
+    uint partition = DiskPathPartition(&path);
+
+    Fat32TraceContext("CAT");
+    struct Fat32Volume* vol = Fat32OpenPartition(args[0], partition, openFlags, fatBudget);
+    if(vol == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", args[0], errno == EINVAL ? "not a FAT32 volume" : errno == ENOMEM ? "the FAT does not fit the memory budget" : errno == ENOENT ? "no such partition" : strerror(errno));
+        return 1;
+    }
+
+    int status = 1;
+    struct Fat32Entry entry;
+    if(!Fat32Stat(vol, Fat32RootCluster(vol), path, &entry)) fprintf(stderr, "%s: File Not Found\n", path);
+    else if((entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY) fprintf(stderr, "%s is a directory\n", path);
+    else if(offset > entry.dir.DIR_FileSize) fprintf(stderr, "Offset %llu is past the end of the file\n", (unsigned long long)offset);
+    else
+    {
+        if(length > entry.dir.DIR_FileSize - offset) length = entry.dir.DIR_FileSize - offset;
+        status = 0;
+        for(u_int64_t done = 0; done < length; )
+        {
+            ssize_t n = Fat32SendFile(vol, &entry, outFd, offset + done, length - done);
+            if(n <= 0)
+            {
+                fprintf(stderr, "%s: %s\n", path, n < 0 ? strerror(errno) : "file ended early");
+                status = 1;
+                break;
+            }
+            done += n;
+        }
+    }
+
+    Fat32Close(vol);
+    return status;
+}
+
+#endif
@@ -0,0 +1,421 @@
+
+/******************/
+/*Check.h         */
+/******************/
+
+/*
+This header file holds the CHECK command, a read-only consistency check of
+a volume in the spirit of fsck.
+
+    CHECK [--threads n]
+
+It reports
+    - a backup boot sector (BPB_BkBootSec) that differs from the primary one,
+    - FAT copies that differ from the first one,
+    - chains that run into a free, bad or out of range cluster,
+    - chains that loop back on themselves,
+    - clusters claimed by more than one chain (cross-links),
+    - files whose chain is shorter or longer than DIR_FileSize needs,
+    - lost chains: allocated clusters that no directory entry leads to.
+
+The tree is walked by a pool of threads sharing one queue of directories.
+Every chain is followed through the in-memory FAT and each cluster is claimed
+in an ownership map with a compare and swap, so the first chain to reach a
+cluster owns it and any later one is cross-linked with it. A chain owns
+itself only if it claimed its own first cluster, so meeting its own mark
+again later is a loop, while two entries sharing a first cluster are a
+cross-link. While the tree is
+being walked, another thread compares the FAT copies on disk.
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define CHECK_MAX_THREADS 16
+#define CHECK_MAX_REPORTED 1000 //Problems printed before the rest are only counted
+
+/// @brief A directory waiting to be checked.
+struct CheckJob
+{
+    u_int32_t cluster;
+    char* path;
+    struct CheckJob* next;
+};
+
+/// @brief Everything the checking threads share.
+struct CheckState
+{
+    struct Fat32Volume* vol;
+    u_int32_t* owner; //First cluster of the chain each cluster belongs to, 0 while unclaimed
+    bool outOfMemory; //Set by any thread that could not get memory; the walk winds down and CHECK reports nothing else
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct CheckJob* jobs;
+    uint busy;
+
+    pthread_mutex_t reportLock;
+    FILE* report; //Problems found while walking, printed once the walk is done
+    u_int64_t problems;
+
+    //Filled in by the FAT comparison thread
+    u_int64_t fatMismatches[8];
+    bool fatUnreadable[8];
+};
+
+/// @brief Records a problem found in the tree.
+void CheckProblem(struct CheckState* state, const char* format, ...)
+{
+    va_list args;
+    pthread_mutex_lock(&state->reportLock);
+    if(state->problems < CHECK_MAX_REPORTED)
+    {
+        va_start(args, format);
+        vfprintf(state->report, format, args);
+        va_end(args);
+    }
+    state->problems++;
+    pthread_mutex_unlock(&state->reportLock);
+}
+
+void CheckOutOfMemory(struct CheckState* state)
+{
+    __atomic_store_n(&state->outOfMemory, true, __ATOMIC_RELAXED);
+}
+
+/// @brief Follows one chain through the FAT, claiming its clusters and checking its length.
+/// @param isDirectory Whether the chain is a directory's, whose length is not recorded anywhere. Otherwise it must be expectedClusters long.
+/// @return Whether this call claimed the first cluster. A chain some other entry claimed first is not walked again.
+bool CheckChain(struct CheckState* state, const char* path, u_int32_t first, bool isDirectory, u_int32_t expectedClusters)
+{
+    struct Fat32Volume* vol = state->vol;
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    u_int32_t length = 0;
+    u_int32_t cluster = first;
+
+    while(true)
+    {
+        if(cluster < 2 || cluster >= clusterCount)
+        {
+            CheckProblem(state, "%s: chain points outside the volume (cluster %u)\n", path, cluster);
+            break;
+        }
+
+        u_int32_t expected = 0;
+        if(!__atomic_compare_exchange_n(&state->owner[cluster], &expected, first, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            //Having claimed the first cluster, only this chain can have left its mark further on
+            if(expected == first && length > 0) CheckProblem(state, "%s: chain loops back to cluster %u\n", path, cluster);
+            else CheckProblem(state, "%s: cross-linked with the chain starting at cluster %u, at cluster %u\n", path, expected, cluster);
+            break;
+        }
+        length++;
+
+        u_int32_t next = Fat32NextCluster(vol, cluster);
+        if(next == 0)
+        {
+            CheckProblem(state, "%s: chain runs into free cluster %u\n", path, cluster);
+            break;
+        }
+        if(next == 0x0FFFFFF7)
+        {
+            CheckProblem(state, "%s: chain runs into bad cluster %u\n", path, cluster);
+            break;
+        }
+        if(next >= 0x0FFFFFF8) break;
+        cluster = next;
+    }
+
+    if(!isDirectory && length != expectedClusters) CheckProblem(state, "%s: chain is %u cluster(s) long but the size needs %u\n", path, length, expectedClusters);
+    return length > 0;
+}
+
+/// @return Whether there was memory to queue the directory. It takes path over either way.
+bool CheckPushJob(struct CheckState* state, u_int32_t cluster, char* path)
+{
+    struct CheckJob* job = path != NULL ? malloc(sizeof(struct CheckJob)) : NULL;
+    if(job == NULL)
+    {
+        free(path);
+        CheckOutOfMemory(state);
+        return false;
+    }
+    job->cluster = cluster;
+    job->path = path;
+
+    pthread_mutex_lock(&state->lock);
+    job->next = state->jobs;
+    state->jobs = job;
+    pthread_cond_signal(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+    return true;
+}
+
+/// @brief Checks the chain of every entry in a directory. Subdirectories are queued for whichever thread is free next.
+void CheckDirectory(struct CheckState* state, struct CheckJob* job)
+{
+    struct Fat32Volume* vol = state->vol;
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(vol, job->cluster, &dir)) return;
+
+    while(!__atomic_load_n(&state->outOfMemory, __ATOMIC_RELAXED) && Fat32ReadDir(&dir, &entry))
+    {
+        if((entry.dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+        bool isDirectory = (entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+        if(isDirectory && (strcmp(entry.shortName, ".") == 0 || strcmp(entry.shortName, "..") == 0)) continue;
+
+        char* path = malloc(strlen(job->path) + strlen(entry.name) + 2);
+        if(path == NULL)
+        {
+            CheckOutOfMemory(state);
+            break;
+        }
+        sprintf(path, "%s/%s", job->path, entry.name);
+
+        u_int32_t expectedClusters = ((u_int64_t)entry.dir.DIR_FileSize + clusterBytes - 1) / clusterBytes;
+        bool queued = false;
+        if(entry.firstCluster == 0)
+        {
+            if(isDirectory) CheckProblem(state, "%s: directory has no clusters\n", path);
+            else if(expectedClusters != 0) CheckProblem(state, "%s: has a size of %u but no clusters\n", path, entry.dir.DIR_FileSize);
+        }
+        else if(isDirectory)
+        {
+            //Claiming the chain decides which thread walks the directory, so a directory reachable twice is only walked once
+            if(CheckChain(state, path, entry.firstCluster, true, 0))
+            {
+                CheckPushJob(state, entry.firstCluster, path);
+                queued = true;
+            }
+        }
+        else CheckChain(state, path, entry.firstCluster, false, expectedClusters);
+
+        if(!queued) free(path);
+    }
+
+    Fat32CloseDir(&dir);
+}
+
+void* CheckWorker(void* argument)
+{
+    struct CheckState* state = argument;
+    Fat32TraceContext("CHECK");
+
+    pthread_mutex_lock(&state->lock);
+    while(true)
+    {
+        while(state->jobs == NULL && state->busy > 0) pthread_cond_wait(&state->wake, &state->lock);
+        if(state->jobs == NULL) break;
+
+        struct CheckJob* job = state->jobs;
+        state->jobs = job->next;
+        state->busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        CheckDirectory(state, job);
+        free(job->path);
+        free(job);
+
+        pthread_mutex_lock(&state->lock);
+        state->busy--;
+        if(state->busy == 0 && state->jobs == NULL) pthread_cond_broadcast(&state->wake);
+    }
+    pthread_cond_broadcast(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+/// @brief Compares every other FAT copy with the first one, in large reads.
+void* CheckFatCopies(void* argument)
+{
+    struct CheckState* state = argument;
+    Fat32TraceContext("CHECK");
+    struct Fat32Volume* vol = state->vol;
+    const struct BPBStruct* bpb = Fat32GetBPB(vol);
+    u_int64_t fatBytes = (u_int64_t)bpb->BPB_FATSz32 * bpb->BPB_BytsPerSec;
+    u_int32_t chunk = Fat32PreferredReadBytes(vol);
+    unsigned char* first = Fat32GetBuffer(vol);
+    unsigned char* other = Fat32GetBuffer(vol);
+    if(first == NULL || other == NULL) CheckOutOfMemory(state);
+
+    for(uint copy = 1; first != NULL && other != NULL && copy < bpb->BPB_NumFATs && copy < 8; copy++)
+    {
+        for(u_int64_t offset = 0; offset < fatBytes; offset += chunk)
+        {
+            size_t count = fatBytes - offset < chunk ? fatBytes - offset : chunk;
+            if(!Fat32ReadAt(vol, first, count, Fat32FatOffset(vol, 0) + offset) || !Fat32ReadAt(vol, other, count, Fat32FatOffset(vol, copy) + offset))
+            {
+                state->fatUnreadable[copy] = true;
+                break;
+            }
+            if(memcmp(first, other, count) == 0) continue;
+            for(size_t i = 0; i + 4 <= count; i += 4) if(memcmp(first + i, other + i, 4) != 0) state->fatMismatches[copy]++;
+        }
+    }
+
+    Fat32PutBuffer(vol, first);
+    Fat32PutBuffer(vol, other);
+    return NULL;
+}
+
+void CheckFree(struct CheckState* state)
+{
+    free(state->owner);
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->wake);
+    pthread_mutex_destroy(&state->reportLock);
+}
+
+/// @brief Runs CHECK. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Check(struct Fat32Volume* vol, char* argument, FILE* out)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < CHECK_MAX_THREADS ? online : CHECK_MAX_THREADS) : 1;
+
+    char* cursor = argument;
+    char* word = NextWord(&cursor);
+    if(word != NULL)
+    {
+        char* value = NextWord(&cursor);
+        numThreads = value ? atoi(value) : 0;
+        if(strcmp(word, "--threads") != 0 || numThreads < 1 || numThreads > CHECK_MAX_THREADS || NextWord(&cursor) != NULL)
+        {
+            fprintf(out, "Usage: CHECK [--threads n] (1 to %d threads)\n", CHECK_MAX_THREADS);
+            return;
+        }
+    }
+
+    const struct BPBStruct* bpb = Fat32GetBPB(vol);
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    u_int64_t totalProblems = 0;
+
+    struct CheckState state;
+    memset(&state, 0, sizeof(state));
+    state.vol = vol;
+    state.owner = calloc(clusterCount, sizeof(u_int32_t));
+    char* reportText = NULL;
+    size_t reportLength = 0;
+    state.report = state.owner != NULL ? open_memstream(&reportText, &reportLength) : NULL;
+    if(state.report == NULL)
+    {
+        fprintf(out, "Out of memory\n");
+        free(state.owner);
+        return;
+    }
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.wake, NULL);
+    pthread_mutex_init(&state.reportLock, NULL);
+
+    //The FAT copies are compared on their own thread while the tree is walked
+    pthread_t fatThread;
+    bool fatThreadStarted = pthread_create(&fatThread, NULL, CheckFatCopies, &state) == 0;
+
+    //The root has no entry of its own, so its chain is checked here
+    u_int32_t root = Fat32RootCluster(vol);
+    CheckChain(&state, "/", root, true, 0);
+    CheckPushJob(&state, root, strdup(""));
+
+    pthread_t threads[CHECK_MAX_THREADS];
+    uint started = 0;
+    for(uint i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, CheckWorker, &state) != 0) break;
+        started++;
+    }
+    CheckWorker(&state);
+    for(uint i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    if(fatThreadStarted) pthread_join(fatThread, NULL);
+    else CheckFatCopies(&state);
+    fclose(state.report);
+
+    //Anything less than the whole walk would report every cluster it missed as lost
+    unsigned char* primary = Fat32AllocBuffer(vol, 0);
+    unsigned char* backup = Fat32AllocBuffer(vol, 0);
+    unsigned char* pointedAt = calloc(clusterCount / 8 + 1, 1);
+    if(state.outOfMemory || primary == NULL || backup == NULL || pointedAt == NULL)
+    {
+        fprintf(out, "Out of memory; the check could not be finished\n");
+        free(primary);
+        free(backup);
+        free(pointedAt);
+        free(reportText);
+        CheckFree(&state);
+        return;
+    }
+
+    //Boot sector
+    fprintf(out, "Boot sector: ");
+    if(bpb->BPB_BkBootSec == 0 || bpb->BPB_BkBootSec >= bpb->BPB_RsvdSecCnt) fprintf(out, "no backup\n");
+    else if(!Fat32ReadAt(vol, primary, bpb->BPB_BytsPerSec, Fat32PartitionOffset(vol)) || !Fat32ReadAt(vol, backup, bpb->BPB_BytsPerSec, Fat32PartitionOffset(vol) + (u_int64_t)bpb->BPB_BkBootSec * bpb->BPB_BytsPerSec))
+    {
+        fprintf(out, "backup at sector %u could not be read\n", bpb->BPB_BkBootSec);
+        totalProblems++;
+    }
+    else if(memcmp(primary, backup, bpb->BPB_BytsPerSec) != 0)
+    {
+        fprintf(out, "backup at sector %u differs from the primary\n", bpb->BPB_BkBootSec);
+        totalProblems++;
+    }
+    else fprintf(out, "backup at sector %u matches\n", bpb->BPB_BkBootSec);
+    free(primary);
+    free(backup);
+
+    //FAT copies
+    for(uint copy = 1; copy < bpb->BPB_NumFATs && copy < 8; copy++)
+    {
+        fprintf(out, "FAT copy %u: ", copy + 1);
+        if(state.fatUnreadable[copy]) fprintf(out, "could not be read\n");
+        else if(state.fatMismatches[copy] != 0) fprintf(out, "%llu entr%s differ from the first copy\n", (unsigned long long)state.fatMismatches[copy], state.fatMismatches[copy] == 1 ? "y" : "ies");
+        else fprintf(out, "matches\n");
+        if(state.fatUnreadable[copy] || state.fatMismatches[copy] != 0) totalProblems++;
+    }
+
+    //Problems found in the tree
+    fprintf(out, "%s", reportText);
+    if(state.problems > CHECK_MAX_REPORTED) fprintf(out, "... and %llu more\n", (unsigned long long)(state.problems - CHECK_MAX_REPORTED));
+    totalProblems += state.problems;
+    free(reportText);
+
+    //Lost chains: allocated clusters nothing owns. A lost cluster no other lost cluster points at starts a chain.
+    u_int32_t lostClusters = 0, lostChains = 0, usedClusters = 0;
+    for(u_int32_t c = 2; c < clusterCount; c++)
+    {
+        u_int32_t value = Fat32NextCluster(vol, c);
+        if(value == 0 || value == 0x0FFFFFF7) continue;
+        usedClusters++;
+        if(state.owner[c] != 0) continue;
+        lostClusters++;
+        if(value >= 2 && value < clusterCount) pointedAt[value / 8] |= 1 << (value % 8);
+    }
+    for(u_int32_t c = 2; c < clusterCount; c++)
+    {
+        u_int32_t value = Fat32NextCluster(vol, c);
+        if(value == 0 || value == 0x0FFFFFF7 || state.owner[c] != 0 || (pointedAt[c / 8] & (1 << (c % 8)))) continue;
+        if(lostChains < 20) fprintf(out, "Lost chain starting at cluster %u\n", c);
+        lostChains++;
+    }
+    if(lostClusters != 0)
+    {
+        fprintf(out, "%u lost cluster(s) in %u chain(s)\n", lostClusters, lostChains);
+        totalProblems++;
+    }
+    free(pointedAt);
+
+    fprintf(out, "\n%u of %u clusters in use\n", usedClusters, clusterCount - 2);
+    if(totalProblems == 0) fprintf(out, "No problems found\n");
+    else fprintf(out, "%llu problem(s) found\n", (unsigned long long)totalProblems);
+    CheckFree(&state);
+}
+
+#endif
@@ -0,0 +1,296 @@
+
+/******************/
+/*Dirsort.h       */
+/******************/
+
+/*
+This header file holds sorted DIR listings.
+
+    DIR --sort=name|size|mtime|ctime [--reverse]
+
+The directory is read once into compact records: the short entry, an offset
+into one pool of long names, and a 64 bit sort key worked out up front. Names
+key on their first eight case folded characters, sizes on DIR_FileSize, and
+times on the packed FAT date and time words, which sort the same way the
+dates and times they hold do. The records are then put in order by an LSD
+radix sort over the key bytes, skipping any byte every key shares, and only
+names that tie on all eight characters are compared in full. The listing is
+formatted into memory and written out in one go.
+
+Equal keys keep their on-disk order. --reverse reverses the whole listing,
+and on its own sorts by name.
+*/
+
+#ifndef DIRSORT_H
+#define DIRSORT_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/// @brief What a sorted listing is sorted by.
+enum DirSortField
+{
+    DIR_SORT_NAME,
+    DIR_SORT_SIZE,
+    DIR_SORT_MTIME,
+    DIR_SORT_CTIME
+};
+
+/// @brief One entry of the directory, as much of it as the listing needs.
+struct DirSortItem
+{
+    struct DirectoryEntry dir;
+    u_int32_t nameOffset; //Into the name pool; the long name, or the 8.3 name when there is none
+    bool hasLongName;
+};
+
+/// @brief What gets moved around while sorting.
+struct DirSortRecord
+{
+    u_int64_t key;
+    u_int32_t item;
+};
+
+/// @brief Everything read out of the directory.
+struct DirSortListing
+{
+    struct DirSortItem* items;
+    u_int32_t numItems, maxItems;
+    char* names;
+    size_t namesUsed, namesSize;
+    bool hasVolumeId;
+    struct Fat32Entry volumeId; //Printed ahead of everything else, as the unsorted listing does
+};
+
+/// @brief Packs the first eight characters of a name, lower cased, so that comparing keys compares those characters.
+u_int64_t DirSortNameKey(const char* name)
+{
+    u_int64_t key = 0;
+    for(int i = 0; i < 8; i++)
+    {
+        unsigned char c = *name ? tolower((unsigned char)*name++) : 0;
+        key = (key << 8) | c;
+    }
+    return key;
+}
+
+/// @brief Works out an entry's sort key.
+u_int64_t DirSortKey(const struct DirSortListing* listing, const struct DirSortItem* item, enum DirSortField field)
+{
+    const struct DirectoryEntry* dir = &item->dir;
+    switch(field)
+    {
+    case DIR_SORT_SIZE: return dir->DIR_FileSize;
+    //Packed FAT dates and times already run year, month, day and hours, minutes, seconds from the top bit down
+    case DIR_SORT_MTIME: return ((u_int64_t)dir->DIR_WrtDate << 16) | dir->DIR_WrtTime;
+    case DIR_SORT_CTIME: return ((u_int64_t)dir->DIR_CrtDate << 24) | ((u_int64_t)dir->DIR_CrtTime << 8) | dir->DIR_CrtTimeTenth;
+    default: return DirSortNameKey(listing->names + item->nameOffset);
+    }
+}
+
+/// @brief Reads a directory into a listing.
+/// @return Whether every entry could be kept.
+bool DirSortRead(struct Fat32Volume* vol, uint cluster, struct DirSortListing* listing)
+{
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(vol, cluster, &dir)) return false;
+
+    bool kept = true;
+    while(kept && Fat32ReadDir(&dir, &entry))
+    {
+        if((entry.dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID)
+        {
+            listing->volumeId = entry;
+            listing->hasVolumeId = true;
+            continue;
+        }
+
+        size_t nameBytes = strlen(entry.name) + 1;
+        if(listing->numItems == listing->maxItems)
+        {
+            u_int32_t slots = listing->maxItems ? listing->maxItems * 2 : 256;
+            struct DirSortItem* grown = realloc(listing->items, slots * sizeof(struct DirSortItem));
+            if(grown == NULL) kept = false;
+            else listing->items = grown, listing->maxItems = slots;
+        }
+        if(kept && listing->namesUsed + nameBytes > listing->namesSize)
+        {
+            size_t size = listing->namesSize ? listing->namesSize * 2 : 16384;
+            char* grown = realloc(listing->names, size);
+            if(grown == NULL) kept = false;
+            else listing->names = grown, listing->namesSize = size;
+        }
+        if(!kept) break;
+
+        struct DirSortItem* item = &listing->items[listing->numItems++];
+        item->dir = entry.dir;
+        item->hasLongName = entry.hasLongName;
+        item->nameOffset = listing->namesUsed;
+        memcpy(listing->names + listing->namesUsed, entry.name, nameBytes);
+        listing->namesUsed += nameBytes;
+    }
+    Fat32CloseDir(&dir);
+    return kept;
+}
+
+/// @brief Stable LSD radix sort of records by key, a byte at a time.
+/// @param scratch Room for as many records as there are.
+/// @return Whichever of records and scratch ends up holding the sorted records.
+struct DirSortRecord* DirSortRadix(struct DirSortRecord* records, struct DirSortRecord* scratch, u_int32_t count)
+{
+    //One pass over the keys counts every byte position at once
+    u_int32_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for(u_int32_t i = 0; i < count; i++)
+    {
+        u_int64_t key = records[i].key;
+        for(int b = 0; b < 8; b++) counts[b][(key >> (b * 8)) & 0xFF]++;
+    }
+
+    for(int b = 0; b < 8; b++)
+    {
+        //A byte that every key shares does not move anything
+        if(count == 0 || counts[b][(records[0].key >> (b * 8)) & 0xFF] == count) continue;
+
+        u_int32_t offsets[256];
+        u_int32_t total = 0;
+        for(int v = 0; v < 256; v++)
+        {
+            offsets[v] = total;
+            total += counts[b][v];
+        }
+        for(u_int32_t i = 0; i < count; i++) scratch[offsets[(records[i].key >> (b * 8)) & 0xFF]++] = records[i];
+
+        struct DirSortRecord* swap = records;
+        records = scratch;
+        scratch = swap;
+    }
+    return records;
+}
+
+//qsort has no context pointer, and a listing is only ever sorted on the thread running the command
+static __thread const struct DirSortListing* DirSortCompareListing;
+
+/// @brief Orders two records by full name, then by their on-disk order.
+int DirSortCompareNames(const void* a, const void* b)
+{
+    const struct DirSortRecord* left = a;
+    const struct DirSortRecord* right = b;
+    const struct DirSortListing* listing = DirSortCompareListing;
+    int order = strcasecmp(listing->names + listing->items[left->item].nameOffset, listing->names + listing->items[right->item].nameOffset);
+    if(order != 0) return order;
+    return left->item < right->item ? -1 : left->item > right->item;
+}
+
+/// @brief Prints a directory sorted by one field.
+void ReaddirSorted(struct Fat32Volume* vol, uint loCluster, enum DirSortField field, bool reverse, FILE* out)
+{
+    struct DirSortListing listing;
+    memset(&listing, 0, sizeof(listing));
+    if(!DirSortRead(vol, loCluster, &listing))
+    {
+        fprintf(out, "Out of memory reading the directory\n");
+        free(listing.items);
+        free(listing.names);
+        return;
+    }
+
+    u_int32_t count = listing.numItems;
+    struct DirSortRecord* records = malloc((count + 1) * sizeof(struct DirSortRecord));
+    struct DirSortRecord* scratch = malloc((count + 1) * sizeof(struct DirSortRecord));
+    char* text = NULL;
+    size_t textLength = 0;
+    FILE* buffer = open_memstream(&text, &textLength);
+    if(records == NULL || scratch == NULL || buffer == NULL)
+    {
+        fprintf(out, "Out of memory sorting the directory\n");
+        goto done;
+    }
+
+    for(u_int32_t i = 0; i < count; i++)
+    {
+        records[i].key = DirSortKey(&listing, &listing.items[i], field);
+        records[i].item = i;
+    }
+    struct DirSortRecord* sorted = DirSortRadix(records, scratch, count);
+
+    //Names only key on eight characters; runs that tie on all of them and run longer get compared in full
+    if(field == DIR_SORT_NAME)
+    {
+        DirSortCompareListing = &listing;
+        for(u_int32_t start = 0; start < count; )
+        {
+            u_int32_t end = start + 1;
+            while(end < count && sorted[end].key == sorted[start].key) end++;
+            if(end - start > 1 && (sorted[start].key & 0xFF) != 0) qsort(&sorted[start], end - start, sizeof(struct DirSortRecord), DirSortCompareNames);
+            start = end;
+        }
+    }
+
+    struct ReaddirTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    if(listing.hasVolumeId) ReaddirPrintEntry(vol, &listing.volumeId, &totals, buffer);
+
+    struct Fat32Entry entry;
+    for(u_int32_t i = 0; i < count; i++)
+    {
+        struct DirSortItem* item = &listing.items[sorted[reverse ? count - 1 - i : i].item];
+        entry.dir = item->dir;
+        entry.hasLongName = item->hasLongName;
+        strcpy(entry.name, listing.names + item->nameOffset);
+        ReaddirPrintEntry(vol, &entry, &totals, buffer);
+    }
+    ReaddirPrintTotals(&totals, buffer);
+
+    fclose(buffer);
+    buffer = NULL;
+    fwrite(text, 1, textLength, out);
+
+done:
+    if(buffer != NULL) fclose(buffer);
+    free(text);
+    free(records);
+    free(scratch);
+    free(listing.items);
+    free(listing.names);
+}
+
+/// @brief Runs DIR with options. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void ReaddirCommand(struct Fat32Volume* vol, uint loCluster, char* argument, FILE* out)
+{
+    const char* fieldNames[] = {"name", "size", "mtime", "ctime"};
+    int field = -1;
+    bool reverse = false;
+
+    char* cursor = argument;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        char* value = NULL;
+        if(strncmp(word, "--sort=", 7) == 0) value = word + 7;
+        else if(strcmp(word, "--sort") == 0) value = NextWord(&cursor);
+        else if(strcmp(word, "--reverse") == 0)
+        {
+            reverse = true;
+            continue;
+        }
+
+        field = -1;
+        for(int f = 0; value != NULL && f < 4; f++) if(strcasecmp(value, fieldNames[f]) == 0) field = f;
+        if(field < 0)
+        {
+            fprintf(out, "Usage: DIR [--sort=name|size|mtime|ctime] [--reverse]\n");
+            return;
+        }
+    }
+
+    if(field < 0 && !reverse) Readdir(vol, loCluster, out);
+    else ReaddirSorted(vol, loCluster, field < 0 ? DIR_SORT_NAME : field, reverse, out);
+}
+
+#endif
@@ -0,0 +1,329 @@
+
+/******************/
+/*Disk.h          */
+/******************/
+
+/*
+This header file holds whole disk images: every partition on one, MBR or GPT,
+each mounted the first time it is used with its own BPB, FAT and caches.
+
+    USE          List the partitions, with a * by the one in use.
+    USE <n>      Switch to partition n. Each partition keeps its own current directory.
+
+Partitions are numbered the way Linux numbers them: MBR slots 1 to 4, logical
+partitions in an extended one from 5, and GPT entries in table order from 1.
+
+The path in the image a command takes can also name its partition, pN:/path or
+pN:path, to run that one command there without switching. Commands that take
+no such path take a lone pN: as their first word instead:
+
+    CAT p2:/logs/boot.txt
+    STAT p3:
+    DIR p2:
+    CD p2:docs           (CD does switch, then changes directory)
+
+FAT names cannot hold a ':', so a prefix is never part of a real name. Host
+paths, such as IMPORT's source or EXPORT --output, are left as they are.
+
+The daemon gives each client a view of every served Disk: its own current
+partition and directories, over the mounts the Disk shares with everyone.
+*/
+
+#ifndef DISK_H
+#define DISK_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define DISK_PREFIX_NONE -1 //No prefix; the command runs on the session as it is
+#define DISK_PREFIX_DONE -2 //The prefix has been dealt with, or was wrong and said so
+
+/// @brief An image and every partition on it.
+struct Disk
+{
+    char* imagePath;
+    int openFlags;
+    u_int64_t fatBudget;
+    struct Fat32PartitionInfo partitions[FAT32_MAX_PARTITIONS];
+    int numPartitions;
+    struct Fat32Volume* volumes[FAT32_MAX_PARTITIONS]; //NULL until the partition is first used
+    u_int32_t currentDirectory[FAT32_MAX_PARTITIONS]; //Where each partition was left; the session holds the one in use
+    int current; //Index of the partition the session is on
+    struct Disk* shared; //The Disk that owns the mounts, when this one is only a view of it
+    pthread_mutex_t mountLock; //Held while partitions are mounted for views
+};
+
+/// @brief Mounts a partition if it is not mounted yet.
+/// @return The volume, or NULL with errno set.
+struct Fat32Volume* DiskMount(struct Disk* disk, int index)
+{
+    if(disk->volumes[index] == NULL && disk->shared != NULL)
+    {
+        //Mounted once for every view, whichever asks first
+        pthread_mutex_lock(&disk->shared->mountLock);
+        disk->volumes[index] = DiskMount(disk->shared, index);
+        int error = errno;
+        pthread_mutex_unlock(&disk->shared->mountLock);
+        errno = error;
+        if(disk->volumes[index] != NULL) disk->currentDirectory[index] = Fat32RootCluster(disk->volumes[index]);
+    }
+    else if(disk->volumes[index] == NULL)
+    {
+        disk->volumes[index] = Fat32OpenPartition(disk->imagePath, disk->partitions[index].number, disk->openFlags, disk->fatBudget);
+        if(disk->volumes[index] != NULL) disk->currentDirectory[index] = Fat32RootCluster(disk->volumes[index]);
+    }
+    return disk->volumes[index];
+}
+
+/// @brief Reads an image's partition table and mounts the first partition that holds FAT32. The rest wait until they are used.
+/// @return Whether a partition could be mounted. errno says why not.
+bool DiskOpen(struct Disk* disk, const char* imagePath, int openFlags, u_int64_t fatBudget)
+{
+    memset(disk, 0, sizeof(struct Disk));
+    pthread_mutex_init(&disk->mountLock, NULL);
+    disk->imagePath = strdup(imagePath);
+    disk->openFlags = openFlags;
+    disk->fatBudget = fatBudget;
+    disk->numPartitions = Fat32ListPartitions(imagePath, disk->partitions, FAT32_MAX_PARTITIONS);
+    if(disk->numPartitions < 0) return false;
+    errno = EINVAL;
+
+    //Partitions that are not FAT32 say EINVAL; anything else is the more useful thing to report
+    int error = EINVAL;
+    for(int i = 0; i < disk->numPartitions; i++)
+    {
+        if(DiskMount(disk, i) != NULL)
+        {
+            disk->current = i;
+            return true;
+        }
+        if(error == EINVAL) error = errno;
+    }
+    errno = error;
+    return false;
+}
+
+/// @brief Starts a view of a Disk, on the partition it opened at its root.
+/// A view shares the Disk's mounts and keeps its own place on them. It is freed without DiskClose, before the Disk is closed.
+void DiskView(struct Disk* view, struct Disk* disk)
+{
+    pthread_mutex_lock(&disk->mountLock);
+    memcpy(view->partitions, disk->partitions, sizeof(disk->partitions));
+    memcpy(view->volumes, disk->volumes, sizeof(disk->volumes));
+    memcpy(view->currentDirectory, disk->currentDirectory, sizeof(disk->currentDirectory));
+    pthread_mutex_unlock(&disk->mountLock);
+    view->imagePath = disk->imagePath;
+    view->openFlags = disk->openFlags;
+    view->fatBudget = disk->fatBudget;
+    view->numPartitions = disk->numPartitions;
+    view->current = disk->current;
+    view->shared = disk;
+}
+
+void DiskClose(struct Disk* disk)
+{
+    for(int i = 0; i < disk->numPartitions; i++) Fat32Close(disk->volumes[i]);
+    free(disk->imagePath);
+    pthread_mutex_destroy(&disk->mountLock);
+}
+
+/// @brief Finds a partition by number.
+/// @return Its index, or -1.
+int DiskFind(struct Disk* disk, uint number)
+{
+    for(int i = 0; i < disk->numPartitions; i++) if(disk->partitions[i].number == number) return i;
+    return -1;
+}
+
+/// @brief Finds and mounts partition number for a command, saying why when it cannot.
+/// @return Its index, or -1.
+int DiskMountNumber(struct Disk* disk, uint number, FILE* out)
+{
+    int index = DiskFind(disk, number);
+    if(index < 0)
+    {
+        fprintf(out, "Partition %u not found\n", number);
+        return -1;
+    }
+    if(DiskMount(disk, index) == NULL)
+    {
+        fprintf(out, "Partition %u: %s\n", number, errno == EINVAL ? "not a FAT32 volume" : strerror(errno));
+        return -1;
+    }
+    return index;
+}
+
+/// @brief Moves a session onto another partition, keeping where it was on the one it leaves.
+void DiskSwitch(struct Session* session, int index)
+{
+    struct Disk* disk = session->disk;
+    disk->currentDirectory[disk->current] = session->currentDirectory;
+    disk->current = index;
+    session->vol = disk->volumes[index];
+    session->currentDirectory = disk->currentDirectory[index];
+}
+
+/// @brief Prints the partition table.
+void DiskList(struct Disk* disk, FILE* out)
+{
+    fprintf(out, "  %-4s %14s %14s  %-6s %s\n", "#", "Start", "Sectors", "Type", "Label");
+    for(int i = 0; i < disk->numPartitions; i++)
+    {
+        struct Fat32PartitionInfo* part = &disk->partitions[i];
+        char type[8];
+        if(part->gpt) snprintf(type, sizeof(type), "GPT");
+        else snprintf(type, sizeof(type), "0x%02X", part->mbrType);
+
+        //Partitions are only looked inside once they have been used
+        char label[64];
+        if(disk->volumes[i] != NULL) snprintf(label, sizeof(label), "%s", Fat32GetBPB(disk->volumes[i])->BS_VolLab);
+        else snprintf(label, sizeof(label), "-");
+        fprintf(out, "%c %-4u %'14llu %'14llu  %-6s %s%s%s%s\n", i == disk->current ? '*' : ' ', part->number,
+        (unsigned long long)part->firstLba, (unsigned long long)part->numLbas, type, label,
+        part->name[0] ? " \"" : "", part->name, part->name[0] ? "\"" : "");
+    }
+}
+
+/// @brief Runs USE. See the top of this file for the syntax.
+void DiskUse(struct Session* session, char* argument, FILE* out)
+{
+    if(session->disk == NULL)
+    {
+        fprintf(out, "Only one volume is open here\n");
+        return;
+    }
+    if(argument[0] == '\0')
+    {
+        DiskList(session->disk, out);
+        return;
+    }
+
+    char* end;
+    unsigned long number = strtoul(argument, &end, 10);
+    if(*end != '\0')
+    {
+        fprintf(out, "Usage: USE [n]\n");
+        return;
+    }
+    int index = DiskMountNumber(session->disk, number, out);
+    if(index >= 0) DiskSwitch(session, index);
+}
+
+/// @brief Splits a pN: prefix off a path given on the command line.
+/// @return N, or 0 when the path has no prefix.
+uint DiskPathPartition(char** path)
+{
+    char* text = *path;
+    if(tolower((unsigned char)text[0]) != 'p' || !isdigit((unsigned char)text[1])) return 0;
+
+    char* end;
+    unsigned long number = strtoul(text + 1, &end, 10);
+    if(*end != ':') return 0;
+    *path = end + 1;
+    return number;
+}
+
+/// @brief Where a command takes a path in the image, the only place a pN: prefix is looked for.
+struct DiskPathArgument
+{
+    const char* command;
+    int position; //Which word that is not an option holds the path, counting from 0
+    const char* valueOptions; //Options whose value is the next word, each followed by a space
+};
+
+static const struct DiskPathArgument DiskPathArguments[] =
+{
+    {"EXTRACT", 0, "--manifest "}, //EXTRACT -r's host directory comes after the path
+    {"CD", 0, ""},
+    {"STAT", 0, ""},
+    {"CAT", 0, ""},
+    {"DU", 0, "--threads "},
+    {"FRAG", 0, "--threads "},
+    {"HEXDUMP", 0, "--sector --cluster --count --offset --length "},
+    {"EXPORT", 0, "--output "},
+    {"IMPORT", 1, ""}, //The host path comes first
+};
+
+/// @brief Finds the word of a command's argument a pN: prefix may start: the command's path in the image,
+/// or a lone pN: as the first word of a command that takes no such path.
+/// @return The start of the word, past any opening quote, or NULL.
+char* DiskPrefixWord(const char* command, char* argument)
+{
+    const struct DiskPathArgument* path = NULL;
+    for(uint i = 0; i < sizeof(DiskPathArguments) / sizeof(DiskPathArguments[0]); i++)
+    {
+        if(strcasecmp(command, DiskPathArguments[i].command) == 0) path = &DiskPathArguments[i];
+    }
+
+    int position = 0;
+    bool isValue = false;
+    for(char* word = argument; *word; )
+    {
+        while(isspace((unsigned char)*word)) word++;
+        if(*word == '\0') break;
+        bool quoted = *word == '"';
+        char* start = quoted ? word + 1 : word;
+        char* end = quoted ? strchr(start, '"') : start + strcspn(start, " \t\r\n");
+        if(end == NULL) end = start + strlen(start);
+
+        if(isValue) isValue = false;
+        else if(start[0] == '-')
+        {
+            //An option's value is never the path
+            char option[32];
+            if(path != NULL && end - start < (long)sizeof(option) - 1)
+            {
+                snprintf(option, sizeof(option), "%.*s ", (int)(end - start), start);
+                isValue = strstr(path->valueOptions, option) != NULL;
+            }
+        }
+        else if(path != NULL && position++ == path->position) return start;
+        else if(path == NULL)
+        {
+            //A command without a path only takes the prefix alone, so nothing else it is given is mistaken for one
+            char* colon = start + 1 + strspn(start + 1, "0123456789");
+            return end - start >= 3 && colon == end - 1 && *colon == ':' ? start : NULL;
+        }
+        word = *end == '"' ? end + 1 : end;
+    }
+    return NULL;
+}
+
+/// @brief Looks for pN: at the start of the word of a command's argument that names a path in the image, and strips it.
+/// @param prefixed Set up to run the command on partition N when the result is an index.
+/// @return The index of partition N, DISK_PREFIX_NONE when there is no prefix, or DISK_PREFIX_DONE when the command needs nothing more.
+int DiskPrefix(struct Session* session, const char* command, char* argument, struct Session* prefixed, FILE* out)
+{
+    char* word = DiskPrefixWord(command, argument);
+    if(word == NULL || tolower((unsigned char)word[0]) != 'p' || !isdigit((unsigned char)word[1])) return DISK_PREFIX_NONE;
+    char* end;
+    long number = strtol(word + 1, &end, 10);
+    if(*end != ':') return DISK_PREFIX_NONE;
+    memmove(word, end + 1, strlen(end + 1) + 1);
+
+    if(session->disk == NULL)
+    {
+        fprintf(out, "Only one volume is open here\n");
+        return DISK_PREFIX_DONE;
+    }
+    int index = DiskMountNumber(session->disk, number, out);
+    if(index < 0) return DISK_PREFIX_DONE;
+
+    //CD moves the session over for good, then carries on as usual
+    if(strcasecmp(command, "CD") == 0)
+    {
+        DiskSwitch(session, index);
+        return argument[0] == '\0' ? DISK_PREFIX_DONE : DISK_PREFIX_NONE;
+    }
+
+    prefixed->vol = session->disk->volumes[index];
+    prefixed->disk = session->disk;
+    prefixed->currentDirectory = index == session->disk->current ? session->currentDirectory : session->disk->currentDirectory[index];
+    return index;
+}
+
+#endif
@@ -0,0 +1,470 @@
+
+/******************/
+/*Du.h            */
+/******************/
+
+/*
+This header file holds the DU command, which adds up how much space a
+subtree takes.
+
+    DU [-s] [--threads n] [path]
+
+For every directory under path (the current directory by default) it prints
+the space allocated to the subtree, whole clusters including the clusters of
+the directories themselves, and the logical size of its files. -s prints the
+total for path alone. All counters are 64 bit.
+
+The tree is walked by a pool of threads sharing one queue of directories.
+Each directory's own totals are counted by whichever thread reads it, and
+subtree totals are added up bottom-up once the walk is over.
+
+Every subtree worked out is remembered, keyed by the first cluster of its
+directory, for as long as the volume does not change (see Fat32Generation).
+A later DU of anything already counted, such as the current directory after a
+CD into a directory an earlier DU covered, is answered from memory, and a walk
+that reaches a remembered directory takes its totals without descending.
+*/
+
+#ifndef DU_H
+#define DU_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DU_MAX_THREADS 16
+#define DU_MEMO_VOLUMES 16 //Volumes remembered at once, enough for every image the daemon can mount
+#define DU_MEMO_BUCKETS 4096
+#define DU_MAX_DEPTH 256 //Deepest listing printed, so a looping tree cannot recurse forever
+
+/// @brief Sizes of a directory, or of a whole subtree.
+struct DuTotals
+{
+    u_int64_t logical; //Sum of the file sizes
+    u_int64_t clusters; //Clusters allocated to files and directories
+    u_int64_t files;
+    u_int64_t directories;
+};
+
+/// @brief A remembered subtree.
+struct DuNode
+{
+    u_int32_t cluster;
+    struct DuTotals total;
+    u_int32_t numChildren;
+    u_int32_t* children; //First clusters of the subdirectories
+    char** childNames;
+    struct DuNode* next; //Next node in the same bucket
+};
+
+/// @brief Every subtree remembered for one volume, while its generation holds.
+struct DuMemo
+{
+    struct Fat32Volume* vol;
+    char* imagePath; //Tells a reopened volume that landed at the same address apart
+    u_int64_t generation;
+    struct DuNode* buckets[DU_MEMO_BUCKETS];
+};
+
+static struct DuMemo DuMemos[DU_MEMO_VOLUMES];
+static uint DuMemoNextSlot;
+static pthread_mutex_t DuMemoLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief A directory met during one walk.
+struct DuWalkNode
+{
+    u_int32_t cluster;
+    char* name;
+    int parent; //Index of the parent node, -1 for the starting directory
+    bool remembered; //Totals came from the memo, so the directory was not read
+    struct DuTotals total;
+    u_int32_t numChildren, maxChildren;
+    u_int32_t* children;
+    char** childNames;
+};
+
+/// @brief Everything the walking threads share.
+struct DuWalk
+{
+    struct Fat32Volume* vol;
+    u_int64_t generation; //Of the volume when the walk began; the memo is only trusted, and filled, while it holds
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct DuWalkNode** nodes; //Children always come after their parents
+    uint numNodes, maxNodes;
+    uint* jobs; //Indices of nodes waiting to be read
+    uint numJobs, maxJobs;
+    uint busy;
+    unsigned char* visited; //One bit per cluster, so a looping tree is only walked once
+};
+
+void DuAdd(struct DuTotals* into, const struct DuTotals* from)
+{
+    into->logical += from->logical;
+    into->clusters += from->clusters;
+    into->files += from->files;
+    into->directories += from->directories;
+}
+
+/// @brief Counts the clusters in a chain, stopping at a loop.
+u_int64_t DuChainLength(struct Fat32Volume* vol, u_int32_t cluster)
+{
+    u_int64_t length = 0;
+    u_int32_t limit = Fat32ClusterCount(vol);
+    for(; !Fat32IsEndOfChain(vol, cluster) && length < limit; cluster = Fat32NextCluster(vol, cluster)) length++;
+    return length;
+}
+
+/// @brief Finds the memo for a volume, starting a fresh one when the volume has changed since it was filled. Called with DuMemoLock held.
+struct DuMemo* DuMemoFor(struct Fat32Volume* vol)
+{
+    struct DuMemo* memo = NULL;
+    for(uint i = 0; i < DU_MEMO_VOLUMES && memo == NULL; i++)
+    {
+        if(DuMemos[i].vol == vol && strcmp(DuMemos[i].imagePath, Fat32ImagePath(vol)) == 0) memo = &DuMemos[i];
+    }
+    if(memo == NULL)
+    {
+        memo = &DuMemos[DuMemoNextSlot];
+        DuMemoNextSlot = (DuMemoNextSlot + 1) % DU_MEMO_VOLUMES;
+        free(memo->imagePath);
+        memo->imagePath = strdup(Fat32ImagePath(vol));
+        memo->vol = vol;
+        memo->generation = Fat32Generation(vol) + 1; //Forces the clear below
+    }
+
+    if(memo->generation != Fat32Generation(vol))
+    {
+        for(int b = 0; b < DU_MEMO_BUCKETS; b++)
+        {
+            while(memo->buckets[b] != NULL)
+            {
+                struct DuNode* node = memo->buckets[b];
+                memo->buckets[b] = node->next;
+                for(u_int32_t c = 0; c < node->numChildren; c++) free(node->childNames[c]);
+                free(node->children);
+                free(node->childNames);
+                free(node);
+            }
+        }
+        memo->generation = Fat32Generation(vol);
+    }
+    return memo;
+}
+
+/// @brief Looks a subtree up in the memo. Called with DuMemoLock held.
+struct DuNode* DuMemoFind(struct DuMemo* memo, u_int32_t cluster)
+{
+    for(struct DuNode* node = memo->buckets[cluster % DU_MEMO_BUCKETS]; node != NULL; node = node->next)
+    {
+        if(node->cluster == cluster) return node;
+    }
+    return NULL;
+}
+
+/// @brief Adds a node to the walk and, unless it was remembered, queues it to be read.
+/// @return The node's index, or -1 when memory ran out.
+int DuAddNode(struct DuWalk* walk, u_int32_t cluster, const char* name, int parent, const struct DuTotals* remembered)
+{
+    struct DuWalkNode* node = calloc(1, sizeof(struct DuWalkNode));
+    if(node == NULL) return -1;
+    node->cluster = cluster;
+    node->name = strdup(name);
+    node->parent = parent;
+    if(remembered != NULL)
+    {
+        node->remembered = true;
+        node->total = *remembered;
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    int index = -1;
+    if(walk->numNodes == walk->maxNodes)
+    {
+        uint slots = walk->maxNodes ? walk->maxNodes * 2 : 256;
+        struct DuWalkNode** grown = realloc(walk->nodes, slots * sizeof(struct DuWalkNode*));
+        if(grown != NULL) walk->nodes = grown, walk->maxNodes = slots;
+    }
+    if(remembered == NULL && walk->numJobs == walk->maxJobs)
+    {
+        uint slots = walk->maxJobs ? walk->maxJobs * 2 : 256;
+        uint* grown = realloc(walk->jobs, slots * sizeof(uint));
+        if(grown != NULL) walk->jobs = grown, walk->maxJobs = slots;
+    }
+    if(walk->numNodes < walk->maxNodes && (remembered != NULL || walk->numJobs < walk->maxJobs))
+    {
+        index = walk->numNodes++;
+        walk->nodes[index] = node;
+        if(remembered == NULL)
+        {
+            walk->jobs[walk->numJobs++] = index;
+            pthread_cond_signal(&walk->wake);
+        }
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    if(index < 0)
+    {
+        free(node->name);
+        free(node);
+    }
+    return index;
+}
+
+/// @brief Reads one directory: totals up its files and its own clusters, and adds its subdirectories to the walk.
+void DuReadDirectory(struct DuWalk* walk, uint index)
+{
+    //Other threads only ever append to nodes, and never touch this node while it is being read
+    pthread_mutex_lock(&walk->lock);
+    struct DuWalkNode* node = walk->nodes[index];
+    pthread_mutex_unlock(&walk->lock);
+
+    struct Fat32Volume* vol = walk->vol;
+    node->total.directories = 1;
+    node->total.clusters = DuChainLength(vol, node->cluster);
+
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(vol, node->cluster, &dir)) return;
+    while(Fat32ReadDir(&dir, &entry))
+    {
+        if((entry.dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+        if((entry.dir.DIR_Attr & ATTR_DIRECTORY) != ATTR_DIRECTORY)
+        {
+            node->total.files++;
+            node->total.logical += entry.dir.DIR_FileSize;
+            node->total.clusters += DuChainLength(vol, entry.firstCluster);
+            continue;
+        }
+
+        if(strcmp(entry.shortName, ".") == 0 || strcmp(entry.shortName, "..") == 0) continue;
+        u_int32_t cluster = entry.firstCluster;
+        if(cluster < 2 || cluster >= Fat32ClusterCount(vol)) continue;
+        unsigned char bit = 1 << (cluster % 8);
+        if((__atomic_fetch_or(&walk->visited[cluster / 8], bit, __ATOMIC_RELAXED) & bit) != 0) continue;
+
+        //A subtree counted before is taken as it is. The memo is fetched again, since another DU may have cleared or reused it meanwhile
+        struct DuTotals remembered;
+        pthread_mutex_lock(&DuMemoLock);
+        struct DuMemo* memo = DuMemoFor(vol);
+        struct DuNode* known = memo->generation == walk->generation ? DuMemoFind(memo, cluster) : NULL;
+        if(known != NULL) remembered = known->total;
+        pthread_mutex_unlock(&DuMemoLock);
+
+        if(DuAddNode(walk, cluster, entry.name, index, known != NULL ? &remembered : NULL) < 0) continue;
+        if(node->numChildren == node->maxChildren)
+        {
+            u_int32_t slots = node->maxChildren ? node->maxChildren * 2 : 16;
+            u_int32_t* children = realloc(node->children, slots * sizeof(u_int32_t));
+            if(children != NULL) node->children = children;
+            char** names = realloc(node->childNames, slots * sizeof(char*));
+            if(names != NULL) node->childNames = names;
+            if(children == NULL || names == NULL) continue;
+            node->maxChildren = slots;
+        }
+        node->children[node->numChildren] = cluster;
+        node->childNames[node->numChildren++] = strdup(entry.name);
+    }
+    Fat32CloseDir(&dir);
+}
+
+void* DuWorker(void* argument)
+{
+    struct DuWalk* walk = argument;
+    Fat32TraceContext("DU");
+
+    pthread_mutex_lock(&walk->lock);
+    while(true)
+    {
+        //The walk is over once nothing is queued and nobody is left to queue more
+        while(walk->numJobs == 0 && walk->busy > 0) pthread_cond_wait(&walk->wake, &walk->lock);
+        if(walk->numJobs == 0) break;
+
+        uint index = walk->jobs[--walk->numJobs];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        DuReadDirectory(walk, index);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+        if(walk->busy == 0 && walk->numJobs == 0) pthread_cond_broadcast(&walk->wake);
+    }
+    pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+/// @brief Walks the subtree at cluster, which is not in the memo yet, and remembers every directory in it.
+/// @return False when the volume changed during the walk, so nothing was remembered.
+bool DuWalkTree(struct Fat32Volume* vol, u_int32_t cluster, uint numThreads)
+{
+    struct DuWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.vol = vol;
+    walk.generation = Fat32Generation(vol);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.wake, NULL);
+    walk.visited = calloc(Fat32ClusterCount(vol) / 8 + 1, 1);
+    if(walk.visited == NULL) return true;
+    walk.visited[cluster / 8] |= 1 << (cluster % 8);
+    DuAddNode(&walk, cluster, "", -1, NULL);
+
+    pthread_t threads[DU_MAX_THREADS];
+    uint started = 0;
+    for(uint i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, DuWorker, &walk) != 0) break;
+        started++;
+    }
+    //The calling thread walks too
+    DuWorker(&walk);
+    for(uint i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    //Children come after their parents, so going backwards finishes every subtree before its parent needs it
+    for(uint i = walk.numNodes; i-- > 1; )
+    {
+        struct DuWalkNode* node = walk.nodes[i];
+        DuAdd(&walk.nodes[node->parent]->total, &node->total);
+    }
+
+    //Totals from before a change are stale, and another DU of the same tree may have remembered a directory first
+    pthread_mutex_lock(&DuMemoLock);
+    struct DuMemo* memo = DuMemoFor(vol);
+    bool current = memo->generation == walk.generation;
+    for(uint i = 0; i < walk.numNodes; i++)
+    {
+        struct DuWalkNode* node = walk.nodes[i];
+        bool wanted = current && !node->remembered && DuMemoFind(memo, node->cluster) == NULL;
+        struct DuNode* memoNode = wanted ? calloc(1, sizeof(struct DuNode)) : NULL;
+        if(memoNode != NULL)
+        {
+            memoNode->cluster = node->cluster;
+            memoNode->total = node->total;
+            memoNode->numChildren = node->numChildren;
+            memoNode->children = node->children;
+            memoNode->childNames = node->childNames;
+            memoNode->next = memo->buckets[node->cluster % DU_MEMO_BUCKETS];
+            memo->buckets[node->cluster % DU_MEMO_BUCKETS] = memoNode;
+        }
+        else
+        {
+            for(u_int32_t c = 0; c < node->numChildren; c++) free(node->childNames[c]);
+            free(node->children);
+            free(node->childNames);
+        }
+        free(node->name);
+        free(node);
+    }
+    pthread_mutex_unlock(&DuMemoLock);
+
+    free(walk.nodes);
+    free(walk.jobs);
+    free(walk.visited);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.wake);
+    return current;
+}
+
+/// @brief Prints the subtrees under a remembered directory before the directory itself, as du does. Called with DuMemoLock held.
+void DuPrint(struct Fat32Volume* vol, struct DuMemo* memo, struct DuNode* node, char* path, uint depth, FILE* out)
+{
+    size_t length = strlen(path);
+    for(u_int32_t c = 0; c < node->numChildren && depth < DU_MAX_DEPTH; c++)
+    {
+        struct DuNode* child = DuMemoFind(memo, node->children[c]);
+        if(child == NULL || length + strlen(node->childNames[c]) + 2 > 4096) continue;
+        sprintf(path + length, "%s%s", length > 0 && path[length - 1] == '/' ? "" : "/", node->childNames[c]);
+        DuPrint(vol, memo, child, path, depth + 1, out);
+        path[length] = '\0';
+    }
+    fprintf(out, "%'18llu %'18llu  %s\n", (unsigned long long)(node->total.clusters * Fat32ClusterBytes(vol)), (unsigned long long)node->total.logical, path);
+}
+
+/// @brief Runs DU. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Du(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    bool summary = false;
+    const char* path = NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < DU_MAX_THREADS ? online : DU_MAX_THREADS) : 1;
+
+    char* cursor = argument;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        if(strcmp(word, "-s") == 0) summary = true;
+        else if(strcmp(word, "--threads") == 0)
+        {
+            char* value = NextWord(&cursor);
+            numThreads = value ? atoi(value) : 0;
+            if(numThreads < 1 || numThreads > DU_MAX_THREADS)
+            {
+                fprintf(out, "Invalid value for --threads\n");
+                return;
+            }
+        }
+        else if(path == NULL) path = word;
+        else
+        {
+            fprintf(out, "Usage: DU [-s] [--threads n] [path]\n");
+            return;
+        }
+    }
+
+    u_int32_t cluster = currentDirectory;
+    struct Fat32Entry entry;
+    if(path != NULL)
+    {
+        if(!Fat32Stat(vol, currentDirectory, path, &entry))
+        {
+            fprintf(out, "Directory Not Found\n");
+            return;
+        }
+        if((entry.dir.DIR_Attr & ATTR_DIRECTORY) != ATTR_DIRECTORY)
+        {
+            //A single file is its own subtree
+            fprintf(out, "%'18llu %'18u  %s\n", (unsigned long long)(DuChainLength(vol, entry.firstCluster) * Fat32ClusterBytes(vol)), entry.dir.DIR_FileSize, path);
+            return;
+        }
+        cluster = entry.firstCluster;
+    }
+    if(cluster == 0) cluster = Fat32RootCluster(vol);
+
+    pthread_mutex_lock(&DuMemoLock);
+    struct DuMemo* memo = DuMemoFor(vol);
+    bool known = DuMemoFind(memo, cluster) != NULL;
+    pthread_mutex_unlock(&DuMemoLock);
+    if(!known && !DuWalkTree(vol, cluster, numThreads))
+    {
+        fprintf(out, "The volume changed during the walk; run DU again\n");
+        return;
+    }
+
+    //The memo only goes away under the lock, so everything printed below stays put
+    pthread_mutex_lock(&DuMemoLock);
+    memo = DuMemoFor(vol);
+    struct DuNode* node = DuMemoFind(memo, cluster);
+    if(node == NULL) fprintf(out, "Out of memory walking the tree\n");
+    else
+    {
+        char* printed = malloc(4096 + 256);
+        if(printed != NULL)
+        {
+            fprintf(out, "%18s %18s  %s\n", "Allocated", "Logical", "Path");
+            snprintf(printed, 4096, "%s", path ? path : ".");
+            if(summary) fprintf(out, "%'18llu %'18llu  %s\n", (unsigned long long)(node->total.clusters * Fat32ClusterBytes(vol)), (unsigned long long)node->total.logical, printed);
+            else DuPrint(vol, memo, node, printed, 0, out);
+            fprintf(out, "\n%'llu file(s) in %'llu director(ies)\n", (unsigned long long)node->total.files, (unsigned long long)node->total.directories);
+            free(printed);
+        }
+    }
+    pthread_mutex_unlock(&DuMemoLock);
+}
+
+#endif
@@ -0,0 +1,494 @@
+
+/******************/
+/*Export.h        */
+/******************/
+
+/*
+This header file holds the EXPORT command, which writes a file or a whole
+directory tree as one tar or cpio archive.
+
+    EXPORT <path> [--format=tar|cpio] [--output file]
+
+Without --output the archive goes to the command's own output, the same way
+CAT writes a file. The prompt frames its output, so to pipe an archive
+somewhere use
+
+    fat32 --export <image> <path> [--format=tar|cpio] | ssh host tar -x
+
+which writes the archive alone to stdout, or to the descriptor given with
+--fd n, and exits. The path may start with pN: to export from partition N.
+
+tar archives are POSIX ustar. Names longer than ustar can hold get a GNU
+long name entry first. cpio archives use the "newc" format. Entries are named
+relative to the directory exported, under its own name. Exporting / names
+them from the root down. Both formats carry the last write time, which FAT
+records in local time without a zone, so it is stored as if it were UTC.
+Read-only files lose their write permission bits.
+
+Nothing is written to the local disk. Directory trees are walked depth first
+in directory order, and each file's clusters go straight into the archive:
+through splice or sendfile when the output is a pipe or a socket, otherwise
+through a buffer. While one file is being written, readahead has already been
+started for the files after it in the same directory, EXPORT_PREFETCH_BYTES
+ahead, and for the rest of a large file the same distance ahead of where it
+is being read.
+*/
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define EXPORT_PREFETCH_BYTES (16*1024*1024) //How far ahead of the bytes being written readahead is started
+#define EXPORT_STEP_BYTES (4*1024*1024) //Largest piece of a file handed to Fat32SendFile at once
+#define EXPORT_TAR_RECORD 10240 //tar archives are padded to a whole number of these
+
+/// @brief An archive being written.
+struct ExportArchive
+{
+    struct Fat32Volume* vol;
+    bool cpio;
+    FILE* out;
+    int outFd; //Descriptor behind out, or -1 when it has none
+    unsigned char* buffer;
+    u_int64_t written; //Bytes of archive so far
+    u_int32_t nextInode; //cpio entries each need their own
+    unsigned char* visited; //One bit per directory cluster, so a looping tree is only exported once
+    u_int64_t files, directories;
+    bool failed; //A write to out failed, or memory ran out, so there is no point going on. errno says which
+};
+
+/// @brief Turns a FAT date and time into seconds since 1970, taking them as UTC.
+time_t ExportTime(u_int16_t date, u_int16_t time)
+{
+    if(date == 0) return 0;
+    struct tm when;
+    memset(&when, 0, sizeof(when));
+    when.tm_year = (date >> 9) + 80;
+    when.tm_mon = ((date >> 5) & 0x0F) - 1;
+    when.tm_mday = date & 0x1F;
+    when.tm_hour = time >> 11;
+    when.tm_min = (time >> 5) & 0x3F;
+    when.tm_sec = (time & 0x1F) * 2;
+    return timegm(&when);
+}
+
+/// @brief Permission bits for an entry, from its read-only attribute.
+uint ExportMode(const struct Fat32Entry* entry)
+{
+    bool isDirectory = (entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+    uint mode = isDirectory ? 0755 : 0644;
+    if((entry->dir.DIR_Attr & ATTR_READ_ONLY) == ATTR_READ_ONLY) mode &= ~0222;
+    return mode;
+}
+
+void ExportWrite(struct ExportArchive* archive, const void* bytes, size_t count)
+{
+    if(count > 0 && fwrite(bytes, 1, count, archive->out) != count) archive->failed = true;
+    archive->written += count;
+}
+
+/// @brief Writes zeros up to the next multiple of alignment.
+void ExportPad(struct ExportArchive* archive, uint alignment)
+{
+    static const unsigned char zeros[512];
+    uint pad = (alignment - archive->written % alignment) % alignment;
+    for(; pad > 0 && !archive->failed; )
+    {
+        uint chunk = pad < sizeof(zeros) ? pad : sizeof(zeros);
+        ExportWrite(archive, zeros, chunk);
+        pad -= chunk;
+    }
+}
+
+/// @brief Writes one ustar header block.
+void ExportTarBlock(struct ExportArchive* archive, const char* name, const char* prefix, char type, uint mode, u_int64_t size, time_t mtime)
+{
+    char block[512];
+    memset(block, 0, sizeof(block));
+    strncpy(&block[0], name, 100);
+    snprintf(&block[100], 8, "%07o", mode);
+    snprintf(&block[108], 8, "%07o", 0);
+    snprintf(&block[116], 8, "%07o", 0);
+    snprintf(&block[124], 12, "%011llo", (unsigned long long)size);
+    snprintf(&block[136], 12, "%011llo", (unsigned long long)(mtime > 0 ? mtime : 0) & 077777777777ull); //FAT dates end in 2107, well inside 11 octal digits
+    block[156] = type;
+    memcpy(&block[257], "ustar", 6);
+    memcpy(&block[263], "00", 2);
+    strncpy(&block[345], prefix, 155);
+
+    //The checksum is taken with its own field read as spaces
+    memset(&block[148], ' ', 8);
+    uint sum = 0;
+    for(int i = 0; i < 512; i++) sum += (unsigned char)block[i];
+    snprintf(&block[148], 8, "%06o", sum);
+    block[155] = ' ';
+
+    ExportWrite(archive, block, sizeof(block));
+}
+
+/// @brief Writes the tar header of an entry, splitting its name between the name and prefix fields, or giving it a long name entry.
+void ExportTarHeader(struct ExportArchive* archive, const char* name, const struct Fat32Entry* entry)
+{
+    bool isDirectory = (entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+    char type = isDirectory ? '5' : '0';
+    u_int64_t size = isDirectory ? 0 : entry->dir.DIR_FileSize;
+    time_t mtime = ExportTime(entry->dir.DIR_WrtDate, entry->dir.DIR_WrtTime);
+    size_t length = strlen(name);
+
+    if(length <= 100)
+    {
+        ExportTarBlock(archive, name, "", type, ExportMode(entry), size, mtime);
+        return;
+    }
+
+    //ustar keeps up to 155 more characters in the prefix field, split off at a '/'
+    for(const char* slash = strchr(name, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        size_t prefixLength = slash - name;
+        if(prefixLength > 155) break;
+        if(length - prefixLength - 1 > 100 || slash[1] == '\0') continue;
+
+        char prefix[156];
+        memcpy(prefix, name, prefixLength);
+        prefix[prefixLength] = '\0';
+        ExportTarBlock(archive, slash + 1, prefix, type, ExportMode(entry), size, mtime);
+        return;
+    }
+
+    //Longer still: a GNU long name entry holds the whole name, and the header after it a shortened one
+    ExportTarBlock(archive, "././@LongLink", "", 'L', 0644, length + 1, 0);
+    ExportWrite(archive, name, length + 1);
+    ExportPad(archive, 512);
+    ExportTarBlock(archive, name, "", type, ExportMode(entry), size, mtime);
+}
+
+/// @brief Writes a cpio newc header and name. name may be NULL for the trailer.
+void ExportCpioHeader(struct ExportArchive* archive, const char* name, const struct Fat32Entry* entry)
+{
+    bool isDirectory = entry != NULL && (entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+    uint mode = entry == NULL ? 0 : (isDirectory ? 0040000 : 0100000) | ExportMode(entry);
+    u_int32_t size = entry == NULL || isDirectory ? 0 : entry->dir.DIR_FileSize;
+    time_t mtime = entry == NULL ? 0 : ExportTime(entry->dir.DIR_WrtDate, entry->dir.DIR_WrtTime);
+    if(name == NULL) name = "TRAILER!!!";
+
+    char header[111];
+    snprintf(header, sizeof(header), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+    entry == NULL ? 0 : ++archive->nextInode, mode, 0, 0, isDirectory ? 2 : 1, (u_int32_t)(mtime > 0 ? mtime : 0), size,
+    0, 0, 0, 0, (u_int32_t)strlen(name) + 1, 0);
+    ExportWrite(archive, header, 110);
+    ExportWrite(archive, name, strlen(name) + 1);
+    ExportPad(archive, 4);
+}
+
+/// @brief Writes the contents of a file, zero filled where its chain ends early so the archive stays readable.
+void ExportBody(struct ExportArchive* archive, const char* name, struct Fat32Entry* entry)
+{
+    struct Fat32Volume* vol = archive->vol;
+    u_int64_t size = entry->dir.DIR_FileSize;
+    u_int64_t done = 0;
+
+    //The directory walk has already started readahead for the first EXPORT_PREFETCH_BYTES
+    u_int64_t prefetchedTo = size < EXPORT_PREFETCH_BYTES ? size : EXPORT_PREFETCH_BYTES;
+    u_int64_t step = archive->outFd >= 0 ? EXPORT_STEP_BYTES : Fat32PreferredReadBytes(vol);
+    if(archive->outFd >= 0) fflush(archive->out);
+
+    while(done < size && !archive->failed)
+    {
+        if(prefetchedTo < size && prefetchedTo < done + EXPORT_PREFETCH_BYTES)
+        {
+            u_int64_t end = done + EXPORT_PREFETCH_BYTES < size ? done + EXPORT_PREFETCH_BYTES : size;
+            Fat32Prefetch(vol, entry, prefetchedTo, end - prefetchedTo);
+            prefetchedTo = end;
+        }
+
+        u_int64_t chunk = size - done < step ? size - done : step;
+        ssize_t n;
+        if(archive->outFd >= 0)
+        {
+            n = Fat32SendFile(vol, entry, archive->outFd, done, chunk);
+            if(n < 0 && errno == EPIPE) archive->failed = true;
+            if(n > 0) archive->written += n;
+        }
+        else
+        {
+            n = Fat32PRead(vol, entry, archive->buffer, chunk, done);
+            if(n > 0) ExportWrite(archive, archive->buffer, n);
+        }
+        if(n <= 0)
+        {
+            if(!archive->failed) fprintf(stderr, "%s: %s, filled with zeros from offset %llu\n", name, n < 0 ? strerror(errno) : "chain ends before the file does", (unsigned long long)done);
+            break;
+        }
+        done += n;
+    }
+
+    //The header promised size bytes
+    memset(archive->buffer, 0, Fat32PreferredReadBytes(vol));
+    while(done < size && !archive->failed)
+    {
+        u_int64_t chunk = size - done < Fat32PreferredReadBytes(vol) ? size - done : Fat32PreferredReadBytes(vol);
+        ExportWrite(archive, archive->buffer, chunk);
+        done += chunk;
+    }
+}
+
+/// @brief Gives up on the archive for want of memory.
+void ExportOutOfMemory(struct ExportArchive* archive)
+{
+    errno = ENOMEM;
+    archive->failed = true;
+}
+
+/// @brief Writes one entry: its header, then its contents or, for a directory, everything in it.
+void ExportDirectory(struct ExportArchive* archive, u_int32_t cluster, const char* path);
+void ExportEntry(struct ExportArchive* archive, const char* name, struct Fat32Entry* entry)
+{
+    bool isDirectory = (entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+    if(isDirectory) archive->directories++;
+    else archive->files++;
+
+    if(archive->cpio) ExportCpioHeader(archive, name, entry);
+    else if(isDirectory)
+    {
+        //tar marks directories with a trailing '/'
+        char* slashed = malloc(strlen(name) + 2);
+        if(slashed == NULL)
+        {
+            ExportOutOfMemory(archive);
+            return;
+        }
+        sprintf(slashed, "%s/", name);
+        ExportTarHeader(archive, slashed, entry);
+        free(slashed);
+    }
+    else ExportTarHeader(archive, name, entry);
+
+    if(!isDirectory)
+    {
+        ExportBody(archive, name, entry);
+        ExportPad(archive, archive->cpio ? 4 : 512);
+        return;
+    }
+
+    u_int32_t child = entry->firstCluster;
+    if(child < 2 || child >= Fat32ClusterCount(archive->vol) || (archive->visited[child / 8] & (1 << (child % 8)))) return;
+    archive->visited[child / 8] |= 1 << (child % 8);
+    ExportDirectory(archive, child, name);
+}
+
+/// @brief Writes everything in a directory. path is the archive name of the directory, or "" for the top of the archive.
+void ExportDirectory(struct ExportArchive* archive, u_int32_t cluster, const char* path)
+{
+    struct Fat32Volume* vol = archive->vol;
+
+    //The whole directory is read first, so readahead can run ahead of the file being written
+    uint count = 0, capacity = 64;
+    struct Fat32Entry* entries = malloc(capacity * sizeof(struct Fat32Entry));
+    if(entries == NULL)
+    {
+        ExportOutOfMemory(archive);
+        return;
+    }
+    struct Fat32Dir dir;
+    if(Fat32OpenDir(vol, cluster, &dir))
+    {
+        while(Fat32ReadDir(&dir, &entries[count]))
+        {
+            struct Fat32Entry* entry = &entries[count];
+            if((entry->dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+            if(strcmp(entry->shortName, ".") == 0 || strcmp(entry->shortName, "..") == 0) continue;
+            if(++count < capacity) continue;
+
+            struct Fat32Entry* grown = realloc(entries, capacity * 2 * sizeof(struct Fat32Entry));
+            if(grown == NULL)
+            {
+                ExportOutOfMemory(archive);
+                break;
+            }
+            entries = grown;
+            capacity *= 2;
+        }
+        Fat32CloseDir(&dir);
+    }
+
+    //Readahead has been started for the heads of entries before next, ahead bytes of them not yet written
+    uint next = 0;
+    u_int64_t ahead = 0;
+    for(uint i = 0; i < count && !archive->failed; i++)
+    {
+        while(next < count && (next <= i || ahead < EXPORT_PREFETCH_BYTES))
+        {
+            u_int64_t head = entries[next].dir.DIR_FileSize < EXPORT_PREFETCH_BYTES ? entries[next].dir.DIR_FileSize : EXPORT_PREFETCH_BYTES;
+            if((entries[next].dir.DIR_Attr & ATTR_DIRECTORY) == 0)
+            {
+                Fat32Prefetch(vol, &entries[next], 0, head);
+                ahead += head;
+            }
+            next++;
+        }
+
+        char* name = malloc(strlen(path) + strlen(entries[i].name) + 2);
+        if(name == NULL)
+        {
+            ExportOutOfMemory(archive);
+            break;
+        }
+        sprintf(name, "%s%s%s", path, path[0] ? "/" : "", entries[i].name);
+        ExportEntry(archive, name, &entries[i]);
+        free(name);
+
+        if((entries[i].dir.DIR_Attr & ATTR_DIRECTORY) == 0) ahead -= entries[i].dir.DIR_FileSize < EXPORT_PREFETCH_BYTES ? entries[i].dir.DIR_FileSize : EXPORT_PREFETCH_BYTES;
+    }
+    free(entries);
+}
+
+/// @brief Writes the archive of path to out.
+/// @param messages Where to say why there is no archive.
+/// @return Whether the whole archive was written.
+bool ExportTree(struct Fat32Volume* vol, u_int32_t currentDirectory, const char* path, bool cpio, FILE* out, FILE* messages, struct ExportArchive* archive)
+{
+    memset(archive, 0, sizeof(struct ExportArchive));
+    archive->vol = vol;
+    archive->cpio = cpio;
+    archive->out = out;
+    archive->outFd = fileno(out);
+
+    //The root, . and .. have no name of their own, so what is in them goes at the top of the archive
+    u_int32_t topCluster = Fat32RootCluster(vol);
+    bool hasName = false;
+    struct Fat32Entry entry;
+    if(path[0] != '\0' && strspn(path, "/") != strlen(path))
+    {
+        if(!Fat32Stat(vol, currentDirectory, path, &entry))
+        {
+            fprintf(messages, "File Not Found\n");
+            return false;
+        }
+        if(strcmp(entry.shortName, ".") != 0 && strcmp(entry.shortName, "..") != 0) hasName = true;
+        else if(entry.firstCluster != 0) topCluster = entry.firstCluster;
+    }
+
+    archive->buffer = Fat32GetBuffer(vol);
+    archive->visited = calloc(Fat32ClusterCount(vol) / 8 + 1, 1);
+    if(archive->buffer == NULL || archive->visited == NULL)
+    {
+        fprintf(messages, "Out of memory\n");
+        if(archive->buffer != NULL) Fat32PutBuffer(vol, archive->buffer);
+        free(archive->visited);
+        return false;
+    }
+
+    u_int32_t root = Fat32RootCluster(vol);
+    archive->visited[root / 8] |= 1 << (root % 8);
+    if(hasName) ExportEntry(archive, entry.name, &entry);
+    else
+    {
+        archive->visited[topCluster / 8] |= 1 << (topCluster % 8);
+        ExportDirectory(archive, topCluster, "");
+    }
+
+    //Both formats end with a marker: two empty blocks for tar, padded out to a whole record, and a trailer entry for cpio
+    if(cpio) ExportCpioHeader(archive, NULL, NULL);
+    else
+    {
+        static const unsigned char zeros[1024];
+        ExportWrite(archive, zeros, sizeof(zeros));
+        ExportPad(archive, EXPORT_TAR_RECORD);
+    }
+    if(fflush(out) != 0) archive->failed = true;
+
+    Fat32PutBuffer(vol, archive->buffer);
+    free(archive->visited);
+    return !archive->failed;
+}
+
+/// @brief Reads the --format value.
+/// @return Whether it was tar or cpio.
+bool ExportParseFormat(const char* word, bool* cpio)
+{
+    if(strncmp(word, "--format=", 9) != 0) return false;
+    if(strcasecmp(word + 9, "tar") == 0) *cpio = false;
+    else if(strcasecmp(word + 9, "cpio") == 0) *cpio = true;
+    else return false;
+    return true;
+}
+
+/// @brief Runs EXPORT. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Export(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    char* cursor = argument;
+    char* word;
+    char* path = NULL;
+    char* outputPath = NULL;
+    bool cpio = false;
+    bool valid = true;
+    while(valid && (word = NextWord(&cursor)) != NULL)
+    {
+        if(strncmp(word, "--format", 8) == 0) valid = ExportParseFormat(word, &cpio);
+        else if(strcmp(word, "--output") == 0) valid = (outputPath = NextWord(&cursor)) != NULL;
+        else if(path == NULL) path = word;
+        else valid = false;
+    }
+    if(!valid || path == NULL)
+    {
+        fprintf(out, "Usage: EXPORT <path> [--format=tar|cpio] [--output file]\n");
+        return;
+    }
+
+    FILE* archiveOut = out;
+    if(outputPath != NULL && (archiveOut = fopen(outputPath, "w")) == NULL)
+    {
+        fprintf(out, "%s: %s\n", outputPath, strerror(errno));
+        return;
+    }
+
+    struct ExportArchive archive;
+    bool written = ExportTree(vol, currentDirectory, path, cpio, archiveOut, out, &archive);
+    if(outputPath == NULL) return;
+
+    if(fclose(archiveOut) != 0) written = false;
+    if(written) fprintf(out, "Exported %llu file(s) and %llu director%s, %'llu bytes, into %s\n", (unsigned long long)archive.files,
+    (unsigned long long)archive.directories, archive.directories == 1 ? "y" : "ies", (unsigned long long)archive.written, outputPath);
+    else if(archive.failed) fprintf(out, "%s: %s\n", outputPath, strerror(errno));
+}
+
+/// @brief Runs the reader as fat32 --export <image> <path> [--format=tar|cpio]: writes one archive to outFd and nothing else.
+/// @param args Everything after --export.
+/// @return The exit status.
+int ExportStream(int numArgs, char* args[], int openFlags, u_int64_t fatBudget, int outFd)
+{
+    bool cpio = false;
+    if(numArgs < 2 || numArgs > 3 || (numArgs == 3 && !ExportParseFormat(args[2], &cpio)))
+    {
+        fprintf(stderr, "Usage: fat32 --export <image> <path> [--format=tar|cpio] [--fd n] [--direct] [--compact-fat] [--fat-budget size]\n");
+        return 1;
+    }
+
+    char* path = args[1];
+    uint partition = DiskPathPartition(&path);
+    Fat32TraceContext("EXPORT");
+    struct Fat32Volume* vol = Fat32OpenPartition(args[0], partition, openFlags, fatBudget);
+    if(vol == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", args[0], errno == EINVAL ? "not a FAT32 volume" : errno == ENOMEM ? "the FAT does not fit the memory budget" : errno == ENOENT ? "no such partition" : strerror(errno));
+        return 1;
+    }
+
+    FILE* out = fdopen(outFd, "w");
+    struct ExportArchive archive;
+    memset(&archive, 0, sizeof(archive));
+    bool written = out != NULL && ExportTree(vol, Fat32RootCluster(vol), path, cpio, out, stderr, &archive);
+    if(out != NULL && fclose(out) != 0) written = false;
+    if(out == NULL || archive.failed) fprintf(stderr, "Writing the archive failed: %s\n", strerror(errno));
+
+    Fat32Close(vol);
+    return written ? 0 : 1;
+}
+
+#endif
@@ -10,10 +10,12 @@
 /* the user to interface directly with the disk image.    */
 /**********************************************************/
 
-#pragma pack(push,1)
 #define _GNU_SOURCE
 
 #include "helper.h"
+#include "server.h"
+#include "fleet.h"
+#include "trace.h"
 
 //ABSTRACT
 //Read in the Master Boot Record
@@ -23,111 +25,112 @@
 
 int main(int argc, char* argv[], char* env[])
 {
-    //Invalid arguments
-    if(argc <= 1)
+    //File sizes are printed with thousands separators
+    setlocale(LC_NUMERIC, "");
+
+    //--direct may come anywhere; it reads the images with O_DIRECT so bulk extraction leaves the page cache alone
+    //--write may too; it opens the images read-write so IMPORT can add files to them
+    //--fd n picks the descriptor --cat and --export stream to
+    //--compact-fat holds the FAT as runs, and --fat-budget <size> does so whenever the flat FAT would be bigger than size
+    //--trace <file> records every image access to file for --replay, see trace.h
+    int openFlags = 0;
+    int outFd = STDOUT_FILENO;
+    u_int64_t fatBudget = 0;
+    int kept = 1;
+    for(int i = 1; i < argc; i++)
     {
-        printf("No directory provided. Please try again.\n");
-        abort();
+        if(strcmp(argv[i], "--direct") == 0) openFlags |= FAT32_OPEN_DIRECT;
+        else if(strcmp(argv[i], "--write") == 0) openFlags |= FAT32_OPEN_WRITE;
+        else if(strcmp(argv[i], "--compact-fat") == 0) openFlags |= FAT32_OPEN_COMPACT_FAT;
+        else if(strcmp(argv[i], "--fd") == 0 && i + 1 < argc) outFd = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            if(!Fat32TraceOpen(argv[++i]))
+            {
+                printf("%s: %s\n", argv[i], strerror(errno));
+                return 1;
+            }
+            atexit(Fat32TraceClose);
+        }
+        else if(strcmp(argv[i], "--fat-budget") == 0 && i + 1 < argc)
+        {
+            if(!ParseSize(argv[++i], &fatBudget))
+            {
+                printf("Invalid value for --fat-budget\n");
+                return 1;
+            }
+        }
+        else argv[kept++] = argv[i];
     }
+    argc = kept;
 
-    image = malloc(argc*sizeof(unsigned char));
-    memmove(image, argv[1], strlen(argv[1])+1);
-
-    //Open file
-    filePtr = fopen(image, "r");
-
-    //Read the sector into a char array, return the number of characters read
-    unsigned char* mbr = malloc(512);
+    //Replay mode: fat32 --replay <trace> [--cache sizes] [--readahead sizes] [...]
+    if(argc > 1 && strcmp(argv[1], "--replay") == 0) return RunReplay(argc - 2, &argv[2]);
 
-    fseek(filePtr, 0 * sizeof(unsigned char), SEEK_SET);
-    uint numberOfIntegersRead = fread(mbr, sizeof(unsigned char), BPB_BytsPerSec, filePtr);
+    //Streaming mode: fat32 --cat <image> <path> [offset] [length]
+    if(argc > 1 && strcmp(argv[1], "--cat") == 0) return CatStream(argc - 2, &argv[2], openFlags, fatBudget, outFd);
 
-    //Load MBR with data
-    PackMBR(&MBR, mbr);
+    //Archive mode: fat32 --export <image> <path> [--format=tar|cpio]
+    if(argc > 1 && strcmp(argv[1], "--export") == 0) return ExportStream(argc - 2, &argv[2], openFlags, fatBudget, outFd);
 
-    //Read in partition1
-    //We've already read one sector - read to lbaBegin minus the read sector
-    unsigned char* partitionData = malloc(512);
-    fseek(filePtr, ((MBR.partition1.lbaBegin) * 512), SEEK_SET);
-
-    numberOfIntegersRead = fread(partitionData, sizeof(unsigned char), 512, filePtr);
-
-
-    //Load the BPB with relevant (or not) data
-    PackBPB(&BPB, partitionData);
-
-    u_int32_t numberOfSectors = BPB.BPB_TotSec32; 
-    u_int16_t sizeOfCluster  = BPB.BPB_BytsPerSec * BPB.BPB_SecPerClus;
-    u_int32_t totalNumberOfClusters = (u_int32_t)(numberOfSectors*BPB.BPB_BytsPerSec / (double)sizeOfCluster);
+    //Fleet mode: fat32 --fleet <list> [--threads n] [--io n] <command> [command...]
+    if(argc > 1 && strcmp(argv[1], "--fleet") == 0) return RunFleet(argc - 2, &argv[2], openFlags, fatBudget);
 
+    //Daemon mode: fat32 --serve <socket> [--workers n] [--direct] [--fat-budget size] <image> [image...]
+    //The socket never writes to an image (see server.h), so --write is not offered here
+    if(argc > 1 && strcmp(argv[1], "--serve") == 0)
+    {
+        if(argc <= 3)
+        {
+            printf("Usage: %s --serve <socket> [--workers n] [--direct] [--compact-fat] [--fat-budget size] <image> [image...]\n", argv[0]);
+            return 1;
+        }
 
-    unsigned char cluster[sizeOfCluster+1]; //Initialize our cluster
+        int firstImage = 3;
+        uint numWorkers = 0;
+        if(strcmp(argv[3], "--workers") == 0 && argc > 5)
+        {
+            numWorkers = atoi(argv[4]);
+            firstImage = 5;
+        }
+        return RunServer(argv[2], &argv[firstImage], argc - firstImage, numWorkers, openFlags, fatBudget);
+    }
 
-    cluster[sizeOfCluster] = '\n';
+    //Invalid arguments
+    if(argc <= 1)
+    {
+        printf("No directory provided. Please try again.\n");
+        abort();
+    }
 
-    //We're done with this fileptr...
-    fclose(filePtr);
+    //Read the partition table and mount the first FAT32 partition; the others are mounted when USE or pN: first asks for them
+    Fat32TraceContext("OPEN");
+    struct Disk disk;
+    if(!DiskOpen(&disk, argv[1], openFlags, fatBudget))
+    {
+        printf("%s: %s\n", argv[1], errno == EINVAL ? "not a FAT32 volume" : errno == ENOMEM ? "the FAT does not fit the memory budget" : strerror(errno));
+        DiskClose(&disk);
+        return 1;
+    }
+    struct Session session;
+    session.disk = &disk;
+    session.vol = disk.volumes[disk.current];
+    session.currentDirectory = Fat32RootCluster(session.vol);
 
     //Read user input
     bool keepLooping = true;
-
-    uint currentDirectory = BPB.BPB_RootClus;
+    char line[512];
     while(keepLooping)
     {
-        char* command = malloc(40 * sizeof(char));
         printf("/>");
         //Input command
-        scanf("%39s", command);
+        if(fgets(line, sizeof(line), stdin) == NULL) break;
 
-        int fileSize = 0;
-        //If command is EXTRACT, look for a file input
-        //This needs to factor in 8.3 AND 83 files (without the period)
-        file.fileName = "\0";
-        file.fileName = malloc(120*sizeof(char));
-
-        //If command is EXTRACT
-        if(strncasecmp(command, "EXTRACT", 8) == 0) 
-        {
-            //Read in the file name from the user after the user enters a space
-            //This input formatter will take a string of characters until a newline is reached
-            scanf(" %119[^\n]s", file.fileName);
-
-            //Ensure this is null terminated
-            strcat(file.fileName, "\0");
-            file.fileSize = strlen(file.fileName)+1;
-            file.isSFN = fileNameSFNValidator();
-            
-            Extract(currentDirectory);
-        }
-        //If command is DIR
-        else if(strncasecmp(command, "DIR", 3) == 0)
-        {
-            //Read the directory
-            Readdir(currentDirectory);
-        }
-        //If command is CD
-        else if(strncasecmp(command, "CD", 2) == 0)
-        {
-            //Read in the file name from the user after the user enters a space
-            //This input formatter will take a string of characters until a newline is reached
-            scanf(" %119[^\n]s", file.fileName);
-
-            //Ensure this is null terminated
-            strcat(file.fileName, "\0");
-            file.fileSize = strlen(file.fileName)+1;
-            file.isSFN = fileNameSFNValidator();
-            uint nextDirectory = ChangeDirectory(currentDirectory);
-            if(nextDirectory != ((uint)-1)) currentDirectory = nextDirectory;
-            if(currentDirectory == 0) currentDirectory = 2;
-        }
-        //Exit program
-        else if(strncasecmp(command, "QUIT", 4) == 0)
-        {
-            keepLooping = false;
-            printf("Shutting down...\n");
-        }
+        keepLooping = ExecuteCommand(&session, line, stdout);
 
         printf("\n");
-        free(command);
     }
-}
\ No newline at end of file
+
+    DiskClose(&disk);
+    return 0;
+}
@@ -0,0 +1,2686 @@
+
+/******************/
+/*Fat32lib.c      */
+/******************/
+
+/*
+This file implements libfat32. See fat32lib.h for what the library offers and
+for its threading rules.
+*/
+
+#define _GNU_SOURCE
+
+#include "fat32lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#define CLUSTER_CACHE_SLOTS 1024 //Number of directory clusters kept per volume
+#define DENTRY_CACHE_BUCKETS 4096
+#define DENTRY_CACHE_CHAIN 4 //Entries kept per bucket before the oldest one is dropped
+#define PREAD_EXTENT_CLUSTERS 128 //Largest single read Fat32PRead issues, in clusters
+#define PREAD_MIN_EXTENT_BYTES (1024*1024) //Small cluster volumes still read at least this much at once
+#define MAX_CLUSTER_BYTES (256*1024)
+#define DIRECT_IO_ALIGN 4096 //O_DIRECT wants buffers, offsets and lengths aligned to the backing device's block size
+#define BUFFER_POOL_SLOTS 16 //Idle read buffers kept per volume
+#define EXTENT_CACHE_SLOTS 256 //Extent maps of recently read files kept per volume
+#define FAT_END_OF_CHAIN 0x0FFFFFFF
+#define MAX_DIRECTORY_SLOTS 65536 //A directory may not grow past 2MB of entries
+#define FAT_RUN_SEQUENTIAL 0x80000000 //Value of a compact FAT run whose entries each point at the next cluster
+#define FAT_LOAD_BYTES (1024*1024) //The FAT is read this much at a time while it is compacted
+#define MAX_LOGICAL_PARTITIONS 64 //Longest chain of extended boot records followed
+#define GPT_ENTRY_BYTES (64*1024) //Most of a GPT partition array read, enough for 512 entries of 128 bytes
+#define TRACE_MAX_IMAGES 0xFFFF //Images past this many are all traced under the last id, left unnamed
+#define TRACE_MAX_CONTEXTS 256 //Context ids fit a byte; contexts past this many are traced as 0
+
+struct ClusterCacheSlot
+{
+    u_int32_t clusterNum; //0 when the slot is empty - cluster 0 is never a data cluster
+    unsigned char* bytes;
+};
+
+/// @brief Direct mapped cache of directory clusters, shared by every user of a volume.
+struct ClusterCache
+{
+    pthread_mutex_t lock;
+    struct ClusterCacheSlot slots[CLUSTER_CACHE_SLOTS];
+    u_int64_t hits;
+    u_int64_t misses;
+};
+
+struct DentryCacheNode
+{
+    u_int32_t dirCluster;
+    char key[256]; //Lower case name the entry was looked up with
+    struct Fat32Entry entry;
+    struct DentryCacheNode* next;
+};
+
+/// @brief Caches successful name lookups, keyed by (directory cluster, name).
+struct DentryCache
+{
+    pthread_rwlock_t lock;
+    struct DentryCacheNode* buckets[DENTRY_CACHE_BUCKETS];
+};
+
+/// @brief Direct mapped cache of file extent maps, keyed by first cluster. Each slot holds one reference to its map.
+struct ExtentCache
+{
+    pthread_mutex_t lock;
+    struct Fat32ExtentMap* slots[EXTENT_CACHE_SLOTS];
+};
+
+/// @brief Idle sector aligned read buffers, each big enough for the volume's largest read.
+struct BufferPool
+{
+    pthread_mutex_t lock;
+    void* idle[BUFFER_POOL_SLOTS];
+    uint numIdle;
+    size_t bufferBytes;
+};
+
+/// @brief An open addressed hash set of strings, kept in one pool.
+struct NameSet
+{
+    u_int32_t* slots; //Offset of each key in pool plus one, 0 for an empty slot
+    u_int32_t capacity; //A power of two
+    u_int32_t count;
+    char* pool;
+    size_t poolUsed, poolSize;
+};
+
+/// @brief What Fat32CreateEntry knows about the directory it last added to, so a run of additions reads that directory only once.
+/// Only Fat32CreateEntry changes directories, so the index stays true for as long as it describes the same one.
+struct DirectoryIndex
+{
+    u_int32_t dirCluster; //0 when the index describes nothing
+    u_int32_t* chain;
+    u_int32_t numClusters, maxClusters;
+    uint endSlot; //First slot of the free tail of the directory
+    struct NameSet names; //Lower cased long names, and short names with and without their period
+    struct NameSet shortNames; //Raw 11 byte short names
+    u_int32_t tailHints[64]; //Last numeric tail handed out, by a hash of the basis it went to
+};
+
+/// @brief A stretch of FAT entries, running up to the start of the next run.
+struct FatRun
+{
+    u_int32_t start;
+    u_int32_t value; //The value of every entry in the run, or FAT_RUN_SEQUENTIAL
+};
+
+/// @brief The FAT held as runs, sorted by start. The first run starts at entry 0.
+/// Built once when the volume is opened and never changed, so lookups take no lock.
+struct CompactFat
+{
+    struct FatRun* runs;
+    u_int32_t numRuns, maxRuns;
+};
+
+/// @brief A run of free clusters.
+struct FreeExtent
+{
+    u_int32_t start;
+    u_int32_t length;
+};
+
+/// @brief An open image. Everything here is read only after Fat32Open returns, except for the caches which carry their own locks
+/// and the FAT and free space map, which only change under writeLock on volumes opened with FAT32_OPEN_WRITE.
+struct Fat32Volume
+{
+    char* imagePath;
+    int fd;
+    int directFd; //-1 unless direct I/O was asked for and the filesystem accepted O_DIRECT
+    bool directRefused; //Set once a direct read fails with EINVAL
+    int openFlags;
+    u_int32_t bufferAlign;
+    struct MasterBootRecord mbr;
+    struct BPBStruct bpb;
+    uint partitionNumber;
+    u_int64_t partitionOffset; //Byte offset of the BPB in the image
+    u_int64_t dataOffset; //Byte offset of cluster 2
+    u_int32_t sectorBytes;
+    u_int32_t clusterBytes;
+    u_int32_t maxExtentBytes; //Largest single read, scaled to the cluster size
+    u_int32_t (*nextLiveSlot)(const unsigned char* bytes, u_int32_t index); //Directory scan kernel for clusterBytes
+    u_int32_t fatEntries;
+    u_int32_t* fat; //The first FAT copy, masked to 28 bits. NULL when the FAT is held compact
+    struct CompactFat compactFat;
+    struct ClusterCache clusterCache;
+    struct DentryCache dentryCache;
+    struct ExtentCache extentCache;
+    struct BufferPool bufferPool;
+
+    //Write support
+    pthread_mutex_t writeLock; //Serializes allocation, directory changes and flushing
+    unsigned char* fatDirty; //One bit per sector of the FAT changed since the last flush
+    bool freeMapBuilt;
+    struct FreeExtent* freeExtents; //Free runs in cluster order, built on the first allocation
+    uint numFreeExtents;
+    uint maxFreeExtents;
+    u_int32_t freeClusters;
+    struct DirectoryIndex directoryIndex;
+    u_int64_t generation; //Bumped by every change to the FAT or a directory
+
+    //Tracing, guarded by the trace's lock
+    u_int32_t traceSerial; //Serial of the trace traceImage belongs to, 0 for none
+    u_int16_t traceImage;
+};
+
+/// @brief The process's access trace. See Fat32TraceOpen.
+struct Trace
+{
+    pthread_mutex_t lock;
+    FILE* file; //NULL while nothing is being recorded
+    u_int32_t serial; //Bumped by every Fat32TraceOpen, so ids handed out for an earlier trace are known to be stale
+    struct timespec start;
+    char** images; //Image paths, by id
+    u_int32_t numImages, maxImages;
+    char contexts[TRACE_MAX_CONTEXTS][FAT32_TRACE_CONTEXT_BYTES]; //Context 0 is the empty name
+    uint numContexts;
+};
+
+static struct Trace trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static bool tracing; //Read without the lock by every access, so an untraced process pays one load for it
+static __thread char traceContext[FAT32_TRACE_CONTEXT_BYTES];
+static __thread u_int32_t traceContextSerial; //Serial of the trace traceContextId belongs to, 0 for none
+static __thread u_int8_t traceContextId;
+static __thread const struct Fat32Volume* traceFatVolume; //Last FAT sector the thread looked up, so a chain walk within one sector is one record
+static __thread u_int64_t traceFatSector;
+
+static void DirectoryIndexFree(struct DirectoryIndex* index);
+
+
+//NOTE: This function is kind of ugly, but I needed it for many functions in readdir.
+//It is not intended for memory which overlaps. Keep in mind, it is similar in design to memcpy, NOT memmove.
+//If dest does not have enough space, a buffer overflow WILL occur. BE CAREFUL.
+/// @brief This function is intended to function like memcpy, but perform custom offsets and iterations.
+/// @param dest Destination array being copied to. The size must be at least one greater than srcSize / iterator. It will be null terminated.
+/// @param src Source array being copied from.
+/// @param srcSize The number of items being copied from src. The size available in dest must be AT LEAST srcSize / iterator.
+/// @param forOffset The offset used when beginning to copy. Src will begin being copied at index forOffset.
+/// @param destOffset Destination will begin being copied to from index destOffset.
+/// @param iterator The custom iterator for this function. Iterator - 1 is the number of bytes skipped between each copy operation in src.
+/// @return The number of bytes copied minus one. The index returned would be the final index copied to in dest.
+int OffsetCopier(unsigned char* dest, unsigned char* src, int srcSize, int forOffset, int destOffset, int iterator)
+{
+    //Initial dest index (not counting the offset)
+    int counter = 0;
+    //Loop from forOffset to forOffset + srcSize, where each iteration increments i by iterator.
+    for(int i = forOffset; i < forOffset+srcSize; i+=iterator)
+    {
+        //This byte is not used.
+        if(src[i] != 0xFF )
+        {
+            //Set dest to src[i]
+            dest[counter + destOffset] = src[i];
+        }
+        //Copy over a null terminator (\0) instead of 0xFF.
+        else dest[counter+destOffset] = '\0';
+
+        //Increment counter because dest[counter+destOffset] was written to.
+        counter++;
+    }
+
+    //Set the final byte at index counter (which is now one greater than the previous index written to)
+    //To the null terminator. This terminates the string, and allows it to work appropriately with functions which expect it to be there
+    //or are not dependent on size. If size did not factor for a null terminator, memory errors shall ensue.
+    dest[counter] = '\0';
+    return counter;
+}
+
+
+void PackPartition(struct Partition* part, unsigned char bytes[16])
+{
+    part->bootFlag = bytes[0];
+    //CHS fields are three raw bytes with no room for OffsetCopier's terminator, and 0xFF is a real value in them
+    memcpy(part->chsBegin, &bytes[1], 3);
+    part->typeCode = bytes[4];
+    memcpy(part->chsEnd, &bytes[5], 3);
+    part->lbaBegin = bytes[8] | ((u_int16_t) bytes[9] << 8) | ((u_int32_t) bytes[10] << 16) |  ((u_int32_t) bytes[11] << 24);
+    part->numberOfSectors = bytes[12] | ((u_int16_t) bytes[13] << 8) | ((u_int32_t) bytes[14] << 16) |  ((u_int32_t) bytes[15] << 24);
+}
+
+void PackMBR(struct MasterBootRecord* mbr, unsigned char sector[512])
+{
+    OffsetCopier(mbr->bootCode, sector, 446, 0, 0, 1);
+    unsigned char partition[17]; //OffsetCopier null terminates, so leave room for one more byte
+    OffsetCopier(partition, sector, 16, 446, 0, 1);
+    PackPartition(&mbr->partition1, partition);
+    OffsetCopier(partition, sector, 16, 462, 0, 1);
+    PackPartition(&mbr->partition2, partition);
+    OffsetCopier(partition, sector, 16, 478, 0, 1);
+    PackPartition(&mbr->partition3, partition);
+    OffsetCopier(partition, sector, 16, 494, 0, 1);
+    PackPartition(&mbr->partition4, partition);
+    mbr->mbrPattern = sector[510] | ((u_int16_t)sector[511] << 8);
+}
+
+/// @brief This function packs a LongDirectoryEntry struct with a directory in a sector. This directory is found using an offset.
+/// @param directory The DirectoryEntry struct being packed.
+/// @param sector The sector containing the correct directory.
+/// @param offset The offset through which the directory can be found in the sector. Offset % 32 MUST equal zero, and it must be < (512-32) but > 0 bytes.
+void PackLongDirectoryEntry(struct LongDirectoryEntry* directory, unsigned char* cluster, int offset)
+{
+    directory->LDIR_Ord = cluster[offset+0];
+    OffsetCopier(directory->LDIR_Name1, cluster, 10, offset+1, 0, 2);
+    directory->LDIR_Attr = cluster[offset+11];
+    directory->LDIR_Type = cluster[offset+12];
+    directory->LDIR_Chksum = cluster[offset+13];
+    OffsetCopier(directory->LDIR_Name2, cluster, 12, offset+14, 0, 2);
+    directory->LDIR_FstClusLO = cluster[offset+26] | (cluster[offset+27] << 8);
+    OffsetCopier(directory->LDIR_Name3, cluster, 4, offset+28, 0, 2);
+}
+
+/// @brief Unpacks one raw 32 byte short entry. The two name loops have constant bounds, 8 and 3, for the compiler
+/// to unroll, and every other field is a load from a fixed place. It does not depend on the cluster size.
+static inline void DecodeShortEntry(struct DirectoryEntry* directory, const unsigned char* raw)
+{
+    //Each 0xFF byte in a name is replaced with a NUL and the copy carries on, as OffsetCopier does,
+    //so a string read of the name ends at the first of them
+    for(int i = 0; i < 8; i++) directory->DIR_Name8[i] = raw[i] == 0xFF ? '\0' : raw[i];
+    directory->DIR_Name8[8] = '\0';
+    for(int i = 0; i < 3; i++) directory->DIR_Name3[i] = raw[8 + i] == 0xFF ? '\0' : raw[8 + i];
+    directory->DIR_Name3[3] = '\0';
+    directory->DIR_Attr = raw[11];
+    directory->DIR_NTRes = raw[12];
+    directory->DIR_CrtTimeTenth = raw[13];
+    //These are in little endian format (least-significant byte on the right)
+    directory->DIR_CrtTime = raw[14] | ((u_int16_t)raw[15] << 8);
+    directory->DIR_CrtDate = raw[16] | ((u_int16_t)raw[17] << 8);
+    directory->DIR_LstAccDate = raw[18] | ((u_int16_t)raw[19] << 8);
+    directory->DIR_FstClusHI = raw[20] | ((u_int16_t)raw[21] << 8);
+    directory->DIR_WrtTime = raw[22] | ((u_int16_t)raw[23] << 8);
+    directory->DIR_WrtDate = raw[24] | ((u_int16_t)raw[25] << 8);
+    directory->DIR_FstClusLO = raw[26] | ((u_int16_t)raw[27] << 8);
+    directory->DIR_FileSize = raw[28] | ((u_int32_t)raw[29] << 8) | ((u_int32_t)raw[30] << 16) | ((u_int32_t)raw[31] << 24);
+}
+
+/// @brief This function packs a DirectoryEntry struct with a directory in a sector. This directory is found using an offset.
+/// @param directory The DirectoryEntry struct being packed.
+/// @param sector The sector containing the correct directory.
+/// @param offset The offset through which the directory can be found in the sector. Offset % 32 MUST equal zero, and it must be < (512-32) but > 0 bytes.
+void PackDirectoryEntry(struct DirectoryEntry* directory, unsigned char* cluster, int offset)
+{
+    if(offset % 32 != 0 || offset < 0) return;
+    DecodeShortEntry(directory, &cluster[offset]);
+}
+
+//Directory scan kernels, one per cluster size. A kernel only skips deleted (0xE5) slots, looking at them eight at
+//a time; end markers, long name slots and decoding are left to the caller. With the cluster size a constant, the loop over the groups has a fixed
+//bound and the loop inside a group unrolls completely. The sector size and sectors per cluster only matter through
+//their product, so the ten cluster sizes FAT32 allows, 512 bytes to 256K, cover every legal combination of the two.
+
+/// @brief Bit k is set unless slot k of a group of eight holds a deleted entry. The end marker counts as in use.
+static inline u_int32_t LiveSlotMask(const unsigned char* group)
+{
+    u_int32_t mask = 0;
+    for(int k = 0; k < 8; k++) mask |= (u_int32_t)(group[k * 32] != 0xE5) << k;
+    return mask;
+}
+
+/// @brief Defines NextLiveSlot<BYTES>, which returns the offset of the first slot at or after index that is not
+/// a deleted entry, or BYTES when the rest of the cluster is deleted entries.
+#define DIR_SCAN_KERNEL(BYTES) \
+static u_int32_t NextLiveSlot##BYTES(const unsigned char* bytes, u_int32_t index) \
+{ \
+    u_int32_t group = index & ~255u; \
+    u_int32_t mask = LiveSlotMask(&bytes[group]) & (0xFFu << ((index & 255) / 32)); \
+    while(mask == 0) \
+    { \
+        group += 256; \
+        if(group >= BYTES) return BYTES; \
+        mask = LiveSlotMask(&bytes[group]); \
+    } \
+    return group + __builtin_ctz(mask) * 32; \
+}
+
+DIR_SCAN_KERNEL(512)
+DIR_SCAN_KERNEL(1024)
+DIR_SCAN_KERNEL(2048)
+DIR_SCAN_KERNEL(4096)
+DIR_SCAN_KERNEL(8192)
+DIR_SCAN_KERNEL(16384)
+DIR_SCAN_KERNEL(32768)
+DIR_SCAN_KERNEL(65536)
+DIR_SCAN_KERNEL(131072)
+DIR_SCAN_KERNEL(262144)
+
+//Indexed by log2 of the cluster size, less 9
+static u_int32_t (*const DirScanKernels[10])(const unsigned char* bytes, u_int32_t index) =
+{
+    NextLiveSlot512, NextLiveSlot1024, NextLiveSlot2048, NextLiveSlot4096, NextLiveSlot8192,
+    NextLiveSlot16384, NextLiveSlot32768, NextLiveSlot65536, NextLiveSlot131072, NextLiveSlot262144
+};
+
+/// @brief Packs 2 bytes into the TimeFormat struct
+/// @param time The TimeFormat struct to be packed
+/// @param bitPackage The package to be loaded
+void PackTime(struct TimeFormat* time, u_int16_t bitPackage)
+{
+
+    //This is initially measured in two second intervals -
+    //Multiply by two to get an accurate count
+    time->secondCount = (bitPackage & 0x001F)*2;
+    time->minuteCount = (bitPackage & 0x07E0) >> 5;
+    time->hoursCount = (bitPackage & 0xF800) >> 11;
+}
+
+/// @brief Packs 2 bytes into the DateFormat struct
+/// @param date The DateFormat struct to be packed
+/// @param bitPackage The package to be loaded
+void PackDate(struct DateFormat* date, u_int16_t bitPackage)
+{
+    date->dayOfMonth = (bitPackage & 0x001F);
+    date->monthOfYear = (bitPackage & 0x01E0) >> 5;
+    date->yearsSince1980 = (bitPackage & 0xFE00) >> 9;
+}
+
+/// @brief Returns whether or not the given directory is a LFD
+/// @param directoryEntry The directory in question
+/// @return Whether or not the directory is a LFD
+bool isLongFileDirectory(unsigned char directoryEntry[32])
+{
+    return directoryEntry[11] == (unsigned char)ATTR_LONG_NAME;
+}
+
+
+void PackBPB(struct BPBStruct* bpb, unsigned char bytes[512])
+{
+    memcpy(bpb->BS_jmpBoot, bytes, 3);
+    OffsetCopier(bpb->BS_OEMNane, bytes, 8, 3, 0, 1);
+    bpb->BPB_BytsPerSec = bytes[11] | ((u_int16_t)bytes[12] << 8);
+    bpb->BPB_SecPerClus = bytes[13];
+    bpb->BPB_RsvdSecCnt = bytes[14] | ((u_int16_t)bytes[15] << 8);
+    bpb->BPB_NumFATs = bytes[16];
+    bpb->BPB_RootEntCnt = bytes[17] | ((u_int16_t)bytes[18] << 8);;
+    bpb->BPB_TotSec16 = bytes[19] | ((u_int16_t)bytes[20] << 8);;
+    bpb->BPB_Media = bytes[21];
+    bpb->BPB_FATSz16 = bytes[22] | ((u_int16_t)bytes[23] << 8);;
+    bpb->BPB_SecPerTrk = bytes[24] | ((u_int16_t)bytes[25] << 8);;
+    bpb->BPB_NumHeads = bytes[26] | ((u_int16_t)bytes[27] << 8);;
+    bpb->BPB_HiddSec = bytes[28] | ((u_int16_t)bytes[29] << 8) | ((u_int32_t)bytes[30] << 16) | ((u_int32_t)bytes[31] << 24);
+    bpb->BPB_TotSec32 = bytes[32] | ((u_int16_t)bytes[33] << 8) | ((u_int32_t)bytes[34] << 16) | ((u_int32_t)bytes[35] << 24);
+    bpb->BPB_FATSz32 = bytes[36] | ((u_int16_t)bytes[37] << 8) | ((u_int32_t)bytes[38] << 16) | ((u_int32_t)bytes[39] << 24);
+    bpb->BPB_Flags = bytes[40] | ((u_int16_t)bytes[41] << 8);
+    bpb->BPB_FSVer = bytes[42] | ((u_int16_t)bytes[43] << 8);
+    bpb->BPB_RootClus = bytes[44] | ((u_int16_t)bytes[45] << 8) | ((u_int32_t)bytes[46] << 16) | ((u_int32_t)bytes[47] << 24);
+    bpb->BPB_FSInfo = bytes[48] | ((u_int16_t)bytes[49] << 8);
+    bpb->BPB_BkBootSec = bytes[50] | ((u_int16_t)bytes[51] << 8);
+    OffsetCopier(bpb->BPB_Reserved, bytes, 12, 52, 0, 1);
+    bpb->BS_DrvNum = bytes[64];
+    bpb->BS_Reserved1 = bytes[65];
+    bpb->BS_BootSig = bytes[66];
+    OffsetCopier(bpb->BS_VolID, bytes, 4, 67, 0, 1);
+    OffsetCopier(bpb->BS_VolLab, bytes, 11, 71, 0, 1);
+    OffsetCopier(bpb->BS_FilSysType, bytes, 8, 82, 0, 1);
+    OffsetCopier(bpb->unused, bytes, 420, 90, 0, 1);
+    OffsetCopier(bpb->signature, bytes, 2, 510, 0, 1);
+}
+
+/// @brief Computes the checksum a long name stores for its short entry.
+u_int8_t Fat32ShortNameChecksum(const unsigned char* raw)
+{
+    u_int8_t sum = 0;
+    for(int i = 0; i < 11; i++) sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + raw[i];
+    return sum;
+}
+
+bool Fat32ValidGeometry(const struct BPBStruct* bpb)
+{
+    //Sectors are 512 to 4096 bytes and clusters a power of two sectors
+    uint bytesPerSec = bpb->BPB_BytsPerSec;
+    uint secPerClus = bpb->BPB_SecPerClus;
+    if(bytesPerSec < 512 || bytesPerSec > 4096 || (bytesPerSec & (bytesPerSec - 1)) != 0) return false;
+    if(secPerClus == 0 || (secPerClus & (secPerClus - 1)) != 0) return false;
+    if(bytesPerSec * secPerClus > MAX_CLUSTER_BYTES) return false;
+
+    //FAT32 keeps its root in the data region and its FAT size in the 32 bit field
+    if(bpb->BPB_RsvdSecCnt == 0 || bpb->BPB_NumFATs == 0 || bpb->BPB_FATSz32 == 0) return false;
+    if(bpb->BPB_RootEntCnt != 0 || bpb->BPB_FATSz16 != 0 || bpb->BPB_TotSec32 == 0) return false;
+    return bpb->signature[0] == 0x55 && bpb->signature[1] == 0xAA;
+}
+
+void* Fat32AllocBuffer(struct Fat32Volume* vol, size_t size)
+{
+    void* buffer = NULL;
+    if(size == 0) size = vol->sectorBytes;
+    if(posix_memalign(&buffer, vol->bufferAlign, size) != 0) return NULL;
+    return buffer;
+}
+
+void* Fat32GetBuffer(struct Fat32Volume* vol)
+{
+    struct BufferPool* pool = &vol->bufferPool;
+    void* buffer = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->numIdle > 0) buffer = pool->idle[--pool->numIdle];
+    pthread_mutex_unlock(&pool->lock);
+
+    if(buffer == NULL) buffer = Fat32AllocBuffer(vol, pool->bufferBytes);
+    return buffer;
+}
+
+void Fat32PutBuffer(struct Fat32Volume* vol, void* buffer)
+{
+    struct BufferPool* pool = &vol->bufferPool;
+    if(buffer == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->numIdle < BUFFER_POOL_SLOTS)
+    {
+        pool->idle[pool->numIdle++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buffer);
+}
+
+bool Fat32DirectIO(struct Fat32Volume* vol)
+{
+    return (vol->openFlags & FAT32_OPEN_DIRECT) == FAT32_OPEN_DIRECT;
+}
+
+bool Fat32Writable(struct Fat32Volume* vol)
+{
+    return (vol->openFlags & FAT32_OPEN_WRITE) == FAT32_OPEN_WRITE;
+}
+
+u_int64_t Fat32Generation(struct Fat32Volume* vol)
+{
+    return __atomic_load_n(&vol->generation, __ATOMIC_RELAXED);
+}
+
+/// @brief Writes one record, and the name it carries if it is a name record. Called with the trace's lock held.
+static void TraceEmit(u_int8_t kind, u_int16_t image, u_int8_t context, u_int64_t offset, u_int32_t length, const char* name)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct Fat32TraceRecord record;
+    record.offset = offset;
+    record.time = (u_int64_t)((int64_t)(now.tv_sec - trace.start.tv_sec) * 1000000000 + (now.tv_nsec - trace.start.tv_nsec));
+    record.length = length;
+    record.image = image;
+    record.kind = kind;
+    record.context = context;
+    fwrite_unlocked(&record, sizeof(record), 1, trace.file);
+    if(name != NULL) fwrite_unlocked(name, length, 1, trace.file);
+}
+
+/// @brief The id of a volume's image in the open trace, naming it first if it is new. Called with the trace's lock held.
+static u_int16_t TraceImageId(struct Fat32Volume* vol)
+{
+    if(vol->traceSerial == trace.serial) return vol->traceImage;
+
+    //Partitions of one image share its id
+    u_int32_t id = 0;
+    while(id < trace.numImages && strcmp(trace.images[id], vol->imagePath) != 0) id++;
+    if(id == trace.numImages && id < TRACE_MAX_IMAGES)
+    {
+        if(trace.numImages == trace.maxImages)
+        {
+            u_int32_t slots = trace.maxImages ? trace.maxImages * 2 : 16;
+            char** grown = realloc(trace.images, slots * sizeof(char*));
+            if(grown != NULL) trace.images = grown, trace.maxImages = slots;
+        }
+        char* path = trace.numImages < trace.maxImages ? strdup(vol->imagePath) : NULL;
+        if(path != NULL)
+        {
+            trace.images[trace.numImages++] = path;
+            TraceEmit(FAT32_TRACE_IMAGE_NAME, 0, 0, id, strlen(path), path);
+        }
+    }
+    if(id > TRACE_MAX_IMAGES - 1) id = TRACE_MAX_IMAGES - 1;
+    vol->traceSerial = trace.serial;
+    vol->traceImage = id;
+    return id;
+}
+
+/// @brief The id of the calling thread's context in the open trace, naming it first if it is new. Called with the trace's lock held.
+static u_int8_t TraceContextId(void)
+{
+    if(traceContextSerial == trace.serial) return traceContextId;
+
+    uint id = 0;
+    if(traceContext[0] != '\0')
+    {
+        id = 1;
+        while(id < trace.numContexts && strcmp(trace.contexts[id], traceContext) != 0) id++;
+        if(id == trace.numContexts && id < TRACE_MAX_CONTEXTS)
+        {
+            strcpy(trace.contexts[trace.numContexts++], traceContext);
+            TraceEmit(FAT32_TRACE_CONTEXT_NAME, 0, 0, id, strlen(traceContext), traceContext);
+        }
+        if(id >= TRACE_MAX_CONTEXTS) id = 0;
+    }
+    traceContextSerial = trace.serial;
+    traceContextId = id;
+    return id;
+}
+
+/// @brief Appends an access to the trace. Kept out of line so the check in front of it is all an untraced access costs.
+static __attribute__((noinline)) void TraceAccess(struct Fat32Volume* vol, u_int8_t kind, u_int64_t offset, u_int64_t length)
+{
+    pthread_mutex_lock(&trace.lock);
+    if(trace.file != NULL)
+    {
+        u_int16_t image = TraceImageId(vol);
+        u_int8_t context = TraceContextId();
+        //An access past 4GB, which only a whole FAT can be, goes in as several
+        do
+        {
+            u_int32_t part = length > 0x80000000u ? 0x80000000u : (u_int32_t)length;
+            TraceEmit(kind, image, context, offset, part, NULL);
+            offset += part;
+            length -= part;
+        } while(length > 0);
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static inline void Trace(struct Fat32Volume* vol, u_int8_t kind, u_int64_t offset, u_int64_t length)
+{
+    if(__atomic_load_n(&tracing, __ATOMIC_RELAXED)) TraceAccess(vol, kind, offset, length);
+}
+
+/// @brief Works out what a raw read of the image is from where it lands.
+static u_int8_t TraceReadKind(struct Fat32Volume* vol, u_int64_t offset)
+{
+    //Reads made while the volume is being opened come before the layout is known
+    if(vol->dataOffset == 0 || offset < Fat32FatOffset(vol, 0)) return FAT32_TRACE_META;
+    return offset < vol->dataOffset ? FAT32_TRACE_FAT : FAT32_TRACE_DATA;
+}
+
+/// @brief Traces the FAT sector holding a cluster's entry, unless the thread's last lookup was in the same one.
+static __attribute__((noinline)) void TraceFatLookup(struct Fat32Volume* vol, u_int32_t clusterNum)
+{
+    u_int64_t sector = (u_int64_t)clusterNum * 4 / vol->sectorBytes;
+    if(traceFatVolume == vol && traceFatSector == sector) return;
+    traceFatVolume = vol;
+    traceFatSector = sector;
+    TraceAccess(vol, FAT32_TRACE_FAT_LOOKUP, Fat32FatOffset(vol, 0) + sector * vol->sectorBytes, vol->sectorBytes);
+}
+
+bool Fat32TraceOpen(const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if(file == NULL) return false;
+    struct Fat32TraceHeader header;
+    memcpy(header.magic, FAT32_TRACE_MAGIC, sizeof(header.magic));
+    header.version = FAT32_TRACE_VERSION;
+    header.recordBytes = sizeof(struct Fat32TraceRecord);
+    if(fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        int savedErrno = errno;
+        fclose(file);
+        errno = savedErrno;
+        return false;
+    }
+
+    Fat32TraceClose();
+    pthread_mutex_lock(&trace.lock);
+    trace.file = file;
+    trace.serial++;
+    trace.numContexts = 1;
+    clock_gettime(CLOCK_MONOTONIC, &trace.start);
+    pthread_mutex_unlock(&trace.lock);
+    __atomic_store_n(&tracing, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+void Fat32TraceContext(const char* name)
+{
+    uint i;
+    for(i = 0; name[i] != '\0' && i < FAT32_TRACE_CONTEXT_BYTES - 1; i++) traceContext[i] = toupper((unsigned char)name[i]);
+    traceContext[i] = '\0';
+    traceContextSerial = 0;
+}
+
+void Fat32TraceClose(void)
+{
+    __atomic_store_n(&tracing, false, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&trace.lock);
+    if(trace.file != NULL) fclose(trace.file);
+    trace.file = NULL;
+    for(u_int32_t i = 0; i < trace.numImages; i++) free(trace.images[i]);
+    free(trace.images);
+    trace.images = NULL;
+    trace.numImages = trace.maxImages = 0;
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/// @brief pread until count bytes arrive or the file ends.
+/// @return The number of bytes read, or -1 with errno set.
+static ssize_t ReadFully(int fd, void* buffer, size_t count, u_int64_t offset)
+{
+    size_t done = 0;
+    while(done < count)
+    {
+        ssize_t n = pread(fd, (unsigned char*)buffer + done, count - done, offset + done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        if(n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/// @brief Reads through the O_DIRECT descriptor. Unaligned requests are widened to the alignment and bounced through a pooled buffer.
+/// @return 1 on success, 0 on a read error, -1 when the kernel refused the direct read and the caller should fall back.
+static int DirectReadAt(struct Fat32Volume* vol, int directFd, void* buffer, size_t count, u_int64_t offset)
+{
+    u_int64_t align = vol->bufferAlign;
+
+    //Aligned requests go straight into the caller's buffer
+    if((uintptr_t)buffer % align == 0 && offset % align == 0 && count % align == 0)
+    {
+        ssize_t n = ReadFully(directFd, buffer, count, offset);
+        if(n < 0) return errno == EINVAL ? -1 : 0;
+        return (size_t)n == count;
+    }
+
+    unsigned char* bounce = Fat32GetBuffer(vol);
+    if(bounce == NULL) return 0;
+
+    int result = 1;
+    size_t done = 0;
+    while(done < count && result == 1)
+    {
+        u_int64_t alignedStart = (offset + done) / align * align;
+        size_t lead = (offset + done) - alignedStart;
+        size_t take = count - done < vol->maxExtentBytes ? count - done : vol->maxExtentBytes;
+        size_t span = (lead + take + align - 1) / align * align;
+
+        //The image may end inside the last aligned block, so a short read is fine as long as it covers what was asked for
+        ssize_t n = ReadFully(directFd, bounce, span, alignedStart);
+        if(n < 0) result = errno == EINVAL ? -1 : 0;
+        else if((size_t)n < lead + take) result = 0;
+        else
+        {
+            memcpy((unsigned char*)buffer + done, bounce + lead, take);
+            done += take;
+        }
+    }
+
+    Fat32PutBuffer(vol, bounce);
+    return result;
+}
+
+/// @brief Reads the image without tracing the read.
+static bool ReadImage(struct Fat32Volume* vol, void* buffer, size_t count, u_int64_t offset)
+{
+    if(vol->directFd >= 0 && !__atomic_load_n(&vol->directRefused, __ATOMIC_RELAXED))
+    {
+        int result = DirectReadAt(vol, vol->directFd, buffer, count, offset);
+        if(result >= 0) return result == 1;
+
+        //The filesystem took O_DIRECT at open time but refuses the reads, so stay buffered from now on.
+        //The descriptor stays open until Fat32Close since another thread may still be reading through it.
+        __atomic_store_n(&vol->directRefused, true, __ATOMIC_RELAXED);
+    }
+
+    ssize_t n = ReadFully(vol->fd, buffer, count, offset);
+
+    //Without O_DIRECT, still keep bulk reads from crowding everything else out of the page cache
+    if(Fat32DirectIO(vol) && count >= vol->clusterBytes) posix_fadvise(vol->fd, offset, count, POSIX_FADV_DONTNEED);
+    return n >= 0 && (size_t)n == count;
+}
+
+bool Fat32ReadAt(struct Fat32Volume* vol, void* buffer, size_t count, u_int64_t offset)
+{
+    if(__atomic_load_n(&tracing, __ATOMIC_RELAXED)) TraceAccess(vol, TraceReadKind(vol, offset), offset, count);
+    return ReadImage(vol, buffer, count, offset);
+}
+
+/// @brief Copies a GPT partition name, UTF-16 in the table, into ASCII.
+static void GptName(char* dest, const unsigned char* raw)
+{
+    int length = 0;
+    for(int i = 0; i < 36; i++)
+    {
+        u_int16_t c = raw[i * 2] | ((u_int16_t)raw[i * 2 + 1] << 8);
+        if(c == 0) break;
+        dest[length++] = c < 0x80 && c >= 0x20 ? (char)c : '?';
+    }
+    dest[length] = '\0';
+}
+
+/// @brief Reads the GPT that a protective MBR points to, trying 512 and then 4096 byte LBAs.
+/// @return The number of partitions, or -1 when no valid header was found.
+static int ReadGpt(int fd, struct Fat32PartitionInfo* parts, int maxParts)
+{
+    unsigned char header[512];
+    for(u_int32_t lbaBytes = 512; lbaBytes <= 4096; lbaBytes *= 8)
+    {
+        if(ReadFully(fd, header, 512, lbaBytes) != 512 || memcmp(header, "EFI PART", 8) != 0) continue;
+
+        u_int64_t entriesLba;
+        u_int32_t numEntries, entryBytes;
+        memcpy(&entriesLba, header + 72, 8);
+        memcpy(&numEntries, header + 80, 4);
+        memcpy(&entryBytes, header + 84, 4);
+        if(entryBytes < 128 || entryBytes > GPT_ENTRY_BYTES) continue;
+        if((u_int64_t)numEntries * entryBytes > GPT_ENTRY_BYTES) numEntries = GPT_ENTRY_BYTES / entryBytes;
+
+        unsigned char* entries = malloc((size_t)numEntries * entryBytes);
+        if(entries == NULL) return -1;
+        ssize_t got = ReadFully(fd, entries, (size_t)numEntries * entryBytes, entriesLba * lbaBytes);
+        if(got < 0) got = 0;
+
+        int count = 0;
+        for(u_int32_t i = 0; i < numEntries && (i + 1) * (u_int64_t)entryBytes <= (u_int64_t)got && count < maxParts; i++)
+        {
+            const unsigned char* entry = entries + (size_t)i * entryBytes;
+            static const unsigned char unused[16];
+            if(memcmp(entry, unused, 16) == 0) continue;
+
+            u_int64_t firstLba, lastLba;
+            memcpy(&firstLba, entry + 32, 8);
+            memcpy(&lastLba, entry + 40, 8);
+            struct Fat32PartitionInfo* part = &parts[count++];
+            memset(part, 0, sizeof(struct Fat32PartitionInfo));
+            part->number = i + 1;
+            part->firstLba = firstLba;
+            part->numLbas = lastLba >= firstLba ? lastLba - firstLba + 1 : 0;
+            part->lbaBytes = lbaBytes;
+            part->gpt = true;
+            GptName(part->name, entry + 56);
+        }
+        free(entries);
+        return count;
+    }
+    return -1;
+}
+
+/// @brief Reads the partition table of an open image.
+static int ReadPartitionTable(int fd, struct Fat32PartitionInfo* parts, int maxParts)
+{
+    unsigned char sector[512];
+    if(ReadFully(fd, sector, 512, 0) != 512)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(sector[510] != 0x55 || sector[511] != 0xAA) return 0;
+
+    //A protective MBR hands everything over to the GPT
+    for(int slot = 0; slot < 4; slot++)
+    {
+        if(sector[446 + slot * 16 + 4] != 0xEE) continue;
+        int count = ReadGpt(fd, parts, maxParts);
+        if(count >= 0) return count;
+        break;
+    }
+
+    int count = 0;
+    u_int32_t extendedLba = 0;
+    for(int slot = 0; slot < 4 && count < maxParts; slot++)
+    {
+        const unsigned char* raw = sector + 446 + slot * 16;
+        u_int8_t type = raw[4];
+        u_int32_t lba, numLbas;
+        memcpy(&lba, raw + 8, 4);
+        memcpy(&numLbas, raw + 12, 4);
+        if(type == 0 || numLbas == 0) continue;
+        if(type == 0x05 || type == 0x0F || type == 0x85)
+        {
+            if(extendedLba == 0) extendedLba = lba;
+            continue;
+        }
+
+        struct Fat32PartitionInfo* part = &parts[count++];
+        memset(part, 0, sizeof(struct Fat32PartitionInfo));
+        part->number = slot + 1;
+        part->firstLba = lba;
+        part->numLbas = numLbas;
+        part->mbrType = type;
+    }
+
+    //Logical partitions hang off a chain of extended boot records, each placed relative to the extended partition.
+    //The chain is followed in 512 byte sectors, which is what every disk that has one uses.
+    u_int64_t ebrLba = extendedLba;
+    for(int logical = 0; extendedLba != 0 && logical < MAX_LOGICAL_PARTITIONS && count < maxParts; logical++)
+    {
+        unsigned char ebr[512];
+        if(ReadFully(fd, ebr, 512, ebrLba * 512) != 512 || ebr[510] != 0x55 || ebr[511] != 0xAA) break;
+
+        u_int32_t lba, numLbas, nextLba;
+        memcpy(&lba, ebr + 446 + 8, 4);
+        memcpy(&numLbas, ebr + 446 + 12, 4);
+        memcpy(&nextLba, ebr + 462 + 8, 4);
+        if(ebr[446 + 4] != 0 && numLbas != 0)
+        {
+            struct Fat32PartitionInfo* part = &parts[count++];
+            memset(part, 0, sizeof(struct Fat32PartitionInfo));
+            part->number = 5 + logical;
+            part->firstLba = ebrLba + lba;
+            part->numLbas = numLbas;
+            part->mbrType = ebr[446 + 4];
+        }
+        if(ebr[462 + 4] == 0 || nextLba == 0) break;
+        ebrLba = (u_int64_t)extendedLba + nextLba;
+    }
+    return count;
+}
+
+int Fat32ListPartitions(const char* imagePath, struct Fat32PartitionInfo* parts, int maxParts)
+{
+    int fd = open(imagePath, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+    int count = ReadPartitionTable(fd, parts, maxParts);
+    int savedErrno = errno;
+    close(fd);
+    errno = savedErrno;
+    return count;
+}
+
+struct Fat32Volume* Fat32Open(const char* imagePath)
+{
+    return Fat32OpenWithFlags(imagePath, 0);
+}
+
+/// @brief Appends one FAT entry to a compact FAT being built, starting a new run unless it continues the last one.
+/// @return Whether there was memory, within the budget, for any new run.
+static bool CompactFatAppend(struct CompactFat* fat, u_int32_t clusterNum, u_int32_t value, u_int64_t budget)
+{
+    u_int32_t encoded = value == clusterNum + 1 ? FAT_RUN_SEQUENTIAL : value;
+    if(fat->numRuns > 0 && fat->runs[fat->numRuns - 1].value == encoded) return true;
+
+    if(fat->numRuns == fat->maxRuns)
+    {
+        u_int32_t slots = fat->maxRuns ? fat->maxRuns * 2 : 4096;
+        if(budget > 0 && (u_int64_t)fat->numRuns * sizeof(struct FatRun) >= budget) return false;
+        if(budget > 0 && (u_int64_t)slots * sizeof(struct FatRun) > budget) slots = budget / sizeof(struct FatRun);
+        struct FatRun* grown = realloc(fat->runs, (size_t)slots * sizeof(struct FatRun));
+        if(grown == NULL) return false;
+        fat->runs = grown;
+        fat->maxRuns = slots;
+    }
+    fat->runs[fat->numRuns].start = clusterNum;
+    fat->runs[fat->numRuns++].value = encoded;
+    return true;
+}
+
+/// @brief Reads the FAT a slice at a time into runs, so the flat FAT is never in memory whole.
+static bool LoadCompactFat(struct Fat32Volume* vol, u_int64_t fatOffset, u_int64_t budget)
+{
+    u_int32_t* slice = malloc(FAT_LOAD_BYTES);
+    if(slice == NULL) return false;
+
+    bool loaded = true;
+    for(u_int32_t first = 0; first < vol->fatEntries && loaded; first += FAT_LOAD_BYTES / 4)
+    {
+        u_int32_t count = vol->fatEntries - first < FAT_LOAD_BYTES / 4 ? vol->fatEntries - first : FAT_LOAD_BYTES / 4;
+        Trace(vol, FAT32_TRACE_FAT_LOAD, fatOffset + (u_int64_t)first * 4, (u_int64_t)count * 4);
+        if(!ReadImage(vol, slice, (size_t)count * 4, fatOffset + (u_int64_t)first * 4))
+        {
+            errno = EINVAL;
+            loaded = false;
+            break;
+        }
+        for(u_int32_t i = 0; i < count && loaded; i++)
+        {
+            loaded = CompactFatAppend(&vol->compactFat, first + i, slice[i] & 0x0FFFFFFF, budget);
+            if(!loaded) errno = ENOMEM;
+        }
+    }
+    free(slice);
+
+    //Growth doubled the array; the rest of its life it only gets searched
+    if(loaded && vol->compactFat.numRuns < vol->compactFat.maxRuns)
+    {
+        struct FatRun* trimmed = realloc(vol->compactFat.runs, (size_t)vol->compactFat.numRuns * sizeof(struct FatRun));
+        if(trimmed != NULL) vol->compactFat.runs = trimmed, vol->compactFat.maxRuns = vol->compactFat.numRuns;
+    }
+    return loaded;
+}
+
+/// @brief Looks an entry up in a compact FAT by binary search over its runs.
+static u_int32_t CompactFatEntry(const struct CompactFat* fat, u_int32_t clusterNum)
+{
+    //The last run starting at or before the entry holds it
+    u_int32_t low = 0, high = fat->numRuns - 1;
+    while(low < high)
+    {
+        u_int32_t middle = low + (high - low + 1) / 2;
+        if(fat->runs[middle].start <= clusterNum) low = middle;
+        else high = middle - 1;
+    }
+    u_int32_t value = fat->runs[low].value;
+    return value == FAT_RUN_SEQUENTIAL ? clusterNum + 1 : value;
+}
+
+/// @brief Reads one entry of the in-memory FAT, however it is held.
+static inline u_int32_t FatEntry(struct Fat32Volume* vol, u_int32_t clusterNum)
+{
+    if(__atomic_load_n(&tracing, __ATOMIC_RELAXED)) TraceFatLookup(vol, clusterNum);
+    return vol->fat != NULL ? vol->fat[clusterNum] : CompactFatEntry(&vol->compactFat, clusterNum);
+}
+
+struct Fat32Volume* Fat32OpenWithFlags(const char* imagePath, int flags)
+{
+    return Fat32OpenWithBudget(imagePath, flags, 0);
+}
+
+struct Fat32Volume* Fat32OpenWithBudget(const char* imagePath, int flags, u_int64_t fatBudget)
+{
+    return Fat32OpenPartition(imagePath, 0, flags, fatBudget);
+}
+
+struct Fat32Volume* Fat32OpenPartition(const char* imagePath, uint partition, int flags, u_int64_t fatBudget)
+{
+    //Partition 0 is whichever partition first mounts; real ones are numbered from 1
+    if(partition == 0)
+    {
+        struct Fat32PartitionInfo parts[FAT32_MAX_PARTITIONS];
+        int numParts = Fat32ListPartitions(imagePath, parts, FAT32_MAX_PARTITIONS);
+        if(numParts < 0) return NULL;
+        errno = EINVAL;
+        for(int i = 0; i < numParts; i++)
+        {
+            struct Fat32Volume* vol = Fat32OpenPartition(imagePath, parts[i].number, flags, fatBudget);
+            if(vol != NULL || errno != EINVAL) return vol;
+        }
+        return NULL;
+    }
+
+    struct Fat32Volume* vol = calloc(1, sizeof(struct Fat32Volume));
+    if(vol == NULL) return NULL;
+    vol->imagePath = strdup(imagePath);
+    vol->openFlags = flags;
+    vol->directFd = -1;
+    pthread_mutex_init(&vol->bufferPool.lock, NULL);
+    pthread_mutex_init(&vol->writeLock, NULL);
+    vol->fd = open(imagePath, ((flags & FAT32_OPEN_WRITE) == FAT32_OPEN_WRITE ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    pthread_mutex_init(&vol->clusterCache.lock, NULL);
+    pthread_rwlock_init(&vol->dentryCache.lock, NULL);
+    pthread_mutex_init(&vol->extentCache.lock, NULL);
+    if(vol->fd < 0) goto fail;
+
+    unsigned char sector[512];
+    if(!Fat32ReadAt(vol, sector, 512, 0)) goto invalid;
+    PackMBR(&vol->mbr, sector);
+
+    struct Fat32PartitionInfo parts[FAT32_MAX_PARTITIONS];
+    int numParts = ReadPartitionTable(vol->fd, parts, FAT32_MAX_PARTITIONS);
+    if(numParts <= 0) goto invalid;
+    int chosen = -1;
+    for(int i = 0; i < numParts && chosen < 0; i++) if(parts[i].number == partition) chosen = i;
+    if(chosen < 0)
+    {
+        errno = ENOENT;
+        goto fail;
+    }
+    vol->partitionNumber = parts[chosen].number;
+
+    //An MBR counts in logical sectors, which are not always 512 bytes.
+    //Take the first sector size whose boot sector agrees with it.
+    u_int32_t sectorBytes;
+    for(sectorBytes = 512; sectorBytes <= 4096; sectorBytes *= 2)
+    {
+        if(parts[chosen].lbaBytes != 0 && parts[chosen].lbaBytes != sectorBytes) continue;
+        vol->partitionOffset = parts[chosen].firstLba * sectorBytes;
+        if(!Fat32ReadAt(vol, sector, 512, vol->partitionOffset)) continue;
+        PackBPB(&vol->bpb, sector);
+        if(vol->bpb.BPB_BytsPerSec == sectorBytes) break;
+    }
+    if(sectorBytes > 4096 || !Fat32ValidGeometry(&vol->bpb)) goto invalid;
+
+    struct BPBStruct* bpb = &vol->bpb;
+    vol->sectorBytes = bpb->BPB_BytsPerSec;
+    vol->clusterBytes = (u_int32_t)bpb->BPB_BytsPerSec * bpb->BPB_SecPerClus;
+    //Larger clusters get proportionally larger reads
+    vol->maxExtentBytes = vol->clusterBytes * PREAD_EXTENT_CLUSTERS;
+    //Fat32ValidGeometry only lets through power of two cluster sizes from 512 bytes to 256K
+    vol->nextLiveSlot = DirScanKernels[__builtin_ctz(vol->clusterBytes) - 9];
+    if(vol->maxExtentBytes < PREAD_MIN_EXTENT_BYTES) vol->maxExtentBytes = PREAD_MIN_EXTENT_BYTES;
+    u_int64_t fatOffset = vol->partitionOffset + (u_int64_t)bpb->BPB_RsvdSecCnt * bpb->BPB_BytsPerSec;
+    u_int64_t fatBytes = (u_int64_t)bpb->BPB_FATSz32 * bpb->BPB_BytsPerSec;
+    vol->dataOffset = fatOffset + fatBytes * bpb->BPB_NumFATs;
+
+    //The FAT may be longer than the data region needs; only keep entries that map to real clusters
+    u_int64_t metadataSectors = bpb->BPB_RsvdSecCnt + (u_int64_t)bpb->BPB_NumFATs * bpb->BPB_FATSz32;
+    if(bpb->BPB_TotSec32 <= metadataSectors) goto invalid;
+    u_int64_t dataSectors = bpb->BPB_TotSec32 - metadataSectors;
+    u_int64_t clusterCount = dataSectors / bpb->BPB_SecPerClus;
+    vol->fatEntries = (u_int32_t)((clusterCount + 2 < fatBytes / 4) ? clusterCount + 2 : fatBytes / 4);
+    if(bpb->BPB_RootClus < 2 || bpb->BPB_RootClus >= vol->fatEntries) goto invalid;
+
+    //A flat FAT that does not fit the budget is held compact; writing needs the flat one
+    bool compact = (flags & FAT32_OPEN_COMPACT_FAT) == FAT32_OPEN_COMPACT_FAT || (fatBudget > 0 && (u_int64_t)vol->fatEntries * 4 > fatBudget);
+    if(compact && Fat32Writable(vol))
+    {
+        errno = (flags & FAT32_OPEN_COMPACT_FAT) == FAT32_OPEN_COMPACT_FAT ? EROFS : ENOMEM;
+        goto fail;
+    }
+    if(compact)
+    {
+        if(!LoadCompactFat(vol, fatOffset, fatBudget)) goto fail;
+    }
+    else
+    {
+        vol->fat = malloc((size_t)vol->fatEntries * 4);
+        Trace(vol, FAT32_TRACE_FAT_LOAD, fatOffset, (u_int64_t)vol->fatEntries * 4);
+        if(vol->fat == NULL || !ReadImage(vol, vol->fat, (size_t)vol->fatEntries * 4, fatOffset)) goto invalid;
+        for(u_int32_t i = 0; i < vol->fatEntries; i++) vol->fat[i] &= 0x0FFFFFFF;
+    }
+
+    if(Fat32Writable(vol))
+    {
+        vol->fatDirty = calloc((bpb->BPB_FATSz32 + 7) / 8, 1);
+        if(vol->fatDirty == NULL) goto fail;
+    }
+
+    //Pooled buffers hold one largest read plus the slack an unaligned direct read is widened by
+    vol->bufferAlign = vol->sectorBytes > DIRECT_IO_ALIGN ? vol->sectorBytes : DIRECT_IO_ALIGN;
+    vol->bufferPool.bufferBytes = vol->maxExtentBytes + 2 * vol->bufferAlign;
+
+    //Some filesystems (tmpfs among them) refuse O_DIRECT; reads then stay buffered
+    if((flags & FAT32_OPEN_DIRECT) == FAT32_OPEN_DIRECT) vol->directFd = open(imagePath, O_RDONLY | O_CLOEXEC | O_DIRECT);
+
+    return vol;
+
+invalid:
+    errno = EINVAL;
+fail:
+    {
+        int savedErrno = errno;
+        Fat32Close(vol);
+        errno = savedErrno;
+    }
+    return NULL;
+}
+
+void Fat32Close(struct Fat32Volume* vol)
+{
+    if(vol == NULL) return;
+    //Changes still waiting in memory go out before the image is let go
+    if(vol->fatDirty != NULL && vol->fd >= 0) Fat32Flush(vol);
+    if(vol->fd >= 0) close(vol->fd);
+    if(vol->directFd >= 0) close(vol->directFd);
+    for(uint i = 0; i < vol->bufferPool.numIdle; i++) free(vol->bufferPool.idle[i]);
+    pthread_mutex_destroy(&vol->bufferPool.lock);
+
+    for(int i = 0; i < CLUSTER_CACHE_SLOTS; i++) free(vol->clusterCache.slots[i].bytes);
+    for(int i = 0; i < DENTRY_CACHE_BUCKETS; i++)
+    {
+        struct DentryCacheNode* node = vol->dentryCache.buckets[i];
+        while(node)
+        {
+            struct DentryCacheNode* next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    pthread_mutex_destroy(&vol->clusterCache.lock);
+    pthread_rwlock_destroy(&vol->dentryCache.lock);
+    for(int i = 0; i < EXTENT_CACHE_SLOTS; i++) Fat32PutExtentMap(vol, vol->extentCache.slots[i]);
+    pthread_mutex_destroy(&vol->extentCache.lock);
+
+    pthread_mutex_destroy(&vol->writeLock);
+    DirectoryIndexFree(&vol->directoryIndex);
+    free(vol->fatDirty);
+    free(vol->freeExtents);
+    free(vol->fat);
+    free(vol->compactFat.runs);
+    free(vol->imagePath);
+    free(vol);
+}
+
+const char* Fat32ImagePath(struct Fat32Volume* vol)
+{
+    return vol->imagePath;
+}
+
+uint Fat32PartitionNumber(struct Fat32Volume* vol)
+{
+    return vol->partitionNumber;
+}
+
+const struct MasterBootRecord* Fat32GetMBR(struct Fat32Volume* vol)
+{
+    return &vol->mbr;
+}
+
+const struct BPBStruct* Fat32GetBPB(struct Fat32Volume* vol)
+{
+    return &vol->bpb;
+}
+
+u_int32_t Fat32RootCluster(struct Fat32Volume* vol)
+{
+    return vol->bpb.BPB_RootClus;
+}
+
+u_int32_t Fat32SectorBytes(struct Fat32Volume* vol)
+{
+    return vol->sectorBytes;
+}
+
+u_int32_t Fat32ClusterBytes(struct Fat32Volume* vol)
+{
+    return vol->clusterBytes;
+}
+
+u_int32_t Fat32PreferredReadBytes(struct Fat32Volume* vol)
+{
+    return vol->maxExtentBytes;
+}
+
+u_int64_t Fat32FatMemory(struct Fat32Volume* vol, bool* compact)
+{
+    if(compact != NULL) *compact = vol->fat == NULL;
+    if(vol->fat != NULL) return (u_int64_t)vol->fatEntries * 4;
+    return (u_int64_t)vol->compactFat.maxRuns * sizeof(struct FatRun);
+}
+
+u_int32_t Fat32ClusterCount(struct Fat32Volume* vol)
+{
+    return vol->fatEntries;
+}
+
+u_int64_t Fat32PartitionOffset(struct Fat32Volume* vol)
+{
+    return vol->partitionOffset;
+}
+
+u_int64_t Fat32FatOffset(struct Fat32Volume* vol, uint copy)
+{
+    const struct BPBStruct* bpb = &vol->bpb;
+    return vol->partitionOffset + ((u_int64_t)bpb->BPB_RsvdSecCnt + (u_int64_t)copy * bpb->BPB_FATSz32) * bpb->BPB_BytsPerSec;
+}
+
+u_int64_t Fat32ClusterOffset(struct Fat32Volume* vol, u_int32_t clusterNum)
+{
+    return vol->dataOffset + (u_int64_t)(clusterNum - 2) * vol->clusterBytes;
+}
+
+u_int32_t Fat32NextCluster(struct Fat32Volume* vol, u_int32_t clusterNum)
+{
+    if(clusterNum < 2 || clusterNum >= vol->fatEntries) return 0x0FFFFFFF;
+    return FatEntry(vol, clusterNum);
+}
+
+bool Fat32IsEndOfChain(struct Fat32Volume* vol, u_int32_t value)
+{
+    return value < 2 || value >= 0x0FFFFFF7 || value >= vol->fatEntries;
+}
+
+bool Fat32ReadCluster(struct Fat32Volume* vol, u_int32_t clusterNum, unsigned char* dest)
+{
+    struct ClusterCache* cache = &vol->clusterCache;
+    struct ClusterCacheSlot* slot = &cache->slots[clusterNum % CLUSTER_CACHE_SLOTS];
+    //Traced as asked for, hit or miss, so a replay can try other cache sizes on it
+    Trace(vol, FAT32_TRACE_CLUSTER, Fat32ClusterOffset(vol, clusterNum), vol->clusterBytes);
+
+    pthread_mutex_lock(&cache->lock);
+    if(slot->clusterNum == clusterNum && slot->bytes != NULL)
+    {
+        memcpy(dest, slot->bytes, vol->clusterBytes);
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    //Read outside the lock so one slow read does not stall every other thread
+    if(!ReadImage(vol, dest, vol->clusterBytes, Fat32ClusterOffset(vol, clusterNum))) return false;
+
+    pthread_mutex_lock(&cache->lock);
+    if(slot->bytes == NULL) slot->bytes = Fat32AllocBuffer(vol, vol->clusterBytes);
+    if(slot->bytes != NULL)
+    {
+        memcpy(slot->bytes, dest, vol->clusterBytes);
+        slot->clusterNum = clusterNum;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+/// @brief Builds the trimmed 8.3 name of a raw short entry, with a period before the extension if there is one.
+static void ShortNameFromRaw(char* dest, const unsigned char* raw)
+{
+    int length = 0;
+    for(int i = 0; i < 8 && raw[i] != 0x20; i++) dest[length++] = raw[i];
+    //0x05 stands in for a leading 0xE5 byte
+    if(length > 0 && (unsigned char)dest[0] == 0x05) dest[0] = (char)0xE5;
+    if(raw[8] != 0x20)
+    {
+        dest[length++] = '.';
+        for(int i = 8; i < 11 && raw[i] != 0x20; i++) dest[length++] = raw[i];
+    }
+    dest[length] = '\0';
+}
+
+//Byte offsets of the 13 name characters inside a long directory entry
+static const u_int8_t LDIR_CHAR_OFFSETS[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+bool Fat32OpenDir(struct Fat32Volume* vol, u_int32_t dirCluster, struct Fat32Dir* dir)
+{
+    memset(dir, 0, sizeof(struct Fat32Dir));
+    dir->vol = vol;
+    dir->longChecksum = -1;
+    dir->bytes = Fat32AllocBuffer(vol, vol->clusterBytes);
+    if(dir->bytes == NULL) return false;
+
+    //".." entries of first level directories use cluster 0 for the root
+    dir->currentCluster = dirCluster == 0 ? vol->bpb.BPB_RootClus : dirCluster;
+    dir->endSlot = UINT32_MAX;
+    dir->finished = Fat32IsEndOfChain(vol, dir->currentCluster);
+    if(!dir->finished && !Fat32ReadCluster(vol, dir->currentCluster, dir->bytes)) dir->finished = dir->failed = true;
+    dir->clustersWalked = 1;
+    return true;
+}
+
+/// @brief Assembles the long name held in the iterator's saved slots.
+/// @return Whether every slot of the name was present.
+static bool DecodeLongName(struct Fat32Dir* dir, char* name)
+{
+    memset(name, 0, 256);
+    for(uint order = 1; order <= dir->longOrder; order++)
+    {
+        if((dir->longMask & (1u << (order - 1))) == 0) return false;
+        const unsigned char* raw = &dir->longSlots[(order - 1) * 32];
+        for(int c = 0; c < 13; c++)
+        {
+            uint index = (order - 1) * 13 + c;
+            unsigned char low = raw[LDIR_CHAR_OFFSETS[c]];
+            unsigned char high = raw[LDIR_CHAR_OFFSETS[c] + 1];
+            if(index >= 255) break;
+            //The reader has always shown the low byte of each UCS-2 character
+            name[index] = (low == 0xFF && high == 0xFF) ? '\0' : (char)low;
+        }
+    }
+    return name[0] != '\0';
+}
+
+bool Fat32ReadDir(struct Fat32Dir* dir, struct Fat32Entry* entry)
+{
+    return Fat32ReadDirFiltered(dir, entry, NULL, NULL);
+}
+
+bool Fat32ReadDirFiltered(struct Fat32Dir* dir, struct Fat32Entry* entry, bool (*accept)(const unsigned char* raw, void* context), void* context)
+{
+    struct Fat32Volume* vol = dir->vol;
+
+    while(!dir->finished)
+    {
+        //Move on to the next cluster of the directory once this one is used up
+        if(dir->index >= vol->clusterBytes)
+        {
+            dir->currentCluster = Fat32NextCluster(vol, dir->currentCluster);
+            dir->index = 0;
+            if(Fat32IsEndOfChain(vol, dir->currentCluster))
+            {
+                dir->finished = true;
+                break;
+            }
+            //A looping chain must not hang the caller forever
+            if(++dir->clustersWalked > vol->fatEntries || !Fat32ReadCluster(vol, dir->currentCluster, dir->bytes))
+            {
+                dir->finished = dir->failed = true;
+                break;
+            }
+        }
+
+        //Deleted entries are skipped in bulk. One between a long name and its short entry orphans the long name.
+        u_int32_t live = vol->nextLiveSlot(dir->bytes, dir->index);
+        if(live != dir->index) dir->longChecksum = -1;
+        dir->index = live;
+        if(live >= vol->clusterBytes) continue;
+
+        unsigned char* raw = &dir->bytes[dir->index];
+        dir->index += 32;
+
+        //This entry and every entry after it are free
+        if(raw[0] == 0x00)
+        {
+            dir->endSlot = (dir->clustersWalked - 1) * (vol->clusterBytes / 32) + (dir->index - 32) / 32;
+            dir->finished = true;
+            break;
+        }
+
+        if(raw[11] == ATTR_LONG_NAME)
+        {
+            uint order = raw[0] & 0x1F;
+            if(order == 0 || order > 20) continue;
+            if((raw[0] & LAST_LONG_ENTRY) == LAST_LONG_ENTRY)
+            {
+                dir->longChecksum = raw[13];
+                dir->longOrder = order;
+                dir->longMask = 0;
+            }
+            //Only keep the raw slot for now; the name is decoded once its short entry turns out to be wanted
+            if(dir->longChecksum >= 0 && order <= dir->longOrder)
+            {
+                memcpy(&dir->longSlots[(order - 1) * 32], raw, 32);
+                dir->longMask |= 1u << (order - 1);
+            }
+            continue;
+        }
+
+        //Let the caller turn the entry down from its raw bytes before anything is decoded
+        if(accept != NULL && !accept(raw, context))
+        {
+            dir->longChecksum = -1;
+            continue;
+        }
+
+        DecodeShortEntry(&entry->dir, raw);
+        ShortNameFromRaw(entry->shortName, raw);
+        entry->firstCluster = entry->dir.DIR_FstClusLO | ((u_int32_t)entry->dir.DIR_FstClusHI << 16);
+
+        if(dir->longChecksum == Fat32ShortNameChecksum(raw) && DecodeLongName(dir, entry->name)) entry->hasLongName = true;
+        else
+        {
+            strcpy(entry->name, entry->shortName);
+            entry->hasLongName = false;
+        }
+        dir->longChecksum = -1;
+        return true;
+    }
+
+    return false;
+}
+
+void Fat32CloseDir(struct Fat32Dir* dir)
+{
+    free(dir->bytes);
+    dir->bytes = NULL;
+    dir->finished = true;
+}
+
+/// @brief Hashes a (directory cluster, lower case name) pair into a dentry cache bucket.
+static uint DentryHash(u_int32_t dirCluster, const char* key)
+{
+    u_int32_t hash = 2166136261u ^ dirCluster;
+    for(const char* c = key; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash % DENTRY_CACHE_BUCKETS;
+}
+
+static bool DentryLookup(struct Fat32Volume* vol, u_int32_t dirCluster, const char* key, struct Fat32Entry* entry)
+{
+    struct DentryCache* cache = &vol->dentryCache;
+    bool found = false;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    for(struct DentryCacheNode* node = cache->buckets[DentryHash(dirCluster, key)]; node; node = node->next)
+    {
+        if(node->dirCluster == dirCluster && strcmp(node->key, key) == 0)
+        {
+            *entry = node->entry;
+            found = true;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    return found;
+}
+
+static void DentryInsert(struct Fat32Volume* vol, u_int32_t dirCluster, const char* key, struct Fat32Entry* entry)
+{
+    struct DentryCache* cache = &vol->dentryCache;
+    struct DentryCacheNode* node = malloc(sizeof(struct DentryCacheNode));
+    if(node == NULL) return;
+    node->dirCluster = dirCluster;
+    strcpy(node->key, key);
+    node->entry = *entry;
+
+    uint bucket = DentryHash(dirCluster, key);
+    pthread_rwlock_wrlock(&cache->lock);
+    node->next = cache->buckets[bucket];
+    cache->buckets[bucket] = node;
+
+    //Keep chains short - drop whatever is past the chain limit
+    struct DentryCacheNode* tail = node;
+    for(int depth = 1; tail->next != NULL; depth++)
+    {
+        if(depth == DENTRY_CACHE_CHAIN)
+        {
+            struct DentryCacheNode* extra = tail->next;
+            tail->next = NULL;
+            while(extra)
+            {
+                struct DentryCacheNode* next = extra->next;
+                free(extra);
+                extra = next;
+            }
+            break;
+        }
+        tail = tail->next;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+bool Fat32NameMatches(struct Fat32Entry* entry, const char* name)
+{
+    if(strcasecmp(entry->name, name) == 0 || strcasecmp(entry->shortName, name) == 0) return true;
+
+    char undotted[13];
+    int length = 0;
+    for(const char* c = entry->shortName; *c; c++) if(*c != '.') undotted[length++] = *c;
+    undotted[length] = '\0';
+    return strcasecmp(undotted, name) == 0;
+}
+
+bool Fat32Lookup(struct Fat32Volume* vol, u_int32_t dirCluster, const char* name, struct Fat32Entry* entry)
+{
+    if(dirCluster == 0) dirCluster = vol->bpb.BPB_RootClus;
+
+    char key[256];
+    int length = 0;
+    for(; name[length] && length < 255; length++) key[length] = tolower((unsigned char)name[length]);
+    key[length] = '\0';
+    if(DentryLookup(vol, dirCluster, key, entry)) return true;
+
+    struct Fat32Dir dir;
+    if(!Fat32OpenDir(vol, dirCluster, &dir)) return false;
+    bool found = false;
+    while(Fat32ReadDir(&dir, entry))
+    {
+        if((entry->dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+        if(Fat32NameMatches(entry, name))
+        {
+            found = true;
+            break;
+        }
+    }
+    Fat32CloseDir(&dir);
+
+    if(found) DentryInsert(vol, dirCluster, key, entry);
+    return found;
+}
+
+/// @brief Fills entry with a stand-in for the root directory, which has no entry of its own.
+static void RootEntry(struct Fat32Volume* vol, struct Fat32Entry* entry)
+{
+    memset(entry, 0, sizeof(struct Fat32Entry));
+    entry->dir.DIR_Attr = ATTR_DIRECTORY;
+    entry->dir.DIR_FstClusLO = vol->bpb.BPB_RootClus & 0xFFFF;
+    entry->dir.DIR_FstClusHI = vol->bpb.BPB_RootClus >> 16;
+    entry->firstCluster = vol->bpb.BPB_RootClus;
+    strcpy(entry->name, "/");
+    strcpy(entry->shortName, "/");
+    entry->hasLongName = false;
+}
+
+bool Fat32Stat(struct Fat32Volume* vol, u_int32_t dirCluster, const char* path, struct Fat32Entry* entry)
+{
+    RootEntry(vol, entry);
+    if(path[0] != '/')
+    {
+        entry->firstCluster = dirCluster == 0 ? vol->bpb.BPB_RootClus : dirCluster;
+        strcpy(entry->name, ".");
+    }
+
+    const char* component = path;
+    while(*component)
+    {
+        while(*component == '/') component++;
+        if(*component == '\0') break;
+
+        const char* end = strchr(component, '/');
+        size_t length = end ? (size_t)(end - component) : strlen(component);
+        if(length > 255) return false;
+
+        char name[256];
+        memcpy(name, component, length);
+        name[length] = '\0';
+        component += length;
+
+        if((entry->dir.DIR_Attr & ATTR_DIRECTORY) != ATTR_DIRECTORY) return false;
+        u_int32_t parent = entry->firstCluster;
+        if(!Fat32Lookup(vol, parent, name, entry)) return false;
+        //".." of a first level directory points at cluster 0, which means the root
+        if((entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY && entry->firstCluster == 0) RootEntry(vol, entry);
+    }
+    return true;
+}
+
+/// @brief Walks a chain into a new extent map holding one reference.
+static struct Fat32ExtentMap* BuildExtentMap(struct Fat32Volume* vol, u_int32_t firstCluster)
+{
+    struct Fat32ExtentMap* map = calloc(1, sizeof(struct Fat32ExtentMap));
+    if(map == NULL) return NULL;
+    map->firstCluster = firstCluster;
+    map->generation = Fat32Generation(vol);
+    map->refs = 1;
+
+    u_int32_t maxExtents = 0;
+    u_int64_t numClusters = 0;
+    u_int32_t cluster = firstCluster;
+    while(!Fat32IsEndOfChain(vol, cluster))
+    {
+        //A chain longer than the volume has looped
+        if(numClusters >= vol->fatEntries)
+        {
+            map->broken = true;
+            break;
+        }
+
+        struct Fat32Extent* last = map->numExtents > 0 ? &map->extents[map->numExtents - 1] : NULL;
+        if(last != NULL && cluster == last->cluster + last->length) last->length++;
+        else
+        {
+            if(map->numExtents == maxExtents)
+            {
+                u_int32_t slots = maxExtents ? maxExtents * 2 : 4;
+                struct Fat32Extent* grown = realloc(map->extents, slots * sizeof(struct Fat32Extent));
+                if(grown == NULL)
+                {
+                    free(map->extents);
+                    free(map);
+                    errno = ENOMEM;
+                    return NULL;
+                }
+                map->extents = grown;
+                maxExtents = slots;
+            }
+            last = &map->extents[map->numExtents++];
+            last->offset = numClusters * vol->clusterBytes;
+            last->cluster = cluster;
+            last->length = 1;
+        }
+        numClusters++;
+        cluster = FatEntry(vol, cluster);
+    }
+    //Free and bad entries end a chain too, but only an end of chain marker ends it properly
+    if(numClusters > 0 && cluster < 0x0FFFFFF8) map->broken = true;
+    map->chainBytes = numClusters * vol->clusterBytes;
+    return map;
+}
+
+const struct Fat32ExtentMap* Fat32GetExtentMap(struct Fat32Volume* vol, u_int32_t firstCluster)
+{
+    struct ExtentCache* cache = &vol->extentCache;
+    struct Fat32ExtentMap** slot = &cache->slots[firstCluster % EXTENT_CACHE_SLOTS];
+    u_int64_t generation = Fat32Generation(vol);
+
+    pthread_mutex_lock(&cache->lock);
+    struct Fat32ExtentMap* map = *slot;
+    if(map != NULL && map->firstCluster == firstCluster && map->generation == generation)
+    {
+        map->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        return map;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    //Walk outside the lock; a long chain should not stall readers of other files
+    map = BuildExtentMap(vol, firstCluster);
+    if(map == NULL) return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    struct Fat32ExtentMap* old = *slot;
+    *slot = map;
+    map->refs++;
+    pthread_mutex_unlock(&cache->lock);
+    Fat32PutExtentMap(vol, old);
+    return map;
+}
+
+void Fat32PutExtentMap(struct Fat32Volume* vol, const struct Fat32ExtentMap* map)
+{
+    if(map == NULL) return;
+    struct Fat32ExtentMap* owned = (struct Fat32ExtentMap*)map;
+    pthread_mutex_lock(&vol->extentCache.lock);
+    bool last = --owned->refs == 0;
+    pthread_mutex_unlock(&vol->extentCache.lock);
+    if(last)
+    {
+        free(owned->extents);
+        free(owned);
+    }
+}
+
+u_int32_t Fat32FindExtent(const struct Fat32ExtentMap* map, u_int64_t offset)
+{
+    if(offset >= map->chainBytes) return map->numExtents;
+
+    //The last extent starting at or before offset holds it
+    u_int32_t low = 0, high = map->numExtents - 1;
+    while(low < high)
+    {
+        u_int32_t middle = low + (high - low + 1) / 2;
+        if(map->extents[middle].offset <= offset) low = middle;
+        else high = middle - 1;
+    }
+    return low;
+}
+
+ssize_t Fat32PRead(struct Fat32Volume* vol, const struct Fat32Entry* entry, void* buffer, size_t count, u_int64_t offset)
+{
+    if((entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+    {
+        errno = EISDIR;
+        return -1;
+    }
+    if(offset >= entry->dir.DIR_FileSize) return 0;
+    if(count > entry->dir.DIR_FileSize - offset) count = entry->dir.DIR_FileSize - offset;
+
+    const struct Fat32ExtentMap* map = Fat32GetExtentMap(vol, entry->firstCluster);
+    if(map == NULL) return -1;
+
+    size_t done = 0;
+    u_int32_t index = Fat32FindExtent(map, offset);
+    while(done < count && index < map->numExtents)
+    {
+        //Each extent is one read, split only where it passes the largest read size
+        const struct Fat32Extent* extent = &map->extents[index];
+        u_int64_t skip = (offset + done) - extent->offset;
+        u_int64_t extentBytes = (u_int64_t)extent->length * vol->clusterBytes;
+        u_int64_t chunk = extentBytes - skip;
+        if(chunk > count - done) chunk = count - done;
+        if(chunk > vol->maxExtentBytes) chunk = vol->maxExtentBytes;
+        if(!Fat32ReadAt(vol, (unsigned char*)buffer + done, chunk, Fat32ClusterOffset(vol, extent->cluster) + skip))
+        {
+            Fat32PutExtentMap(vol, map);
+            if(done > 0) return done;
+            errno = EIO;
+            return -1;
+        }
+
+        done += chunk;
+        if(skip + chunk == extentBytes) index++;
+    }
+    Fat32PutExtentMap(vol, map);
+
+    //The chain is shorter than the size in the directory entry
+    if(done == 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return done;
+}
+
+void Fat32Prefetch(struct Fat32Volume* vol, const struct Fat32Entry* entry, u_int64_t offset, u_int64_t count)
+{
+    if((entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY || entry->firstCluster == 0) return;
+    if(offset >= entry->dir.DIR_FileSize) return;
+    if(count > entry->dir.DIR_FileSize - offset) count = entry->dir.DIR_FileSize - offset;
+
+    //Taking the map walks the chain now, and leaves it cached for the reads that follow
+    const struct Fat32ExtentMap* map = Fat32GetExtentMap(vol, entry->firstCluster);
+    if(map == NULL) return;
+
+    //Readahead fills the page cache, which direct reads would not use and --direct means to leave alone
+    if(!Fat32DirectIO(vol))
+    {
+        u_int64_t done = 0;
+        for(u_int32_t index = Fat32FindExtent(map, offset); done < count && index < map->numExtents; index++)
+        {
+            const struct Fat32Extent* extent = &map->extents[index];
+            u_int64_t skip = (offset + done) - extent->offset;
+            u_int64_t chunk = (u_int64_t)extent->length * vol->clusterBytes - skip;
+            if(chunk > count - done) chunk = count - done;
+            posix_fadvise(vol->fd, Fat32ClusterOffset(vol, extent->cluster) + skip, chunk, POSIX_FADV_WILLNEED);
+            done += chunk;
+        }
+    }
+    Fat32PutExtentMap(vol, map);
+}
+
+/// @brief Copies count bytes of the image at offset to outFd through a pooled buffer.
+/// @return The number of bytes written, or -1 with errno set if none were.
+static ssize_t CopyToFd(struct Fat32Volume* vol, int outFd, u_int64_t offset, u_int64_t count)
+{
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    if(buffer == NULL) return -1;
+
+    u_int64_t done = 0;
+    while(done < count)
+    {
+        size_t chunk = count - done < vol->maxExtentBytes ? count - done : vol->maxExtentBytes;
+        if(!Fat32ReadAt(vol, buffer, chunk, offset + done))
+        {
+            errno = EIO;
+            break;
+        }
+        size_t written = 0;
+        while(written < chunk)
+        {
+            ssize_t n = write(outFd, buffer + written, chunk - written);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) break;
+            written += n;
+        }
+        done += written;
+        if(written < chunk) break;
+    }
+    Fat32PutBuffer(vol, buffer);
+    return done > 0 || count == 0 ? (ssize_t)done : -1;
+}
+
+/// @brief Moves count bytes of the image at offset to a pipe or socket without copying them through user space.
+/// @return The number of bytes moved, or -1 with errno set if none were. EINVAL and ENOSYS mean the kernel would not do it.
+static ssize_t SpliceToFd(struct Fat32Volume* vol, int outFd, bool isPipe, u_int64_t offset, u_int64_t count)
+{
+    Trace(vol, FAT32_TRACE_DATA, offset, count);
+    u_int64_t done = 0;
+    while(done < count)
+    {
+        size_t chunk = count - done < 0x40000000 ? count - done : 0x40000000;
+        ssize_t n;
+        if(isPipe)
+        {
+            loff_t from = offset + done;
+            n = splice(vol->fd, &from, outFd, NULL, chunk, SPLICE_F_MORE | SPLICE_F_MOVE);
+        }
+        else
+        {
+            off_t from = offset + done;
+            n = sendfile(outFd, vol->fd, &from, chunk);
+        }
+
+        if(n < 0 && errno == EINTR) continue;
+        //A non-blocking destination is waited on rather than treated as an error
+        if(n < 0 && errno == EAGAIN)
+        {
+            struct pollfd wait = {.fd = outFd, .events = POLLOUT};
+            if(poll(&wait, 1, -1) >= 0) continue;
+        }
+        if(n < 0) return done > 0 ? (ssize_t)done : -1;
+        if(n == 0)
+        {
+            //The image is shorter than the chain says
+            errno = EIO;
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t Fat32SendFile(struct Fat32Volume* vol, const struct Fat32Entry* entry, int outFd, u_int64_t offset, u_int64_t count)
+{
+    if((entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+    {
+        errno = EISDIR;
+        return -1;
+    }
+    if(offset >= entry->dir.DIR_FileSize) return 0;
+    if(count > entry->dir.DIR_FileSize - offset) count = entry->dir.DIR_FileSize - offset;
+    if(count == 0) return 0;
+
+    //Pipes take splice and sockets take sendfile; anything else is copied through a buffer
+    struct stat info;
+    if(fstat(outFd, &info) != 0) return -1;
+    bool zeroCopy = S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode);
+
+    const struct Fat32ExtentMap* map = Fat32GetExtentMap(vol, entry->firstCluster);
+    if(map == NULL) return -1;
+
+    u_int64_t done = 0;
+    u_int32_t index = Fat32FindExtent(map, offset);
+    while(done < count && index < map->numExtents)
+    {
+        const struct Fat32Extent* extent = &map->extents[index];
+        u_int64_t skip = (offset + done) - extent->offset;
+        u_int64_t chunk = (u_int64_t)extent->length * vol->clusterBytes - skip;
+        if(chunk > count - done) chunk = count - done;
+        u_int64_t from = Fat32ClusterOffset(vol, extent->cluster) + skip;
+
+        ssize_t n = -1;
+        if(zeroCopy)
+        {
+            n = SpliceToFd(vol, outFd, S_ISFIFO(info.st_mode), from, chunk);
+            //Older kernels and some filesystems refuse; the rest of the file goes the slow way
+            if(n < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                zeroCopy = false;
+                continue;
+            }
+        }
+        else n = CopyToFd(vol, outFd, from, chunk);
+
+        if(n > 0) done += n;
+        if(n != (ssize_t)chunk) break;
+        index++;
+    }
+    //The chain is shorter than the size in the directory entry
+    if(index >= map->numExtents) errno = EIO;
+    Fat32PutExtentMap(vol, map);
+    return done > 0 ? (ssize_t)done : -1;
+}
+
+/// @brief pwrite until every byte is written.
+static bool WriteFully(int fd, const void* buffer, size_t count, u_int64_t offset)
+{
+    size_t done = 0;
+    while(done < count)
+    {
+        ssize_t n = pwrite(fd, (const unsigned char*)buffer + done, count - done, offset + done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/// @brief Drops every cached cluster that a write to the image overlapped.
+static void ForgetClusters(struct Fat32Volume* vol, u_int64_t offset, size_t count)
+{
+    if(count == 0 || offset + count <= vol->dataOffset) return;
+    u_int64_t first = offset < vol->dataOffset ? 2 : (offset - vol->dataOffset) / vol->clusterBytes + 2;
+    u_int64_t last = (offset + count - 1 - vol->dataOffset) / vol->clusterBytes + 2;
+
+    struct ClusterCache* cache = &vol->clusterCache;
+    pthread_mutex_lock(&cache->lock);
+    for(int i = 0; i < CLUSTER_CACHE_SLOTS; i++)
+    {
+        if(cache->slots[i].clusterNum >= first && cache->slots[i].clusterNum <= last) cache->slots[i].clusterNum = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+bool Fat32WriteAt(struct Fat32Volume* vol, const void* buffer, size_t count, u_int64_t offset)
+{
+    if(!Fat32Writable(vol))
+    {
+        errno = EROFS;
+        return false;
+    }
+    Trace(vol, FAT32_TRACE_WRITE, offset, count);
+    bool written = WriteFully(vol->fd, buffer, count, offset);
+    ForgetClusters(vol, offset, count);
+    return written;
+}
+
+/// @brief Changes one FAT entry in memory and marks its sector for the next flush. Called with writeLock held.
+static void SetFatEntry(struct Fat32Volume* vol, u_int32_t clusterNum, u_int32_t value)
+{
+    __atomic_store_n(&vol->fat[clusterNum], value, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&vol->generation, 1, __ATOMIC_RELAXED);
+    u_int32_t sector = (u_int64_t)clusterNum * 4 / vol->sectorBytes;
+    vol->fatDirty[sector / 8] |= 1 << (sector % 8);
+}
+
+/// @brief Inserts a free extent at index, growing the array when it is full. Called with writeLock held.
+static bool InsertFreeExtent(struct Fat32Volume* vol, uint index, u_int32_t start, u_int32_t length)
+{
+    if(vol->numFreeExtents == vol->maxFreeExtents)
+    {
+        uint slots = vol->maxFreeExtents ? vol->maxFreeExtents * 2 : 64;
+        struct FreeExtent* grown = realloc(vol->freeExtents, slots * sizeof(struct FreeExtent));
+        if(grown == NULL) return false;
+        vol->freeExtents = grown;
+        vol->maxFreeExtents = slots;
+    }
+    memmove(&vol->freeExtents[index + 1], &vol->freeExtents[index], (vol->numFreeExtents - index) * sizeof(struct FreeExtent));
+    vol->freeExtents[index].start = start;
+    vol->freeExtents[index].length = length;
+    vol->numFreeExtents++;
+    return true;
+}
+
+/// @brief Builds the free extent map from the in-memory FAT the first time something is allocated or freed. Called with writeLock held.
+static bool BuildFreeExtents(struct Fat32Volume* vol)
+{
+    if(vol->freeMapBuilt) return true;
+
+    vol->numFreeExtents = 0;
+    vol->freeClusters = 0;
+    for(u_int32_t c = 2; c < vol->fatEntries; c++)
+    {
+        if(vol->fat[c] != 0) continue;
+        struct FreeExtent* last = vol->numFreeExtents ? &vol->freeExtents[vol->numFreeExtents - 1] : NULL;
+        if(last != NULL && last->start + last->length == c) last->length++;
+        else if(!InsertFreeExtent(vol, vol->numFreeExtents, c, 1)) return false;
+        vol->freeClusters++;
+    }
+    vol->freeMapBuilt = true;
+    return true;
+}
+
+/// @brief Allocates count clusters as one chain, appended to after unless it is 0. Called with writeLock held.
+/// The first free extent long enough takes the whole chain; only when none is does the chain get split across extents.
+/// @return The first cluster, or 0 with errno set.
+static u_int32_t AllocateLocked(struct Fat32Volume* vol, u_int32_t count, u_int32_t after)
+{
+    if(!BuildFreeExtents(vol))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    if(count == 0 || count > vol->freeClusters)
+    {
+        errno = count == 0 ? EINVAL : ENOSPC;
+        return 0;
+    }
+
+    uint index = 0;
+    while(index < vol->numFreeExtents && vol->freeExtents[index].length < count) index++;
+    if(index == vol->numFreeExtents) index = 0;
+
+    u_int32_t first = 0;
+    u_int32_t previous = after;
+    u_int32_t remaining = count;
+    while(remaining > 0)
+    {
+        struct FreeExtent* extent = &vol->freeExtents[index];
+        u_int32_t take = extent->length < remaining ? extent->length : remaining;
+        for(u_int32_t c = extent->start; c < extent->start + take; c++)
+        {
+            if(first == 0) first = c;
+            if(previous != 0) SetFatEntry(vol, previous, c);
+            previous = c;
+        }
+        extent->start += take;
+        extent->length -= take;
+        remaining -= take;
+        if(extent->length == 0)
+        {
+            memmove(extent, extent + 1, (vol->numFreeExtents - index - 1) * sizeof(struct FreeExtent));
+            vol->numFreeExtents--;
+        }
+    }
+    SetFatEntry(vol, previous, FAT_END_OF_CHAIN);
+    vol->freeClusters -= count;
+    return first;
+}
+
+u_int32_t Fat32AllocateChain(struct Fat32Volume* vol, u_int32_t count)
+{
+    if(!Fat32Writable(vol))
+    {
+        errno = EROFS;
+        return 0;
+    }
+    pthread_mutex_lock(&vol->writeLock);
+    u_int32_t first = AllocateLocked(vol, count, 0);
+    pthread_mutex_unlock(&vol->writeLock);
+    return first;
+}
+
+/// @brief Gives one cluster back to the free extent map, merging it with its neighbours. Called with writeLock held.
+static void ReleaseCluster(struct Fat32Volume* vol, u_int32_t clusterNum)
+{
+    //Binary search for the first extent starting past the cluster
+    uint low = 0, high = vol->numFreeExtents;
+    while(low < high)
+    {
+        uint middle = (low + high) / 2;
+        if(vol->freeExtents[middle].start > clusterNum) high = middle;
+        else low = middle + 1;
+    }
+
+    struct FreeExtent* before = low > 0 ? &vol->freeExtents[low - 1] : NULL;
+    struct FreeExtent* after = low < vol->numFreeExtents ? &vol->freeExtents[low] : NULL;
+    bool joinsBefore = before != NULL && before->start + before->length == clusterNum;
+    bool joinsAfter = after != NULL && clusterNum + 1 == after->start;
+
+    if(joinsBefore && joinsAfter)
+    {
+        before->length += 1 + after->length;
+        memmove(after, after + 1, (vol->numFreeExtents - low - 1) * sizeof(struct FreeExtent));
+        vol->numFreeExtents--;
+    }
+    else if(joinsBefore) before->length++;
+    else if(joinsAfter)
+    {
+        after->start--;
+        after->length++;
+    }
+    //Out of memory only costs the map this cluster until the volume is reopened
+    else if(!InsertFreeExtent(vol, low, clusterNum, 1)) return;
+    vol->freeClusters++;
+}
+
+bool Fat32FreeChain(struct Fat32Volume* vol, u_int32_t firstCluster)
+{
+    if(!Fat32Writable(vol))
+    {
+        errno = EROFS;
+        return false;
+    }
+    pthread_mutex_lock(&vol->writeLock);
+    bool built = BuildFreeExtents(vol);
+    u_int32_t walked = 0;
+    for(u_int32_t c = firstCluster; !Fat32IsEndOfChain(vol, c) && walked < vol->fatEntries; walked++)
+    {
+        u_int32_t next = vol->fat[c];
+        SetFatEntry(vol, c, 0);
+        if(built) ReleaseCluster(vol, c);
+        c = next;
+    }
+    pthread_mutex_unlock(&vol->writeLock);
+    return true;
+}
+
+/// @brief Writes a run of FAT sectors to every FAT copy. Called with writeLock held.
+/// The run is read back from the first copy so the reserved top bits of each entry, and entries past the last cluster, keep what is on disk.
+static bool WriteFatSectors(struct Fat32Volume* vol, unsigned char* buffer, u_int32_t firstSector, u_int32_t numSectors)
+{
+    size_t bytes = (size_t)numSectors * vol->sectorBytes;
+    if(!Fat32ReadAt(vol, buffer, bytes, Fat32FatOffset(vol, 0) + (u_int64_t)firstSector * vol->sectorBytes)) return false;
+
+    u_int32_t* entries = (u_int32_t*)buffer;
+    u_int64_t firstEntry = (u_int64_t)firstSector * vol->sectorBytes / 4;
+    for(u_int64_t i = 0; i < bytes / 4 && firstEntry + i < vol->fatEntries; i++)
+    {
+        entries[i] = (entries[i] & 0xF0000000) | vol->fat[firstEntry + i];
+    }
+
+    bool written = true;
+    for(uint copy = 0; copy < vol->bpb.BPB_NumFATs; copy++)
+    {
+        u_int64_t offset = Fat32FatOffset(vol, copy) + (u_int64_t)firstSector * vol->sectorBytes;
+        Trace(vol, FAT32_TRACE_WRITE, offset, bytes);
+        if(!WriteFully(vol->fd, buffer, bytes, offset)) written = false;
+    }
+    return written;
+}
+
+/// @brief Brings the FSInfo free count and next free hint up to date. Called with writeLock held.
+static bool WriteFsInfo(struct Fat32Volume* vol, unsigned char* buffer)
+{
+    u_int16_t fsInfoSector = vol->bpb.BPB_FSInfo;
+    if(fsInfoSector == 0 || fsInfoSector == 0xFFFF || fsInfoSector >= vol->bpb.BPB_RsvdSecCnt || !vol->freeMapBuilt) return true;
+
+    u_int64_t offset = vol->partitionOffset + (u_int64_t)fsInfoSector * vol->sectorBytes;
+    if(!Fat32ReadAt(vol, buffer, 512, offset)) return false;
+
+    u_int32_t leadSig, structSig;
+    memcpy(&leadSig, buffer, 4);
+    memcpy(&structSig, buffer + 484, 4);
+    if(leadSig != 0x41615252 || structSig != 0x61417272) return true;
+
+    u_int32_t nextFree = vol->numFreeExtents ? vol->freeExtents[0].start : 0xFFFFFFFF;
+    memcpy(buffer + 488, &vol->freeClusters, 4);
+    memcpy(buffer + 492, &nextFree, 4);
+    Trace(vol, FAT32_TRACE_WRITE, offset, 512);
+    return WriteFully(vol->fd, buffer, 512, offset);
+}
+
+bool Fat32Flush(struct Fat32Volume* vol)
+{
+    if(!Fat32Writable(vol)) return true;
+
+    pthread_mutex_lock(&vol->writeLock);
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    bool flushed = buffer != NULL;
+    bool changed = false;
+    u_int32_t fatSectors = vol->bpb.BPB_FATSz32;
+    u_int32_t runLimit = vol->maxExtentBytes / vol->sectorBytes;
+
+    //Neighbouring dirty sectors go out as one write per FAT copy
+    for(u_int32_t sector = 0; buffer != NULL && sector < fatSectors; )
+    {
+        if((vol->fatDirty[sector / 8] & (1 << (sector % 8))) == 0)
+        {
+            sector++;
+            continue;
+        }
+
+        u_int32_t runStart = sector;
+        while(sector < fatSectors && sector - runStart < runLimit && (vol->fatDirty[sector / 8] & (1 << (sector % 8))) != 0) sector++;
+        if(!WriteFatSectors(vol, buffer, runStart, sector - runStart))
+        {
+            flushed = false;
+            continue;
+        }
+        for(u_int32_t s = runStart; s < sector; s++) vol->fatDirty[s / 8] &= ~(1 << (s % 8));
+        changed = true;
+    }
+
+    if(changed && !WriteFsInfo(vol, buffer)) flushed = false;
+    Fat32PutBuffer(vol, buffer);
+    pthread_mutex_unlock(&vol->writeLock);
+    return flushed;
+}
+
+ssize_t Fat32PWrite(struct Fat32Volume* vol, u_int32_t firstCluster, const void* buffer, size_t count, u_int64_t offset)
+{
+    if(!Fat32Writable(vol))
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    //Walk the chain up to the cluster holding offset
+    u_int32_t currentCluster = firstCluster;
+    u_int64_t clusterStart = 0;
+    while(clusterStart + vol->clusterBytes <= offset && !Fat32IsEndOfChain(vol, currentCluster))
+    {
+        currentCluster = Fat32NextCluster(vol, currentCluster);
+        clusterStart += vol->clusterBytes;
+    }
+
+    size_t done = 0;
+    while(done < count)
+    {
+        if(Fat32IsEndOfChain(vol, currentCluster))
+        {
+            //The chain ends before the data does
+            if(done > 0) return done;
+            errno = ENOSPC;
+            return -1;
+        }
+
+        //Coalesce a run of consecutive clusters into one write
+        u_int32_t runStart = currentCluster;
+        u_int32_t runLength = 1;
+        u_int32_t next = Fat32NextCluster(vol, currentCluster);
+        u_int64_t wanted = (offset + count) - clusterStart;
+        while(next == runStart + runLength && (u_int64_t)(runLength + 1) * vol->clusterBytes <= vol->maxExtentBytes && (u_int64_t)runLength * vol->clusterBytes < wanted)
+        {
+            runLength++;
+            next = Fat32NextCluster(vol, next);
+        }
+
+        u_int64_t skip = (offset + done) - clusterStart;
+        u_int64_t runBytes = (u_int64_t)runLength * vol->clusterBytes - skip;
+        size_t chunk = runBytes < count - done ? (size_t)runBytes : count - done;
+        if(!Fat32WriteAt(vol, (const unsigned char*)buffer + done, chunk, Fat32ClusterOffset(vol, runStart) + skip))
+        {
+            if(done > 0) return done;
+            errno = EIO;
+            return -1;
+        }
+
+        done += chunk;
+        clusterStart += (u_int64_t)runLength * vol->clusterBytes;
+        currentCluster = next;
+    }
+    return done;
+}
+
+/// @brief Lays out a short directory entry in its on-disk form.
+static void EncodeDirectoryEntry(unsigned char* raw, const unsigned char shortName[11], const struct DirectoryEntry* dir)
+{
+    memcpy(raw, shortName, 11);
+    raw[11] = dir->DIR_Attr;
+    raw[12] = 0;
+    raw[13] = dir->DIR_CrtTimeTenth;
+    u_int16_t words[] = {dir->DIR_CrtTime, dir->DIR_CrtDate, dir->DIR_LstAccDate, dir->DIR_FstClusHI, dir->DIR_WrtTime, dir->DIR_WrtDate, dir->DIR_FstClusLO};
+    for(int i = 0; i < 7; i++)
+    {
+        raw[14 + i * 2] = words[i] & 0xFF;
+        raw[15 + i * 2] = words[i] >> 8;
+    }
+    for(int i = 0; i < 4; i++) raw[28 + i] = (dir->DIR_FileSize >> (i * 8)) & 0xFF;
+}
+
+/// @brief Maps one character of a long name onto the short name character set.
+static unsigned char ShortNameChar(unsigned char c, bool* needsLong, bool* lossy)
+{
+    if(c >= 0x80 || strchr("+,;=[]", c) != NULL)
+    {
+        *lossy = true;
+        return '_';
+    }
+    if(islower(c))
+    {
+        *needsLong = true;
+        return toupper(c);
+    }
+    return c;
+}
+
+/// @brief Builds the basis 8.3 name of a long name, in raw form.
+/// @param baseLength Set to the number of characters in the name part.
+/// @param needsLong Set when the short name alone cannot hold the name.
+/// @param lossy Set when characters were dropped or replaced, so the short name needs a numeric tail to tell it apart.
+static void ShortNameBasis(const char* name, unsigned char raw[11], uint* baseLength, bool* needsLong, bool* lossy)
+{
+    memset(raw, ' ', 11);
+    *needsLong = false;
+    *lossy = false;
+
+    //The extension follows the last period, unless that period leads the name
+    const char* dot = strrchr(name, '.');
+    if(dot == name) dot = NULL;
+
+    uint length = 0;
+    for(const char* c = name; *c && (dot == NULL || c < dot); c++)
+    {
+        //Spaces and periods have no place in a short name
+        if(*c == ' ' || *c == '.') *lossy = true;
+        else if(length == 8) *lossy = true;
+        else raw[length++] = ShortNameChar(*c, needsLong, lossy);
+    }
+    if(length == 0)
+    {
+        raw[length++] = '_';
+        *lossy = true;
+    }
+    *baseLength = length;
+
+    if(dot != NULL)
+    {
+        uint extLength = 0;
+        for(const char* c = dot + 1; *c; c++)
+        {
+            if(*c == ' ') *lossy = true;
+            else if(extLength == 3) *lossy = true;
+            else raw[8 + extLength++] = ShortNameChar(*c, needsLong, lossy);
+        }
+    }
+    if(*lossy) *needsLong = true;
+}
+
+/// @brief Hashes a key for a NameSet.
+static u_int32_t NameSetHash(const char* key)
+{
+    u_int32_t hash = 2166136261u;
+    for(const char* c = key; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool NameSetContains(const struct NameSet* set, const char* key)
+{
+    if(set->capacity == 0) return false;
+    for(u_int32_t i = NameSetHash(key) & (set->capacity - 1); set->slots[i] != 0; i = (i + 1) & (set->capacity - 1))
+    {
+        if(strcmp(set->pool + set->slots[i] - 1, key) == 0) return true;
+    }
+    return false;
+}
+
+/// @brief Adds a key to a NameSet, growing the table past half full.
+static bool NameSetAdd(struct NameSet* set, const char* key)
+{
+    if(NameSetContains(set, key)) return true;
+
+    size_t length = strlen(key) + 1;
+    if(set->poolUsed + length > set->poolSize)
+    {
+        size_t size = set->poolSize ? set->poolSize * 2 : 16384;
+        while(size < set->poolUsed + length) size *= 2;
+        char* grown = realloc(set->pool, size);
+        if(grown == NULL) return false;
+        set->pool = grown;
+        set->poolSize = size;
+    }
+
+    if((set->count + 1) * 2 > set->capacity)
+    {
+        u_int32_t capacity = set->capacity ? set->capacity * 2 : 1024;
+        u_int32_t* slots = calloc(capacity, sizeof(u_int32_t));
+        if(slots == NULL) return false;
+        for(u_int32_t i = 0; i < set->capacity; i++)
+        {
+            if(set->slots[i] == 0) continue;
+            u_int32_t j = NameSetHash(set->pool + set->slots[i] - 1) & (capacity - 1);
+            while(slots[j] != 0) j = (j + 1) & (capacity - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+
+    memcpy(set->pool + set->poolUsed, key, length);
+    u_int32_t i = NameSetHash(key) & (set->capacity - 1);
+    while(set->slots[i] != 0) i = (i + 1) & (set->capacity - 1);
+    set->slots[i] = set->poolUsed + 1;
+    set->poolUsed += length;
+    set->count++;
+    return true;
+}
+
+static void NameSetFree(struct NameSet* set)
+{
+    free(set->slots);
+    free(set->pool);
+    memset(set, 0, sizeof(struct NameSet));
+}
+
+/// @brief Adds the names a lookup could match an entry by: its long name and its short name with and without the period, lower cased.
+static bool DirectoryIndexAddNames(struct DirectoryIndex* index, const char* longName, const unsigned char rawShort[11])
+{
+    char shortName[13], key[256];
+    ShortNameFromRaw(shortName, rawShort);
+
+    int length = 0;
+    for(; longName[length]; length++) key[length] = tolower((unsigned char)longName[length]);
+    key[length] = '\0';
+    if(!NameSetAdd(&index->names, key)) return false;
+
+    for(length = 0; shortName[length]; length++) key[length] = tolower((unsigned char)shortName[length]);
+    key[length] = '\0';
+    if(!NameSetAdd(&index->names, key)) return false;
+
+    length = 0;
+    for(const char* c = shortName; *c; c++) if(*c != '.') key[length++] = tolower((unsigned char)*c);
+    key[length] = '\0';
+    if(!NameSetAdd(&index->names, key)) return false;
+
+    char raw[12];
+    memcpy(raw, rawShort, 11);
+    raw[11] = '\0';
+    return NameSetAdd(&index->shortNames, raw);
+}
+
+static void DirectoryIndexFree(struct DirectoryIndex* index)
+{
+    NameSetFree(&index->names);
+    NameSetFree(&index->shortNames);
+    free(index->chain);
+    memset(index, 0, sizeof(struct DirectoryIndex));
+}
+
+/// @brief Makes the volume's directory index describe dirCluster, reading the directory if it described another one. Called with writeLock held.
+static bool DirectoryIndexLoad(struct Fat32Volume* vol, u_int32_t dirCluster)
+{
+    struct DirectoryIndex* index = &vol->directoryIndex;
+    if(index->dirCluster == dirCluster) return true;
+    DirectoryIndexFree(index);
+
+    for(u_int32_t c = dirCluster; !Fat32IsEndOfChain(vol, c) && index->numClusters < vol->fatEntries; c = Fat32NextCluster(vol, c))
+    {
+        if(index->numClusters == index->maxClusters)
+        {
+            index->maxClusters = index->maxClusters ? index->maxClusters * 2 : 16;
+            u_int32_t* grown = realloc(index->chain, index->maxClusters * sizeof(u_int32_t));
+            if(grown == NULL) goto fail;
+            index->chain = grown;
+        }
+        index->chain[index->numClusters++] = c;
+    }
+    if(index->numClusters == 0)
+    {
+        errno = ENOTDIR;
+        goto fail;
+    }
+
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(vol, dirCluster, &dir)) goto nomem;
+    while(Fat32ReadDir(&dir, &entry))
+    {
+        unsigned char rawShort[11];
+        memcpy(rawShort, entry.dir.DIR_Name8, 8);
+        memcpy(rawShort + 8, entry.dir.DIR_Name3, 3);
+        if(!DirectoryIndexAddNames(index, entry.name, rawShort))
+        {
+            Fat32CloseDir(&dir);
+            goto nomem;
+        }
+    }
+
+    //New entries go at the end marker, or after the last cluster when the directory is full to the end of its chain.
+    //A directory only partly read has an unknown end, and writing at a guess could land on a live entry.
+    bool failed = dir.failed;
+    index->endSlot = dir.endSlot != UINT32_MAX ? dir.endSlot : index->numClusters * (vol->clusterBytes / 32);
+    Fat32CloseDir(&dir);
+    if(failed)
+    {
+        errno = EIO;
+        goto fail;
+    }
+
+    index->dirCluster = dirCluster;
+    return true;
+
+nomem:
+    errno = ENOMEM;
+fail:
+    {
+        int savedErrno = errno;
+        DirectoryIndexFree(index);
+        errno = savedErrno;
+    }
+    return false;
+}
+
+/// @brief Writes the tail ~n over a basis name.
+static void ApplyNumericTail(unsigned char raw[11], uint baseLength, u_int32_t tail)
+{
+    char digits[12];
+    int numDigits = snprintf(digits, sizeof(digits), "%u", tail);
+    uint prefix = baseLength < 7u - numDigits ? baseLength : 7u - numDigits;
+    memset(raw + prefix, ' ', 8 - prefix);
+    raw[prefix] = '~';
+    memcpy(raw + prefix + 1, digits, numDigits);
+}
+
+/// @brief Gives a lossy short name the first numeric tail no entry of the directory uses. Called with writeLock held.
+/// The search starts after the tail last handed out to the same basis, so a run of similar names does not probe every earlier tail.
+static void PickNumericTail(struct DirectoryIndex* index, unsigned char raw[11], uint baseLength)
+{
+    unsigned char basis[11];
+    memcpy(basis, raw, 11);
+
+    char key[13];
+    memcpy(key, basis, 11);
+    key[11] = '\0';
+    u_int32_t* hint = &index->tailHints[NameSetHash(key) % 64];
+
+    u_int32_t tail = *hint < 999999 ? *hint + 1 : 1;
+    for(;; tail = tail < 999999 ? tail + 1 : 1)
+    {
+        memcpy(raw, basis, 11);
+        ApplyNumericTail(raw, baseLength, tail);
+
+        //The tail has to be free as a short name, and must not spell out some other entry's long name either
+        memcpy(key, raw, 11);
+        key[11] = '\0';
+        if(NameSetContains(&index->shortNames, key)) continue;
+        ShortNameFromRaw(key, raw);
+        for(char* c = key; *c; c++) *c = tolower((unsigned char)*c);
+        if(!NameSetContains(&index->names, key)) break;
+    }
+    *hint = tail;
+}
+
+/// @brief Whether a name can be a long name at all.
+/// Names are ASCII only: each character goes into its UCS-2 slot as is, and the reader shows them back a byte apiece.
+static bool ValidLongName(const char* name)
+{
+    if(name[0] == '\0' || strlen(name) > 255 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return false;
+    for(const unsigned char* c = (const unsigned char*)name; *c; c++)
+    {
+        if(*c < 0x20 || *c >= 0x7F || strchr("\"*/:<>?\\|", *c) != NULL) return false;
+    }
+    return true;
+}
+
+bool Fat32CreateEntry(struct Fat32Volume* vol, u_int32_t dirCluster, const char* name, const struct DirectoryEntry* dir, struct Fat32Entry* entry)
+{
+    if(!Fat32Writable(vol))
+    {
+        errno = EROFS;
+        return false;
+    }
+
+    //Trailing periods and spaces are dropped, as Windows does
+    char longName[256];
+    size_t nameLength = strlen(name);
+    if(nameLength > 255)
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memcpy(longName, name, nameLength + 1);
+    while(nameLength > 0 && (longName[nameLength - 1] == '.' || longName[nameLength - 1] == ' ')) longName[--nameLength] = '\0';
+    if(!ValidLongName(longName))
+    {
+        errno = EINVAL;
+        return false;
+    }
+    if(dirCluster == 0) dirCluster = vol->bpb.BPB_RootClus;
+
+    pthread_mutex_lock(&vol->writeLock);
+    bool created = false;
+    struct DirectoryIndex* index = &vol->directoryIndex;
+    //Room for 20 long entries, the short entry and the end marker after them
+    unsigned char slots[22 * 32];
+    memset(slots, 0, sizeof(slots));
+    if(!DirectoryIndexLoad(vol, dirCluster)) goto done;
+
+    char key[256];
+    for(size_t i = 0; i <= nameLength; i++) key[i] = tolower((unsigned char)longName[i]);
+    if(NameSetContains(&index->names, key))
+    {
+        errno = EEXIST;
+        goto done;
+    }
+
+    unsigned char shortName[11];
+    uint baseLength;
+    bool needsLong, lossy;
+    ShortNameBasis(longName, shortName, &baseLength, &needsLong, &lossy);
+    if(lossy) PickNumericTail(index, shortName, baseLength);
+    uint numSlots = needsLong ? 1 + (nameLength + 12) / 13 : 1;
+
+    //New entries go after the last one in use rather than into the holes deleted entries left, which UNDELETE may still want
+    uint slotsPerCluster = vol->clusterBytes / 32;
+    uint totalSlots = index->numClusters * slotsPerCluster;
+    uint start = index->endSlot;
+    if(start + numSlots > MAX_DIRECTORY_SLOTS)
+    {
+        errno = ENOSPC;
+        goto done;
+    }
+    if(start + numSlots > totalSlots)
+    {
+        //Grow the directory by the clusters the entry still needs, zeroed so they read as free
+        uint extra = (start + numSlots - totalSlots + slotsPerCluster - 1) / slotsPerCluster;
+        u_int32_t* grown = realloc(index->chain, (index->numClusters + extra) * sizeof(u_int32_t));
+        if(grown == NULL)
+        {
+            errno = ENOMEM;
+            goto done;
+        }
+        index->chain = grown;
+        index->maxClusters = index->numClusters + extra;
+
+        u_int32_t added = AllocateLocked(vol, extra, index->chain[index->numClusters - 1]);
+        if(added == 0) goto done;
+        unsigned char* zeroes = Fat32AllocBuffer(vol, vol->clusterBytes);
+        if(zeroes == NULL)
+        {
+            errno = ENOMEM;
+            goto done;
+        }
+        memset(zeroes, 0, vol->clusterBytes);
+        bool zeroed = true;
+        for(u_int32_t c = added; !Fat32IsEndOfChain(vol, c); c = Fat32NextCluster(vol, c))
+        {
+            index->chain[index->numClusters++] = c;
+            if(!Fat32WriteAt(vol, zeroes, vol->clusterBytes, Fat32ClusterOffset(vol, c))) zeroed = false;
+        }
+        free(zeroes);
+        totalSlots = index->numClusters * slotsPerCluster;
+        if(!zeroed) goto done;
+    }
+
+    //Long entries come last to first, ahead of the short entry they belong to
+    u_int8_t checksum = Fat32ShortNameChecksum(shortName);
+    for(uint order = 1; order < numSlots; order++)
+    {
+        unsigned char* raw = &slots[(numSlots - 1 - order) * 32];
+        raw[0] = order | (order == numSlots - 1 ? LAST_LONG_ENTRY : 0);
+        raw[11] = ATTR_LONG_NAME;
+        raw[13] = checksum;
+        for(int c = 0; c < 13; c++)
+        {
+            uint charIndex = (order - 1) * 13 + c;
+            //ValidLongName let through ASCII only, so every character is its own UCS-2 code unit
+            unsigned char low = charIndex < nameLength ? (unsigned char)longName[charIndex] : charIndex == nameLength ? 0x00 : 0xFF;
+            unsigned char high = charIndex <= nameLength ? 0x00 : 0xFF;
+            raw[LDIR_CHAR_OFFSETS[c]] = low;
+            raw[LDIR_CHAR_OFFSETS[c] + 1] = high;
+        }
+    }
+    EncodeDirectoryEntry(&slots[(numSlots - 1) * 32], shortName, dir);
+
+    //The slot after the new entry is rewritten as the end marker, in case the free tail held anything but zeroes.
+    //Whatever lands in one directory cluster goes out in one write.
+    uint writeSlots = start + numSlots < totalSlots ? numSlots + 1 : numSlots;
+    for(uint s = 0; s < writeSlots; )
+    {
+        uint slotIndex = start + s;
+        uint inCluster = slotsPerCluster - slotIndex % slotsPerCluster;
+        if(inCluster > writeSlots - s) inCluster = writeSlots - s;
+        u_int64_t offset = Fat32ClusterOffset(vol, index->chain[slotIndex / slotsPerCluster]) + (u_int64_t)(slotIndex % slotsPerCluster) * 32;
+        if(!Fat32WriteAt(vol, &slots[s * 32], inCluster * 32, offset))
+        {
+            //What made it to disk is unknown, so the index is read again next time
+            DirectoryIndexFree(index);
+            goto done;
+        }
+        s += inCluster;
+    }
+
+    index->endSlot = start + numSlots;
+    __atomic_add_fetch(&vol->generation, 1, __ATOMIC_RELAXED);
+    if(!DirectoryIndexAddNames(index, longName, shortName)) DirectoryIndexFree(index);
+
+    PackDirectoryEntry(&entry->dir, slots, (numSlots - 1) * 32);
+    ShortNameFromRaw(entry->shortName, shortName);
+    entry->hasLongName = needsLong;
+    strcpy(entry->name, needsLong ? longName : entry->shortName);
+    entry->firstCluster = entry->dir.DIR_FstClusLO | ((u_int32_t)entry->dir.DIR_FstClusHI << 16);
+    created = true;
+
+done:
+    {
+        int savedErrno = errno;
+        pthread_mutex_unlock(&vol->writeLock);
+        errno = savedErrno;
+    }
+    return created;
+}
+
+bool Fat32MakeDirectory(struct Fat32Volume* vol, u_int32_t parentCluster, const char* name, const struct DirectoryEntry* dir, struct Fat32Entry* entry)
+{
+    if(parentCluster == 0) parentCluster = vol->bpb.BPB_RootClus;
+    u_int32_t cluster = Fat32AllocateChain(vol, 1);
+    if(cluster == 0) return false;
+
+    struct DirectoryEntry self = *dir;
+    self.DIR_Attr |= ATTR_DIRECTORY;
+    self.DIR_FileSize = 0;
+    self.DIR_FstClusLO = cluster & 0xFFFF;
+    self.DIR_FstClusHI = cluster >> 16;
+
+    //"." points at the directory itself and ".." at its parent, with 0 standing for the root
+    struct DirectoryEntry parent = self;
+    u_int32_t parentRef = parentCluster == vol->bpb.BPB_RootClus ? 0 : parentCluster;
+    parent.DIR_FstClusLO = parentRef & 0xFFFF;
+    parent.DIR_FstClusHI = parentRef >> 16;
+
+    unsigned char* bytes = Fat32AllocBuffer(vol, vol->clusterBytes);
+    bool made = bytes != NULL;
+    if(made)
+    {
+        memset(bytes, 0, vol->clusterBytes);
+        EncodeDirectoryEntry(bytes, (const unsigned char*)".          ", &self);
+        EncodeDirectoryEntry(bytes + 32, (const unsigned char*)"..         ", &parent);
+        made = Fat32WriteAt(vol, bytes, vol->clusterBytes, Fat32ClusterOffset(vol, cluster)) && Fat32CreateEntry(vol, parentCluster, name, &self, entry);
+    }
+    else errno = ENOMEM;
+
+    if(!made)
+    {
+        int savedErrno = errno;
+        Fat32FreeChain(vol, cluster);
+        errno = savedErrno;
+    }
+    free(bytes);
+    return made;
+}
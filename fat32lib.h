@@ -0,0 +1,496 @@
+
+/******************/
+/*Fat32lib.h      */
+/******************/
+
+/*
+This header file is the public face of libfat32, the part of the reader that
+knows how to get bytes out of a FAT32 image. All of the state of an open image
+lives in a Fat32Volume handle instead of in globals, so one process can open
+as many images as it likes and read from them on as many threads as it likes.
+
+Every read operation here is safe to call concurrently on the same handle:
+image reads go through pread, the FAT is loaded once when the volume is opened
+and only changes through the write calls, and the shared caches carry their
+own locks. A Fat32Dir iterator belongs to the thread that opened it.
+
+Volumes opened with FAT32_OPEN_WRITE can also be written to. Allocation and
+directory changes are serialized by a per-volume lock; reads do not wait for
+it, so a file should not be read while it is being written. FAT changes are
+made to the in-memory copy and only marked dirty, and Fat32Flush (or
+Fat32Close) writes the dirty sectors out to every FAT copy, neighbouring
+sectors together, along with the FSInfo free count.
+
+The FAT is normally held as a flat array of 32 bit entries, which for a 2TB
+volume is up to a gigabyte. A read-only volume can instead hold it compact:
+sorted runs of entries, where a run is either a stretch of clusters that each
+link to the next one or a stretch that all hold the same value, such as a free
+range. Chains laid out contiguously cost one run plus one for their end, so
+the FAT shrinks to a few bytes per fragment, and an entry is found by binary
+search over the runs. FAT32_OPEN_COMPACT_FAT asks for it outright, and
+Fat32OpenWithBudget picks it when the flat FAT would not fit the budget.
+
+Build the library and the reader with
+    gcc -c fat32lib.c && ar rcs libfat32.a fat32lib.o
+    gcc fat32.c -o fat32 -L. -lfat32 -lpthread -lm
+*/
+
+#ifndef FAT32LIB_H
+#define FAT32LIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define ATTR_READ_ONLY 0x01
+#define ATTR_HIDDEN 0x02
+#define ATTR_SYSTEM 0x04
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LONG_NAME 0x0F
+
+#define LAST_LONG_ENTRY 0x40
+
+//Fat32OpenWithFlags flags
+#define FAT32_OPEN_DIRECT 0x01 //Read the image with O_DIRECT so bulk reads bypass the page cache
+#define FAT32_OPEN_WRITE 0x02 //Open the image read-write so files can be added to it
+#define FAT32_OPEN_COMPACT_FAT 0x04 //Hold the FAT as runs rather than a flat array. Opening fails with EROFS alongside FAT32_OPEN_WRITE
+
+#define FAT32_MAX_PARTITIONS 128 //Most partitions Fat32ListPartitions reports for one image
+
+//Access traces. See Fat32TraceOpen
+#define FAT32_TRACE_MAGIC "F32TRACE"
+#define FAT32_TRACE_VERSION 1
+#define FAT32_TRACE_CONTEXT_BYTES 32 //Longest context name, terminator included
+
+//Fat32TraceRecord kinds
+#define FAT32_TRACE_META 0 //Boot sectors, read while a volume is opened
+#define FAT32_TRACE_FAT_LOAD 1 //The FAT, read whole into memory when a volume is opened
+#define FAT32_TRACE_FAT 2 //Any other read of FAT sectors: FAT copies for CHECK, sectors rewritten by a flush
+#define FAT32_TRACE_FAT_LOOKUP 3 //A FAT sector whose entries were looked up in the in-memory FAT. Repeats within one sector are one record
+#define FAT32_TRACE_CLUSTER 4 //A cluster asked of the cluster cache, directory clusters mostly, whether or not the cache had it
+#define FAT32_TRACE_DATA 5 //File contents and other raw reads of the data region
+#define FAT32_TRACE_WRITE 6 //Anything written to the image
+#define FAT32_TRACE_IMAGE_NAME 0x80 //Names image id offset; length bytes of path follow the record
+#define FAT32_TRACE_CONTEXT_NAME 0x81 //Names context id offset; length bytes of name follow the record
+
+//On-disk layouts are packed; anything declared after the matching pop keeps its natural alignment
+#pragma pack(push,1)
+
+struct Partition
+{
+    unsigned char bootFlag;
+    unsigned char chsBegin[3];
+    unsigned char typeCode;
+    unsigned char chsEnd[3];
+    u_int32_t lbaBegin;
+    u_int32_t numberOfSectors;
+};
+
+struct MasterBootRecord
+{
+    unsigned char bootCode[446]; //Ignore
+    struct Partition partition1;
+    struct Partition partition2;
+    struct Partition partition3;
+    struct Partition partition4;
+    u_int16_t mbrPattern;
+};
+
+//Refer to document page 23
+/// @brief This represents the byte layout of a standard Directory Entry in FAT32.
+struct DirectoryEntry
+{
+    /* data */
+    unsigned char DIR_Name8[9]; //8 filename.
+    unsigned char DIR_Name3[4]; //3 filename.
+
+    u_int8_t DIR_Attr; //What is this directory.
+
+    u_int8_t DIR_NTRes; //Unused for the purposes of this project.
+
+    u_int8_t DIR_CrtTimeTenth; //Millisecond stamp at file creation time.
+
+    u_int16_t DIR_CrtTime; //Time file was created.
+
+    u_int16_t DIR_CrtDate; //Data file was created.
+
+    u_int16_t DIR_LstAccDate; //Last access date.
+
+    u_int16_t DIR_FstClusHI; //High word of the entry's first cluster number.
+
+    u_int16_t DIR_WrtTime; //Time of last write.
+
+    u_int16_t DIR_WrtDate; //Date of last write.
+
+    u_int16_t DIR_FstClusLO; //Low word of this entry's first cluster number.
+
+    u_int32_t DIR_FileSize; //32-Bit DWORD holding this file's size in bytes.
+};
+
+/// @brief  This represents the byte layout of a Long Directory Entry in FAT32.
+struct LongDirectoryEntry
+{
+    u_int8_t LDIR_Ord; //Order of this entry in the sequence of long dir entries associated with the short dir entry at the end of the long dir set.
+
+    unsigned char LDIR_Name1[6]; //Characters 1-5 of the long-name sub-component in this dir entry.
+
+    u_int8_t LDIR_Attr; //Attributes - must be ATTR_LONG_NAME.
+
+    u_int8_t LDIR_Type; //If zero, indicates a directory entry that is a sub-component of a long name.
+
+    u_int8_t LDIR_Chksum; //Checksum of name in the short dir entry at the end of the long dir set.
+
+    unsigned char LDIR_Name2[7]; //Characters 6-11 of the long-name sub-component in this dir entry.
+
+    u_int16_t LDIR_FstClusLO; //Must be ZERO. Meaningless in context of a long dir entry.
+
+    unsigned char LDIR_Name3[3]; //Characters 12-13 of the long-name sub-component in this dir entry.
+};
+
+/// @brief This struct contains the bit formations which represent the date in FAT32 format.
+struct DateFormat
+{
+    u_int8_t dayOfMonth : 5; //Max value = 31 //Bits 0-4
+    u_int8_t monthOfYear : 4; //Max value = 12 //Bits 5-8
+    u_int8_t yearsSince1980 : 7; //Max value = 127 //Bits 9-15
+};
+
+/// @brief This struct contains the bit formations which represent the time in FAT32 format.
+struct TimeFormat
+{
+    u_int8_t secondCount : 5; //Max value = 29 (58 seconds) //Bits 0-4
+    u_int8_t minuteCount : 6; //Max value = 59 (minutes) //Bits 5-10
+    u_int8_t hoursCount : 5; //Max value = 23 (hours) //Bits 11-15
+};
+
+
+struct BPBStruct
+{
+    unsigned char BS_jmpBoot[4]; // Jump instruction to boot code
+    unsigned char BS_OEMNane[9]; // 8-Character string (not null terminated)
+    unsigned short BPB_BytsPerSec; // Had BETTER be 512!
+    unsigned char BPB_SecPerClus; // How many sectors make up a cluster?
+    unsigned short BPB_RsvdSecCnt; // # of reserved sectors at the beginning (including the BPB)?
+    unsigned char BPB_NumFATs; // How many copies of the FAT are there? (had better be 2)
+    unsigned short BPB_RootEntCnt; // ZERO for FAT32
+    unsigned short BPB_TotSec16; // ZERO for FAT32
+    unsigned char BPB_Media; // SHOULD be 0xF8 for "fixed", but isn't critical for us
+    unsigned short BPB_FATSz16; // ZERO for FAT32
+    unsigned short BPB_SecPerTrk; // Don't care; we're using LBA; no CHS
+    unsigned short BPB_NumHeads; // Don't care; we're using LBA; no CHS
+    unsigned int BPB_HiddSec; // Don't care ?
+    unsigned int BPB_TotSec32; // Total Number of Sectors on the volume
+    unsigned int BPB_FATSz32; // How many sectors long is ONE Copy of the FAT?
+    unsigned short BPB_Flags; // Flags (see document)
+    unsigned short BPB_FSVer; // Version of the File System
+    unsigned int BPB_RootClus; // Cluster number where the root directory starts (should be 2)
+    unsigned short BPB_FSInfo; // What sector is the FSINFO struct located in? Usually 1
+    unsigned short BPB_BkBootSec; // REALLY should be 6 – (sector # of the boot record backup)
+    unsigned char BPB_Reserved[13]; // Should be all zeroes -- reserved for future use
+    unsigned char BS_DrvNum; // Drive number for int 13 access (ignore)
+    unsigned char BS_Reserved1; // Reserved (should be 0)
+    unsigned char BS_BootSig; // Boot Signature (must be 0x29)
+    unsigned char BS_VolID[5]; // Volume ID
+    unsigned char BS_VolLab[12]; // Volume Label
+    unsigned char BS_FilSysType[9]; // Must be "FAT32 "
+    unsigned char unused[421]; // Not used
+    unsigned char signature[3]; // MUST BE 0x55 AA
+};
+
+/// @brief Starts every trace file. Traces are written in the byte order of the machine that recorded them.
+struct Fat32TraceHeader
+{
+    char magic[8]; //FAT32_TRACE_MAGIC, with no terminator
+    u_int32_t version;
+    u_int32_t recordBytes; //sizeof(struct Fat32TraceRecord)
+};
+
+/// @brief One access in a trace file.
+struct Fat32TraceRecord
+{
+    u_int64_t offset; //Byte offset in the image, or the id a name record names
+    u_int64_t time; //Nanoseconds since the trace was opened
+    u_int32_t length; //Bytes accessed, or the length of the name after a name record
+    u_int16_t image; //Images are numbered in the order they were first traced
+    u_int8_t kind;
+    u_int8_t context; //What the thread was doing, from Fat32TraceContext. 0 when it never said
+};
+
+#pragma pack(pop)
+
+/// @brief One decoded directory entry, with its long name already assembled.
+struct Fat32Entry
+{
+    struct DirectoryEntry dir;
+    char name[256]; //Long name if there is one, otherwise the 8.3 name with a period.
+    char shortName[13]; //8.3 name with a period, spaces trimmed.
+    bool hasLongName; //Whether name came from long directory entries.
+    u_int32_t firstCluster; //Zero for empty files and for ".." entries that point at the root.
+};
+
+/// @brief One partition of an image, as its partition table describes it.
+struct Fat32PartitionInfo
+{
+    uint number; //MBR primary slots are 1 to 4 and logical partitions 5 up; GPT entries count from 1 in table order
+    u_int64_t firstLba;
+    u_int64_t numLbas;
+    u_int32_t lbaBytes; //Known for GPT, whose header sits at LBA 1. 0 for MBR, where opening the partition works it out
+    u_int8_t mbrType; //0 for GPT partitions
+    bool gpt;
+    char name[37]; //GPT partition name, with anything outside ASCII as '?'. Empty for MBR
+};
+
+/// @brief A run of consecutive clusters in a file's chain.
+struct Fat32Extent
+{
+    u_int64_t offset; //Byte offset in the file where the run starts
+    u_int32_t cluster; //First cluster of the run
+    u_int32_t length; //Clusters in the run
+};
+
+/// @brief A file's chain as runs of consecutive clusters, so any offset maps to a cluster by binary search.
+/// Maps are shared and must be treated as read only.
+struct Fat32ExtentMap
+{
+    u_int32_t firstCluster;
+    u_int64_t generation; //Fat32Generation when the chain was walked
+    u_int32_t numExtents;
+    struct Fat32Extent* extents; //In file order, with offsets rising
+    u_int64_t chainBytes; //Every cluster of the chain, in bytes
+    bool broken; //The chain looped, or ran into a cluster past the end of the volume
+    u_int32_t refs; //Owned by the library
+};
+
+/// @brief An open image. The layout is private to the library.
+struct Fat32Volume;
+
+/// @brief Directory iterator state, in the spirit of opendir/readdir.
+/// Only one cluster of the directory is held at a time, however long the directory is,
+/// so a caller that stops early never reads the rest of the chain.
+struct Fat32Dir
+{
+    struct Fat32Volume* vol;
+    u_int32_t currentCluster; //Cluster held in bytes
+    u_int32_t clustersWalked; //Guards against looping chains
+    unsigned char* bytes;
+    u_int32_t index; //Byte offset of the next slot in bytes
+    bool finished;
+    bool failed; //A cluster could not be read or the chain looped, so finished is not the end of the directory
+    u_int32_t endSlot; //Slot of the end marker, counted from the start of the directory, or UINT32_MAX until it is seen
+    unsigned char longSlots[20 * 32]; //Raw long name entries seen since the last short entry, by order
+    u_int32_t longMask; //Which of longSlots hold an entry
+    u_int8_t longOrder; //Number of entries in the long name being collected
+    int longChecksum; //-1 while no long name is being collected
+};
+
+//Decoding helpers for the on-disk structures
+int OffsetCopier(unsigned char* dest, unsigned char* src, int srcSize, int forOffset, int destOffset, int iterator);
+void PackPartition(struct Partition* part, unsigned char bytes[16]);
+void PackMBR(struct MasterBootRecord* mbr, unsigned char sector[512]);
+void PackBPB(struct BPBStruct* bpb, unsigned char bytes[512]);
+void PackDirectoryEntry(struct DirectoryEntry* directory, unsigned char* cluster, int offset);
+void PackLongDirectoryEntry(struct LongDirectoryEntry* directory, unsigned char* cluster, int offset);
+void PackTime(struct TimeFormat* time, u_int16_t bitPackage);
+void PackDate(struct DateFormat* date, u_int16_t bitPackage);
+bool isLongFileDirectory(unsigned char directoryEntry[32]);
+u_int8_t Fat32ShortNameChecksum(const unsigned char* raw);
+
+/// @brief Checks that a boot sector describes a FAT32 layout the reader can handle: 512 to 4096 byte sectors,
+/// power of two clusters of at most 256K, and FAT32 style root and FAT size fields.
+bool Fat32ValidGeometry(const struct BPBStruct* bpb);
+
+/// @brief Reads an image's partition table: the four MBR slots and any logical partitions in an extended one, or every GPT entry
+/// when the MBR is a protective one.
+/// @param parts Room for maxParts partitions, filled in number order.
+/// @return The number of partitions, 0 when the image has no partition table, or -1 with errno set.
+int Fat32ListPartitions(const char* imagePath, struct Fat32PartitionInfo* parts, int maxParts);
+
+/// @brief Opens an image and mounts its first FAT32 partition.
+/// Sector size, cluster size and every offset come from the boot sector, so 4K sector images work as well as 512 byte ones.
+/// @return The volume handle, or NULL with errno set. EINVAL means the partition is not FAT32.
+struct Fat32Volume* Fat32Open(const char* imagePath);
+
+/// @brief Opens an image like Fat32Open, with FAT32_OPEN_* flags.
+/// FAT32_OPEN_DIRECT falls back to buffered reads, with the page cache dropped behind them, when the filesystem refuses O_DIRECT.
+struct Fat32Volume* Fat32OpenWithFlags(const char* imagePath, int flags);
+
+/// @brief Opens an image like Fat32OpenWithFlags, keeping the in-memory FAT within fatBudget bytes.
+/// A flat FAT that would not fit is held compact instead; a budget of 0 means no limit.
+/// @return The volume handle, or NULL with errno set. ENOMEM means even the compact FAT would not fit,
+/// or that the volume is writable, which needs the flat FAT.
+struct Fat32Volume* Fat32OpenWithBudget(const char* imagePath, int flags, u_int64_t fatBudget);
+
+/// @brief Opens one partition of an image, numbered as Fat32ListPartitions numbers them.
+/// Number 0 is the first one listed that mounts as FAT32; partitions holding anything else are passed over.
+/// Each partition gets its own handle, with its own BPB, FAT and caches, so any number of them can be open at once.
+/// @return The volume handle, or NULL with errno set. ENOENT means there is no such partition, EINVAL that it is not FAT32.
+struct Fat32Volume* Fat32OpenPartition(const char* imagePath, uint partition, int flags, u_int64_t fatBudget);
+
+/// @brief The number of the partition the volume was opened on.
+uint Fat32PartitionNumber(struct Fat32Volume* vol);
+
+/// @brief The bytes the in-memory FAT takes, and whether it is held compact.
+u_int64_t Fat32FatMemory(struct Fat32Volume* vol, bool* compact);
+
+/// @brief Whether the volume was opened with FAT32_OPEN_DIRECT.
+bool Fat32DirectIO(struct Fat32Volume* vol);
+
+/// @brief Whether the volume was opened with FAT32_OPEN_WRITE.
+bool Fat32Writable(struct Fat32Volume* vol);
+
+/// @brief Counts the changes made to the volume through the write calls. Anything worked out from the tree is still true while this stays the same.
+u_int64_t Fat32Generation(struct Fat32Volume* vol);
+
+/// @brief Closes the image and frees the handle and its caches.
+void Fat32Close(struct Fat32Volume* vol);
+
+const char* Fat32ImagePath(struct Fat32Volume* vol);
+const struct MasterBootRecord* Fat32GetMBR(struct Fat32Volume* vol);
+const struct BPBStruct* Fat32GetBPB(struct Fat32Volume* vol);
+u_int32_t Fat32RootCluster(struct Fat32Volume* vol);
+u_int32_t Fat32SectorBytes(struct Fat32Volume* vol);
+u_int32_t Fat32ClusterBytes(struct Fat32Volume* vol);
+
+/// @brief The largest read the library issues in one go. Scales with the cluster size.
+u_int32_t Fat32PreferredReadBytes(struct Fat32Volume* vol);
+
+/// @brief Allocates a buffer aligned for direct I/O (the sector size, and at least 4K). Release it with free.
+/// @param size Bytes wanted, or 0 for one sector.
+void* Fat32AllocBuffer(struct Fat32Volume* vol, size_t size);
+
+/// @brief Takes an aligned buffer of at least Fat32PreferredReadBytes from the volume's pool, allocating one if the pool is empty.
+void* Fat32GetBuffer(struct Fat32Volume* vol);
+
+/// @brief Returns a buffer from Fat32GetBuffer to the pool.
+void Fat32PutBuffer(struct Fat32Volume* vol, void* buffer);
+
+/// @brief The number of FAT entries that map to real clusters, including the two reserved ones.
+u_int32_t Fat32ClusterCount(struct Fat32Volume* vol);
+
+/// @brief Returns the byte offset of the partition's boot sector in the image.
+u_int64_t Fat32PartitionOffset(struct Fat32Volume* vol);
+
+/// @brief Returns the byte offset of a FAT copy in the image. Copy 0 is the one the library reads.
+u_int64_t Fat32FatOffset(struct Fat32Volume* vol, uint copy);
+
+/// @brief Returns the byte offset of a data cluster in the image.
+u_int64_t Fat32ClusterOffset(struct Fat32Volume* vol, u_int32_t clusterNum);
+
+/// @brief Returns the FAT entry following clusterNum, or an end of chain marker when clusterNum is out of range.
+u_int32_t Fat32NextCluster(struct Fat32Volume* vol, u_int32_t clusterNum);
+
+/// @brief Whether a FAT value ends a chain. Free and bad entries also end it, since following them would walk into unrelated data.
+bool Fat32IsEndOfChain(struct Fat32Volume* vol, u_int32_t value);
+
+/// @brief Reads raw bytes from the image.
+/// @return Whether every byte was read.
+bool Fat32ReadAt(struct Fat32Volume* vol, void* buffer, size_t count, u_int64_t offset);
+
+/// @brief Copies a cluster into dest, going through the volume's cluster cache.
+/// @return Whether the cluster could be read.
+bool Fat32ReadCluster(struct Fat32Volume* vol, u_int32_t clusterNum, unsigned char* dest);
+
+/// @brief Starts iterating the directory whose chain begins at dirCluster.
+/// @return Whether the iterator could be set up.
+bool Fat32OpenDir(struct Fat32Volume* vol, u_int32_t dirCluster, struct Fat32Dir* dir);
+
+/// @brief Returns the next live entry of the directory, in on-disk order.
+/// @return False once the directory is exhausted or could not be read.
+bool Fat32ReadDir(struct Fat32Dir* dir, struct Fat32Entry* entry);
+
+/// @brief Fat32ReadDir with a prefilter. accept sees the raw 32 byte short entry before its long name is
+/// decoded or the entry unpacked, and entries it turns down are skipped without either.
+bool Fat32ReadDirFiltered(struct Fat32Dir* dir, struct Fat32Entry* entry, bool (*accept)(const unsigned char* raw, void* context), void* context);
+
+void Fat32CloseDir(struct Fat32Dir* dir);
+
+/// @brief Compares a name against an entry. Long names and short names both match, short names with or without their period.
+bool Fat32NameMatches(struct Fat32Entry* entry, const char* name);
+
+/// @brief Finds one name in a directory, consulting the shared lookup cache first.
+/// The directory is streamed and the scan stops at the first match.
+bool Fat32Lookup(struct Fat32Volume* vol, u_int32_t dirCluster, const char* name, struct Fat32Entry* entry);
+
+/// @brief Resolves a '/' separated path. Paths starting with '/' begin at the root, others at dirCluster.
+/// @return Whether every component was found. entry describes the last one.
+bool Fat32Stat(struct Fat32Volume* vol, u_int32_t dirCluster, const char* path, struct Fat32Entry* entry);
+
+/// @brief Takes the extent map of the chain starting at firstCluster. Maps are cached per volume, keyed by first cluster,
+/// so only the first call for a file walks its chain. A cached map is rebuilt once the FAT has changed.
+/// @return The map, to be handed back with Fat32PutExtentMap, or NULL with errno set.
+const struct Fat32ExtentMap* Fat32GetExtentMap(struct Fat32Volume* vol, u_int32_t firstCluster);
+
+/// @brief Hands back a map from Fat32GetExtentMap.
+void Fat32PutExtentMap(struct Fat32Volume* vol, const struct Fat32ExtentMap* map);
+
+/// @brief Finds the extent holding a byte offset of the file.
+/// @return The index of the extent, or numExtents when the chain ends before offset.
+u_int32_t Fat32FindExtent(const struct Fat32ExtentMap* map, u_int64_t offset);
+
+/// @brief Reads up to count bytes of a file starting at offset.
+/// The cluster holding offset is found through the file's extent map, so seeking costs O(log fragments), not a walk of the chain.
+/// @return The number of bytes read, 0 at end of file, or -1 with errno set.
+ssize_t Fat32PRead(struct Fat32Volume* vol, const struct Fat32Entry* entry, void* buffer, size_t count, u_int64_t offset);
+
+/// @brief Starts reading a stretch of a file into the page cache in the background, so that later reads of it do not wait.
+/// The file's extent map is built and cached too. Volumes opened for direct I/O only get the map.
+void Fat32Prefetch(struct Fat32Volume* vol, const struct Fat32Entry* entry, u_int64_t offset, u_int64_t count);
+
+/// @brief Writes up to count bytes of a file starting at offset to a file descriptor.
+/// Pipes are fed with splice and sockets with sendfile straight from the image, so the data never passes through user space.
+/// Anything else, or a kernel that refuses either call, gets buffered reads and writes. The image's own O_DIRECT handle is not used.
+/// @return The number of bytes written, 0 at end of file, or -1 with errno set.
+ssize_t Fat32SendFile(struct Fat32Volume* vol, const struct Fat32Entry* entry, int outFd, u_int64_t offset, u_int64_t count);
+
+//Writing. Every call here fails with EROFS unless the volume was opened with FAT32_OPEN_WRITE.
+
+/// @brief Writes raw bytes to the image, dropping any cached copy of the clusters they land in.
+/// @return Whether every byte was written.
+bool Fat32WriteAt(struct Fat32Volume* vol, const void* buffer, size_t count, u_int64_t offset);
+
+/// @brief Allocates a chain of count clusters from the free extent map, which is built from the FAT on first use.
+/// The chain is one contiguous run whenever a free run is long enough for it. Only the in-memory FAT changes until Fat32Flush.
+/// @return The first cluster of the chain, or 0 with errno set. ENOSPC means the volume is too full.
+u_int32_t Fat32AllocateChain(struct Fat32Volume* vol, u_int32_t count);
+
+/// @brief Frees every cluster of a chain, giving them back to the free extent map.
+bool Fat32FreeChain(struct Fat32Volume* vol, u_int32_t firstCluster);
+
+/// @brief Writes count bytes at offset into a file whose chain starts at firstCluster, in runs of consecutive clusters.
+/// The chain must already be long enough; the file size in its directory entry is left alone.
+/// @return The number of bytes written, or -1 with errno set. ENOSPC means the chain ended first.
+ssize_t Fat32PWrite(struct Fat32Volume* vol, u_int32_t firstCluster, const void* buffer, size_t count, u_int64_t offset);
+
+/// @brief Adds an entry to a directory: long name entries when the name needs them, and a short entry with a generated 8.3 name.
+/// The attributes, times, first cluster and size come from dir; its name fields are ignored. The directory grows by a cluster when it is full.
+/// @param entry Filled in with the entry as it was written.
+/// @return Whether the entry was written. errno is EEXIST when the name is taken, EINVAL when it is not a valid name
+/// (names outside ASCII included), and EIO when the directory could not be read to its end.
+bool Fat32CreateEntry(struct Fat32Volume* vol, u_int32_t dirCluster, const char* name, const struct DirectoryEntry* dir, struct Fat32Entry* entry);
+
+/// @brief Creates an empty directory with its "." and ".." entries. Times and attributes come from dir.
+bool Fat32MakeDirectory(struct Fat32Volume* vol, u_int32_t parentCluster, const char* name, const struct DirectoryEntry* dir, struct Fat32Entry* entry);
+
+/// @brief Writes the dirty sectors of the in-memory FAT to every FAT copy and updates FSInfo.
+/// @return Whether everything was written.
+bool Fat32Flush(struct Fat32Volume* vol);
+
+//Tracing. One trace covers the whole process, since the volumes a command touches come and go underneath it.
+//While it is open, every access the library makes to any image is appended to it as a Fat32TraceRecord:
+//each read and write, each cluster asked of the cluster cache and each FAT sector looked up, with its time
+//and the context of the thread that made it. Image and context ids are named by a name record the first time
+//they appear. Records cost a lock and a buffered write each, so leave tracing off when measuring speed.
+
+/// @brief Starts recording every image access of the process to a new trace file at path, ending any trace already open.
+/// @return Whether the file could be created, with errno set if not.
+bool Fat32TraceOpen(const char* path);
+
+/// @brief Names what the calling thread does from now on, such as the command it runs. Names are upper cased and cut to fit.
+void Fat32TraceContext(const char* name);
+
+/// @brief Ends the trace, writing out what is still buffered. Takes no arguments so it can be handed to atexit.
+void Fat32TraceClose(void);
+
+#endif
@@ -0,0 +1,400 @@
+
+/******************/
+/*Find.h          */
+/******************/
+
+/*
+This header file holds the FIND command, which searches a whole volume for
+names matching a glob or a regular expression.
+
+    FIND <pattern> [--regex] [--size [+|-]n[K|M|G]] [--after YYYY-MM-DD] [--before YYYY-MM-DD] [--threads n]
+
+The pattern is matched case-insensitively against each entry's long name, or
+its 8.3 name when it has none. --size keeps files larger (+), smaller (-) or
+exactly n bytes, and --after/--before compare against the last write date.
+Matches are printed as full paths from the root as soon as they are found,
+so their order depends on how the threads get scheduled.
+
+Directories are handed out to a pool of threads, each of which streams its
+directory through Fat32ReadDirFiltered. The prefilter looks at the raw short
+entry only: sizes and dates come straight from its bytes, and a glob ending
+in a literal extension such as *.evtx rules out every short entry whose 8.3
+extension does not start the same way. Long names are only decoded for the
+entries that survive.
+*/
+
+#ifndef FIND_H
+#define FIND_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define FIND_MAX_THREADS 16
+
+/// @brief A directory waiting to be searched.
+struct FindJob
+{
+    u_int32_t cluster;
+    char* path; //Full path of the directory, without a trailing '/'
+    struct FindJob* next;
+};
+
+/// @brief Everything the search threads share.
+struct FindSearch
+{
+    struct Fat32Volume* vol;
+
+    //What to match
+    char* pattern;
+    bool isRegex;
+    regex_t regex;
+    char shortExtension[4]; //8.3 extension every match must have, space padded, or empty when the pattern does not pin one down
+
+    //Filters applied to files, straight from the raw entry
+    bool hasMinSize, hasMaxSize;
+    u_int32_t minSize, maxSize;
+    bool hasAfter, hasBefore;
+    u_int16_t afterDate, beforeDate; //FAT packed dates, which sort the same way the dates do
+
+    //Work queue
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct FindJob* jobs;
+    uint busy; //Threads currently searching a directory
+    unsigned char* visited; //One bit per cluster, so a looping tree is only searched once
+    bool outOfMemory; //Set by any thread that could not get memory; the search winds down and reports it
+
+    //Output
+    pthread_mutex_t outLock;
+    FILE* out;
+    u_int64_t matches;
+};
+
+/// @brief Splits the next whitespace separated word off cursor. Double quotes group words with spaces in them.
+/// @return The word, or NULL when none are left.
+char* NextWord(char** cursor)
+{
+    char* word = *cursor;
+    while(isspace((unsigned char)*word)) word++;
+    if(*word == '\0') return NULL;
+
+    char* end;
+    if(*word == '"')
+    {
+        word++;
+        end = strchr(word, '"');
+        if(end == NULL) end = word + strlen(word);
+    }
+    else
+    {
+        end = word;
+        while(*end && !isspace((unsigned char)*end)) end++;
+    }
+
+    *cursor = *end ? end + 1 : end;
+    *end = '\0';
+    return word;
+}
+
+/// @brief Parses a size such as 1500, 64K or 2M.
+/// @return Whether the text was a size.
+bool ParseSize(const char* text, u_int64_t* size)
+{
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if(end == text) return false;
+    if(*end == 'K' || *end == 'k') value <<= 10, end++;
+    else if(*end == 'M' || *end == 'm') value <<= 20, end++;
+    else if(*end == 'G' || *end == 'g') value <<= 30, end++;
+    if(*end != '\0') return false;
+    *size = value;
+    return true;
+}
+
+/// @brief Parses YYYY-MM-DD into a FAT packed date.
+/// @return Whether the text was a date FAT can hold.
+bool ParseFatDate(const char* text, u_int16_t* date)
+{
+    uint year, month, day;
+    if(sscanf(text, "%u-%u-%u", &year, &month, &day) != 3) return false;
+    if(year < 1980 || year > 2107 || month < 1 || month > 12 || day < 1 || day > 31) return false;
+    *date = ((year - 1980) << 9) | (month << 5) | day;
+    return true;
+}
+
+/// @brief Works out the 8.3 extension every name matching a glob must have, if the glob ends in a literal one.
+/// Long names keep the first three characters of their extension, upper cased, in their short name.
+void FindShortExtension(struct FindSearch* search)
+{
+    search->shortExtension[0] = '\0';
+    if(search->isRegex) return;
+
+    const char* dot = strrchr(search->pattern, '.');
+    if(dot == NULL || dot[1] == '\0') return;
+    //Only plain letters and digits are carried over to the short name unchanged
+    for(const char* c = dot + 1; *c; c++) if(!isalnum((unsigned char)*c)) return;
+
+    size_t length = strlen(dot + 1);
+    for(size_t i = 0; i < 3; i++) search->shortExtension[i] = i < length ? toupper((unsigned char)dot[1 + i]) : ' ';
+    search->shortExtension[3] = '\0';
+}
+
+/// @brief The Fat32ReadDirFiltered prefilter. Rejects entries from their raw bytes before any long name is decoded.
+bool FindPrefilter(const unsigned char* raw, void* context)
+{
+    struct FindSearch* search = context;
+    u_int8_t attributes = raw[11];
+
+    if((attributes & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) return false;
+    //Directories are always wanted, since they have to be searched too
+    if((attributes & ATTR_DIRECTORY) == ATTR_DIRECTORY) return true;
+
+    u_int32_t size = raw[28] | ((u_int32_t)raw[29] << 8) | ((u_int32_t)raw[30] << 16) | ((u_int32_t)raw[31] << 24);
+    u_int16_t date = raw[24] | ((u_int16_t)raw[25] << 8);
+    if(search->hasMinSize && size <= search->minSize) return false;
+    if(search->hasMaxSize && size >= search->maxSize) return false;
+    if(search->hasAfter && date < search->afterDate) return false;
+    if(search->hasBefore && date > search->beforeDate) return false;
+
+    if(search->shortExtension[0] != '\0' && memcmp(&raw[8], search->shortExtension, 3) != 0)
+    {
+        //A long name that starts with its only period (".evtx") gets a short name with no extension at all
+        bool noExtension = raw[8] == ' ' && raw[9] == ' ' && raw[10] == ' ';
+        return noExtension && memchr(raw, '~', 8) != NULL;
+    }
+    return true;
+}
+
+/// @brief Whether a surviving entry's name matches the pattern.
+bool FindNameMatches(struct FindSearch* search, struct Fat32Entry* entry)
+{
+    if(search->isRegex) return regexec(&search->regex, entry->name, 0, NULL, 0) == 0;
+    return fnmatch(search->pattern, entry->name, FNM_CASEFOLD) == 0;
+}
+
+void FindOutOfMemory(struct FindSearch* search)
+{
+    __atomic_store_n(&search->outOfMemory, true, __ATOMIC_RELAXED);
+}
+
+/// @brief Queues a directory to be searched.
+/// @return Whether there was memory to queue the directory. It takes path over either way.
+bool FindPushJob(struct FindSearch* search, u_int32_t cluster, char* path)
+{
+    struct FindJob* job = path != NULL ? malloc(sizeof(struct FindJob)) : NULL;
+    if(job == NULL)
+    {
+        free(path);
+        FindOutOfMemory(search);
+        return false;
+    }
+    job->cluster = cluster;
+    job->path = path;
+
+    pthread_mutex_lock(&search->lock);
+    job->next = search->jobs;
+    search->jobs = job;
+    pthread_cond_signal(&search->wake);
+    pthread_mutex_unlock(&search->lock);
+    return true;
+}
+
+/// @brief Searches one directory. Subdirectories are queued for whichever thread is free next.
+void FindSearchDirectory(struct FindSearch* search, struct FindJob* job)
+{
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(search->vol, job->cluster, &dir)) return;
+
+    while(!__atomic_load_n(&search->outOfMemory, __ATOMIC_RELAXED) && Fat32ReadDirFiltered(&dir, &entry, FindPrefilter, search))
+    {
+        bool isDirectory = (entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+        if(isDirectory && (strcmp(entry.shortName, ".") == 0 || strcmp(entry.shortName, "..") == 0)) continue;
+
+        char* path = malloc(strlen(job->path) + strlen(entry.name) + 2);
+        if(path == NULL)
+        {
+            FindOutOfMemory(search);
+            break;
+        }
+        sprintf(path, "%s/%s", job->path, entry.name);
+
+        //Size and date filters only describe files
+        bool filtered = search->hasMinSize || search->hasMaxSize || search->hasAfter || search->hasBefore;
+        if((!isDirectory || !filtered) && FindNameMatches(search, &entry))
+        {
+            pthread_mutex_lock(&search->outLock);
+            fprintf(search->out, "%s%s\n", path, isDirectory ? "/" : "");
+            search->matches++;
+            pthread_mutex_unlock(&search->outLock);
+        }
+
+        bool queued = false;
+        if(isDirectory && entry.firstCluster >= 2 && entry.firstCluster < Fat32ClusterCount(search->vol))
+        {
+            unsigned char bit = 1 << (entry.firstCluster % 8);
+            unsigned char previous = __atomic_fetch_or(&search->visited[entry.firstCluster / 8], bit, __ATOMIC_RELAXED);
+            if((previous & bit) == 0)
+            {
+                FindPushJob(search, entry.firstCluster, path);
+                queued = true; //Freed by FindPushJob when it fails
+            }
+        }
+        if(!queued) free(path);
+    }
+
+    Fat32CloseDir(&dir);
+}
+
+void* FindWorker(void* argument)
+{
+    struct FindSearch* search = argument;
+    Fat32TraceContext("FIND");
+
+    pthread_mutex_lock(&search->lock);
+    while(true)
+    {
+        //The search is over once nothing is queued and nobody is left to queue more
+        while(search->jobs == NULL && search->busy > 0) pthread_cond_wait(&search->wake, &search->lock);
+        if(search->jobs == NULL) break;
+
+        struct FindJob* job = search->jobs;
+        search->jobs = job->next;
+        search->busy++;
+        pthread_mutex_unlock(&search->lock);
+
+        FindSearchDirectory(search, job);
+        free(job->path);
+        free(job);
+
+        pthread_mutex_lock(&search->lock);
+        search->busy--;
+        if(search->busy == 0 && search->jobs == NULL) pthread_cond_broadcast(&search->wake);
+    }
+    pthread_cond_broadcast(&search->wake);
+    pthread_mutex_unlock(&search->lock);
+    return NULL;
+}
+
+/// @brief Runs FIND. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Find(struct Fat32Volume* vol, char* argument, FILE* out)
+{
+    struct FindSearch search;
+    memset(&search, 0, sizeof(search));
+    search.vol = vol;
+    search.out = out;
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < FIND_MAX_THREADS ? online : FIND_MAX_THREADS) : 1;
+
+    char* cursor = argument;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        char* value = NULL;
+        if(strcmp(word, "--regex") == 0) search.isRegex = true;
+        else if(strcmp(word, "--size") == 0 || strcmp(word, "--after") == 0 || strcmp(word, "--before") == 0 || strcmp(word, "--threads") == 0)
+        {
+            value = NextWord(&cursor);
+            if(value == NULL)
+            {
+                fprintf(out, "%s needs a value\n", word);
+                return;
+            }
+
+            u_int64_t size;
+            bool valid = true;
+            if(strcmp(word, "--size") == 0)
+            {
+                char sign = (value[0] == '+' || value[0] == '-') ? value[0] : '=';
+                valid = ParseSize(sign == '=' ? value : value + 1, &size) && size < 0xFFFFFFFFull;
+                //Exact sizes are a range one byte wide on either side
+                if(valid && sign != '-') search.hasMinSize = true, search.minSize = sign == '+' ? size : size - 1;
+                if(valid && sign != '+') search.hasMaxSize = true, search.maxSize = sign == '-' ? size : size + 1;
+                if(valid && sign == '=' && size == 0) search.hasMinSize = false;
+            }
+            else if(strcmp(word, "--after") == 0) valid = search.hasAfter = ParseFatDate(value, &search.afterDate);
+            else if(strcmp(word, "--before") == 0) valid = search.hasBefore = ParseFatDate(value, &search.beforeDate);
+            else
+            {
+                numThreads = atoi(value);
+                valid = numThreads >= 1 && numThreads <= FIND_MAX_THREADS;
+            }
+
+            if(!valid)
+            {
+                fprintf(out, "Invalid value for %s: %s\n", word, value);
+                return;
+            }
+        }
+        else if(search.pattern == NULL) search.pattern = word;
+        else
+        {
+            fprintf(out, "Unexpected argument %s\n", word);
+            return;
+        }
+    }
+
+    if(search.pattern == NULL)
+    {
+        fprintf(out, "Usage: FIND <pattern> [--regex] [--size [+|-]n[K|M|G]] [--after YYYY-MM-DD] [--before YYYY-MM-DD] [--threads n]\n");
+        return;
+    }
+    if(search.isRegex)
+    {
+        int result = regcomp(&search.regex, search.pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+        if(result != 0)
+        {
+            char message[128];
+            regerror(result, &search.regex, message, sizeof(message));
+            fprintf(out, "Invalid regular expression: %s\n", message);
+            return;
+        }
+    }
+    FindShortExtension(&search);
+
+    pthread_mutex_init(&search.lock, NULL);
+    pthread_cond_init(&search.wake, NULL);
+    pthread_mutex_init(&search.outLock, NULL);
+    search.visited = calloc(Fat32ClusterCount(vol) / 8 + 1, 1);
+
+    //The search always starts at the root, so every match has a full path
+    u_int32_t root = Fat32RootCluster(vol);
+    if(search.visited != NULL)
+    {
+        search.visited[root / 8] |= 1 << (root % 8);
+        FindPushJob(&search, root, strdup(""));
+    }
+    else FindOutOfMemory(&search);
+
+    pthread_t threads[FIND_MAX_THREADS];
+    uint started = 0;
+    for(uint i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, FindWorker, &search) != 0) break;
+        started++;
+    }
+    //The calling thread searches too
+    FindWorker(&search);
+    for(uint i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    //Whatever matched before memory ran out is already printed, but the list is not complete
+    if(search.outOfMemory) fprintf(out, "\nOut of memory; the search could not be finished\n");
+    else fprintf(out, "\n%llu match(es)\n", (unsigned long long)search.matches);
+
+    free(search.visited);
+    pthread_mutex_destroy(&search.lock);
+    pthread_cond_destroy(&search.wake);
+    pthread_mutex_destroy(&search.outLock);
+    if(search.isRegex) regfree(&search.regex);
+}
+
+#endif
@@ -0,0 +1,657 @@
+
+/******************/
+/*Fleet.h         */
+/******************/
+
+/*
+This header file holds fleet mode, which runs the same commands over a whole
+batch of images at once and merges what they find into one NDJSON stream.
+
+    fat32 --fleet <list> [--threads n] [--io n] <command> [command...]
+
+<list> is a file naming one image per line, or - for stdin. Blank lines and
+lines starting with # are skipped. The commands are
+
+    LIST             every file and directory, with its size and last write time
+    FIND <pattern>   names matching a glob, as FIND matches them (may be given more than once)
+    HASH             the SHA-256 of every file
+    DF               cluster and byte counts: total, used, free and bad
+    CHECK            the CHECK report and how many problems it found
+
+Every FAT32 partition of every image is scanned. Each output line is one JSON
+object carrying "image", "partition" and "command", followed by that
+command's fields. A partition ends with a "done" record counting what was
+walked, and an image that cannot be read gets a single "error" record:
+
+    {"image":"a.img","partition":1,"command":"hash","path":"/LOGS/BOOT.TXT","size":812,"sha256":"9f86..."}
+
+--threads n bounds the number of images worked on at once, which defaults to
+the number of CPUs. Each image is walked by one thread, so a batch keeps
+every thread busy rather than splitting a single image between them. --io n
+bounds how many of those threads may be reading file contents (HASH) or FAT
+copies (CHECK) at the same moment, and defaults to the thread count; lower it
+for images on spinning disks. Records from different images interleave, but
+each line is written whole.
+*/
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define FLEET_MAX_THREADS 256
+#define FLEET_MAX_PATTERNS 16
+
+/// @brief Running state of a SHA-256 digest.
+struct Sha256
+{
+    u_int32_t state[8];
+    u_int64_t length; //Bytes hashed so far
+    unsigned char block[64];
+    uint used; //Bytes waiting in block
+};
+
+static const u_int32_t Sha256Constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void Sha256Init(struct Sha256* sha)
+{
+    static const u_int32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+/// @brief Mixes one 64 byte block into the state.
+void Sha256Block(struct Sha256* sha, const unsigned char* block)
+{
+    u_int32_t w[64];
+    for(int i = 0; i < 16; i++) w[i] = ((u_int32_t)block[i * 4] << 24) | ((u_int32_t)block[i * 4 + 1] << 16) | ((u_int32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    for(int i = 16; i < 64; i++)
+    {
+        u_int32_t s0 = SHA256_ROTATE(w[i - 15], 7) ^ SHA256_ROTATE(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u_int32_t s1 = SHA256_ROTATE(w[i - 2], 17) ^ SHA256_ROTATE(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    u_int32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    u_int32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+    for(int i = 0; i < 64; i++)
+    {
+        u_int32_t t1 = h + (SHA256_ROTATE(e, 6) ^ SHA256_ROTATE(e, 11) ^ SHA256_ROTATE(e, 25)) + ((e & f) ^ (~e & g)) + Sha256Constants[i] + w[i];
+        u_int32_t t2 = (SHA256_ROTATE(a, 2) ^ SHA256_ROTATE(a, 13) ^ SHA256_ROTATE(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+    sha->state[0] += a, sha->state[1] += b, sha->state[2] += c, sha->state[3] += d;
+    sha->state[4] += e, sha->state[5] += f, sha->state[6] += g, sha->state[7] += h;
+}
+
+void Sha256Update(struct Sha256* sha, const unsigned char* data, size_t count)
+{
+    sha->length += count;
+    if(sha->used > 0)
+    {
+        size_t take = 64 - sha->used < count ? 64 - sha->used : count;
+        memcpy(sha->block + sha->used, data, take);
+        sha->used += take, data += take, count -= take;
+        if(sha->used < 64) return;
+        Sha256Block(sha, sha->block);
+        sha->used = 0;
+    }
+    //Whole blocks are hashed straight from the caller's buffer
+    for(; count >= 64; data += 64, count -= 64) Sha256Block(sha, data);
+    memcpy(sha->block, data, count);
+    sha->used = count;
+}
+
+/// @brief Pads the message and writes the digest as 64 lowercase hex digits.
+void Sha256Final(struct Sha256* sha, char hex[65])
+{
+    u_int64_t bits = sha->length * 8;
+    unsigned char padding[72] = {0x80};
+    size_t padLength = (sha->used < 56 ? 56 : 120) - sha->used;
+    for(int i = 0; i < 8; i++) padding[padLength + i] = bits >> (56 - i * 8);
+    Sha256Update(sha, padding, padLength + 8);
+
+    for(int i = 0; i < 8; i++) sprintf(&hex[i * 8], "%08x", sha->state[i]);
+}
+
+/// @brief Everything the fleet threads share.
+struct Fleet
+{
+    //What to run on every partition
+    bool list, hash, df, check;
+    char* patterns[FLEET_MAX_PATTERNS];
+    uint numPatterns;
+
+    int openFlags;
+    u_int64_t fatBudget;
+
+    //Images not yet started
+    pthread_mutex_t lock;
+    char** images;
+    uint numImages;
+    uint nextImage;
+    uint failedImages;
+
+    //Threads allowed to read bulk data at once
+    pthread_mutex_t ioLock;
+    pthread_cond_t ioWake;
+    uint ioSlots;
+
+    FILE* out;
+};
+
+/// @brief What one thread is scanning.
+struct FleetScan
+{
+    struct Fleet* fleet;
+    struct Fat32Volume* vol;
+    const char* image;
+    uint partition;
+    unsigned char* buffer; //Read buffer for HASH
+    u_int64_t files, directories, bytes;
+};
+
+void FleetAcquireIO(struct Fleet* fleet)
+{
+    pthread_mutex_lock(&fleet->ioLock);
+    while(fleet->ioSlots == 0) pthread_cond_wait(&fleet->ioWake, &fleet->ioLock);
+    fleet->ioSlots--;
+    pthread_mutex_unlock(&fleet->ioLock);
+}
+
+void FleetReleaseIO(struct Fleet* fleet)
+{
+    pthread_mutex_lock(&fleet->ioLock);
+    fleet->ioSlots++;
+    pthread_cond_signal(&fleet->ioWake);
+    pthread_mutex_unlock(&fleet->ioLock);
+}
+
+/// @brief Writes text as a quoted JSON string. Bytes past ASCII are escaped one by one, so the line is valid whatever a name holds.
+void FleetJsonString(FILE* out, const char* text)
+{
+    fputc('"', out);
+    for(const unsigned char* c = (const unsigned char*)text; *c; c++)
+    {
+        if(*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if(*c < 0x20 || *c >= 0x7F) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+/// @brief Starts a record. The stream stays locked until FleetEndRecord, so records never interleave mid-line.
+void FleetBeginRecord(struct FleetScan* scan, const char* command)
+{
+    FILE* out = scan->fleet->out;
+    flockfile(out);
+    fprintf(out, "{\"image\":");
+    FleetJsonString(out, scan->image);
+    fprintf(out, ",\"partition\":%u,\"command\":\"%s\"", scan->partition, command);
+}
+
+void FleetEndRecord(struct FleetScan* scan)
+{
+    fprintf(scan->fleet->out, "}\n");
+    funlockfile(scan->fleet->out);
+}
+
+/// @brief Writes the path field of a record.
+void FleetPathField(struct FleetScan* scan, const char* path)
+{
+    fprintf(scan->fleet->out, ",\"path\":");
+    FleetJsonString(scan->fleet->out, path[0] ? path : "/");
+}
+
+/// @brief Hashes one file and writes its record.
+void FleetHashFile(struct FleetScan* scan, const char* path, struct Fat32Entry* entry)
+{
+    struct Sha256 sha;
+    Sha256Init(&sha);
+    u_int64_t size = entry->dir.DIR_FileSize;
+    u_int64_t chunkBytes = Fat32PreferredReadBytes(scan->vol);
+    //The read buffer is taken once per partition, and may not have been there to take
+    const char* error = scan->buffer == NULL ? strerror(ENOMEM) : NULL;
+
+    for(u_int64_t done = 0; done < size && error == NULL; )
+    {
+        size_t chunk = size - done < chunkBytes ? size - done : chunkBytes;
+        FleetAcquireIO(scan->fleet);
+        ssize_t n = Fat32PRead(scan->vol, entry, scan->buffer, chunk, done);
+        FleetReleaseIO(scan->fleet);
+        if(n <= 0)
+        {
+            error = n < 0 ? strerror(errno) : "chain ends before the file does";
+            break;
+        }
+        Sha256Update(&sha, scan->buffer, n);
+        done += n;
+    }
+
+    FleetBeginRecord(scan, "hash");
+    FleetPathField(scan, path);
+    fprintf(scan->fleet->out, ",\"size\":%llu", (unsigned long long)size);
+    if(error != NULL)
+    {
+        fprintf(scan->fleet->out, ",\"error\":");
+        FleetJsonString(scan->fleet->out, error);
+    }
+    else
+    {
+        char hex[65];
+        Sha256Final(&sha, hex);
+        fprintf(scan->fleet->out, ",\"sha256\":\"%s\"", hex);
+    }
+    FleetEndRecord(scan);
+}
+
+/// @brief Writes the LIST and FIND records of one entry and hashes it if it is a file.
+void FleetVisit(struct FleetScan* scan, const char* path, struct Fat32Entry* entry)
+{
+    struct Fleet* fleet = scan->fleet;
+    bool isDirectory = (entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+    if(isDirectory) scan->directories++;
+    else scan->files++, scan->bytes += entry->dir.DIR_FileSize;
+
+    if(fleet->list)
+    {
+        u_int16_t date = entry->dir.DIR_WrtDate, time = entry->dir.DIR_WrtTime;
+        FleetBeginRecord(scan, "list");
+        FleetPathField(scan, path);
+        fprintf(fleet->out, ",\"type\":\"%s\",\"size\":%u,\"cluster\":%u,\"attributes\":%u,\"written\":\"%04u-%02u-%02uT%02u:%02u:%02u\"",
+        isDirectory ? "directory" : "file", entry->dir.DIR_FileSize, entry->firstCluster, entry->dir.DIR_Attr,
+        (date >> 9) + 1980, (date >> 5) & 0x0F, date & 0x1F, time >> 11, (time >> 5) & 0x3F, (time & 0x1F) * 2);
+        FleetEndRecord(scan);
+    }
+
+    for(uint i = 0; i < fleet->numPatterns; i++)
+    {
+        if(fnmatch(fleet->patterns[i], entry->name, FNM_CASEFOLD) != 0) continue;
+        FleetBeginRecord(scan, "find");
+        fprintf(fleet->out, ",\"pattern\":");
+        FleetJsonString(fleet->out, fleet->patterns[i]);
+        FleetPathField(scan, path);
+        fprintf(fleet->out, ",\"type\":\"%s\"", isDirectory ? "directory" : "file");
+        FleetEndRecord(scan);
+    }
+
+    if(fleet->hash && !isDirectory) FleetHashFile(scan, path, entry);
+}
+
+/// @brief Writes an error record for the partition being scanned.
+void FleetError(struct FleetScan* scan, const char* message)
+{
+    FleetBeginRecord(scan, "error");
+    fprintf(scan->fleet->out, ",\"error\":");
+    FleetJsonString(scan->fleet->out, message);
+    FleetEndRecord(scan);
+}
+
+/// @brief Walks a partition's whole tree on the calling thread.
+/// @return False, after an error record, if memory ran out before the walk was done.
+bool FleetWalk(struct FleetScan* scan)
+{
+    struct Fat32Volume* vol = scan->vol;
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    unsigned char* visited = calloc(clusterCount / 8 + 1, 1);
+
+    //Directories still to read, as a stack of cluster and path
+    uint capacity = 64, depth = 0;
+    u_int32_t* clusters = malloc(capacity * sizeof(u_int32_t));
+    char** paths = malloc(capacity * sizeof(char*));
+    u_int32_t root = Fat32RootCluster(vol);
+    bool complete = visited != NULL && clusters != NULL && paths != NULL && (paths[0] = strdup("")) != NULL;
+    if(complete)
+    {
+        visited[root / 8] |= 1 << (root % 8);
+        clusters[depth++] = root;
+    }
+
+    while(depth > 0 && complete)
+    {
+        depth--;
+        u_int32_t cluster = clusters[depth];
+        char* directoryPath = paths[depth];
+
+        struct Fat32Dir dir;
+        struct Fat32Entry entry;
+        if(Fat32OpenDir(vol, cluster, &dir))
+        {
+            while(Fat32ReadDir(&dir, &entry))
+            {
+                if((entry.dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+                bool isDirectory = (entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+                if(isDirectory && (strcmp(entry.shortName, ".") == 0 || strcmp(entry.shortName, "..") == 0)) continue;
+
+                char* path = malloc(strlen(directoryPath) + strlen(entry.name) + 2);
+                if(path == NULL)
+                {
+                    complete = false;
+                    break;
+                }
+                sprintf(path, "%s/%s", directoryPath, entry.name);
+                FleetVisit(scan, path, &entry);
+
+                u_int32_t child = entry.firstCluster;
+                if(isDirectory && child >= 2 && child < clusterCount && (visited[child / 8] & (1 << (child % 8))) == 0)
+                {
+                    visited[child / 8] |= 1 << (child % 8);
+                    if(depth == capacity)
+                    {
+                        u_int32_t* grownClusters = realloc(clusters, capacity * 2 * sizeof(u_int32_t));
+                        if(grownClusters != NULL) clusters = grownClusters;
+                        char** grownPaths = realloc(paths, capacity * 2 * sizeof(char*));
+                        if(grownPaths != NULL) paths = grownPaths;
+                        if(grownClusters == NULL || grownPaths == NULL)
+                        {
+                            free(path);
+                            complete = false;
+                            break;
+                        }
+                        capacity *= 2;
+                    }
+                    clusters[depth] = child, paths[depth] = path, depth++;
+                }
+                else free(path);
+            }
+            Fat32CloseDir(&dir);
+        }
+        free(directoryPath);
+    }
+
+    //Directories left on the stack when the walk gave up
+    while(depth > 0) free(paths[--depth]);
+    free(clusters);
+    free(paths);
+    free(visited);
+    if(!complete) FleetError(scan, strerror(ENOMEM));
+    return complete;
+}
+
+/// @brief Counts the clusters of a partition by state and writes the DF record.
+void FleetDf(struct FleetScan* scan)
+{
+    struct Fat32Volume* vol = scan->vol;
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    u_int64_t clusterBytes = Fat32ClusterBytes(vol);
+    u_int32_t used = 0, bad = 0;
+    for(u_int32_t c = 2; c < clusterCount; c++)
+    {
+        u_int32_t value = Fat32NextCluster(vol, c);
+        if(value == 0x0FFFFFF7) bad++;
+        else if(value != 0) used++;
+    }
+    u_int32_t total = clusterCount - 2;
+    u_int32_t unused = total - used - bad;
+
+    char label[12];
+    snprintf(label, sizeof(label), "%s", Fat32GetBPB(vol)->BS_VolLab);
+    for(int i = strlen(label) - 1; i >= 0 && label[i] == ' '; i--) label[i] = '\0';
+
+    FleetBeginRecord(scan, "df");
+    fprintf(scan->fleet->out, ",\"label\":");
+    FleetJsonString(scan->fleet->out, label);
+    fprintf(scan->fleet->out, ",\"clusterBytes\":%llu,\"clusters\":%u,\"used\":%u,\"free\":%u,\"bad\":%u,\"totalBytes\":%llu,\"usedBytes\":%llu,\"freeBytes\":%llu",
+    (unsigned long long)clusterBytes, total, used, unused, bad,
+    (unsigned long long)(total * clusterBytes), (unsigned long long)(used * clusterBytes), (unsigned long long)(unused * clusterBytes));
+    FleetEndRecord(scan);
+}
+
+/// @brief Runs CHECK on one thread and writes its report as a CHECK record.
+void FleetCheck(struct FleetScan* scan)
+{
+    char* text = NULL;
+    size_t length = 0;
+    FILE* report = open_memstream(&text, &length);
+    if(report == NULL)
+    {
+        FleetError(scan, strerror(errno));
+        return;
+    }
+    char argument[] = "--threads 1";
+    FleetAcquireIO(scan->fleet);
+    Check(scan->vol, argument, report);
+    FleetReleaseIO(scan->fleet);
+    fclose(report);
+    if(text == NULL)
+    {
+        FleetError(scan, strerror(ENOMEM));
+        return;
+    }
+
+    //The last line says how many problems were found
+    unsigned long long problems = 0;
+    char* last = strrchr(text, '\n');
+    while(last != NULL && last > text && last[-1] != '\n') last--;
+    if(last != NULL) problems = strtoull(last, NULL, 10);
+
+    FILE* out = scan->fleet->out;
+    FleetBeginRecord(scan, "check");
+    fprintf(out, ",\"problems\":%llu,\"report\":[", problems);
+    bool first = true;
+    //Other images' CHECK records are being split on other threads at the same time
+    char* saved;
+    for(char* line = strtok_r(text, "\n", &saved); line != NULL; line = strtok_r(NULL, "\n", &saved))
+    {
+        if(!first) fputc(',', out);
+        FleetJsonString(out, line);
+        first = false;
+    }
+    fprintf(out, "]");
+    FleetEndRecord(scan);
+    free(text);
+}
+
+/// @brief Runs every command on every FAT32 partition of one image.
+/// @return Whether any partition could be read, and every walk ran to the end.
+bool FleetImage(struct Fleet* fleet, const char* image)
+{
+    struct FleetScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.fleet = fleet;
+    scan.image = image;
+
+    struct Fat32PartitionInfo parts[FAT32_MAX_PARTITIONS];
+    int numParts = Fat32ListPartitions(image, parts, FAT32_MAX_PARTITIONS);
+    int error = numParts < 0 ? errno : EINVAL;
+    uint scanned = 0;
+    bool complete = true;
+    for(int i = 0; i < numParts; i++)
+    {
+        Fat32TraceContext("OPEN");
+        scan.vol = Fat32OpenPartition(image, parts[i].number, fleet->openFlags, fleet->fatBudget);
+        if(scan.vol == NULL)
+        {
+            //Partitions holding some other file system are passed over quietly
+            if(errno != EINVAL) error = errno;
+            continue;
+        }
+        scan.partition = parts[i].number;
+        scan.files = scan.directories = scan.bytes = 0;
+        scan.buffer = fleet->hash ? Fat32GetBuffer(scan.vol) : NULL;
+
+        //LIST, FIND and HASH share one walk, so a trace files them together
+        Fat32TraceContext("WALK");
+        if(fleet->list || fleet->hash || fleet->numPatterns > 0) complete = FleetWalk(&scan) && complete;
+        Fat32TraceContext("DF");
+        if(fleet->df) FleetDf(&scan);
+        Fat32TraceContext("CHECK");
+        if(fleet->check) FleetCheck(&scan);
+
+        FleetBeginRecord(&scan, "done");
+        fprintf(fleet->out, ",\"files\":%llu,\"directories\":%llu,\"bytes\":%llu",
+        (unsigned long long)scan.files, (unsigned long long)scan.directories, (unsigned long long)scan.bytes);
+        FleetEndRecord(&scan);
+
+        if(scan.buffer != NULL) Fat32PutBuffer(scan.vol, scan.buffer);
+        Fat32Close(scan.vol);
+        scanned++;
+    }
+    if(scanned > 0) return complete;
+
+    scan.partition = 0;
+    FleetError(&scan, error == EINVAL ? "not a FAT32 volume" : error == ENOMEM ? "the FAT does not fit the memory budget" : strerror(error));
+    return false;
+}
+
+void* FleetWorker(void* argument)
+{
+    struct Fleet* fleet = argument;
+    while(true)
+    {
+        pthread_mutex_lock(&fleet->lock);
+        uint index = fleet->nextImage++;
+        pthread_mutex_unlock(&fleet->lock);
+        if(index >= fleet->numImages) break;
+
+        if(!FleetImage(fleet, fleet->images[index]))
+        {
+            pthread_mutex_lock(&fleet->lock);
+            fleet->failedImages++;
+            pthread_mutex_unlock(&fleet->lock);
+        }
+    }
+    return NULL;
+}
+
+/// @brief Reads the image list, one path per line.
+/// @return The number of images, or -1 if the list could not be opened.
+int FleetReadList(const char* listPath, char*** images)
+{
+    FILE* list = strcmp(listPath, "-") == 0 ? stdin : fopen(listPath, "r");
+    if(list == NULL) return -1;
+
+    int count = 0, capacity = 64;
+    *images = malloc(capacity * sizeof(char*));
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    bool complete = *images != NULL;
+    while(complete && getline(&line, &lineCapacity, list) > 0)
+    {
+        char* start = line;
+        while(isspace((unsigned char)*start)) start++;
+        char* end = start + strlen(start);
+        while(end > start && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+        if(*start == '\0' || *start == '#') continue;
+
+        if(count == capacity)
+        {
+            char** grown = realloc(*images, capacity * 2 * sizeof(char*));
+            if(grown == NULL) break;
+            *images = grown;
+            capacity *= 2;
+        }
+        (*images)[count] = strdup(start);
+        if((*images)[count] == NULL) break;
+        count++;
+    }
+    complete = complete && feof(list);
+    free(line);
+    if(list != stdin) fclose(list);
+    if(!complete)
+    {
+        while(count > 0 && *images != NULL) free((*images)[--count]);
+        free(*images);
+        *images = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    return count;
+}
+
+/// @brief Runs the reader as fat32 --fleet. See the top of this file for the syntax.
+/// @param args Everything after --fleet.
+/// @return The exit status: 0 when every image could be read.
+int RunFleet(int numArgs, char* args[], int openFlags, u_int64_t fatBudget)
+{
+    struct Fleet fleet;
+    memset(&fleet, 0, sizeof(fleet));
+    fleet.openFlags = openFlags & ~FAT32_OPEN_WRITE;
+    fleet.fatBudget = fatBudget;
+    fleet.out = stdout;
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < FLEET_MAX_THREADS ? online : FLEET_MAX_THREADS) : 1;
+    uint ioSlots = 0;
+
+    bool valid = numArgs >= 2;
+    for(int i = 1; valid && i < numArgs; i++)
+    {
+        if(strcmp(args[i], "--threads") == 0 || strcmp(args[i], "--io") == 0)
+        {
+            uint value = i + 1 < numArgs ? atoi(args[i + 1]) : 0;
+            valid = value >= 1 && value <= FLEET_MAX_THREADS;
+            if(strcmp(args[i], "--threads") == 0) numThreads = value;
+            else ioSlots = value;
+            i++;
+        }
+        else if(strcasecmp(args[i], "LIST") == 0) fleet.list = true;
+        else if(strcasecmp(args[i], "HASH") == 0) fleet.hash = true;
+        else if(strcasecmp(args[i], "DF") == 0) fleet.df = true;
+        else if(strcasecmp(args[i], "CHECK") == 0) fleet.check = true;
+        else if(strcasecmp(args[i], "FIND") == 0 && i + 1 < numArgs && fleet.numPatterns < FLEET_MAX_PATTERNS) fleet.patterns[fleet.numPatterns++] = args[++i];
+        else valid = false;
+    }
+    if(!valid || !(fleet.list || fleet.hash || fleet.df || fleet.check || fleet.numPatterns > 0))
+    {
+        fprintf(stderr, "Usage: fat32 --fleet <list|-> [--threads n] [--io n] <LIST|FIND pattern|HASH|DF|CHECK> [...] (1 to %d threads)\n", FLEET_MAX_THREADS);
+        return 1;
+    }
+
+    int numImages = FleetReadList(args[0], &fleet.images);
+    if(numImages < 0)
+    {
+        fprintf(stderr, "%s: %s\n", args[0], strerror(errno));
+        return 1;
+    }
+    fleet.numImages = numImages;
+    fleet.ioSlots = ioSlots != 0 ? ioSlots : numThreads;
+    if(numThreads > fleet.numImages) numThreads = fleet.numImages > 0 ? fleet.numImages : 1;
+
+    pthread_mutex_init(&fleet.lock, NULL);
+    pthread_mutex_init(&fleet.ioLock, NULL);
+    pthread_cond_init(&fleet.ioWake, NULL);
+
+    pthread_t threads[FLEET_MAX_THREADS];
+    uint started = 0;
+    for(uint i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, FleetWorker, &fleet) != 0) break;
+        started++;
+    }
+    //The calling thread scans too
+    FleetWorker(&fleet);
+    for(uint i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    fflush(fleet.out);
+
+    for(uint i = 0; i < fleet.numImages; i++) free(fleet.images[i]);
+    free(fleet.images);
+    pthread_mutex_destroy(&fleet.lock);
+    pthread_mutex_destroy(&fleet.ioLock);
+    pthread_cond_destroy(&fleet.ioWake);
+    return fleet.failedImages == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,379 @@
+
+/******************/
+/*Frag.h          */
+/******************/
+
+/*
+This header file holds the FRAG command, which reports how fragmented files
+are, to find the images worth defragmenting and the files that read slowly.
+
+    FRAG [-r] [--threads n] [path]
+
+path may be a file or a directory, the current directory by default. For a
+directory every file and subdirectory in it is reported, and with -r
+everything under it, so FRAG -r / covers the whole volume. Each line gives
+
+    fragments  the runs of consecutive clusters the chain breaks into
+    average    the mean run length, in clusters
+    seek       how far the chain jumps between runs, in clusters, summed
+
+followed by the size and path, most fragmented first. A summary and a
+histogram of fragments per file close the report.
+
+Only the FAT is consulted for the chains, and the FAT is already in memory,
+so no data cluster is read; only the directories are. Directories are shared
+out to a pool of threads the same way FIND does it.
+*/
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define FRAG_MAX_THREADS 16
+#define FRAG_HISTOGRAM_BUCKETS 16 //1, 2, 3-4, 5-8 and so on, the last one open ended
+#define FRAG_BAR_WIDTH 40
+
+/// @brief How one chain is laid out.
+struct FragChain
+{
+    u_int32_t clusters;
+    u_int32_t extents;
+    u_int64_t seek; //Clusters skipped, forwards or backwards, between the end of one run and the start of the next
+    bool broken; //Looped or ran into a free or bad cluster
+};
+
+/// @brief One line of the report.
+struct FragRecord
+{
+    char* path;
+    u_int32_t size;
+    bool isDirectory;
+    struct FragChain chain;
+};
+
+/// @brief A directory waiting to be read.
+struct FragJob
+{
+    u_int32_t cluster;
+    char* path;
+    struct FragJob* next;
+};
+
+/// @brief Everything the threads share.
+struct FragScan
+{
+    struct Fat32Volume* vol;
+    bool recursive;
+
+    //Work queue
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct FragJob* jobs;
+    uint busy;
+    unsigned char* visited; //One bit per cluster, so a looping tree is only read once
+
+    //Results, added to under lock
+    struct FragRecord* records;
+    u_int64_t numRecords, maxRecords;
+};
+
+/// @brief Walks a chain through the in-memory FAT.
+void FragWalkChain(struct Fat32Volume* vol, u_int32_t cluster, struct FragChain* chain)
+{
+    memset(chain, 0, sizeof(struct FragChain));
+    u_int32_t limit = Fat32ClusterCount(vol);
+    u_int32_t runEnd = 0; //Cluster just past the current run
+    while(!Fat32IsEndOfChain(vol, cluster))
+    {
+        if(chain->clusters >= limit)
+        {
+            chain->broken = true;
+            return;
+        }
+        if(chain->extents == 0 || cluster != runEnd)
+        {
+            if(chain->extents > 0) chain->seek += cluster > runEnd ? cluster - runEnd : runEnd - cluster;
+            chain->extents++;
+        }
+        chain->clusters++;
+        runEnd = cluster + 1;
+        cluster = Fat32NextCluster(vol, cluster);
+    }
+    //Only an end of chain marker ends a chain properly
+    if(chain->clusters > 0 && cluster < 0x0FFFFFF8) chain->broken = true;
+}
+
+/// @brief Adds one line to the report.
+void FragAddRecord(struct FragScan* scan, char* path, const struct Fat32Entry* entry, const struct FragChain* chain)
+{
+    pthread_mutex_lock(&scan->lock);
+    if(scan->numRecords == scan->maxRecords)
+    {
+        u_int64_t slots = scan->maxRecords ? scan->maxRecords * 2 : 1024;
+        struct FragRecord* grown = realloc(scan->records, slots * sizeof(struct FragRecord));
+        if(grown != NULL) scan->records = grown, scan->maxRecords = slots;
+    }
+    if(scan->numRecords < scan->maxRecords)
+    {
+        struct FragRecord* record = &scan->records[scan->numRecords++];
+        record->path = path;
+        record->size = entry->dir.DIR_FileSize;
+        record->isDirectory = (entry->dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+        record->chain = *chain;
+        path = NULL;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    free(path);
+}
+
+void FragPushJob(struct FragScan* scan, u_int32_t cluster, char* path)
+{
+    struct FragJob* job = malloc(sizeof(struct FragJob));
+    if(job == NULL)
+    {
+        free(path);
+        return;
+    }
+    job->cluster = cluster;
+    job->path = path;
+
+    pthread_mutex_lock(&scan->lock);
+    job->next = scan->jobs;
+    scan->jobs = job;
+    pthread_cond_signal(&scan->wake);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/// @brief Reports every entry of one directory. Subdirectories are queued when the scan is recursive.
+void FragScanDirectory(struct FragScan* scan, struct FragJob* job)
+{
+    struct Fat32Dir dir;
+    struct Fat32Entry entry;
+    if(!Fat32OpenDir(scan->vol, job->cluster, &dir)) return;
+
+    while(Fat32ReadDir(&dir, &entry))
+    {
+        if((entry.dir.DIR_Attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) continue;
+        bool isDirectory = (entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY;
+        if(isDirectory && (strcmp(entry.shortName, ".") == 0 || strcmp(entry.shortName, "..") == 0)) continue;
+
+        size_t length = strlen(job->path) + strlen(entry.name) + 2;
+        char* path = malloc(length);
+        if(path == NULL) continue;
+        snprintf(path, length, "%s%s%s", job->path, job->path[0] && job->path[strlen(job->path) - 1] == '/' ? "" : "/", entry.name);
+
+        struct FragChain chain;
+        FragWalkChain(scan->vol, entry.firstCluster, &chain);
+
+        u_int32_t cluster = entry.firstCluster;
+        if(scan->recursive && isDirectory && cluster >= 2 && cluster < Fat32ClusterCount(scan->vol))
+        {
+            unsigned char bit = 1 << (cluster % 8);
+            if((__atomic_fetch_or(&scan->visited[cluster / 8], bit, __ATOMIC_RELAXED) & bit) == 0) FragPushJob(scan, cluster, strdup(path));
+        }
+        FragAddRecord(scan, path, &entry, &chain);
+    }
+    Fat32CloseDir(&dir);
+}
+
+void* FragWorker(void* argument)
+{
+    struct FragScan* scan = argument;
+    Fat32TraceContext("FRAG");
+
+    pthread_mutex_lock(&scan->lock);
+    while(true)
+    {
+        //The scan is over once nothing is queued and nobody is left to queue more
+        while(scan->jobs == NULL && scan->busy > 0) pthread_cond_wait(&scan->wake, &scan->lock);
+        if(scan->jobs == NULL) break;
+
+        struct FragJob* job = scan->jobs;
+        scan->jobs = job->next;
+        scan->busy++;
+        pthread_mutex_unlock(&scan->lock);
+
+        FragScanDirectory(scan, job);
+        free(job->path);
+        free(job);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->busy--;
+        if(scan->busy == 0 && scan->jobs == NULL) pthread_cond_broadcast(&scan->wake);
+    }
+    pthread_cond_broadcast(&scan->wake);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+/// @brief Orders records most fragmented first, then by path.
+int FragCompareRecords(const void* a, const void* b)
+{
+    const struct FragRecord* left = a;
+    const struct FragRecord* right = b;
+    if(left->chain.extents != right->chain.extents) return left->chain.extents > right->chain.extents ? -1 : 1;
+    return strcmp(left->path, right->path);
+}
+
+/// @brief The histogram bucket a fragment count falls in.
+uint FragBucket(u_int32_t extents)
+{
+    uint bucket = 0;
+    while(bucket + 1 < FRAG_HISTOGRAM_BUCKETS && (1u << bucket) < extents) bucket++;
+    return bucket;
+}
+
+void FragPrintRecord(const struct FragRecord* record, FILE* out)
+{
+    double average = record->chain.extents ? (double)record->chain.clusters / record->chain.extents : 0;
+    fprintf(out, "%10u %10.1f %'14llu %'14u  %s%s%s\n", record->chain.extents, average, (unsigned long long)record->chain.seek,
+    record->size, record->path, record->isDirectory ? "/" : "", record->chain.broken ? "  (broken chain)" : "");
+}
+
+/// @brief Prints the totals and the histogram of fragments per file.
+void FragPrintSummary(struct FragRecord* records, u_int64_t numRecords, FILE* out)
+{
+    u_int64_t histogram[FRAG_HISTOGRAM_BUCKETS] = {0};
+    u_int64_t files = 0, empty = 0, fragmented = 0, extents = 0, clusters = 0, seek = 0, breaks = 0, broken = 0;
+    for(u_int64_t i = 0; i < numRecords; i++)
+    {
+        const struct FragChain* chain = &records[i].chain;
+        if(chain->broken) broken++;
+        if(records[i].isDirectory) continue;
+        files++;
+        if(chain->extents == 0)
+        {
+            empty++;
+            continue;
+        }
+        if(chain->extents > 1) fragmented++;
+        extents += chain->extents;
+        clusters += chain->clusters;
+        seek += chain->seek;
+        breaks += chain->extents - 1;
+        histogram[FragBucket(chain->extents)]++;
+    }
+
+    u_int64_t nonEmpty = files - empty;
+    fprintf(out, "\n%'llu file(s), %'llu empty, %'llu fragmented (%.1f%%)\n", (unsigned long long)files, (unsigned long long)empty,
+    (unsigned long long)fragmented, nonEmpty ? 100.0 * fragmented / nonEmpty : 0.0);
+    fprintf(out, "%'llu extent(s), %.2f per file, %.1f clusters each on average\n", (unsigned long long)extents,
+    nonEmpty ? (double)extents / nonEmpty : 0.0, extents ? (double)clusters / extents : 0.0);
+    fprintf(out, "%'llu clusters of seeking, %.1f per break\n", (unsigned long long)seek, breaks ? (double)seek / breaks : 0.0);
+    if(broken > 0) fprintf(out, "%'llu broken chain(s)\n", (unsigned long long)broken);
+    if(nonEmpty == 0) return;
+
+    u_int64_t largest = 0;
+    for(int b = 0; b < FRAG_HISTOGRAM_BUCKETS; b++) if(histogram[b] > largest) largest = histogram[b];
+    fprintf(out, "\nFragments per file\n");
+    for(int b = 0; b < FRAG_HISTOGRAM_BUCKETS; b++)
+    {
+        if(histogram[b] == 0) continue;
+        char label[32];
+        u_int32_t low = b == 0 ? 1 : (1u << (b - 1)) + 1;
+        if(b == 0 || b == 1) snprintf(label, sizeof(label), "%u", b + 1);
+        else if(b + 1 == FRAG_HISTOGRAM_BUCKETS) snprintf(label, sizeof(label), "%u+", low);
+        else snprintf(label, sizeof(label), "%u-%u", low, 1u << b);
+
+        int width = (int)((histogram[b] * FRAG_BAR_WIDTH + largest - 1) / largest);
+        fprintf(out, "%12s %'12llu  %.*s\n", label, (unsigned long long)histogram[b], width, "########################################");
+    }
+}
+
+/// @brief Runs FRAG. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Frag(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    struct FragScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.vol = vol;
+    const char* path = NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < FRAG_MAX_THREADS ? online : FRAG_MAX_THREADS) : 1;
+
+    char* cursor = argument;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        if(strcmp(word, "-r") == 0) scan.recursive = true;
+        else if(strcmp(word, "--threads") == 0)
+        {
+            char* value = NextWord(&cursor);
+            numThreads = value ? atoi(value) : 0;
+            if(numThreads < 1 || numThreads > FRAG_MAX_THREADS)
+            {
+                fprintf(out, "Invalid value for --threads\n");
+                return;
+            }
+        }
+        else if(path == NULL) path = word;
+        else
+        {
+            fprintf(out, "Usage: FRAG [-r] [--threads n] [path]\n");
+            return;
+        }
+    }
+
+    u_int32_t cluster = currentDirectory;
+    struct Fat32Entry entry;
+    if(path != NULL)
+    {
+        if(!Fat32Stat(vol, currentDirectory, path, &entry))
+        {
+            fprintf(out, "File Not Found\n");
+            return;
+        }
+        //A single file is reported on its own
+        if((entry.dir.DIR_Attr & ATTR_DIRECTORY) != ATTR_DIRECTORY)
+        {
+            struct FragRecord record = {.path = (char*)path, .size = entry.dir.DIR_FileSize};
+            FragWalkChain(vol, entry.firstCluster, &record.chain);
+            fprintf(out, "%10s %10s %14s %14s  %s\n", "Fragments", "Average", "Seek", "Size", "Path");
+            FragPrintRecord(&record, out);
+            return;
+        }
+        cluster = entry.firstCluster;
+    }
+    if(cluster == 0) cluster = Fat32RootCluster(vol);
+
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.wake, NULL);
+    scan.visited = calloc(Fat32ClusterCount(vol) / 8 + 1, 1);
+    if(scan.visited == NULL)
+    {
+        fprintf(out, "Out of memory\n");
+        return;
+    }
+    scan.visited[cluster / 8] |= 1 << (cluster % 8);
+    FragPushJob(&scan, cluster, strdup(path ? path : "."));
+
+    pthread_t threads[FRAG_MAX_THREADS];
+    uint started = 0;
+    for(uint i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, FragWorker, &scan) != 0) break;
+        started++;
+    }
+    //The calling thread scans too
+    FragWorker(&scan);
+    for(uint i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    qsort(scan.records, scan.numRecords, sizeof(struct FragRecord), FragCompareRecords);
+    fprintf(out, "%10s %10s %14s %14s  %s\n", "Fragments", "Average", "Seek", "Size", "Path");
+    for(u_int64_t i = 0; i < scan.numRecords; i++) FragPrintRecord(&scan.records[i], out);
+    FragPrintSummary(scan.records, scan.numRecords, out);
+
+    for(u_int64_t i = 0; i < scan.numRecords; i++) free(scan.records[i].path);
+    free(scan.records);
+    free(scan.visited);
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.wake);
+}
+
+#endif
@@ -0,0 +1,338 @@
+
+/******************/
+/*Hexdump.h       */
+/******************/
+
+/*
+This header file holds the HEXDUMP command, for looking at the raw bytes of
+an image.
+
+    HEXDUMP --sector <n> [--count k]
+    HEXDUMP --cluster <n> [--count k]
+    HEXDUMP <path> [--offset n] [--length n]
+
+Sectors are numbered from the start of the image, in the volume's sector
+size, so sector 0 is the MBR. Clusters are data clusters, dumped in disk
+order rather than by following their chain. A file is dumped through its
+chain, from offset for length bytes or to its end. Numbers may be written in
+hex with a leading 0x, and sizes may end in K, M or G.
+
+The layout is that of hexdump -C: the offset in the image (or the file), 16
+bytes in hex and the same bytes as text, with runs of identical rows squeezed
+into a single "*". Rows are built from lookup tables straight into a large
+buffer that goes out in one write when it fills, so dumping megabytes does
+not cost a formatted print per byte.
+*/
+
+#ifndef HEXDUMP_H
+#define HEXDUMP_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define HEXDUMP_ROW_BYTES 16
+#define HEXDUMP_LINE_MAX 96 //Longest line one row formats to
+#define HEXDUMP_OUT_BYTES (256*1024)
+
+//Two hex digits and the text character for every byte value, filled in once
+static char HexDumpPairs[256][2];
+static char HexDumpText[256];
+static pthread_once_t HexDumpTablesOnce = PTHREAD_ONCE_INIT;
+
+static void HexDumpBuildTables(void)
+{
+    const char* digits = "0123456789abcdef";
+    for(int b = 0; b < 256; b++)
+    {
+        HexDumpPairs[b][0] = digits[b >> 4];
+        HexDumpPairs[b][1] = digits[b & 0x0F];
+        HexDumpText[b] = (b >= 32 && b < 127) ? b : '.';
+    }
+}
+
+/// @brief A dump in progress. Rows may arrive in any number of pieces.
+struct HexDump
+{
+    FILE* out;
+    char* text; //Formatted rows waiting to be written
+    size_t used;
+    u_int64_t offset; //Offset printed on the next row
+    unsigned char row[HEXDUMP_ROW_BYTES]; //Bytes of the row being filled
+    uint rowFill;
+    unsigned char previous[HEXDUMP_ROW_BYTES]; //Last full row printed, for squeezing repeats
+    bool hasPrevious;
+    bool squeezing;
+};
+
+void HexDumpBegin(struct HexDump* dump, u_int64_t offset, FILE* out)
+{
+    pthread_once(&HexDumpTablesOnce, HexDumpBuildTables);
+    memset(dump, 0, sizeof(struct HexDump));
+    dump->out = out;
+    dump->offset = offset;
+    dump->text = malloc(HEXDUMP_OUT_BYTES);
+}
+
+/// @brief Writes out every formatted row held in the buffer.
+void HexDumpDrain(struct HexDump* dump)
+{
+    if(dump->used > 0) fwrite(dump->text, 1, dump->used, dump->out);
+    dump->used = 0;
+}
+
+/// @brief Writes a 12 digit hex offset into line.
+static inline char* HexDumpOffset(char* line, u_int64_t offset)
+{
+    for(int shift = 40; shift >= 0; shift -= 8)
+    {
+        memcpy(line, HexDumpPairs[(offset >> shift) & 0xFF], 2);
+        line += 2;
+    }
+    return line;
+}
+
+/// @brief Formats one row of up to 16 bytes.
+void HexDumpRow(struct HexDump* dump, const unsigned char* bytes, uint count)
+{
+    //Full rows that repeat the one before are squeezed, as hexdump -C does
+    if(count == HEXDUMP_ROW_BYTES && dump->hasPrevious && memcmp(bytes, dump->previous, HEXDUMP_ROW_BYTES) == 0)
+    {
+        if(!dump->squeezing)
+        {
+            if(dump->used + 2 > HEXDUMP_OUT_BYTES) HexDumpDrain(dump);
+            memcpy(dump->text + dump->used, "*\n", 2);
+            dump->used += 2;
+            dump->squeezing = true;
+        }
+        dump->offset += count;
+        return;
+    }
+    dump->squeezing = false;
+    if(count == HEXDUMP_ROW_BYTES)
+    {
+        memcpy(dump->previous, bytes, HEXDUMP_ROW_BYTES);
+        dump->hasPrevious = true;
+    }
+
+    if(dump->used + HEXDUMP_LINE_MAX > HEXDUMP_OUT_BYTES) HexDumpDrain(dump);
+    char* line = dump->text + dump->used;
+    char* start = line;
+
+    line = HexDumpOffset(line, dump->offset);
+    *line++ = ' ';
+    for(uint i = 0; i < HEXDUMP_ROW_BYTES; i++)
+    {
+        //An extra space splits the row in two
+        if(i % 8 == 0) *line++ = ' ';
+        if(i < count) memcpy(line, HexDumpPairs[bytes[i]], 2);
+        else memcpy(line, "  ", 2);
+        line[2] = ' ';
+        line += 3;
+    }
+    *line++ = ' ';
+    *line++ = '|';
+    for(uint i = 0; i < count; i++) *line++ = HexDumpText[bytes[i]];
+    *line++ = '|';
+    *line++ = '\n';
+
+    dump->used += line - start;
+    dump->offset += count;
+}
+
+/// @brief Adds bytes to the dump. Whole rows are formatted straight from bytes; only a row split across calls is copied.
+void HexDumpBytes(struct HexDump* dump, const unsigned char* bytes, size_t count)
+{
+    if(dump->text == NULL) return;
+
+    //Finish a row left partly filled by the last call
+    while(dump->rowFill > 0 && count > 0)
+    {
+        dump->row[dump->rowFill++] = *bytes++;
+        count--;
+        if(dump->rowFill == HEXDUMP_ROW_BYTES)
+        {
+            HexDumpRow(dump, dump->row, HEXDUMP_ROW_BYTES);
+            dump->rowFill = 0;
+        }
+    }
+
+    for(; count >= HEXDUMP_ROW_BYTES; bytes += HEXDUMP_ROW_BYTES, count -= HEXDUMP_ROW_BYTES) HexDumpRow(dump, bytes, HEXDUMP_ROW_BYTES);
+
+    memcpy(dump->row, bytes, count);
+    dump->rowFill = count;
+}
+
+/// @brief Prints the last partial row and the final offset, and frees the buffer.
+void HexDumpEnd(struct HexDump* dump)
+{
+    if(dump->text == NULL)
+    {
+        fprintf(dump->out, "Out of memory\n");
+        return;
+    }
+    if(dump->rowFill > 0) HexDumpRow(dump, dump->row, dump->rowFill);
+
+    char* line = HexDumpOffset(dump->text + dump->used, dump->offset);
+    *line++ = '\n';
+    dump->used = line - dump->text;
+    HexDumpDrain(dump);
+    free(dump->text);
+    dump->text = NULL;
+}
+
+/// @brief Parses a number for HEXDUMP: decimal with an optional K, M or G, or hex with a leading 0x.
+bool HexDumpParseNumber(const char* text, u_int64_t* value)
+{
+    if(text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        char* end;
+        *value = strtoull(text + 2, &end, 16);
+        return end != text + 2 && *end == '\0';
+    }
+    return ParseSize(text, value);
+}
+
+/// @brief Dumps a range of the image, read in the volume's preferred read size.
+void HexDumpImage(struct Fat32Volume* vol, u_int64_t offset, u_int64_t length, FILE* out)
+{
+    //Clip the range to the image so a dump running off its end stops there
+    struct stat info;
+    if(stat(Fat32ImagePath(vol), &info) == 0)
+    {
+        if(offset >= (u_int64_t)info.st_size)
+        {
+            fprintf(out, "Offset %llu is past the end of the image\n", (unsigned long long)offset);
+            return;
+        }
+        if(length > (u_int64_t)info.st_size - offset) length = info.st_size - offset;
+    }
+
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    if(buffer == NULL) return;
+
+    struct HexDump dump;
+    HexDumpBegin(&dump, offset, out);
+    u_int64_t chunkBytes = Fat32PreferredReadBytes(vol);
+    for(u_int64_t done = 0; done < length; )
+    {
+        size_t chunk = length - done < chunkBytes ? length - done : chunkBytes;
+        if(!Fat32ReadAt(vol, buffer, chunk, offset + done))
+        {
+            HexDumpDrain(&dump);
+            fprintf(out, "Read failed at offset %llu\n", (unsigned long long)(offset + done));
+            break;
+        }
+        HexDumpBytes(&dump, buffer, chunk);
+        done += chunk;
+    }
+    HexDumpEnd(&dump);
+    Fat32PutBuffer(vol, buffer);
+}
+
+/// @brief Dumps part of a file, following its chain.
+void HexDumpFile(struct Fat32Volume* vol, struct Fat32Entry* entry, u_int64_t offset, u_int64_t length, FILE* out)
+{
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    if(buffer == NULL) return;
+
+    struct HexDump dump;
+    HexDumpBegin(&dump, offset, out);
+    u_int64_t chunkBytes = Fat32PreferredReadBytes(vol);
+    for(u_int64_t done = 0; done < length; )
+    {
+        size_t chunk = length - done < chunkBytes ? length - done : chunkBytes;
+        ssize_t n = Fat32PRead(vol, entry, buffer, chunk, offset + done);
+        if(n <= 0)
+        {
+            HexDumpDrain(&dump);
+            if(n < 0) fprintf(out, "Read failed at offset %llu: %s\n", (unsigned long long)(offset + done), strerror(errno));
+            break;
+        }
+        HexDumpBytes(&dump, buffer, n);
+        done += n;
+    }
+    HexDumpEnd(&dump);
+    Fat32PutBuffer(vol, buffer);
+}
+
+/// @brief Runs HEXDUMP. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Hexdump(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    char* path = NULL;
+    bool hasSector = false, hasCluster = false, hasLength = false;
+    u_int64_t start = 0, count = 1, offset = 0, length = 0;
+
+    char* cursor = argument;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        if(strcmp(word, "--sector") == 0 || strcmp(word, "--cluster") == 0 || strcmp(word, "--count") == 0 || strcmp(word, "--offset") == 0 || strcmp(word, "--length") == 0)
+        {
+            char* value = NextWord(&cursor);
+            u_int64_t number;
+            if(value == NULL || !HexDumpParseNumber(value, &number))
+            {
+                fprintf(out, "%s needs a number\n", word);
+                return;
+            }
+            if(strcmp(word, "--sector") == 0) hasSector = true, start = number;
+            else if(strcmp(word, "--cluster") == 0) hasCluster = true, start = number;
+            else if(strcmp(word, "--count") == 0) count = number;
+            else if(strcmp(word, "--offset") == 0) offset = number;
+            else hasLength = true, length = number;
+        }
+        else if(path == NULL && word[0] != '-') path = word;
+        else
+        {
+            fprintf(out, "Unknown option %s\n", word);
+            return;
+        }
+    }
+
+    if((hasSector + hasCluster + (path != NULL)) != 1)
+    {
+        fprintf(out, "Usage: HEXDUMP --sector <n> [--count k] | --cluster <n> [--count k] | <path> [--offset n] [--length n]\n");
+        return;
+    }
+
+    if(hasSector)
+    {
+        u_int64_t sectorBytes = Fat32SectorBytes(vol);
+        HexDumpImage(vol, start * sectorBytes, count * sectorBytes, out);
+    }
+    else if(hasCluster)
+    {
+        u_int64_t clusterBytes = Fat32ClusterBytes(vol);
+        if(start < 2 || start >= Fat32ClusterCount(vol))
+        {
+            fprintf(out, "Cluster %llu is not a data cluster\n", (unsigned long long)start);
+            return;
+        }
+        if(count > Fat32ClusterCount(vol) - start) count = Fat32ClusterCount(vol) - start;
+        HexDumpImage(vol, Fat32ClusterOffset(vol, start), count * clusterBytes, out);
+    }
+    else
+    {
+        struct Fat32Entry entry;
+        if(!Fat32Stat(vol, currentDirectory, path, &entry))
+        {
+            fprintf(out, "File Not Found\n");
+            return;
+        }
+        if((entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+        {
+            fprintf(out, "%s is a directory\n", path);
+            return;
+        }
+        if(offset > entry.dir.DIR_FileSize) offset = entry.dir.DIR_FileSize;
+        if(!hasLength || length > entry.dir.DIR_FileSize - offset) length = entry.dir.DIR_FileSize - offset;
+        HexDumpFile(vol, &entry, offset, length, out);
+    }
+}
+
+#endif
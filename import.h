@@ -0,0 +1,283 @@
+
+/******************/
+/*Import.h        */
+/******************/
+
+/*
+This header file holds the IMPORT command, which copies files from the host
+into the image. It is the only command that writes, and it needs the image to
+be opened with --write.
+
+    IMPORT <host path> [dest]
+
+A host directory is copied with everything under it. dest is a path in the
+image: an existing directory to copy into, or a new name to copy to. Without
+it the copy lands in the current directory under its host name. Symbolic
+links inside a copied directory are skipped, not followed, so a link back up
+the tree cannot make the copy go on forever.
+
+Each file gets its clusters from the library's free extent map in one
+contiguous run whenever there is room for one, and its data goes out in reads
+and writes as large as the library's preferred read size. Clusters are
+linked in the in-memory FAT only, and the dirty FAT sectors are written to
+every FAT copy once, when the whole import is done, so importing thousands of
+small files costs a handful of FAT writes rather than one per cluster.
+*/
+
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/// @brief Running totals for one IMPORT.
+struct ImportTotals
+{
+    u_int64_t files;
+    u_int64_t directories;
+    u_int64_t bytes;
+    u_int64_t failures;
+};
+
+/// @brief Fills in the times and attributes of a new directory entry from a host file's stat.
+void ImportEntryTimes(struct DirectoryEntry* dir, const struct stat* info, u_int8_t attr)
+{
+    memset(dir, 0, sizeof(struct DirectoryEntry));
+    dir->DIR_Attr = attr;
+
+    //FAT dates start in 1980 and count time in local time, two seconds at a time
+    struct tm local;
+    time_t written = info->st_mtime;
+    localtime_r(&written, &local);
+    if(local.tm_year < 80)
+    {
+        local.tm_year = 80;
+        local.tm_mon = 0;
+        local.tm_mday = 1;
+        local.tm_hour = local.tm_min = local.tm_sec = 0;
+    }
+    u_int16_t date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+    u_int16_t time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+
+    dir->DIR_CrtDate = dir->DIR_WrtDate = dir->DIR_LstAccDate = date;
+    dir->DIR_CrtTime = dir->DIR_WrtTime = time;
+    dir->DIR_CrtTimeTenth = (local.tm_sec % 2) * 100;
+}
+
+/// @brief Copies one host file into a directory of the image.
+/// @return Whether the file was imported.
+bool ImportFile(struct Fat32Volume* vol, u_int32_t dirCluster, const char* hostPath, const char* name, struct ImportTotals* totals, FILE* out)
+{
+    int fd = open(hostPath, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        fprintf(out, "%s: %s\n", hostPath, strerror(errno));
+        if(fd >= 0) close(fd);
+        return false;
+    }
+    if((u_int64_t)info.st_size > 0xFFFFFFFFull)
+    {
+        fprintf(out, "%s: too large for FAT32\n", hostPath);
+        close(fd);
+        return false;
+    }
+
+    //The whole chain is allocated up front so the file lands in one run when it can
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    u_int32_t numClusters = ((u_int64_t)info.st_size + clusterBytes - 1) / clusterBytes;
+    u_int32_t firstCluster = 0;
+    if(numClusters > 0 && (firstCluster = Fat32AllocateChain(vol, numClusters)) == 0)
+    {
+        fprintf(out, "%s: %s\n", hostPath, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    u_int32_t chunkBytes = Fat32PreferredReadBytes(vol);
+    bool copied = buffer != NULL;
+    u_int64_t offset = 0;
+    while(copied && offset < (u_int64_t)info.st_size)
+    {
+        ssize_t n = pread(fd, buffer, chunkBytes, offset);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0)
+        {
+            fprintf(out, "%s: %s\n", hostPath, n < 0 ? strerror(errno) : "file shrank while it was imported");
+            copied = false;
+            break;
+        }
+
+        //The slack at the end of the last cluster is zeroed rather than left holding whatever was there before
+        size_t length = n;
+        if(offset + n >= (u_int64_t)info.st_size && length % clusterBytes != 0)
+        {
+            size_t padded = (length + clusterBytes - 1) / clusterBytes * clusterBytes;
+            memset(buffer + length, 0, padded - length);
+            length = padded;
+        }
+        if(Fat32PWrite(vol, firstCluster, buffer, length, offset) != (ssize_t)length)
+        {
+            fprintf(out, "%s: %s\n", hostPath, strerror(errno));
+            copied = false;
+        }
+        offset += n;
+    }
+    Fat32PutBuffer(vol, buffer);
+    close(fd);
+
+    struct DirectoryEntry dir;
+    ImportEntryTimes(&dir, &info, ATTR_ARCHIVE);
+    dir.DIR_FstClusLO = firstCluster & 0xFFFF;
+    dir.DIR_FstClusHI = firstCluster >> 16;
+    dir.DIR_FileSize = info.st_size;
+
+    struct Fat32Entry entry;
+    if(copied && !Fat32CreateEntry(vol, dirCluster, name, &dir, &entry))
+    {
+        fprintf(out, "%s: %s\n", name, errno == EEXIST ? "already exists" : errno == EINVAL ? "not a valid FAT name (ASCII only)" : strerror(errno));
+        copied = false;
+    }
+
+    if(!copied)
+    {
+        if(firstCluster != 0) Fat32FreeChain(vol, firstCluster);
+        return false;
+    }
+    totals->files++;
+    totals->bytes += info.st_size;
+    return true;
+}
+
+/// @brief Copies a host directory and everything under it into a new directory of the image.
+bool ImportTree(struct Fat32Volume* vol, u_int32_t dirCluster, const char* hostPath, const char* name, struct ImportTotals* totals, FILE* out)
+{
+    struct stat info;
+    DIR* hostDir = opendir(hostPath);
+    if(hostDir == NULL || stat(hostPath, &info) != 0)
+    {
+        fprintf(out, "%s: %s\n", hostPath, strerror(errno));
+        if(hostDir != NULL) closedir(hostDir);
+        return false;
+    }
+
+    struct DirectoryEntry dir;
+    struct Fat32Entry entry;
+    ImportEntryTimes(&dir, &info, ATTR_DIRECTORY);
+    if(!Fat32MakeDirectory(vol, dirCluster, name, &dir, &entry))
+    {
+        fprintf(out, "%s: %s\n", name, errno == EEXIST ? "already exists" : errno == EINVAL ? "not a valid FAT name (ASCII only)" : strerror(errno));
+        closedir(hostDir);
+        return false;
+    }
+    totals->directories++;
+
+    struct dirent* child;
+    while((child = readdir(hostDir)) != NULL)
+    {
+        if(strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0) continue;
+
+        size_t length = strlen(hostPath) + strlen(child->d_name) + 2;
+        char* childPath = malloc(length);
+        if(childPath == NULL) break;
+        snprintf(childPath, length, "%s/%s", hostPath, child->d_name);
+
+        struct stat childInfo;
+        bool imported = false;
+        if(lstat(childPath, &childInfo) != 0) fprintf(out, "%s: %s\n", childPath, strerror(errno));
+        else if(S_ISLNK(childInfo.st_mode)) fprintf(out, "%s: symbolic link, skipped\n", childPath);
+        else if(S_ISDIR(childInfo.st_mode)) imported = ImportTree(vol, entry.firstCluster, childPath, child->d_name, totals, out);
+        else if(S_ISREG(childInfo.st_mode)) imported = ImportFile(vol, entry.firstCluster, childPath, child->d_name, totals, out);
+        else fprintf(out, "%s: not a regular file, skipped\n", childPath);
+        if(!imported) totals->failures++;
+        free(childPath);
+    }
+    closedir(hostDir);
+    return true;
+}
+
+/// @brief Runs IMPORT. See the top of this file for the syntax.
+void Import(struct Fat32Volume* vol, u_int32_t currentDirectory, char* argument, FILE* out)
+{
+    char* cursor = argument;
+    char* hostPath = NextWord(&cursor);
+    char* dest = NextWord(&cursor);
+    if(hostPath == NULL || NextWord(&cursor) != NULL)
+    {
+        fprintf(out, "Usage: IMPORT <host path> [dest]\n");
+        return;
+    }
+    if(!Fat32Writable(vol))
+    {
+        fprintf(out, "The image is open read-only. Start the reader with --write to import.\n");
+        return;
+    }
+
+    struct stat info;
+    if(stat(hostPath, &info) != 0)
+    {
+        fprintf(out, "%s: %s\n", hostPath, strerror(errno));
+        return;
+    }
+
+    //The name in the image defaults to the last component of the host path
+    char* hostName = hostPath + strlen(hostPath);
+    while(hostName > hostPath && hostName[-1] == '/') *--hostName = '\0';
+    while(hostName > hostPath && hostName[-1] != '/') hostName--;
+
+    //dest is either a directory to copy into, or a new name whose parent directory exists
+    u_int32_t dirCluster = currentDirectory;
+    const char* name = hostName;
+    struct Fat32Entry destEntry;
+    if(dest != NULL && Fat32Stat(vol, currentDirectory, dest, &destEntry))
+    {
+        if((destEntry.dir.DIR_Attr & ATTR_DIRECTORY) != ATTR_DIRECTORY)
+        {
+            fprintf(out, "%s: already exists\n", dest);
+            return;
+        }
+        dirCluster = destEntry.firstCluster;
+    }
+    else if(dest != NULL)
+    {
+        char* slash = strrchr(dest, '/');
+        name = slash ? slash + 1 : dest;
+        if(slash != NULL)
+        {
+            *slash = '\0';
+            if(!Fat32Stat(vol, currentDirectory, dest[0] ? dest : "/", &destEntry) || (destEntry.dir.DIR_Attr & ATTR_DIRECTORY) != ATTR_DIRECTORY)
+            {
+                fprintf(out, "%s: No such directory\n", dest[0] ? dest : "/");
+                return;
+            }
+            dirCluster = destEntry.firstCluster;
+        }
+    }
+
+    struct ImportTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    bool imported;
+    if(S_ISDIR(info.st_mode)) imported = ImportTree(vol, dirCluster, hostPath, name, &totals, out);
+    else if(S_ISREG(info.st_mode)) imported = ImportFile(vol, dirCluster, hostPath, name, &totals, out);
+    else
+    {
+        fprintf(out, "%s: not a regular file or directory\n", hostPath);
+        return;
+    }
+    if(!imported) totals.failures++;
+
+    //Everything allocated above has only touched the in-memory FAT so far
+    if(!Fat32Flush(vol)) fprintf(out, "Writing the FAT failed: %s\n", strerror(errno));
+
+    fprintf(out, "Imported %'llu file(s) and %'llu director(ies), %'llu bytes", (unsigned long long)totals.files, (unsigned long long)totals.directories, (unsigned long long)totals.bytes);
+    if(totals.failures > 0) fprintf(out, ", %'llu failed", (unsigned long long)totals.failures);
+    fprintf(out, "\n");
+}
+
+#endif
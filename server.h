@@ -0,0 +1,477 @@
+
+/******************/
+/*Server.h        */
+/******************/
+
+/*
+This header file holds the daemon mode of the reader. Images are mounted once
+and then served to any number of clients over a Unix-domain socket, so a query
+no longer pays the mount cost or throws away what the previous query read.
+
+The main thread owns an epoll loop which accepts clients and waits for them to
+send data. Ready clients are handed to a pool of worker threads which parse the
+commands, run them against the shared mounts and write the reply back.
+Client sockets are registered as EPOLLONESHOT, so a client is only ever owned by
+one worker at a time and its commands are answered in the order they were sent.
+
+Every image is opened as a Disk, so USE and pN: prefixes reach its other partitions.
+Every client keeps its own selected image, partition and current directories;
+a partition is mounted the first time any client uses it, and from then on is shared.
+The FAT, directory entry and cluster caches live on the Fat32Volume and are shared by everyone.
+Apart from VOL, EXTRACT and QUIT, commands are run by ExecuteCommand exactly as they are at the prompt,
+but only the ones that read the image and reply in text. Commands that read or write host paths
+(IMPORT, CARVE, UNDELETE --recover, EXPORT, EXTRACT -r) would do so as the daemon's user on a client's
+say, and CAT would put raw bytes in a reply that ends at a "." line, so the socket refuses them.
+
+Protocol: one command per line. Every reply ends with a line holding a single ".".
+    VOL [n]            List the mounted images, or select image n.
+    USE [n]            List the selected image's partitions, or switch to partition n.
+    DIR                List the current directory.
+    CD <name>          Change the current directory.
+    STAT <path>        Print the directory entry of a file or directory.
+    FIND, DU, FRAG, CHECK, HEXDUMP and UNDELETE --scan, as at the prompt.
+    EXTRACT <path>     Reply "DATA <size>" followed by exactly <size> raw bytes. The path may start with pN:.
+    QUIT               Close the connection.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "helper.h"
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#define SERVER_MAX_VOLUMES 16
+#define SERVER_MAX_EVENTS 64
+#define SERVER_LINE_MAX 512
+
+/// @brief Per connection state. Only the worker currently holding the client touches it.
+struct ServerClient
+{
+    int fd;
+    uint volumeIndex;
+    struct Disk* disks[SERVER_MAX_VOLUMES]; //This client's view of each image, made the first time it is selected
+    char inBuffer[SERVER_LINE_MAX];
+    uint inLength;
+    struct ServerClient* nextJob;
+    struct ServerClient* previousClient; //Every open connection is on server.clients, so shutdown can close them all
+    struct ServerClient* nextClient;
+};
+
+struct Server
+{
+    struct Disk disks[SERVER_MAX_VOLUMES];
+    uint numVolumes;
+    int epollFd;
+    int listenFd;
+
+    //Worker pool job queue
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueCond;
+    struct ServerClient* queueHead;
+    struct ServerClient* queueTail;
+    bool stopping;
+
+    //Every open connection, whether queued, being served or parked in epoll
+    pthread_mutex_t clientsLock;
+    struct ServerClient* clients;
+}server;
+
+volatile sig_atomic_t serverStopRequested = 0;
+
+void ServerSignalHandler(int sig)
+{
+    (void)sig;
+    serverStopRequested = 1;
+}
+
+/// @brief Writes exactly count bytes to a socket, retrying short writes.
+/// @return Whether every byte was written.
+bool ServerWriteAll(int fd, const void* buffer, size_t count)
+{
+    size_t done = 0;
+    while(done < count)
+    {
+        ssize_t n = send(fd, (const unsigned char*)buffer + done, count - done, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/// @brief The client's view of the image it has selected, made on first use.
+/// @return The view, or NULL when there was no memory for it.
+struct Disk* ServerClientDisk(struct ServerClient* client)
+{
+    struct Disk** view = &client->disks[client->volumeIndex];
+    if(*view == NULL && (*view = calloc(1, sizeof(struct Disk))) != NULL) DiskView(*view, &server.disks[client->volumeIndex]);
+    return *view;
+}
+
+/// @brief Streams a file to the client.
+/// @return Whether the client is still connected.
+bool ServerCommandExtract(struct ServerClient* client, char* name, FILE* out)
+{
+    struct Disk* disk = ServerClientDisk(client);
+    if(disk == NULL)
+    {
+        fprintf(out, "%s\n", strerror(ENOMEM));
+        return true;
+    }
+    uint number = DiskPathPartition(&name);
+    int index = number == 0 ? disk->current : DiskMountNumber(disk, number, out);
+    if(index < 0) return true;
+
+    struct Fat32Volume* vol = disk->volumes[index];
+    struct Fat32Entry entry;
+    if(!Fat32Stat(vol, disk->currentDirectory[index], name, &entry) || (entry.dir.DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+    {
+        fprintf(out, "File Not Found\n");
+        return true;
+    }
+
+    //The header and the raw bytes go straight to the socket; only the terminator goes through the reply buffer
+    char header[32];
+    int headerLength = snprintf(header, sizeof(header), "DATA %u\n", entry.dir.DIR_FileSize);
+    if(!ServerWriteAll(client->fd, header, headerLength)) return false;
+
+    //The file goes from the image to the socket with sendfile, so its bytes never pass through the worker
+    u_int64_t offset = 0;
+    while(offset < entry.dir.DIR_FileSize)
+    {
+        ssize_t sent = Fat32SendFile(vol, &entry, client->fd, offset, entry.dir.DIR_FileSize - offset);
+        if(sent > 0)
+        {
+            offset += sent;
+            continue;
+        }
+        if(errno != EIO) return false;
+        break;
+    }
+
+    //Zero fill when the chain is shorter than the size says, so the client still gets the length it was promised
+    bool connected = true;
+    if(offset < entry.dir.DIR_FileSize)
+    {
+        u_int32_t extentBytes = Fat32PreferredReadBytes(vol);
+        unsigned char* buffer = Fat32GetBuffer(vol);
+        if(buffer == NULL) return false;
+        memset(buffer, 0, extentBytes);
+        while(offset < entry.dir.DIR_FileSize && connected)
+        {
+            u_int64_t chunk = entry.dir.DIR_FileSize - offset < extentBytes ? entry.dir.DIR_FileSize - offset : extentBytes;
+            connected = ServerWriteAll(client->fd, buffer, chunk);
+            offset += chunk;
+        }
+        Fat32PutBuffer(vol, buffer);
+    }
+    return connected;
+}
+
+void ServerCommandVol(struct ServerClient* client, const char* argument, FILE* out)
+{
+    if(argument[0] != '\0')
+    {
+        char* end;
+        unsigned long index = strtoul(argument, &end, 10);
+        if(*end != '\0' || index >= server.numVolumes)
+        {
+            fprintf(out, "Volume Not Found\n");
+            return;
+        }
+        client->volumeIndex = index;
+    }
+
+    for(uint i = 0; i < server.numVolumes; i++)
+    {
+        //The partition this client is on, or the one the image was opened on
+        struct Disk* disk = client->disks[i] != NULL ? client->disks[i] : &server.disks[i];
+        struct Fat32Volume* vol = disk->volumes[disk->current];
+        fprintf(out, "%c %u %s %s\n", i == client->volumeIndex ? '*' : ' ', i, Fat32GetBPB(vol)->BS_VolLab, Fat32ImagePath(vol));
+    }
+}
+
+/// @brief Whether a prompt command may be run for a client. See the top of this file.
+bool ServerAllowed(const char* command, const char* argument)
+{
+    static const char* textCommands[] = {"DIR", "CD", "STAT", "FIND", "DU", "FRAG", "CHECK", "HEXDUMP", "USE"};
+    for(uint i = 0; i < sizeof(textCommands) / sizeof(textCommands[0]); i++) if(strcasecmp(command, textCommands[i]) == 0) return true;
+
+    //UNDELETE only lists; --recover writes to the host
+    return strcasecmp(command, "UNDELETE") == 0 && strncmp(argument, "--scan", 6) == 0 && (argument[6] == '\0' || isspace((unsigned char)argument[6]));
+}
+
+/// @brief Runs one command line for a client and sends the reply.
+/// @return Whether the connection should stay open.
+bool ServerExecute(struct ServerClient* client, char* line)
+{
+    char* reply = NULL;
+    size_t replyLength = 0;
+    FILE* out = open_memstream(&reply, &replyLength);
+    if(out == NULL) return false;
+
+    //Everything but the connection level commands runs exactly as it does at the prompt
+    char command[SERVER_LINE_MAX];
+    strcpy(command, line);
+    char* argument = SplitCommand(command);
+    if(command[0] == '\0')
+    {
+        fclose(out);
+        free(reply);
+        return true;
+    }
+
+    bool keepOpen = true;
+    Fat32TraceContext(command);
+    if(strcasecmp(command, "VOL") == 0) ServerCommandVol(client, argument, out);
+    else if(strcasecmp(command, "EXTRACT") == 0) keepOpen = ServerCommandExtract(client, argument, out);
+    else if(strcasecmp(command, "QUIT") == 0) keepOpen = false;
+    else if(!ServerAllowed(command, argument)) fprintf(out, "%s is not available over the socket\n", command);
+    else if(ServerClientDisk(client) == NULL) fprintf(out, "%s\n", strerror(ENOMEM));
+    else
+    {
+        //The session runs on the client's view, so USE and CD p2: move only this client
+        struct Disk* disk = client->disks[client->volumeIndex];
+        struct Session session = {.vol = disk->volumes[disk->current], .currentDirectory = disk->currentDirectory[disk->current], .disk = disk};
+        ExecuteCommand(&session, line, out);
+        disk->currentDirectory[disk->current] = session.currentDirectory;
+    }
+
+    fprintf(out, ".\n");
+    fclose(out);
+    if(keepOpen || strcasecmp(command, "QUIT") == 0) keepOpen = ServerWriteAll(client->fd, reply, replyLength) && keepOpen;
+    free(reply);
+    return keepOpen;
+}
+
+/// @brief Hands a ready client to the worker pool.
+void ServerQueuePush(struct ServerClient* client)
+{
+    pthread_mutex_lock(&server.queueLock);
+    client->nextJob = NULL;
+    if(server.queueTail) server.queueTail->nextJob = client;
+    else server.queueHead = client;
+    server.queueTail = client;
+    pthread_cond_signal(&server.queueCond);
+    pthread_mutex_unlock(&server.queueLock);
+}
+
+/// @brief Blocks until a client is ready or the server stops.
+/// @return The client to serve, or NULL when the worker should exit.
+struct ServerClient* ServerQueuePop()
+{
+    pthread_mutex_lock(&server.queueLock);
+    while(server.queueHead == NULL && !server.stopping) pthread_cond_wait(&server.queueCond, &server.queueLock);
+    struct ServerClient* client = server.queueHead;
+    if(client)
+    {
+        server.queueHead = client->nextJob;
+        if(server.queueHead == NULL) server.queueTail = NULL;
+    }
+    pthread_mutex_unlock(&server.queueLock);
+    return client;
+}
+
+/// @brief Reads whatever the client has sent and runs every complete line in it.
+/// @return Whether the connection should stay open.
+bool ServerServeClient(struct ServerClient* client)
+{
+    while(true)
+    {
+        ssize_t n = recv(client->fd, client->inBuffer + client->inLength, SERVER_LINE_MAX - 1 - client->inLength, MSG_DONTWAIT);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if(n <= 0) return false;
+        client->inLength += n;
+
+        //Run every complete line, then keep the partial one for the next read
+        char* lineStart = client->inBuffer;
+        char* newline;
+        while((newline = memchr(lineStart, '\n', client->inLength - (lineStart - client->inBuffer))) != NULL)
+        {
+            *newline = '\0';
+            if(!ServerExecute(client, lineStart)) return false;
+            lineStart = newline + 1;
+        }
+
+        client->inLength -= lineStart - client->inBuffer;
+        memmove(client->inBuffer, lineStart, client->inLength);
+
+        //A line longer than the buffer can never complete
+        if(client->inLength == SERVER_LINE_MAX - 1)
+        {
+            const char* error = "ERR line too long\n.\n";
+            ServerWriteAll(client->fd, error, strlen(error));
+            return false;
+        }
+    }
+}
+
+void ServerClientFree(struct ServerClient* client)
+{
+    pthread_mutex_lock(&server.clientsLock);
+    if(client->previousClient) client->previousClient->nextClient = client->nextClient;
+    else server.clients = client->nextClient;
+    if(client->nextClient) client->nextClient->previousClient = client->previousClient;
+    pthread_mutex_unlock(&server.clientsLock);
+
+    close(client->fd);
+    for(uint i = 0; i < server.numVolumes; i++) free(client->disks[i]);
+    free(client);
+}
+
+void* ServerWorker(void* unused)
+{
+    (void)unused;
+    struct ServerClient* client;
+    while((client = ServerQueuePop()) != NULL)
+    {
+        if(ServerServeClient(client))
+        {
+            //Give the client back to epoll; EPOLLONESHOT disarmed it when it was queued
+            struct epoll_event event = {0};
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            event.data.ptr = client;
+            if(epoll_ctl(server.epollFd, EPOLL_CTL_MOD, client->fd, &event) == 0) continue;
+        }
+        epoll_ctl(server.epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+        ServerClientFree(client);
+    }
+    return NULL;
+}
+
+/// @brief Accepts every pending connection on the listening socket.
+void ServerAccept()
+{
+    while(true)
+    {
+        int fd = accept4(server.listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0) return;
+
+        struct ServerClient* client = calloc(1, sizeof(struct ServerClient));
+        if(client == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+
+        //Listed before epoll can hand it to a worker, which may free it straight away
+        pthread_mutex_lock(&server.clientsLock);
+        client->nextClient = server.clients;
+        if(server.clients) server.clients->previousClient = client;
+        server.clients = client;
+        pthread_mutex_unlock(&server.clientsLock);
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = client;
+        if(epoll_ctl(server.epollFd, EPOLL_CTL_ADD, fd, &event) != 0) ServerClientFree(client);
+    }
+}
+
+/// @brief Mounts every image and serves clients on socketPath until SIGINT or SIGTERM.
+/// @param numWorkers The size of the worker pool. Zero picks one worker per online CPU.
+/// @param openFlags FAT32_OPEN_* flags every image is opened with.
+/// @param fatBudget Most bytes each partition's in-memory FAT may take, or 0 for no limit. See Fat32OpenWithBudget.
+/// @return The process exit status.
+int RunServer(const char* socketPath, char** images, uint numImages, uint numWorkers, int openFlags, u_int64_t fatBudget)
+{
+    if(numImages == 0 || numImages > SERVER_MAX_VOLUMES)
+    {
+        fprintf(stderr, "Between 1 and %d images can be served.\n", SERVER_MAX_VOLUMES);
+        return 1;
+    }
+
+    Fat32TraceContext("OPEN");
+    for(uint i = 0; i < numImages; i++)
+    {
+        if(!DiskOpen(&server.disks[i], images[i], openFlags, fatBudget))
+        {
+            fprintf(stderr, "%s: %s\n", images[i], errno == EINVAL ? "not a FAT32 volume" : errno == ENOMEM ? "the FAT does not fit the memory budget" : strerror(errno));
+            return 1;
+        }
+        server.numVolumes++;
+    }
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long.\n");
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socketPath);
+    if(server.listenFd < 0 || bind(server.listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server.listenFd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", socketPath, strerror(errno));
+        return 1;
+    }
+
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listenEvent = {0};
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.ptr = NULL; //NULL marks the listening socket
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &listenEvent);
+
+    struct sigaction action = {0};
+    action.sa_handler = ServerSignalHandler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(numWorkers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numWorkers = cpus > 0 ? cpus : 4;
+    }
+    pthread_mutex_init(&server.queueLock, NULL);
+    pthread_cond_init(&server.queueCond, NULL);
+    pthread_mutex_init(&server.clientsLock, NULL);
+    pthread_t* workers = malloc(numWorkers * sizeof(pthread_t));
+    for(uint i = 0; i < numWorkers; i++) pthread_create(&workers[i], NULL, ServerWorker, NULL);
+
+    printf("Serving %u image(s) on %s with %u worker(s)\n", server.numVolumes, socketPath, numWorkers);
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while(!serverStopRequested)
+    {
+        //Wake up now and then to notice a stop request
+        int ready = epoll_wait(server.epollFd, events, SERVER_MAX_EVENTS, 500);
+        for(int i = 0; i < ready; i++)
+        {
+            if(events[i].data.ptr == NULL) ServerAccept();
+            else ServerQueuePush(events[i].data.ptr);
+        }
+    }
+
+    printf("Shutting down...\n");
+    pthread_mutex_lock(&server.queueLock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.queueCond);
+    pthread_mutex_unlock(&server.queueLock);
+    for(uint i = 0; i < numWorkers; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    //With the workers gone, the clients left are parked in epoll and nobody else holds them
+    while(server.clients != NULL) ServerClientFree(server.clients);
+    close(server.epollFd);
+
+    close(server.listenFd);
+    unlink(socketPath);
+    for(uint i = 0; i < server.numVolumes; i++) DiskClose(&server.disks[i]);
+    return 0;
+}
+
+#endif
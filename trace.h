@@ -0,0 +1,613 @@
+
+/******************/
+/*Trace.h         */
+/******************/
+
+/*
+This header file holds replay mode, which plays an access trace back against
+simulated caches, so cache and readahead sizes can be picked for a workload
+from what it really did rather than from guesses.
+
+    fat32 --trace <file> <any other mode>    record every image access to file
+    fat32 --replay <file> [--cache sizes] [--readahead sizes] [--block size]
+                          [--hit-ns n] [--seek-us n] [--mbps n] [--paged-fat] [--threads n]
+
+--trace works with the prompt, --cat, --export, --fleet and --serve alike, and
+files each access under the command that made it. See Fat32TraceOpen for what
+is recorded.
+
+--cache and --readahead take comma separated sizes, such as 16M,256M,1G, and
+every pairing of the two is replayed. They default to 4M,16M,64M,256M and
+0,128K,1M. The pairings are replayed in parallel, on up to --threads threads,
+which defaults to the number of CPUs.
+
+The simulated cache is one LRU of --block sized blocks (default 4K) shared by
+every image in the trace. A read costs --hit-ns (default 250) for each block
+found, and one device request for each run of blocks that is not: --seek-us
+(default 100) plus its bytes at --mbps (default 500). Writes go through to the
+device and leave their blocks cached; they count toward device bytes but not
+toward time, since the caller does not wait for them.
+
+Readahead follows up to TRACE_STREAMS sequential streams at once. A cluster or
+data read that starts where a stream ended moves the stream's window on past
+the end of the read. The window opens at four times the read and doubles each
+time the stream carries on, up to the readahead size. Blocks of it not yet cached
+are read along with the read's own missing blocks when it missed, adding only
+their transfer time, or in the background when it hit, adding no time at all.
+
+The library holds the FAT in memory, so by default the read of the whole FAT
+when a volume is opened is replayed and the lookups into it are not.
+--paged-fat replays them the other way round, as a cache that pages the FAT
+in sector by sector would see them.
+
+The report starts with the trace itself, by image and by command, then gives
+one line per pairing: its hit rate overall and for clusters (directories,
+mostly), FAT sectors and file data, the device requests and megabytes it took,
+the readahead megabytes never used, and the simulated time. The fastest
+pairing is named last.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define TRACE_MAX_SIZES 16 //Most sizes one of --cache or --readahead may list
+#define TRACE_MAX_THREADS 64
+#define TRACE_STREAMS 32 //Sequential streams readahead follows at once
+#define TRACE_KINDS (FAT32_TRACE_WRITE + 1)
+#define TRACE_NONE 0xFFFFFFFF //No block cache node
+
+/// @brief An LRU cache of blocks, keyed by image and block number. Nodes are indexes into the arrays.
+struct TraceCache
+{
+    u_int32_t capacity; //Blocks the cache holds. 0 caches nothing
+    u_int32_t used;
+    u_int64_t* keys;
+    u_int32_t* newer; //Toward the most recently used node
+    u_int32_t* older;
+    u_int32_t* chain; //Next node in the same hash bucket
+    bool* prefetched; //Read by readahead and not asked for since
+    u_int32_t* buckets;
+    u_int32_t bucketMask;
+    u_int32_t newest, oldest;
+};
+
+/// @brief A run of sequential reads readahead is following.
+struct TraceStream
+{
+    u_int16_t image;
+    u_int64_t end; //Where the last read of the stream ended
+    u_int64_t windowEnd; //How far readahead has read
+    u_int64_t window; //Bytes readahead keeps ahead of the stream, 0 until it is seen to be sequential
+    u_int64_t lastUsed; //Access number the stream last moved on, so the stalest one is replaced
+};
+
+/// @brief One pairing of cache and readahead size, and what replaying the trace through it cost.
+struct TraceConfig
+{
+    const char* cacheText;
+    const char* readaheadText;
+    u_int64_t cacheBytes, readaheadBytes;
+
+    u_int64_t blocks[TRACE_KINDS]; //Blocks read, by record kind
+    u_int64_t hits[TRACE_KINDS];
+    u_int64_t requests; //Device requests, background readahead and writes included
+    u_int64_t deviceBytes;
+    u_int64_t unusedBytes; //Read ahead and never asked for
+    double nanoseconds; //Simulated time spent waiting on reads
+    bool failed;
+};
+
+/// @brief Everything a replay shares between its threads.
+struct TraceReplay
+{
+    const char* path;
+    u_int64_t blockBytes;
+    double hitNs, seekNs, nsPerByte;
+    bool pagedFat;
+
+    struct TraceConfig configs[TRACE_MAX_SIZES * TRACE_MAX_SIZES];
+    uint numConfigs;
+    pthread_mutex_t lock;
+    uint nextConfig;
+};
+
+/// @brief Opens a trace file and checks its header.
+/// @return The file, positioned at the first record, or NULL after saying why to out.
+FILE* TraceOpenFile(const char* path, FILE* out)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        fprintf(out, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct Fat32TraceHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, FAT32_TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(out, "%s: not a trace file\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if(header.version != FAT32_TRACE_VERSION || header.recordBytes != sizeof(struct Fat32TraceRecord))
+    {
+        fprintf(out, "%s: trace version %u is not one this build reads\n", path, header.version);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/// @brief Reads the next record of a trace. A name record's name is copied into name, cut to fit, or skipped when name is NULL.
+/// @return 1 for a record, 0 at the end of the trace, or -1 when it is cut short.
+int TraceNextRecord(FILE* file, struct Fat32TraceRecord* record, char* name, size_t nameBytes)
+{
+    //A process killed mid-write leaves part of a record at the end
+    size_t got = fread_unlocked(record, 1, sizeof(*record), file);
+    if(got < sizeof(*record)) return got == 0 && !ferror(file) ? 0 : -1;
+    if(record->kind < FAT32_TRACE_IMAGE_NAME) return 1;
+
+    size_t kept = 0;
+    if(name != NULL)
+    {
+        kept = record->length < nameBytes - 1 ? record->length : nameBytes - 1;
+        if(fread_unlocked(name, 1, kept, file) != kept) return -1;
+        name[kept] = '\0';
+    }
+    if(record->length > kept && fseek(file, record->length - kept, SEEK_CUR) != 0) return -1;
+    return 1;
+}
+
+bool TraceCacheInit(struct TraceCache* cache, u_int64_t blocks)
+{
+    memset(cache, 0, sizeof(struct TraceCache));
+    cache->newest = cache->oldest = TRACE_NONE;
+    if(blocks >= TRACE_NONE) blocks = TRACE_NONE - 1;
+    cache->capacity = blocks;
+    if(blocks == 0) return true;
+
+    //Buckets run at half load or less
+    u_int32_t numBuckets = 1;
+    while(numBuckets < blocks * 2 && numBuckets < 0x80000000u) numBuckets *= 2;
+    cache->bucketMask = numBuckets - 1;
+    cache->keys = malloc(blocks * sizeof(u_int64_t));
+    cache->newer = malloc(blocks * sizeof(u_int32_t));
+    cache->older = malloc(blocks * sizeof(u_int32_t));
+    cache->chain = malloc(blocks * sizeof(u_int32_t));
+    cache->prefetched = malloc(blocks * sizeof(bool));
+    cache->buckets = malloc(numBuckets * sizeof(u_int32_t));
+    if(cache->keys == NULL || cache->newer == NULL || cache->older == NULL || cache->chain == NULL || cache->prefetched == NULL || cache->buckets == NULL) return false;
+    memset(cache->buckets, 0xFF, numBuckets * sizeof(u_int32_t));
+    return true;
+}
+
+void TraceCacheFree(struct TraceCache* cache)
+{
+    free(cache->keys);
+    free(cache->newer);
+    free(cache->older);
+    free(cache->chain);
+    free(cache->prefetched);
+    free(cache->buckets);
+}
+
+static inline u_int32_t TraceCacheBucket(struct TraceCache* cache, u_int64_t key)
+{
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ull;
+    key ^= key >> 32;
+    return key & cache->bucketMask;
+}
+
+/// @brief Takes a node out of the recency list.
+static void TraceCacheUnlink(struct TraceCache* cache, u_int32_t node)
+{
+    if(cache->newer[node] != TRACE_NONE) cache->older[cache->newer[node]] = cache->older[node];
+    else cache->newest = cache->older[node];
+    if(cache->older[node] != TRACE_NONE) cache->newer[cache->older[node]] = cache->newer[node];
+    else cache->oldest = cache->newer[node];
+}
+
+/// @brief Puts a node at the most recently used end of the recency list.
+static void TraceCachePushNewest(struct TraceCache* cache, u_int32_t node)
+{
+    cache->newer[node] = TRACE_NONE;
+    cache->older[node] = cache->newest;
+    if(cache->newest != TRACE_NONE) cache->newer[cache->newest] = node;
+    cache->newest = node;
+    if(cache->oldest == TRACE_NONE) cache->oldest = node;
+}
+
+/// @brief Looks a block up, making it the most recently used if it is there.
+/// @return Its node, or TRACE_NONE.
+u_int32_t TraceCacheFind(struct TraceCache* cache, u_int64_t key)
+{
+    if(cache->capacity == 0) return TRACE_NONE;
+    u_int32_t node = cache->buckets[TraceCacheBucket(cache, key)];
+    while(node != TRACE_NONE && cache->keys[node] != key) node = cache->chain[node];
+    if(node != TRACE_NONE && node != cache->newest)
+    {
+        TraceCacheUnlink(cache, node);
+        TraceCachePushNewest(cache, node);
+    }
+    return node;
+}
+
+/// @brief Adds a block that is not in the cache, dropping the least recently used one if the cache is full.
+/// @return Whether the block dropped had been read ahead and never used.
+bool TraceCacheInsert(struct TraceCache* cache, u_int64_t key, bool prefetched)
+{
+    if(cache->capacity == 0) return false;
+
+    u_int32_t node;
+    bool wasted = false;
+    if(cache->used < cache->capacity) node = cache->used++;
+    else
+    {
+        node = cache->oldest;
+        wasted = cache->prefetched[node];
+        TraceCacheUnlink(cache, node);
+        u_int32_t* link = &cache->buckets[TraceCacheBucket(cache, cache->keys[node])];
+        while(*link != node) link = &cache->chain[*link];
+        *link = cache->chain[node];
+    }
+
+    cache->keys[node] = key;
+    cache->prefetched[node] = prefetched;
+    u_int32_t bucket = TraceCacheBucket(cache, key);
+    cache->chain[node] = cache->buckets[bucket];
+    cache->buckets[bucket] = node;
+    TraceCachePushNewest(cache, node);
+    return wasted;
+}
+
+/// @brief Works out a record's effect on the cache, the device and the time spent.
+void TraceReplayRecord(struct TraceReplay* replay, struct TraceConfig* config, struct TraceCache* cache,
+struct TraceStream* streams, u_int64_t accessNumber, const struct Fat32TraceRecord* record)
+{
+    u_int64_t block = replay->blockBytes;
+    u_int64_t first = record->offset / block;
+    u_int64_t last = (record->offset + record->length - 1) / block;
+    //Block numbers stay well under 2^48 for any image a trace can name
+    u_int64_t imageKey = (u_int64_t)record->image << 48;
+
+    if(record->kind == FAT32_TRACE_WRITE)
+    {
+        for(u_int64_t b = first; b <= last; b++)
+        {
+            u_int32_t node = TraceCacheFind(cache, imageKey | b);
+            if(node != TRACE_NONE) cache->prefetched[node] = false;
+            else if(TraceCacheInsert(cache, imageKey | b, false)) config->unusedBytes += block;
+        }
+        config->requests++;
+        config->deviceBytes += record->length;
+        return;
+    }
+
+    //Every run of missing blocks is one request; only the last one can still take readahead blocks on
+    u_int64_t runBlocks = 0;
+    bool endedInMiss = false;
+    for(u_int64_t b = first; b <= last; b++)
+    {
+        u_int32_t node = TraceCacheFind(cache, imageKey | b);
+        config->blocks[record->kind]++;
+        endedInMiss = node == TRACE_NONE;
+        if(node != TRACE_NONE)
+        {
+            config->hits[record->kind]++;
+            cache->prefetched[node] = false;
+            config->nanoseconds += replay->hitNs;
+            if(runBlocks > 0)
+            {
+                config->requests++;
+                config->deviceBytes += runBlocks * block;
+                config->nanoseconds += replay->seekNs + runBlocks * block * replay->nsPerByte;
+                runBlocks = 0;
+            }
+            continue;
+        }
+        if(TraceCacheInsert(cache, imageKey | b, false)) config->unusedBytes += block;
+        runBlocks++;
+    }
+
+    //Readahead follows reads that carry on where an earlier one ended
+    u_int64_t aheadBlocks = 0;
+    u_int64_t end = record->offset + record->length;
+    if(config->readaheadBytes > 0 && (record->kind == FAT32_TRACE_CLUSTER || record->kind == FAT32_TRACE_DATA))
+    {
+        struct TraceStream* stream = NULL;
+        struct TraceStream* stalest = &streams[0];
+        for(int i = 0; i < TRACE_STREAMS && stream == NULL; i++)
+        {
+            if(streams[i].lastUsed != 0 && streams[i].image == record->image && streams[i].end == record->offset) stream = &streams[i];
+            else if(streams[i].lastUsed < stalest->lastUsed) stalest = &streams[i];
+        }
+
+        if(stream == NULL)
+        {
+            stalest->image = record->image;
+            stalest->end = stalest->windowEnd = end;
+            stalest->window = 0;
+            stalest->lastUsed = accessNumber;
+        }
+        else
+        {
+            //The window opens at four times the read and doubles each time the stream carries on, as the kernel's does
+            u_int64_t opening = (record->length + block - 1) / block * block * 4;
+            stream->window = stream->window == 0 ? opening : stream->window * 2;
+            if(stream->window > config->readaheadBytes) stream->window = config->readaheadBytes;
+            u_int64_t windowEnd = end + stream->window;
+            u_int64_t from = stream->windowEnd > end ? stream->windowEnd : end;
+            for(u_int64_t b = (from + block - 1) / block; b < (windowEnd + block - 1) / block; b++)
+            {
+                if(TraceCacheFind(cache, imageKey | b) != TRACE_NONE) continue;
+                if(TraceCacheInsert(cache, imageKey | b, true)) config->unusedBytes += block;
+                aheadBlocks++;
+            }
+            if(windowEnd > stream->windowEnd) stream->windowEnd = windowEnd;
+            stream->end = end;
+            stream->lastUsed = accessNumber;
+        }
+    }
+
+    if(runBlocks > 0)
+    {
+        //A read that ended in a miss waits for the readahead it carries too, but not for another seek
+        if(endedInMiss) runBlocks += aheadBlocks, aheadBlocks = 0;
+        config->requests++;
+        config->deviceBytes += runBlocks * block;
+        config->nanoseconds += replay->seekNs + runBlocks * block * replay->nsPerByte;
+    }
+    if(aheadBlocks > 0)
+    {
+        config->requests++;
+        config->deviceBytes += aheadBlocks * block;
+    }
+}
+
+/// @brief Replays the whole trace through one pairing.
+void TraceReplayConfig(struct TraceReplay* replay, struct TraceConfig* config)
+{
+    FILE* file = TraceOpenFile(replay->path, stderr);
+    if(file == NULL)
+    {
+        config->failed = true;
+        return;
+    }
+    struct TraceCache cache;
+    if(!TraceCacheInit(&cache, config->cacheBytes / replay->blockBytes))
+    {
+        TraceCacheFree(&cache);
+        fclose(file);
+        config->failed = true;
+        return;
+    }
+    struct TraceStream streams[TRACE_STREAMS];
+    memset(streams, 0, sizeof(streams));
+
+    struct Fat32TraceRecord record;
+    u_int64_t accessNumber = 0;
+    //A trace cut short is replayed as far as it goes; the summary has already said so
+    while(TraceNextRecord(file, &record, NULL, 0) == 1)
+    {
+        if(record.kind >= TRACE_KINDS || record.length == 0) continue;
+        //The FAT is either read whole and held, or paged in as it is looked up; never both
+        if(record.kind == (replay->pagedFat ? FAT32_TRACE_FAT_LOAD : FAT32_TRACE_FAT_LOOKUP)) continue;
+        TraceReplayRecord(replay, config, &cache, streams, ++accessNumber, &record);
+    }
+
+    //Whatever readahead left in the cache unused at the end was not needed either
+    for(u_int32_t node = 0; node < cache.used; node++) if(cache.prefetched[node]) config->unusedBytes += replay->blockBytes;
+    TraceCacheFree(&cache);
+    fclose(file);
+}
+
+void* TraceWorker(void* argument)
+{
+    struct TraceReplay* replay = argument;
+    while(true)
+    {
+        pthread_mutex_lock(&replay->lock);
+        uint index = replay->nextConfig < replay->numConfigs ? replay->nextConfig++ : replay->numConfigs;
+        pthread_mutex_unlock(&replay->lock);
+        if(index == replay->numConfigs) return NULL;
+        TraceReplayConfig(replay, &replay->configs[index]);
+    }
+}
+
+/// @brief Prints what the trace holds: its images, and its accesses and bytes by command.
+/// @return Whether the trace could be read.
+bool TraceSummary(const char* path, FILE* out)
+{
+    FILE* file = TraceOpenFile(path, out);
+    if(file == NULL) return false;
+
+    static const char* kindNames[TRACE_KINDS] = {"boot", "fat load", "fat", "fat lookup", "cluster", "data", "write"};
+    char contexts[256][FAT32_TRACE_CONTEXT_BYTES];
+    u_int64_t contextAccesses[256], contextBytes[256];
+    u_int64_t kindAccesses[TRACE_KINDS], kindBytes[TRACE_KINDS];
+    memset(contexts, 0, sizeof(contexts));
+    memset(contextAccesses, 0, sizeof(contextAccesses));
+    memset(contextBytes, 0, sizeof(contextBytes));
+    memset(kindAccesses, 0, sizeof(kindAccesses));
+    memset(kindBytes, 0, sizeof(kindBytes));
+    strcpy(contexts[0], "-");
+
+    struct Fat32TraceRecord record;
+    char name[4096];
+    u_int64_t accesses = 0, lastTime = 0;
+    uint images = 0;
+    int status;
+    while((status = TraceNextRecord(file, &record, name, sizeof(name))) == 1)
+    {
+        if(record.kind == FAT32_TRACE_IMAGE_NAME)
+        {
+            fprintf(out, "Image %llu: %s\n", (unsigned long long)record.offset, name);
+            images++;
+        }
+        else if(record.kind == FAT32_TRACE_CONTEXT_NAME && record.offset < 256) snprintf(contexts[record.offset], FAT32_TRACE_CONTEXT_BYTES, "%.31s", name);
+        else if(record.kind < TRACE_KINDS)
+        {
+            accesses++;
+            contextAccesses[record.context]++;
+            contextBytes[record.context] += record.length;
+            kindAccesses[record.kind]++;
+            kindBytes[record.kind] += record.length;
+            lastTime = record.time;
+        }
+    }
+    fclose(file);
+    if(status < 0) fprintf(out, "%s: the trace is cut short; replaying what there is\n", path);
+
+    fprintf(out, "%'llu access(es) to %u image(s) over %.3f s\n\n", (unsigned long long)accesses, images, lastTime / 1e9);
+    fprintf(out, "%-12s %14s %18s\n", "Command", "Accesses", "Bytes");
+    for(int i = 0; i < 256; i++)
+    {
+        if(contextAccesses[i] == 0) continue;
+        fprintf(out, "%-12s %'14llu %'18llu\n", contexts[i][0] ? contexts[i] : "?", (unsigned long long)contextAccesses[i], (unsigned long long)contextBytes[i]);
+    }
+    fprintf(out, "\n%-12s %14s %18s\n", "Kind", "Accesses", "Bytes");
+    for(int i = 0; i < TRACE_KINDS; i++)
+    {
+        if(kindAccesses[i] > 0) fprintf(out, "%-12s %'14llu %'18llu\n", kindNames[i], (unsigned long long)kindAccesses[i], (unsigned long long)kindBytes[i]);
+    }
+    fprintf(out, "\n");
+    return true;
+}
+
+/// @brief Splits a comma separated list of sizes. The words point into text, which is modified in place.
+/// @return The number of sizes, or -1 if one is not a size or there are too many.
+int TraceParseSizes(char* text, u_int64_t sizes[TRACE_MAX_SIZES], const char* words[TRACE_MAX_SIZES])
+{
+    int count = 0;
+    char* saved;
+    for(char* word = strtok_r(text, ",", &saved); word != NULL; word = strtok_r(NULL, ",", &saved))
+    {
+        if(count == TRACE_MAX_SIZES || !ParseSize(word, &sizes[count])) return -1;
+        words[count++] = word;
+    }
+    return count;
+}
+
+/// @brief A hit rate as a percentage, or a dash when there was nothing to hit.
+static const char* TracePercent(char* text, u_int64_t hits, u_int64_t blocks)
+{
+    if(blocks == 0) strcpy(text, "-");
+    else sprintf(text, "%.1f", 100.0 * hits / blocks);
+    return text;
+}
+
+/// @brief Runs replay mode. See the top of this file for the syntax.
+/// @return The exit status.
+int RunReplay(int numArgs, char* args[])
+{
+    char defaultCaches[] = "4M,16M,64M,256M";
+    char defaultReadaheads[] = "0,128K,1M";
+    char* cacheList = defaultCaches;
+    char* readaheadList = defaultReadaheads;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < TRACE_MAX_THREADS ? online : TRACE_MAX_THREADS) : 1;
+    u_int64_t hitNs = 250, seekUs = 100, mbps = 500;
+
+    struct TraceReplay replay;
+    memset(&replay, 0, sizeof(replay));
+    replay.blockBytes = 4096;
+    bool valid = numArgs >= 1;
+    for(int i = 1; i < numArgs && valid; i++)
+    {
+        u_int64_t value;
+        if(strcmp(args[i], "--paged-fat") == 0) replay.pagedFat = true;
+        else if(i + 1 == numArgs) valid = false;
+        else if(strcmp(args[i], "--cache") == 0) cacheList = args[++i];
+        else if(strcmp(args[i], "--readahead") == 0) readaheadList = args[++i];
+        else if(strcmp(args[i], "--block") == 0) valid = ParseSize(args[++i], &replay.blockBytes) && replay.blockBytes >= 512;
+        else if(strcmp(args[i], "--hit-ns") == 0) valid = ParseSize(args[++i], &hitNs);
+        else if(strcmp(args[i], "--seek-us") == 0) valid = ParseSize(args[++i], &seekUs);
+        else if(strcmp(args[i], "--mbps") == 0) valid = ParseSize(args[++i], &mbps) && mbps > 0;
+        else if(strcmp(args[i], "--threads") == 0)
+        {
+            valid = ParseSize(args[++i], &value) && value >= 1 && value <= TRACE_MAX_THREADS;
+            numThreads = value;
+        }
+        else valid = false;
+    }
+
+    u_int64_t caches[TRACE_MAX_SIZES], readaheads[TRACE_MAX_SIZES];
+    const char* cacheWords[TRACE_MAX_SIZES];
+    const char* readaheadWords[TRACE_MAX_SIZES];
+    int numCaches = valid ? TraceParseSizes(cacheList, caches, cacheWords) : -1;
+    int numReadaheads = valid ? TraceParseSizes(readaheadList, readaheads, readaheadWords) : -1;
+    if(numCaches <= 0 || numReadaheads <= 0)
+    {
+        fprintf(stderr, "Usage: fat32 --replay <trace> [--cache sizes] [--readahead sizes] [--block size] [--hit-ns n] [--seek-us n] [--mbps n] [--paged-fat] [--threads n] (up to %d sizes each, comma separated)\n", TRACE_MAX_SIZES);
+        return 1;
+    }
+
+    if(!TraceSummary(args[0], stdout)) return 1;
+
+    replay.path = args[0];
+    replay.hitNs = hitNs;
+    replay.seekNs = seekUs * 1000.0;
+    replay.nsPerByte = 1000.0 / mbps;
+    pthread_mutex_init(&replay.lock, NULL);
+    for(int c = 0; c < numCaches; c++)
+    {
+        for(int r = 0; r < numReadaheads; r++)
+        {
+            struct TraceConfig* config = &replay.configs[replay.numConfigs++];
+            config->cacheText = cacheWords[c];
+            config->readaheadText = readaheadWords[r];
+            config->cacheBytes = caches[c];
+            config->readaheadBytes = readaheads[r];
+        }
+    }
+
+    //Each pairing is one whole pass over the trace, so they are shared out a pairing at a time
+    if(numThreads > replay.numConfigs) numThreads = replay.numConfigs;
+    pthread_t threads[TRACE_MAX_THREADS];
+    uint started = 0;
+    for(uint i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, TraceWorker, &replay) != 0) break;
+        started++;
+    }
+    TraceWorker(&replay);
+    for(uint i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&replay.lock);
+
+    printf("%-8s %-9s %7s %9s %7s %7s %12s %12s %10s %12s\n", "Cache", "Readahead", "Hit %", "Cluster %", "FAT %", "Data %", "Requests", "Device MB", "Unused MB", "Time ms");
+    struct TraceConfig* fastest = NULL;
+    int status = 0;
+    for(uint i = 0; i < replay.numConfigs; i++)
+    {
+        struct TraceConfig* config = &replay.configs[i];
+        if(config->failed)
+        {
+            printf("%-8s %-9s could not be replayed\n", config->cacheText, config->readaheadText);
+            status = 1;
+            continue;
+        }
+
+        u_int64_t blocks = 0, hits = 0;
+        for(int k = 0; k < TRACE_KINDS; k++) blocks += config->blocks[k], hits += config->hits[k];
+        u_int64_t fatBlocks = config->blocks[FAT32_TRACE_FAT_LOAD] + config->blocks[FAT32_TRACE_FAT] + config->blocks[FAT32_TRACE_FAT_LOOKUP];
+        u_int64_t fatHits = config->hits[FAT32_TRACE_FAT_LOAD] + config->hits[FAT32_TRACE_FAT] + config->hits[FAT32_TRACE_FAT_LOOKUP];
+        char all[16], cluster[16], fat[16], data[16];
+        printf("%-8s %-9s %7s %9s %7s %7s %'12llu %12.1f %10.1f %'12.1f\n", config->cacheText, config->readaheadText,
+        TracePercent(all, hits, blocks), TracePercent(cluster, config->hits[FAT32_TRACE_CLUSTER], config->blocks[FAT32_TRACE_CLUSTER]),
+        TracePercent(fat, fatHits, fatBlocks), TracePercent(data, config->hits[FAT32_TRACE_DATA], config->blocks[FAT32_TRACE_DATA]),
+        (unsigned long long)config->requests, config->deviceBytes / 1048576.0, config->unusedBytes / 1048576.0, config->nanoseconds / 1e6);
+        if(fastest == NULL || config->nanoseconds < fastest->nanoseconds) fastest = config;
+    }
+    if(fastest != NULL) printf("\nFastest: --cache %s --readahead %s, %'.1f ms simulated\n", fastest->cacheText, fastest->readaheadText, fastest->nanoseconds / 1e6);
+    return status;
+}
+
+#endif
@@ -0,0 +1,570 @@
+
+/******************/
+/*Undelete.h      */
+/******************/
+
+/*
+This header file holds the UNDELETE command, which finds and recovers
+deleted files.
+
+    UNDELETE --scan [--all] [--threads n]
+    UNDELETE --recover <cluster>:<offset> [name]
+
+Deleting a file on FAT32 only overwrites the first byte of its short entry
+(and of its long name entries) with 0xE5 and zeroes its FAT chain. The size,
+starting cluster and the rest of the name stay behind in the directory.
+
+--scan sweeps every cluster of every directory reachable from the root,
+including directories that were themselves deleted, and lists the deleted
+entries it finds. --all sweeps the whole data region instead, split into one
+contiguous range per thread and read in large sequential chunks, which also
+finds entries in directories nothing points at any more.
+
+Each entry is listed with its location, the cluster and byte offset of its
+short entry, which --recover takes to extract it. The first character of
+the short name is rebuilt from the long name checksum when a long name
+survives, otherwise it is shown as '_'. Since the chain is gone, the file is
+assumed to have been stored contiguously; the listing says whether those
+clusters are still free in the FAT.
+*/
+
+#ifndef UNDELETE_H
+#define UNDELETE_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define UNDELETE_MAX_THREADS 16
+#define UNDELETE_LOOKBACK (20 * 32) //Bytes kept before a short entry, enough for the longest long name
+
+/// @brief A deleted entry found by the scanner.
+struct DeletedEntry
+{
+    u_int32_t locationCluster; //Cluster holding the short entry
+    u_int32_t locationOffset; //Byte offset of the short entry in that cluster
+    char name[256];
+    char* path; //Directory the entry was found in, or NULL when it came from a raw sweep
+    u_int8_t attributes;
+    u_int32_t firstCluster;
+    u_int32_t size;
+    u_int32_t clustersNeeded;
+    u_int32_t clustersFree; //How many of the clusters the file would have used are still free
+};
+
+/// @brief A growable list of deleted entries.
+struct DeletedList
+{
+    struct DeletedEntry* entries;
+    uint count;
+    uint capacity;
+    bool outOfMemory; //Set when an entry or a directory could not be kept; the scan stops and says so
+};
+
+/// @brief Adds an entry to the list, which takes its path over.
+/// @return Whether there was memory for it. The path is freed when there was not.
+bool DeletedListAdd(struct DeletedList* list, struct DeletedEntry* entry)
+{
+    if(list->count == list->capacity)
+    {
+        uint capacity = list->capacity ? list->capacity * 2 : 64;
+        struct DeletedEntry* entries = realloc(list->entries, capacity * sizeof(struct DeletedEntry));
+        if(entries == NULL)
+        {
+            free(entry->path);
+            list->outOfMemory = true;
+            return false;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    list->entries[list->count++] = *entry;
+    return true;
+}
+
+void DeletedListFree(struct DeletedList* list)
+{
+    for(uint i = 0; i < list->count; i++) free(list->entries[i].path);
+    free(list->entries);
+    memset(list, 0, sizeof(struct DeletedList));
+}
+
+/// @brief Whether a byte may appear in a short name.
+bool IsShortNameByte(unsigned char c)
+{
+    if(c < 0x20 || (c >= 'a' && c <= 'z')) return false;
+    return strchr("\"*+,./:;<=>?[\\]|", c) == NULL;
+}
+
+/// @brief Decides from its bytes whether a slot holds a deleted short entry, rather than free space or file data.
+bool LooksLikeDeletedEntry(struct Fat32Volume* vol, const unsigned char* raw)
+{
+    u_int8_t attributes = raw[11];
+    if(raw[0] != 0xE5 || attributes == ATTR_LONG_NAME || (attributes & 0xC0) != 0 || (attributes & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) return false;
+    if((raw[12] & ~0x18) != 0) return false;
+    for(int i = 1; i < 11; i++) if(!IsShortNameByte(raw[i])) return false;
+    //Names are padded with spaces, never start with one
+    if(raw[1] == ' ' && raw[2] != ' ') return false;
+
+    //The write date must be a real date
+    u_int16_t date = raw[24] | ((u_int16_t)raw[25] << 8);
+    uint month = (date >> 5) & 0x0F;
+    uint day = date & 0x1F;
+    if(month < 1 || month > 12 || day < 1) return false;
+
+    u_int32_t firstCluster = (raw[26] | ((u_int32_t)raw[27] << 8)) | ((u_int32_t)(raw[20] | (raw[21] << 8)) << 16);
+    u_int32_t size = raw[28] | ((u_int32_t)raw[29] << 8) | ((u_int32_t)raw[30] << 16) | ((u_int32_t)raw[31] << 24);
+    if((attributes & ATTR_DIRECTORY) == ATTR_DIRECTORY) return size == 0 && firstCluster >= 2 && firstCluster < Fat32ClusterCount(vol);
+    if(firstCluster == 0) return size == 0;
+    if(firstCluster < 2 || firstCluster >= Fat32ClusterCount(vol)) return false;
+    return (u_int64_t)size <= (u_int64_t)(Fat32ClusterCount(vol) - firstCluster) * Fat32ClusterBytes(vol);
+}
+
+/// @brief Rebuilds a deleted entry from the slot at bytes[slot]. Long name slots are looked for in the bytes before it, back to bytes[0].
+void RebuildDeletedEntry(struct Fat32Volume* vol, const unsigned char* bytes, uint slot, struct DeletedEntry* deleted)
+{
+    const unsigned char* raw = &bytes[slot];
+    unsigned char shortRaw[11];
+    memcpy(shortRaw, raw, 11);
+
+    deleted->attributes = raw[11];
+    deleted->firstCluster = (raw[26] | ((u_int32_t)raw[27] << 8)) | ((u_int32_t)(raw[20] | (raw[21] << 8)) << 16);
+    deleted->size = raw[28] | ((u_int32_t)raw[29] << 8) | ((u_int32_t)raw[30] << 16) | ((u_int32_t)raw[31] << 24);
+
+    //Deleted long name slots lose their order byte, but they still sit in reverse order right before the short entry
+    char longName[256];
+    memset(longName, 0, sizeof(longName));
+    int checksum = -1;
+    uint order = 0;
+    for(int offset = (int)slot - 32; offset >= 0 && order < 20; offset -= 32)
+    {
+        const unsigned char* longRaw = &bytes[offset];
+        if(longRaw[0] != 0xE5 || longRaw[11] != ATTR_LONG_NAME) break;
+        if(checksum >= 0 && longRaw[13] != checksum) break;
+        checksum = longRaw[13];
+
+        static const u_int8_t charOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        for(int c = 0; c < 13 && order * 13 + c < 255; c++)
+        {
+            unsigned char low = longRaw[charOffsets[c]];
+            unsigned char high = longRaw[charOffsets[c] + 1];
+            longName[order * 13 + c] = (low == 0xFF && high == 0xFF) ? '\0' : (char)low;
+        }
+        order++;
+    }
+
+    //The checksum is a bijection of the first name byte, so exactly one value of it fits the long name
+    bool haveLongName = false;
+    if(checksum >= 0 && longName[0] != '\0')
+    {
+        for(uint c = 0x20; c <= 0xFF && !haveLongName; c++)
+        {
+            shortRaw[0] = c;
+            if(Fat32ShortNameChecksum(shortRaw) == checksum) haveLongName = IsShortNameByte(c);
+        }
+    }
+    if(!haveLongName) shortRaw[0] = '_';
+
+    if(haveLongName) strcpy(deleted->name, longName);
+    else
+    {
+        int length = 0;
+        for(int i = 0; i < 8 && shortRaw[i] != ' '; i++) deleted->name[length++] = shortRaw[i];
+        if(shortRaw[8] != ' ')
+        {
+            deleted->name[length++] = '.';
+            for(int i = 8; i < 11 && shortRaw[i] != ' '; i++) deleted->name[length++] = shortRaw[i];
+        }
+        deleted->name[length] = '\0';
+    }
+
+    //The chain was zeroed, so assume the file was contiguous and see whether those clusters were taken since
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    deleted->clustersNeeded = (deleted->attributes & ATTR_DIRECTORY) ? 1 : ((u_int64_t)deleted->size + clusterBytes - 1) / clusterBytes;
+    deleted->clustersFree = 0;
+    for(u_int32_t i = 0; i < deleted->clustersNeeded; i++)
+    {
+        u_int32_t cluster = deleted->firstCluster + i;
+        if(cluster < Fat32ClusterCount(vol) && Fat32NextCluster(vol, cluster) == 0) deleted->clustersFree++;
+    }
+}
+
+/// @brief Decodes the long name of the live short entry at bytes[slot] from the slots before it, back to bytes[0].
+/// @param name Room for 256 bytes. Characters outside ASCII keep only their low byte, as Fat32ReadDir does.
+/// @return Whether a whole long name with the entry's checksum was found.
+bool LiveLongName(const unsigned char* bytes, uint slot, char* name)
+{
+    u_int8_t checksum = Fat32ShortNameChecksum(&bytes[slot]);
+    memset(name, 0, 256);
+
+    //Live long name slots run backwards from order 1, right before the short entry, to the one marked last
+    uint order = 1;
+    for(int offset = (int)slot - 32; offset >= 0 && order <= 20; offset -= 32, order++)
+    {
+        const unsigned char* longRaw = &bytes[offset];
+        if(longRaw[11] != ATTR_LONG_NAME || (longRaw[0] & 0x1F) != order || longRaw[13] != checksum) return false;
+
+        static const u_int8_t charOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        for(int c = 0; c < 13 && (order - 1) * 13 + c < 255; c++)
+        {
+            unsigned char low = longRaw[charOffsets[c]];
+            unsigned char high = longRaw[charOffsets[c] + 1];
+            name[(order - 1) * 13 + c] = (low == 0xFF && high == 0xFF) ? '\0' : (char)low;
+        }
+        if((longRaw[0] & LAST_LONG_ENTRY) == LAST_LONG_ENTRY) return name[0] != '\0';
+    }
+    return false;
+}
+
+/// @brief Looks through a buffer of directory slots for deleted entries.
+/// @param bytes The buffer. Scanning starts at bytes[start]; anything before it is only used to rebuild long names.
+/// @param firstCluster The cluster bytes[start] belongs to. The buffer must hold whole, consecutive clusters from there on.
+void ScanDeletedSlots(struct Fat32Volume* vol, const unsigned char* bytes, uint start, uint length, u_int32_t firstCluster, const char* path, struct DeletedList* list)
+{
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    for(uint slot = start; slot + 32 <= length; slot += 32)
+    {
+        if(bytes[slot] != 0xE5 || !LooksLikeDeletedEntry(vol, &bytes[slot])) continue;
+
+        struct DeletedEntry deleted;
+        memset(&deleted, 0, sizeof(deleted));
+        deleted.locationCluster = firstCluster + (slot - start) / clusterBytes;
+        deleted.locationOffset = (slot - start) % clusterBytes;
+        deleted.path = path ? strdup(path) : NULL;
+        if(path != NULL && deleted.path == NULL)
+        {
+            list->outOfMemory = true;
+            return;
+        }
+        RebuildDeletedEntry(vol, bytes, slot, &deleted);
+        if(!DeletedListAdd(list, &deleted)) return;
+    }
+}
+
+/// @brief A directory waiting to be swept.
+struct UndeleteDir
+{
+    u_int32_t cluster;
+    bool followChain; //False for deleted directories, whose chain is gone
+    char* path;
+    struct UndeleteDir* next;
+};
+
+/// @brief Queues a directory to be swept.
+/// @return Whether there was memory to queue it. It takes path over either way.
+bool UndeletePushDir(struct UndeleteDir** stack, u_int32_t cluster, bool followChain, char* path)
+{
+    struct UndeleteDir* dir = path != NULL ? malloc(sizeof(struct UndeleteDir)) : NULL;
+    if(dir == NULL)
+    {
+        free(path);
+        return false;
+    }
+    dir->cluster = cluster;
+    dir->followChain = followChain;
+    dir->path = path;
+    dir->next = *stack;
+    *stack = dir;
+    return true;
+}
+
+/// @brief Sweeps every directory reachable from the root, including deleted ones, for deleted entries.
+void UndeleteScanTree(struct Fat32Volume* vol, struct DeletedList* list)
+{
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    unsigned char* visited = calloc(clusterCount / 8 + 1, 1);
+    //The previous cluster of the directory is kept in front of the current one, so long names split across the two still rebuild
+    unsigned char* bytes = Fat32AllocBuffer(vol, 2 * clusterBytes);
+
+    struct UndeleteDir* stack = NULL;
+    if(visited == NULL || bytes == NULL || !UndeletePushDir(&stack, Fat32RootCluster(vol), true, strdup(""))) list->outOfMemory = true;
+    while(stack != NULL)
+    {
+        struct UndeleteDir* dir = stack;
+        stack = dir->next;
+
+        //Once memory has run out the directories still queued are only freed
+        if(!list->outOfMemory) memset(bytes, 0, clusterBytes);
+        u_int32_t cluster = dir->cluster;
+        while(!list->outOfMemory && cluster >= 2 && cluster < clusterCount)
+        {
+            if(visited[cluster / 8] & (1 << (cluster % 8))) break;
+            visited[cluster / 8] |= 1 << (cluster % 8);
+            if(!Fat32ReadAt(vol, bytes + clusterBytes, clusterBytes, Fat32ClusterOffset(vol, cluster))) break;
+
+            uint before = list->count;
+            ScanDeletedSlots(vol, bytes, clusterBytes, 2 * clusterBytes, cluster, dir->path, list);
+
+            //Deleted directories whose first cluster is still free and still starts with "." are swept too
+            for(uint i = before; i < list->count; i++)
+            {
+                struct DeletedEntry* deleted = &list->entries[i];
+                if((deleted->attributes & ATTR_DIRECTORY) != ATTR_DIRECTORY || deleted->clustersFree == 0) continue;
+                unsigned char first[32];
+                if(!Fat32ReadAt(vol, first, 32, Fat32ClusterOffset(vol, deleted->firstCluster)) || memcmp(first, ".          ", 11) != 0) continue;
+                char* path = malloc(strlen(dir->path) + strlen(deleted->name) + 2);
+                if(path != NULL) sprintf(path, "%s/%s", dir->path, deleted->name);
+                if(!UndeletePushDir(&stack, deleted->firstCluster, false, path)) list->outOfMemory = true;
+            }
+
+            //Live subdirectories
+            for(uint slot = clusterBytes; slot < 2 * clusterBytes; slot += 32)
+            {
+                unsigned char* raw = &bytes[slot];
+                if(raw[0] == 0x00 || raw[0] == 0xE5 || raw[0] == '.' || raw[11] == ATTR_LONG_NAME) continue;
+                if((raw[11] & (ATTR_DIRECTORY | ATTR_VOLUME_ID)) != ATTR_DIRECTORY) continue;
+
+                //The long name is in the slots before, in this cluster or the previous one still held in front of it
+                char name[256];
+                if(!LiveLongName(bytes, slot, name))
+                {
+                    int length = 0;
+                    for(int i = 0; i < 8 && raw[i] != ' '; i++) name[length++] = raw[i];
+                    if(raw[8] != ' ')
+                    {
+                        name[length++] = '.';
+                        for(int i = 8; i < 11 && raw[i] != ' '; i++) name[length++] = raw[i];
+                    }
+                    name[length] = '\0';
+                }
+
+                u_int32_t subCluster = (raw[26] | ((u_int32_t)raw[27] << 8)) | ((u_int32_t)(raw[20] | (raw[21] << 8)) << 16);
+                char* path = malloc(strlen(dir->path) + strlen(name) + 2);
+                if(path != NULL) sprintf(path, "%s/%s", dir->path, name);
+                if(!UndeletePushDir(&stack, subCluster, true, path)) list->outOfMemory = true;
+            }
+
+            memcpy(bytes, bytes + clusterBytes, clusterBytes);
+            if(!dir->followChain) break;
+            cluster = Fat32NextCluster(vol, cluster);
+            if(Fat32IsEndOfChain(vol, cluster)) break;
+        }
+
+        free(dir->path);
+        free(dir);
+    }
+
+    free(bytes);
+    free(visited);
+}
+
+/// @brief One thread's share of a raw sweep.
+struct UndeleteRange
+{
+    struct Fat32Volume* vol;
+    u_int32_t firstCluster;
+    u_int32_t endCluster;
+    struct DeletedList list;
+};
+
+void* UndeleteScanRange(void* argument)
+{
+    struct UndeleteRange* range = argument;
+    Fat32TraceContext("UNDELETE");
+    struct Fat32Volume* vol = range->vol;
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    u_int32_t chunkClusters = Fat32PreferredReadBytes(vol) / clusterBytes;
+
+    //Each chunk is read in one sequential pread, behind the tail of the chunk before it
+    unsigned char* bytes = Fat32AllocBuffer(vol, UNDELETE_LOOKBACK + (size_t)chunkClusters * clusterBytes);
+    if(bytes == NULL)
+    {
+        range->list.outOfMemory = true;
+        return NULL;
+    }
+    memset(bytes, 0, UNDELETE_LOOKBACK);
+
+    for(u_int32_t cluster = range->firstCluster; cluster < range->endCluster && !range->list.outOfMemory; cluster += chunkClusters)
+    {
+        u_int32_t count = range->endCluster - cluster < chunkClusters ? range->endCluster - cluster : chunkClusters;
+        size_t length = (size_t)count * clusterBytes;
+        if(!Fat32ReadAt(vol, bytes + UNDELETE_LOOKBACK, length, Fat32ClusterOffset(vol, cluster))) break;
+
+        ScanDeletedSlots(vol, bytes, UNDELETE_LOOKBACK, UNDELETE_LOOKBACK + length, cluster, NULL, &range->list);
+        memmove(bytes, bytes + length, UNDELETE_LOOKBACK);
+    }
+
+    free(bytes);
+    return NULL;
+}
+
+/// @brief Sweeps the whole data region for deleted entries, one contiguous range per thread.
+void UndeleteScanAll(struct Fat32Volume* vol, uint numThreads, struct DeletedList* list)
+{
+    u_int32_t clusterCount = Fat32ClusterCount(vol);
+    u_int32_t perThread = (clusterCount - 2 + numThreads - 1) / numThreads;
+    struct UndeleteRange ranges[UNDELETE_MAX_THREADS];
+    pthread_t threads[UNDELETE_MAX_THREADS];
+    bool started[UNDELETE_MAX_THREADS];
+
+    for(uint i = 0; i < numThreads; i++)
+    {
+        memset(&ranges[i], 0, sizeof(struct UndeleteRange));
+        ranges[i].vol = vol;
+        ranges[i].firstCluster = 2 + i * perThread;
+        ranges[i].endCluster = ranges[i].firstCluster + perThread < clusterCount ? ranges[i].firstCluster + perThread : clusterCount;
+        if(ranges[i].firstCluster > ranges[i].endCluster) ranges[i].firstCluster = ranges[i].endCluster;
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, UndeleteScanRange, &ranges[i]) == 0;
+    }
+    //The calling thread takes the first range, and any range a thread could not be started for
+    for(uint i = 0; i < numThreads; i++) if(!started[i]) UndeleteScanRange(&ranges[i]);
+
+    //Ranges are in disk order, so joining them in order keeps the listing in disk order
+    for(uint i = 0; i < numThreads; i++)
+    {
+        if(started[i]) pthread_join(threads[i], NULL);
+        if(ranges[i].list.outOfMemory) list->outOfMemory = true;
+        for(uint j = 0; j < ranges[i].list.count; j++) DeletedListAdd(list, &ranges[i].list.entries[j]);
+        free(ranges[i].list.entries);
+    }
+}
+
+void PrintDeletedEntry(struct DeletedEntry* deleted, FILE* out)
+{
+    char location[24];
+    snprintf(location, sizeof(location), "%u:%u", deleted->locationCluster, deleted->locationOffset);
+
+    char status[48];
+    if((deleted->attributes & ATTR_DIRECTORY) == ATTR_DIRECTORY) snprintf(status, sizeof(status), "<DIR>");
+    else if(deleted->clustersNeeded == 0) snprintf(status, sizeof(status), "empty");
+    else if(deleted->clustersFree == deleted->clustersNeeded) snprintf(status, sizeof(status), "recoverable");
+    else snprintf(status, sizeof(status), "overwritten %u/%u", deleted->clustersNeeded - deleted->clustersFree, deleted->clustersNeeded);
+
+    fprintf(out, "%-16s %'14u  %-18s %s%s%s\n", location, deleted->size, status, deleted->path ? deleted->path : "", deleted->path ? "/" : "", deleted->name);
+}
+
+/// @brief Extracts the deleted file whose short entry is at cluster:offset, assuming it was stored contiguously.
+void UndeleteRecover(struct Fat32Volume* vol, const char* location, const char* name, FILE* out)
+{
+    u_int32_t cluster, offset;
+    u_int32_t clusterBytes = Fat32ClusterBytes(vol);
+    if(sscanf(location, "%u:%u", &cluster, &offset) != 2 || cluster < 2 || cluster >= Fat32ClusterCount(vol) || offset % 32 != 0 || offset >= clusterBytes)
+    {
+        fprintf(out, "Invalid location %s\n", location);
+        return;
+    }
+
+    //Take the bytes before the entry straight from the image so a long name in the previous cluster can still be rebuilt
+    unsigned char bytes[UNDELETE_LOOKBACK + 32];
+    u_int64_t slotOffset = Fat32ClusterOffset(vol, cluster) + offset;
+    uint lookback = slotOffset - Fat32ClusterOffset(vol, 2) < UNDELETE_LOOKBACK ? slotOffset - Fat32ClusterOffset(vol, 2) : UNDELETE_LOOKBACK;
+    if(!Fat32ReadAt(vol, bytes, lookback + 32, slotOffset - lookback) || !LooksLikeDeletedEntry(vol, &bytes[lookback]))
+    {
+        fprintf(out, "No deleted entry at %s\n", location);
+        return;
+    }
+
+    struct DeletedEntry deleted;
+    memset(&deleted, 0, sizeof(deleted));
+    RebuildDeletedEntry(vol, bytes, lookback, &deleted);
+    if((deleted.attributes & ATTR_DIRECTORY) == ATTR_DIRECTORY)
+    {
+        fprintf(out, "%s is a directory\n", deleted.name);
+        return;
+    }
+    if(name == NULL) name = deleted.name;
+    if(deleted.clustersFree < deleted.clustersNeeded) fprintf(out, "Warning: %u of %u clusters have been reused since %s was deleted\n", deleted.clustersNeeded - deleted.clustersFree, deleted.clustersNeeded, deleted.name);
+
+    int newfile = OpenExtractTarget(vol, name);
+    if(newfile < 0)
+    {
+        fprintf(out, "%s: %s\n", name, strerror(errno));
+        return;
+    }
+
+    unsigned char* buffer = Fat32GetBuffer(vol);
+    u_int32_t readBytes = Fat32PreferredReadBytes(vol);
+    u_int64_t start = Fat32ClusterOffset(vol, deleted.firstCluster);
+    u_int32_t blockBytes = ExtractBlockBytes(newfile);
+    u_int64_t done = 0;
+    while(done < deleted.size)
+    {
+        size_t chunk = deleted.size - done < readBytes ? deleted.size - done : readBytes;
+        if(!Fat32ReadAt(vol, buffer, chunk, start + done))
+        {
+            fprintf(out, "%s: read error\n", deleted.name);
+            break;
+        }
+        if(!WriteExtractTarget(newfile, buffer, chunk, done, blockBytes))
+        {
+            fprintf(out, "%s: %s\n", name, strerror(errno));
+            break;
+        }
+        done += chunk;
+    }
+    if(ftruncate(newfile, done) != 0) fprintf(out, "%s: %s\n", name, strerror(errno));
+    close(newfile);
+    Fat32PutBuffer(vol, buffer);
+
+    fprintf(out, "Recovered %'llu bytes into %s\n", (unsigned long long)done, name);
+}
+
+/// @brief Runs UNDELETE. See the top of this file for the syntax.
+/// @param argument Everything after the command word. It is modified in place.
+void Undelete(struct Fat32Volume* vol, char* argument, FILE* out)
+{
+    char* cursor = argument;
+    char* mode = NextWord(&cursor);
+
+    if(mode != NULL && strcmp(mode, "--recover") == 0)
+    {
+        char* location = NextWord(&cursor);
+        if(location == NULL)
+        {
+            fprintf(out, "Usage: UNDELETE --recover <cluster>:<offset> [name]\n");
+            return;
+        }
+        UndeleteRecover(vol, location, NextWord(&cursor), out);
+        return;
+    }
+
+    if(mode == NULL || strcmp(mode, "--scan") != 0)
+    {
+        fprintf(out, "Usage: UNDELETE --scan [--all] [--threads n]\n       UNDELETE --recover <cluster>:<offset> [name]\n");
+        return;
+    }
+
+    bool all = false;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint numThreads = online > 0 ? (online < UNDELETE_MAX_THREADS ? online : UNDELETE_MAX_THREADS) : 1;
+    char* word;
+    while((word = NextWord(&cursor)) != NULL)
+    {
+        if(strcmp(word, "--all") == 0) all = true;
+        else if(strcmp(word, "--threads") == 0)
+        {
+            char* value = NextWord(&cursor);
+            numThreads = value ? atoi(value) : 0;
+            if(numThreads < 1 || numThreads > UNDELETE_MAX_THREADS)
+            {
+                fprintf(out, "--threads takes 1 to %d\n", UNDELETE_MAX_THREADS);
+                return;
+            }
+        }
+        else
+        {
+            fprintf(out, "Unexpected argument %s\n", word);
+            return;
+        }
+    }
+
+    struct DeletedList list;
+    memset(&list, 0, sizeof(list));
+    if(all) UndeleteScanAll(vol, numThreads, &list);
+    else UndeleteScanTree(vol, &list);
+
+    fprintf(out, "%-16s %14s  %-18s %s\n", "Location", "Size", "Status", "Name");
+    for(uint i = 0; i < list.count; i++) PrintDeletedEntry(&list.entries[i], out);
+    //What was found before memory ran out is still listed, but the list is not complete
+    if(list.outOfMemory) fprintf(out, "\nOut of memory; the scan could not be finished\n");
+    else fprintf(out, "\n%u deleted entr%s\n", list.count, list.count == 1 ? "y" : "ies");
+
+    DeletedListFree(&list);
+}
+
+#endif